@@ -1,15 +1,21 @@
 
 #include "mt_random.h"
+#include "thread.h"
 #include <stdlib.h>
 #include <time.h>
 
 #define MT_LEN			624
 
-int mt_index;
-unsigned long mt_buffer[MT_LEN];
+// Each thread has its own generator so simulations running on separate threads don't share state
+static ZG_THREAD_LOCAL int mt_index;
+static ZG_THREAD_LOCAL unsigned long mt_buffer[MT_LEN];
 
 void mt_init(void) {
-    srand((unsigned int)time(NULL));
+    mt_init_seed((unsigned int)time(NULL));
+}
+
+void mt_init_seed(unsigned int seed) {
+    srand(seed);
 	int i;
     for (i = 0; i < MT_LEN; i++)
         mt_buffer[i] = rand();
@@ -7,4 +7,5 @@
 */
 
 void mt_init(void);
+void mt_init_seed(unsigned int seed);
 unsigned long mt_random(void);
@@ -24,6 +24,13 @@
 
 #include <stdint.h>
 
+// Storage class for globals that every thread gets its own copy of
+#if defined(_MSC_VER)
+#define ZG_THREAD_LOCAL __declspec(thread)
+#else
+#define ZG_THREAD_LOCAL __thread
+#endif
+
 typedef void* ZGThread;
 typedef int (*ZGThreadFunction)(void *data);
 
@@ -69,16 +69,14 @@ static void updateDirectionAndMoveTimer(Character *character, bool allowFiring,
 	updateMoveTimer(character, currentTime);
 }
 
+// A client doesn't track who is still joining, so it leaves that to the server that handles its requests to fire
 static bool canFireWeapon(bool allowFiring)
 {
-	return allowFiring && gGameWinner == NO_CHARACTER && (!gNetworkConnection || (gRedRover.netState == NETWORK_PLAYING_STATE && gGreenTree.netState == NETWORK_PLAYING_STATE && gBlueLightning.netState == NETWORK_PLAYING_STATE));
+	return allowFiring && gGameWinner == NO_CHARACTER && (!gNetworkConnection || gNetworkConnection->type == NETWORK_CLIENT_TYPE || (gRedRover.netState == NETWORK_PLAYING_STATE && gGreenTree.netState == NETWORK_PLAYING_STATE && gBlueLightning.netState == NETWORK_PLAYING_STATE));
 }
 
-void updateAI(Character *character, float currentTime, bool allowFiring, double timeDelta)
+static void decideAIActions(Character *character, float currentTime, bool allowFiring, double timeDelta)
 {
-	if (!CHARACTER_IS_ALIVE(character) || character->state != CHARACTER_AI_STATE || !character->active || !character->lives || (gNetworkConnection && gNetworkConnection->type == NETWORK_CLIENT_TYPE))
-		return;
-	
 	bool canFire = canFireWeapon(allowFiring);
 	
 	if (canFire)
@@ -99,6 +97,50 @@ void updateAI(Character *character, float currentTime, bool allowFiring, double
 	}
 }
 
+void updateAI(Character *character, float currentTime, bool allowFiring, double timeDelta)
+{
+	if (!CHARACTER_IS_ALIVE(character) || character->state != CHARACTER_AI_STATE || !character->active || !character->lives || (gNetworkConnection && gNetworkConnection->type == NETWORK_CLIENT_TYPE))
+		return;
+	
+	decideAIActions(character, currentTime, allowFiring, timeDelta);
+}
+
+void updateAIInput(Input *input, float currentTime, double timeDelta)
+{
+	Character *character = input->character;
+	if (!CHARACTER_IS_ALIVE(character) || !character->active || !character->lives)
+		return;
+	
+	// The AI directs the character itself, so undo that and only move it through our input for the server to respond to
+	int direction = character->direction;
+	int pointingDirection = character->pointing_direction;
+	Weapon weapon = *character->weap;
+	character->weap->fired = false;
+	
+	decideAIActions(character, currentTime, true, timeDelta);
+	
+	int decidedDirection = character->direction;
+	bool decidedToFire = character->weap->fired;
+	
+	character->direction = direction;
+	character->pointing_direction = pointingDirection;
+	*character->weap = weapon;
+	
+	if (decidedDirection != direction)
+	{
+		uint64_t ticks = ZGGetTicks();
+		input->right_ticks = (decidedDirection == RIGHT) ? ticks : 0;
+		input->left_ticks = (decidedDirection == LEFT) ? ticks : 0;
+		input->up_ticks = (decidedDirection == UP) ? ticks : 0;
+		input->down_ticks = (decidedDirection == DOWN) ? ticks : 0;
+	}
+	
+	if (decidedToFire)
+	{
+		prepareFiringCharacterWeapon(character, character->x, character->y, character->pointing_direction, 0.0f, 0);
+	}
+}
+
 static void fireCharacterWeaponAfterTurn(Character *character, float currentTime)
 {
 	if (mt_random() % 20 != 0)
@@ -420,7 +462,7 @@ static void shootWeaponToNearingCharacter(Character *character, float currentTim
 
 static void fireAIWeapon(Character *character)
 {
-	prepareFiringCharacterWeapon(character, character->x, character->y, character->pointing_direction, 0.0f);
+	prepareFiringCharacterWeapon(character, character->x, character->y, character->pointing_direction, 0.0f, 0);
 }
 
 static void attackCharacterOnRow(Character *character, Character *characterB, float currentTime)
@@ -22,3 +22,6 @@
 #include "input.h"
 
 void updateAI(Character *chnaracter, float currentTime, bool allowFiring, double timeDelta);
+
+// Plays the character of an input like the AI would by setting the input's directions and firing its weapon, for headless network clients
+void updateAIInput(Input *input, float currentTime, double timeDelta);
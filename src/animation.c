@@ -41,7 +41,7 @@
 
 #define ANIMATION_TIME_ELAPSED_INTERVAL 0.0177 // in seconds
 
-static int gTilesLayer[28];
+static ZG_THREAD_LOCAL int gTilesLayer[28];
 
 typedef struct
 {
@@ -50,15 +50,15 @@ typedef struct
 	int animationTimer;
 } TileLayerState;
 
-static TileLayerState gTileLayerStates[2];
+static ZG_THREAD_LOCAL TileLayerState gTileLayerStates[2];
 
-static float gSecondTimer =						0.0f;
-static float gLastSecond =						0.0f;
+static ZG_THREAD_LOCAL float gSecondTimer =						0.0f;
+static ZG_THREAD_LOCAL float gLastSecond =						0.0f;
 
-static int gCurrentWinner =						0;
-static int gStatsTimer =						0;
+static ZG_THREAD_LOCAL int gCurrentWinner =						0;
+static ZG_THREAD_LOCAL int gStatsTimer =						0;
 
-static double gTimeElapsedAccumulator = 0.0;
+static ZG_THREAD_LOCAL double gTimeElapsedAccumulator = 0.0;
 
 /* Functions */
 
@@ -78,7 +78,9 @@ static void loadSecondTileAnimationLayer(void);
 static void collapseTiles(double timeDelta);
 static void recoverDestroyedTiles(double timeDelta);
 
+static void killCharacterOnTile(Character *player, int location, bool tutorial);
 static void killCharacter(Input *characterInput, bool tutorial, double timeDelta);
+static void killCharactersFromRewoundShot(Character *shooter, int tileIndex);
 static void recoverCharacter(Character *player);
 
 static void sendPing(void);
@@ -96,6 +98,13 @@ void animate(ZGWindow *window, double timeDelta, GameState gameState)
 		gTutorialCoverTimer -= (float)timeDelta;
 	}
 	
+	// The game starts once every player has connected and the countdown has finished
+	// This is part of the simulation rather than rendering so a headless server can start games too
+	if (!tutorialState && !gGameHasStarted && gGameStartNumber == 0 && gPinkBubbleGum.netState != NETWORK_PENDING_STATE && gRedRover.netState != NETWORK_PENDING_STATE && gGreenTree.netState != NETWORK_PENDING_STATE && gBlueLightning.netState != NETWORK_PENDING_STATE)
+	{
+		gGameHasStarted = true;
+	}
+	
 	// Update gSecondTimer and change gLastSecond
 	if ((int)gLastSecond != (int)gSecondTimer)
 	{
@@ -319,7 +328,7 @@ static void sendPing(void)
 	{
 		GameMessage message;
 		message.type = PING_MESSAGE_TYPE;
-		message.pingTimestamp = ZGGetTicks();
+		message.pingTimestamp = (uint32_t)networkMicroTicks();
 		
 		if (gNetworkConnection->type == NETWORK_CLIENT_TYPE)
 		{
@@ -441,7 +450,7 @@ static void animateTilesAndPlayerRecovery(double timeDelta, ZGWindow *window, Ch
 {
 	if (player->weap->animationState)
 	{
-		if (player->animation_timer == 0.0 && ZGWindowHasFocus(window) && gAudioEffectsFlag && gameState != GAME_STATE_PAUSED)
+		if (player->animation_timer == 0.0 && gAudioEffectsFlag && gameState != GAME_STATE_PAUSED && ZGWindowHasFocus(window))
 		{
 			playShootingSound(IDOfCharacter(player) - 1);
 		}
@@ -550,7 +559,7 @@ static void animateTilesAndPlayerRecovery(double timeDelta, ZGWindow *window, Ch
 				gTiles[player->destroyedTileIndex].state = false;
 				gTiles[player->destroyedTileIndex].z -= OBJECT_FALLING_STEP;
 				
-				if (ZGWindowHasFocus(window) && gAudioEffectsFlag && gameState != GAME_STATE_PAUSED)
+				if (gAudioEffectsFlag && gameState != GAME_STATE_PAUSED && ZGWindowHasFocus(window))
 				{
 					playTileFallingSound();
 				}
@@ -567,6 +576,11 @@ static void animateTilesAndPlayerRecovery(double timeDelta, ZGWindow *window, Ch
 				 */
 				gTiles[player->destroyedTileIndex].recovery_timer = player->recovery_time_delay;
 				player->recovery_time_delay -= RECOVERY_TIME_DELAY_DELTA;
+				
+				if (gNetworkConnection != NULL && player->weap->rewindTime > 0)
+				{
+					killCharactersFromRewoundShot(player, player->destroyedTileIndex);
+				}
 			}
 		}
 		
@@ -606,7 +620,7 @@ static void firstTileLayerAnimation(ZGWindow *window, GameState gameState)
 		{
 			setDieingTileColor(gTilesLayer[gTileLayerStates[0].colorIndex]);
 			
-			if (ZGWindowHasFocus(window) && gAudioEffectsFlag && gameState != GAME_STATE_PAUSED)
+			if (gAudioEffectsFlag && gameState != GAME_STATE_PAUSED && ZGWindowHasFocus(window))
 			{
 				playDieingStoneSound();
 			}
@@ -632,7 +646,7 @@ static void firstTileLayerAnimation(ZGWindow *window, GameState gameState)
 			gTiles[gTilesLayer[gTileLayerStates[0].deathIndex]].z -= OBJECT_FALLING_STEP;
 			gTiles[gTilesLayer[gTileLayerStates[0].deathIndex]].isDead = true;
 			
-			if (ZGWindowHasFocus(window) && gAudioEffectsFlag && gameState != GAME_STATE_PAUSED)
+			if (gAudioEffectsFlag && gameState != GAME_STATE_PAUSED && ZGWindowHasFocus(window))
 			{
 				playTileFallingSound();
 			}
@@ -671,7 +685,7 @@ static void secondTileLayerAnimation(ZGWindow *window, GameState gameState)
 		{
 			setDieingTileColor(gTilesLayer[gTileLayerStates[1].colorIndex]);
 			
-			if (ZGWindowHasFocus(window) && gAudioEffectsFlag && gameState != GAME_STATE_PAUSED)
+			if (gAudioEffectsFlag && gameState != GAME_STATE_PAUSED && ZGWindowHasFocus(window))
 			{
 				playDieingStoneSound();
 			}
@@ -697,7 +711,7 @@ static void secondTileLayerAnimation(ZGWindow *window, GameState gameState)
 			gTiles[gTilesLayer[gTileLayerStates[1].deathIndex]].z -= OBJECT_FALLING_STEP;
 			gTiles[gTilesLayer[gTileLayerStates[1].deathIndex]].isDead = true;
 			
-			if (ZGWindowHasFocus(window) && gAudioEffectsFlag && gameState != GAME_STATE_PAUSED)
+			if (gAudioEffectsFlag && gameState != GAME_STATE_PAUSED && ZGWindowHasFocus(window))
 			{
 				playTileFallingSound();
 			}
@@ -867,72 +881,77 @@ void prepareCharactersDeath(Character *player)
 /*
  * The characterInput is passed because we have to turn off the character's inputs
  */
-static void killCharacter(Input *characterInput, bool tutorial, double timeDelta)
+static void killCharacterOnTile(Character *player, int location, bool tutorial)
 {
-	Character *player = characterFromInput(characterInput);
+	prepareCharactersDeath(player);
 	
-	int location = getTileIndexLocation((int)player->x, (int)player->y);
+	player->time_alive = 0.0f;
 	
-	// Make the character fall down if the tile is falling down
-	if (location >= 0 && location < NUMBER_OF_TILES && gTiles[location].z < TILE_ALIVE_Z && CHARACTER_IS_ALIVE(player) && (!gNetworkConnection || gNetworkConnection->type == NETWORK_SERVER_TYPE))
+	player->lives--;
+	player->active = false;
+	
+	if (gNetworkConnection && gNetworkConnection->type == NETWORK_SERVER_TYPE)
 	{
-		prepareCharactersDeath(player);
-		
-		player->time_alive = 0.0f;
+		GameMessage message;
+		message.type = CHARACTER_DIED_UPDATE_MESSAGE_TYPE;
+		message.diedUpdate.characterID = IDOfCharacter(player);
+		message.diedUpdate.characterLives = player->lives;
 		
-		player->lives--;
-		player->active = false;
+		sendToClients(0, &message);
+	}
+	
+	if (!tutorial)
+	{
+		decideWhetherToMakeAPlayerAWinner(player);
+	}
+	
+	// who killed me?
+	Character *killer = NULL;
+	if (gTiles[location].coloredID == RED_ROVER)
+	{
+		killer = &gRedRover;
+	}
+	else if (gTiles[location].coloredID == PINK_BUBBLE_GUM)
+	{
+		killer = &gPinkBubbleGum;
+	}
+	else if (gTiles[location].coloredID == BLUE_LIGHTNING)
+	{
+		killer = &gBlueLightning;
+	}
+	else if (gTiles[location].coloredID == GREEN_TREE)
+	{
+		killer = &gGreenTree;
+	}
+	
+	if (killer)
+	{
+		(killer->kills)++;
 		
 		if (gNetworkConnection && gNetworkConnection->type == NETWORK_SERVER_TYPE)
 		{
 			GameMessage message;
-			message.type = CHARACTER_DIED_UPDATE_MESSAGE_TYPE;
-			message.diedUpdate.characterID = IDOfCharacter(player);
-			message.diedUpdate.characterLives = player->lives;
+			message.type = CHARACTER_KILLED_UPDATE_MESSAGE_TYPE;
+			message.killedUpdate.characterID = IDOfCharacter(killer);
+			message.killedUpdate.kills = killer->kills;
 			
 			sendToClients(0, &message);
 		}
-		
-		if (!tutorial)
-		{
-			decideWhetherToMakeAPlayerAWinner(player);
-		}
-		
-		// who killed me?
-		Character *killer = NULL;
-		if (gTiles[location].coloredID == RED_ROVER)
-		{
-			killer = &gRedRover;
-		}
-		else if (gTiles[location].coloredID == PINK_BUBBLE_GUM)
-		{
-			killer = &gPinkBubbleGum;
-		}
-		else if (gTiles[location].coloredID == BLUE_LIGHTNING)
-		{
-			killer = &gBlueLightning;
-		}
-		else if (gTiles[location].coloredID == GREEN_TREE)
-		{
-			killer = &gGreenTree;
-		}
-		
-		if (killer)
-		{
-			(killer->kills)++;
-			
-			if (gNetworkConnection && gNetworkConnection->type == NETWORK_SERVER_TYPE)
-			{
-				GameMessage message;
-				message.type = CHARACTER_KILLED_UPDATE_MESSAGE_TYPE;
-				message.killedUpdate.characterID = IDOfCharacter(killer);
-				message.killedUpdate.kills = killer->kills;
-				
-				sendToClients(0, &message);
-			}
-		}
-		
-		player->z -= OBJECT_FALLING_STEP;
+	}
+	
+	player->z -= OBJECT_FALLING_STEP;
+}
+
+static void killCharacter(Input *characterInput, bool tutorial, double timeDelta)
+{
+	Character *player = characterFromInput(characterInput);
+	
+	int location = getTileIndexLocation((int)player->x, (int)player->y);
+	
+	// Make the character fall down if the tile is falling down
+	if (location >= 0 && location < NUMBER_OF_TILES && gTiles[location].z < TILE_ALIVE_Z && CHARACTER_IS_ALIVE(player) && (!gNetworkConnection || gNetworkConnection->type == NETWORK_SERVER_TYPE))
+	{
+		killCharacterOnTile(player, location, tutorial);
 	}
 	
 	if (!CHARACTER_IS_ALIVE(player) && player->z > CHARACTER_TERMINATING_Z)
@@ -942,6 +961,20 @@ static void killCharacter(Input *characterInput, bool tutorial, double timeDelta
 	}
 }
 
+// A client's shot is judged against where it saw the other characters, which is a little in the past for the server
+// So characters that were standing on a tile it destroys by then die as well, even if they have since moved off it
+static void killCharactersFromRewoundShot(Character *shooter, int tileIndex)
+{
+	for (uint8_t characterID = RED_ROVER; characterID <= PINK_BUBBLE_GUM; characterID++)
+	{
+		Character *character = getCharacter(characterID);
+		if (character != shooter && CHARACTER_IS_ALIVE(character) && rewoundCharacterTileIndex(character, shooter->weap->rewindTime) == tileIndex)
+		{
+			killCharacterOnTile(character, tileIndex, false);
+		}
+	}
+}
+
 static void recoverCharacter(Character *player)
 {
 	if (!player->lives || (gNetworkConnection && gNetworkConnection->type == NETWORK_CLIENT_TYPE))
@@ -0,0 +1,312 @@
+/*
+ * Copyright 2010 Mayur Pawashe
+ * https://zgcoder.net
+ 
+ * This file is part of skycheckers.
+ * skycheckers is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ 
+ * skycheckers is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with skycheckers.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Measures how fast GameMessages get from one thread to another through a GameMessageQueue,
+// compared to the mutex guarded array the network code used before it
+// Usage: queuebench [number of messages] [burst size] [microseconds between bursts]
+// With no arguments it runs bursts like a game's network traffic and then pushes as fast as possible
+
+#include "message_queue.h"
+#include "thread.h"
+#include "zgtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if PLATFORM_WINDOWS
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
+#define DEFAULT_MESSAGE_COUNT 200000
+#define DEFAULT_BURST_SIZE 16
+#define DEFAULT_BURST_INTERVAL 100
+
+// How the network code passed messages between threads before GameMessageQueue
+typedef struct
+{
+	GameMessage *messages;
+	uint32_t count;
+	uint32_t capacity;
+	ZGMutex mutex;
+} GameMessageArray;
+
+typedef struct
+{
+	// Exactly one of these is used
+	GameMessageQueue *queue;
+	GameMessageArray *array;
+	
+	uint32_t messageCount;
+	uint32_t burstSize;
+	uint64_t burstInterval;
+	
+	// Nanoseconds the producer spent pushing
+	uint64_t pushTime;
+	uint64_t startTime;
+	uint64_t endTime;
+	
+	// When each message started being pushed, indexed by the packet number it's sent with, in nanoseconds
+	uint64_t *pushTimes;
+	// How long each message took to be read after it started being pushed, in nanoseconds
+	uint32_t *latencies;
+	// Only writable from the consumer thread
+	uint32_t receivedCount;
+} QueueBenchmark;
+
+static void yieldThread(void)
+{
+#if PLATFORM_WINDOWS
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+static void pushGameMessageArray(GameMessageArray *messageArray, GameMessage message)
+{
+	ZGLockMutex(messageArray->mutex);
+	
+	if (messageArray->count >= messageArray->capacity)
+	{
+		uint32_t newCapacity = (messageArray->capacity == 0) ? 1024 : (uint32_t)(messageArray->capacity * 1.6f);
+		messageArray->messages = realloc(messageArray->messages, newCapacity * sizeof(message));
+		messageArray->capacity = newCapacity;
+	}
+	messageArray->messages[messageArray->count++] = message;
+	
+	ZGUnlockMutex(messageArray->mutex);
+}
+
+// Returns a copy of every pushed message for the caller to free, or NULL if there are none
+static GameMessage *popGameMessageArray(GameMessageArray *messageArray, uint32_t *count)
+{
+	GameMessage *messages = NULL;
+	
+	ZGLockMutex(messageArray->mutex);
+	
+	if (messageArray->count > 0)
+	{
+		size_t size = sizeof(*messages) * messageArray->count;
+		messages = malloc(size);
+		memcpy(messages, messageArray->messages, size);
+		*count = messageArray->count;
+		messageArray->count = 0;
+	}
+	
+	ZGUnlockMutex(messageArray->mutex);
+	
+	return messages;
+}
+
+static int producerThread(void *context)
+{
+	QueueBenchmark *benchmark = context;
+	
+	uint64_t nextBurstTime = ZGGetNanoTicks();
+	uint32_t messageIndex = 0;
+	while (messageIndex < benchmark->messageCount)
+	{
+		if (benchmark->burstInterval > 0)
+		{
+			while (ZGGetNanoTicks() < nextBurstTime)
+			{
+				yieldThread();
+			}
+			nextBurstTime += benchmark->burstInterval;
+		}
+		
+		for (uint32_t burstIndex = 0; burstIndex < benchmark->burstSize && messageIndex < benchmark->messageCount; burstIndex++, messageIndex++)
+		{
+			// Both implementations get the same bound so the array can't grow without limit when pushing as fast as possible
+			while (messageIndex - loadAcquireUInt32(&benchmark->receivedCount) >= GAME_MESSAGE_QUEUE_CAPACITY)
+			{
+				yieldThread();
+			}
+			
+			GameMessage message = {0};
+			message.type = CHARACTER_MOVED_UPDATE_MESSAGE_TYPE;
+			message.packetNumber = messageIndex;
+			
+			uint64_t pushTime = ZGGetNanoTicks();
+			benchmark->pushTimes[messageIndex] = pushTime;
+			
+			if (benchmark->queue != NULL)
+			{
+				pushNetworkMessage(benchmark->queue, message);
+			}
+			else
+			{
+				pushGameMessageArray(benchmark->array, message);
+			}
+			
+			benchmark->pushTime += ZGGetNanoTicks() - pushTime;
+		}
+	}
+	
+	return 0;
+}
+
+static uint32_t recordLatencies(QueueBenchmark *benchmark, GameMessage *messages, uint32_t count, uint32_t receivedCount, uint64_t readTime)
+{
+	for (uint32_t messageIndex = 0; messageIndex < count; messageIndex++)
+	{
+		benchmark->latencies[receivedCount++] = (uint32_t)(readTime - benchmark->pushTimes[messages[messageIndex].packetNumber]);
+	}
+	return receivedCount;
+}
+
+static int consumerThread(void *context)
+{
+	QueueBenchmark *benchmark = context;
+	
+	uint32_t receivedCount = 0;
+	while (receivedCount < benchmark->messageCount)
+	{
+		uint64_t readTime = ZGGetNanoTicks();
+		if (benchmark->queue != NULL)
+		{
+			uint32_t count = beginReadingNetworkMessages(benchmark->queue);
+			if (count == 0)
+			{
+				yieldThread();
+				continue;
+			}
+			
+			// Messages are read in place, and may wrap around the end of the queue
+			for (uint32_t messageIndex = 0; messageIndex < count; messageIndex++)
+			{
+				receivedCount = recordLatencies(benchmark, networkMessageAtIndex(benchmark->queue, messageIndex), 1, receivedCount, readTime);
+			}
+			finishReadingNetworkMessages(benchmark->queue, count);
+		}
+		else
+		{
+			uint32_t count = 0;
+			GameMessage *messages = popGameMessageArray(benchmark->array, &count);
+			if (messages == NULL)
+			{
+				yieldThread();
+				continue;
+			}
+			
+			receivedCount = recordLatencies(benchmark, messages, count, receivedCount, readTime);
+			free(messages);
+		}
+		
+		storeReleaseUInt32(&benchmark->receivedCount, receivedCount);
+	}
+	
+	benchmark->endTime = ZGGetNanoTicks();
+	
+	return 0;
+}
+
+static int compareLatencies(const void *latency1, const void *latency2)
+{
+	uint32_t value1 = *(const uint32_t *)latency1;
+	uint32_t value2 = *(const uint32_t *)latency2;
+	return (value1 > value2) - (value1 < value2);
+}
+
+// Latencies must be sorted
+static double latencyPercentile(const uint32_t *latencies, uint32_t count, double percentile)
+{
+	uint32_t index = (uint32_t)(percentile / 100.0 * (count - 1));
+	return latencies[index] / 1000.0;
+}
+
+static void runQueueBenchmark(const char *name, GameMessageQueue *queue, GameMessageArray *array, uint32_t messageCount, uint32_t burstSize, uint32_t burstInterval)
+{
+	QueueBenchmark benchmark;
+	memset(&benchmark, 0, sizeof(benchmark));
+	benchmark.queue = queue;
+	benchmark.array = array;
+	benchmark.messageCount = messageCount;
+	benchmark.burstSize = burstSize;
+	benchmark.burstInterval = (uint64_t)burstInterval * 1000;
+	benchmark.pushTimes = calloc(messageCount, sizeof(*benchmark.pushTimes));
+	benchmark.latencies = calloc(messageCount, sizeof(*benchmark.latencies));
+	
+	benchmark.startTime = ZGGetNanoTicks();
+	ZGThread consumer = ZGCreateThread(consumerThread, "consumer-thread", &benchmark);
+	ZGThread producer = ZGCreateThread(producerThread, "producer-thread", &benchmark);
+	ZGWaitThread(producer);
+	ZGWaitThread(consumer);
+	
+	qsort(benchmark.latencies, messageCount, sizeof(*benchmark.latencies), compareLatencies);
+	
+	double seconds = (benchmark.endTime - benchmark.startTime) / 1e9;
+	printf("%-18s %12.1f %14.0f %10.2f %10.2f %10.2f %10.2f\n", name, (double)benchmark.pushTime / messageCount, messageCount / seconds, latencyPercentile(benchmark.latencies, messageCount, 50.0), latencyPercentile(benchmark.latencies, messageCount, 99.0), latencyPercentile(benchmark.latencies, messageCount, 99.9), latencyPercentile(benchmark.latencies, messageCount, 100.0));
+	
+	free(benchmark.pushTimes);
+	free(benchmark.latencies);
+}
+
+static void runQueueBenchmarks(uint32_t messageCount, uint32_t burstSize, uint32_t burstInterval)
+{
+	if (burstInterval > 0)
+	{
+		printf("%u messages in bursts of %u every %u us\n", messageCount, burstSize, burstInterval);
+	}
+	else
+	{
+		printf("%u messages pushed as fast as possible\n", messageCount);
+	}
+	printf("%-18s %12s %14s %10s %10s %10s %10s\n", "", "push ns/msg", "msgs/s", "p50 us", "p99 us", "p99.9 us", "max us");
+	
+	GameMessageQueue *queue = calloc(1, sizeof(*queue));
+	runQueueBenchmark("GameMessageQueue", queue, NULL, messageCount, burstSize, burstInterval);
+	free(queue);
+	
+	GameMessageArray array;
+	memset(&array, 0, sizeof(array));
+	array.mutex = ZGCreateMutex();
+	runQueueBenchmark("mutex + array", NULL, &array, messageCount, burstSize, burstInterval);
+	free(array.messages);
+	
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+	{
+		int messageCount = atoi(argv[1]);
+		int burstSize = (argc > 2) ? atoi(argv[2]) : DEFAULT_BURST_SIZE;
+		int burstInterval = (argc > 3) ? atoi(argv[3]) : DEFAULT_BURST_INTERVAL;
+		if (messageCount < 1 || burstSize < 1 || burstInterval < 0)
+		{
+			fprintf(stderr, "Usage: %s [number of messages] [burst size] [microseconds between bursts]\n", argv[0]);
+			return 1;
+		}
+		
+		runQueueBenchmarks((uint32_t)messageCount, (uint32_t)burstSize, (uint32_t)burstInterval);
+	}
+	else
+	{
+		runQueueBenchmarks(DEFAULT_MESSAGE_COUNT, DEFAULT_BURST_SIZE, DEFAULT_BURST_INTERVAL);
+		runQueueBenchmarks(DEFAULT_MESSAGE_COUNT, DEFAULT_BURST_SIZE, 0);
+	}
+	
+	return 0;
+}
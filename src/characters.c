@@ -32,10 +32,10 @@ int gAIMode = AI_EASY_MODE;
 
 int gNumberOfNetHumans = 1;
 
-Character gRedRover;
-Character gGreenTree;
-Character gPinkBubbleGum;
-Character gBlueLightning;
+ZG_THREAD_LOCAL Character gRedRover;
+ZG_THREAD_LOCAL Character gGreenTree;
+ZG_THREAD_LOCAL Character gPinkBubbleGum;
+ZG_THREAD_LOCAL Character gBlueLightning;
 
 static BufferArrayObject gCharacterVertexAndTextureCoordinateArrayObject;
 static BufferObject gCharacterIndicesBufferObject;
@@ -73,8 +73,6 @@ void loadCharacter(Character *character)
 	character->xDiscrepancy = 0.0f;
 	character->yDiscrepancy = 0.0f;
 	character->movementConsumedCounter = 0;
-	character->predictedDirectionTime = 0;
-	character->predictedDirection = NO_DIRECTION;
 	
 	character->move_timer = 0.0f;
 	character->fire_timer = 0.0f;
@@ -115,7 +113,7 @@ static void initCharacter(Character *character, float red, float green, float bl
 	character->weap->blue = weapBlue;
 	
 	character->netState = NETWORK_NO_STATE;
-	character->netName = NULL;
+	memset(character->netName, 0, sizeof(character->netName));
 	character->backup_state = 0;
 	
 	memset(character->controllerName, 0, sizeof(character->controllerName));
@@ -492,7 +490,7 @@ static const char *labelForCharacter(Character *character, const char *playerNum
 {
 	if (gNetworkConnection)
 	{
-		if (character->netName)
+		if (character->netName[0] != '\0')
 		{
 			return character->netName;
 		}
@@ -745,6 +743,21 @@ static void sendCharacterMovement(Character *character)
 			message.movedUpdate.dead = !CHARACTER_IS_ALIVE(character);
 			message.movedUpdate.direction = character->direction;
 			message.movedUpdate.pointing_direction = character->pointing_direction;
+			message.movedUpdate.inputSequence = 0;
+			message.movedUpdate.inputSteps = 0;
+			
+			// Let the character's client know which of its movement requests this movement follows from
+			uint8_t addressIndex = message.movedUpdate.characterID - 1;
+			if (addressIndex < 3)
+			{
+				message.movedUpdate.inputSequence = gNetworkConnection->clientInputSequences[addressIndex];
+				message.movedUpdate.inputSteps = gNetworkConnection->clientInputSteps[addressIndex];
+				
+				if (gNetworkConnection->clientInputSteps[addressIndex] < UINT16_MAX)
+				{
+					gNetworkConnection->clientInputSteps[addressIndex]++;
+				}
+			}
 			
 			sendToClients(0, &message);
 		}
@@ -857,6 +870,8 @@ void fireCharacterWeapon(Character *character)
 					{
 						GameMessage message;
 						message.type = CHARACTER_FIRED_REQUEST_MESSAGE_TYPE;
+						// The other characters are shown as they were a half-ping ago plus however far behind they're rendered
+						message.firedRequest.renderTime = gNetworkConnection->serverClockSynchronized ? serverTimeNow() - gNetworkConnection->serverHalfPing - gNetworkConnection->interpolationDelay : 0;
 						
 						sendToServer(message);
 					}
@@ -876,7 +891,7 @@ void fireCharacterWeapon(Character *character)
 }
 
 #define INITIAL_WEAPON_DISPLACEMENT 2.0f
-void prepareFiringCharacterWeapon(Character *character, float x, float y, int direction, float compensation)
+void prepareFiringCharacterWeapon(Character *character, float x, float y, int direction, float compensation, uint32_t rewindTime)
 {
 	if (character->active && !character->weap->animationState)
 	{
@@ -906,6 +921,7 @@ void prepareFiringCharacterWeapon(Character *character, float x, float y, int di
 		character->weap->initialX = x;
 		character->weap->initialY = y;
 		character->weap->compensation = compensation;
+		character->weap->rewindTime = rewindTime;
 		character->weap->direction = direction;
 		
 		character->weap->fired = true;
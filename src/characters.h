@@ -23,6 +23,7 @@
 #include "weapon.h"
 #include "math_3d.h"
 #include "renderer.h"
+#include "globals.h"
 
 #define CHARACTER_TERMINATING_Z -70.0f
 
@@ -96,10 +97,6 @@ typedef struct _Character
 	/* The number of movements we have consumed -- used to determine when we should correct a player's position for netcode */
 	int movementConsumedCounter;
 	
-	/* Predicted direction character client uses for netcode */
-	int predictedDirection;
-	uint32_t predictedDirectionTime;
-	
 	/* Speed of character */
 	float speed;
 	
@@ -124,7 +121,8 @@ typedef struct _Character
 	
 	/* Character's network state */
 	int netState;
-	char *netName;
+	// Empty unless someone plays the character in a network game
+	char netName[MAX_USER_NAME_SIZE];
 	
 	Weapon *weap;
 	bool active;
@@ -157,10 +155,10 @@ typedef struct _Character
 	char controllerName[MAX_CONTROLLER_NAME_SIZE];
 } Character;
 
-extern Character gRedRover;
-extern Character gGreenTree;
-extern Character gPinkBubbleGum;
-extern Character gBlueLightning;
+extern ZG_THREAD_LOCAL Character gRedRover;
+extern ZG_THREAD_LOCAL Character gGreenTree;
+extern ZG_THREAD_LOCAL Character gPinkBubbleGum;
+extern ZG_THREAD_LOCAL Character gBlueLightning;
 
 void initCharacters(void);
 void resetCharacterWins(void);
@@ -191,6 +189,6 @@ void moveCharacter(Character *character, double timeDelta);
 void turnCharacter(Character *character, int direction);
 
 void fireCharacterWeapon(Character *character);
-void prepareFiringCharacterWeapon(Character *character, float x, float y, int direction, float compensation);
+void prepareFiringCharacterWeapon(Character *character, float x, float y, int direction, float compensation, uint32_t rewindTime);
 
 void saveRenderCharacterState(Character *character);
@@ -35,6 +35,8 @@
  * example 2: redRover.weapon.z 8.3 // note that objects can contain more objects. weapon is an object owned by redRover object in this case. 
  * example 3: tile(5).z -20.0 // The arg 5 specifies that the user wants to set the fifth tile's z property to the value of -20.0
  * example 4: fps // notice that this command doesn't require any value to be inputted
+ * example 5: net.stats // prints telemetry of the network connection, and net.overlay draws some of it on screen
+ * example 6: net.latency 80 // the network conditioner holds outgoing datagrams back by 80 ms (see also net.jitter, net.loss, net.duplicate, net.reorder and net.seed)
  *
  * Also note that no commands contain capital letters and no objects or properties contain spaces, however,
  * they may contain underscores. For example, the tile object has a property called recovery_timer.
@@ -60,6 +62,7 @@ static unsigned int gConsoleStringIndex;
 
 static float getConsoleValue(void);
 static float setConsoleValue(bool *errorFlag);
+static float setNetworkConditionerConsoleValue(NetworkConditionerSetting setting, bool valueExists, float value);
 
 void initConsole(void)
 {
@@ -815,10 +818,61 @@ static float setConsoleValue(bool *errorFlag)
 			value = gDrawPings;
 		}
 	}
+	else if (strcmp(input, "scc~: net.stats") == 0)
+	{
+		printNetworkStats(stderr);
+	}
+	else if (strcmp(input, "scc~: net.overlay") == 0)
+	{
+		if (valueExists)
+		{
+			gDrawNetworkStats = (bool)value;
+		}
+		else
+		{
+			gDrawNetworkStats = !gDrawNetworkStats;
+			value = gDrawNetworkStats;
+		}
+	}
+	else if (strcmp(input, "scc~: net.latency") == 0)
+	{
+		value = setNetworkConditionerConsoleValue(NETWORK_CONDITIONER_LATENCY, valueExists, value);
+	}
+	else if (strcmp(input, "scc~: net.jitter") == 0)
+	{
+		value = setNetworkConditionerConsoleValue(NETWORK_CONDITIONER_JITTER, valueExists, value);
+	}
+	else if (strcmp(input, "scc~: net.loss") == 0)
+	{
+		value = setNetworkConditionerConsoleValue(NETWORK_CONDITIONER_LOSS, valueExists, value);
+	}
+	else if (strcmp(input, "scc~: net.duplicate") == 0)
+	{
+		value = setNetworkConditionerConsoleValue(NETWORK_CONDITIONER_DUPLICATE, valueExists, value);
+	}
+	else if (strcmp(input, "scc~: net.reorder") == 0)
+	{
+		value = setNetworkConditionerConsoleValue(NETWORK_CONDITIONER_REORDER, valueExists, value);
+	}
+	else if (strcmp(input, "scc~: net.seed") == 0)
+	{
+		value = setNetworkConditionerConsoleValue(NETWORK_CONDITIONER_SEED, valueExists, value);
+	}
 	
 	return value;
 }
 
+// Without a value, this reports the network conditioner's current setting
+static float setNetworkConditionerConsoleValue(NetworkConditionerSetting setting, bool valueExists, float value)
+{
+	if (valueExists)
+	{
+		setNetworkConditionerSetting(setting, value);
+	}
+	
+	return networkConditionerSetting(setting);
+}
+
 void clearConsole(void)
 {
 	if (gConsoleStringIndex > MIN_CONSOLE_STRING_LENGTH)
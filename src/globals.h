@@ -23,6 +23,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "platforms.h"
+#include "thread.h"
 
 #define MAX_CHARACTER_LIVES 10
 
@@ -48,14 +49,16 @@ void endNetworkGame(ZGWindow *window);
 #if PLATFORM_IOS
 extern bool gSuggestedTutorial;
 #endif
-extern bool gGameHasStarted;
-extern bool gGameShouldReset;
-extern int gGameWinner;
-extern int32_t gGameStartNumber;
-extern uint8_t gTutorialStage;
-extern float gTutorialCoverTimer;
+// State of the game being simulated, which every match of a dedicated server keeps on its own thread
+extern ZG_THREAD_LOCAL bool gGameHasStarted;
+extern ZG_THREAD_LOCAL bool gGameShouldReset;
+extern ZG_THREAD_LOCAL int gGameWinner;
+extern ZG_THREAD_LOCAL int32_t gGameStartNumber;
+extern ZG_THREAD_LOCAL uint8_t gTutorialStage;
+extern ZG_THREAD_LOCAL float gTutorialCoverTimer;
 extern bool gDrawFPS;
 extern bool gDrawPings;
+extern bool gDrawNetworkStats;
 
 extern int gCharacterLives;
 
@@ -23,10 +23,10 @@
 #include "collision.h"
 #include "globals.h"
 
-Input gRedRoverInput;
-Input gGreenTreeInput;
-Input gPinkBubbleGumInput;
-Input gBlueLightningInput;
+ZG_THREAD_LOCAL Input gRedRoverInput;
+ZG_THREAD_LOCAL Input gGreenTreeInput;
+ZG_THREAD_LOCAL Input gPinkBubbleGumInput;
+ZG_THREAD_LOCAL Input gBlueLightningInput;
 
 void initInput(Input *input)
 {
@@ -77,7 +77,7 @@ Character *characterFromInput(Input *characterInput)
 
 static void prepareFiringFromInput(Input *input)
 {
-	prepareFiringCharacterWeapon(input->character, input->character->x, input->character->y, input->character->pointing_direction, 0.0f);
+	prepareFiringCharacterWeapon(input->character, input->character->x, input->character->y, input->character->pointing_direction, 0.0f, 0);
 }
 
 #if PLATFORM_IOS
@@ -392,8 +392,7 @@ void updateCharacterFromAnyInput(void)
 			GameMessage message;
 			message.type = MOVEMENT_REQUEST_MESSAGE_TYPE;
 			message.movementRequest.direction = newDirection;
-
-			setPredictedDirection(character, newDirection);
+			message.movementRequest.inputSequence = predictCharacterDirection(character, newDirection);
 
 			sendToServer(message);
 		}
@@ -63,10 +63,10 @@ typedef struct
 	GamepadIndex gamepadIndex;
 } Input;
 
-extern Input gRedRoverInput;
-extern Input gGreenTreeInput;
-extern Input gPinkBubbleGumInput;
-extern Input gBlueLightningInput;
+extern ZG_THREAD_LOCAL Input gRedRoverInput;
+extern ZG_THREAD_LOCAL Input gGreenTreeInput;
+extern ZG_THREAD_LOCAL Input gPinkBubbleGumInput;
+extern ZG_THREAD_LOCAL Input gBlueLightningInput;
 
 void initInput(Input *input);
 
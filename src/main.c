@@ -22,12 +22,14 @@
 #include "characters.h"
 #include "scenery.h"
 #include "input.h"
+#include "ai.h"
 #include "animation.h"
 #include "weapon.h"
 #include "font.h"
 #include "text.h"
 #include "audio.h"
 #include "menus.h"
+#include "menu_actions.h"
 #include "network.h"
 #include "mt_random.h"
 #include "quit.h"
@@ -44,6 +46,8 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <time.h>
 
 #define MATH_3D_IMPLEMENTATION
 #include "math_3d.h"
@@ -62,12 +66,12 @@
 // A license to embed the font was acquired (for me, Mayur, only) from http://typodermicfonts.com/goodfish/
 #define FONT_PATH "Data/Fonts/typelib.dat"
 
-bool gGameHasStarted;
-bool gGameShouldReset;
-int32_t gGameStartNumber;
-uint8_t gTutorialStage;
-float gTutorialCoverTimer;
-int gGameWinner;
+ZG_THREAD_LOCAL bool gGameHasStarted;
+ZG_THREAD_LOCAL bool gGameShouldReset;
+ZG_THREAD_LOCAL int32_t gGameStartNumber;
+ZG_THREAD_LOCAL uint8_t gTutorialStage;
+ZG_THREAD_LOCAL float gTutorialCoverTimer;
+ZG_THREAD_LOCAL int gGameWinner;
 
 GamepadManager *gGamepadManager;
 static GamepadIndex gGamepads[12] = {INVALID_GAMEPAD_INDEX, INVALID_GAMEPAD_INDEX, INVALID_GAMEPAD_INDEX, INVALID_GAMEPAD_INDEX, INVALID_GAMEPAD_INDEX, INVALID_GAMEPAD_INDEX, INVALID_GAMEPAD_INDEX, INVALID_GAMEPAD_INDEX, INVALID_GAMEPAD_INDEX, INVALID_GAMEPAD_INDEX, INVALID_GAMEPAD_INDEX, INVALID_GAMEPAD_INDEX};
@@ -110,16 +114,23 @@ static bool gConsoleActivated;
 
 bool gDrawFPS;
 bool gDrawPings;
+bool gDrawNetworkStats;
 
-static GameState gGameState;
+static ZG_THREAD_LOCAL GameState gGameState;
+
+// Time carried over between runs of fixed simulation steps, in seconds
+typedef struct
+{
+	double lastFrameTime;
+	double cyclesLeftOver;
+} FixedTimestep;
 
 typedef struct
 {
 	Renderer renderer;
 	bool needsToDrawScene;
 	
-	double lastFrameTime;
-	double cyclesLeftOver;
+	FixedTimestep timestep;
 	uint32_t lastRunloopTime;
 
 #if PLATFORM_WINDOWS
@@ -129,6 +140,34 @@ typedef struct
 
 #define MAX_FPS_RATE 120
 
+#if !PLATFORM_IOS
+// Set from a signal handler when a dedicated server or bot clients are asked to quit
+static volatile sig_atomic_t gDedicatedServerShouldQuit;
+// Set between steps of a stepped network test once its server stops playing so its clients can catch up
+static bool gNetworkTestSettling;
+#endif
+
+// in seconds
+#define DEDICATED_SERVER_NEW_GAME_DELAY 8.0
+
+#define MAX_DEDICATED_SERVER_MATCHES 64
+
+// Enough to fill every match of the largest dedicated server
+#define MAX_BOT_CLIENTS (MAX_DEDICATED_SERVER_MATCHES * 3)
+// in milliseconds
+// Bots connect one after another so a server isn't flooded with handshakes all at once
+#define BOT_CONNECT_INTERVAL 50
+// in seconds
+#define BOT_SCRIPTED_TURN_INTERVAL 0.4
+
+// A network test runs a server and one client for every character but the host's
+#define NETWORK_TEST_CLIENT_COUNT 3
+// in milliseconds
+#define DEFAULT_NETWORK_TEST_DURATION 10000
+// in seconds
+// How long a stepped network test keeps stepping its clients after its server stops playing, before checking they caught up
+#define NETWORK_TEST_SETTLE_DURATION 2.0
+
 #define CHARACTER_ICON_DISPLACEMENT 5.0f
 #define CHARACTER_ICON_OFFSET -8.5f
 
@@ -560,7 +599,8 @@ void initGame(ZGWindow *window, bool firstGame, bool tutorial)
 		initialNumberOfLives = gCharacterLives;
 	}
 	
-	if (firstGame)
+	// A dedicated server has no gamepad manager
+	if (firstGame && gGamepadManager != NULL)
 	{
 		if (gNetworkConnection != NULL)
 		{
@@ -689,7 +729,7 @@ void initGame(ZGWindow *window, bool firstGame, bool tutorial)
 		playGameMusic(!windowFocus);
 	}
 	
-	if (firstGame && gGameState != GAME_STATE_PAUSED)
+	if (firstGame && gGameState != GAME_STATE_PAUSED && window != NULL)
 	{
 		ZGAppSetAllowsScreenIdling(false);
 #if PLATFORM_TVOS
@@ -741,7 +781,10 @@ void endGame(ZGWindow *window, bool lastGame)
 			playMainMenuMusic(!windowFocus);
 		}
 		
-		ZGAppSetAllowsScreenIdling(true);
+		if (window != NULL)
+		{
+			ZGAppSetAllowsScreenIdling(true);
+		}
 		
 		if (gGameState != GAME_STATE_PAUSED)
 		{
@@ -889,6 +932,58 @@ static void drawPings(Renderer *renderer)
 	}
 }
 
+// Draws a line of telemetry for every peer of the connection, refreshed once a second
+static void drawNetworkStats(Renderer *renderer)
+{
+	if (gNetworkConnection == NULL)
+	{
+		return;
+	}
+	
+	static char statsStrings[3][256];
+	static NetworkPeerStats previousStats[3];
+	static double lastStatsDisplayTime = -1.0;
+	
+	double currentTime = ZGGetTicks() / 1000.0;
+	bool rebuildStrings = (lastStatsDisplayTime < 0.0 || currentTime - lastStatsDisplayTime >= 1.0);
+	double elapsedTime = currentTime - lastStatsDisplayTime;
+	
+	for (uint8_t peerIndex = 0; peerIndex < 3; peerIndex++)
+	{
+		NetworkPeerStats stats;
+		if (!copyNetworkPeerStats(peerIndex, &stats))
+		{
+			memset(&previousStats[peerIndex], 0, sizeof(previousStats[peerIndex]));
+			continue;
+		}
+		
+		if (rebuildStrings)
+		{
+			// Rates are only meaningful once we have an earlier sample to compare against
+			double bytesSentRate = (lastStatsDisplayTime < 0.0) ? 0.0 : (double)(stats.bytesSent - previousStats[peerIndex].bytesSent) / elapsedTime;
+			double bytesReceivedRate = (lastStatsDisplayTime < 0.0) ? 0.0 : (double)(stats.bytesReceived - previousStats[peerIndex].bytesReceived) / elapsedTime;
+			
+			snprintf(statsStrings[peerIndex], sizeof(statsStrings[peerIndex]), "rtt %u/%u/%u out %.1fKB/s in %.1fKB/s rtx %u dup %u ooo %u", networkRoundTripTimePercentile(&stats, 50), networkRoundTripTimePercentile(&stats, 95), networkRoundTripTimePercentile(&stats, 99), bytesSentRate / 1024.0, bytesReceivedRate / 1024.0, stats.retransmissions, stats.duplicates, stats.outOfOrder);
+			
+			if (gNetworkConnection->type == NETWORK_CLIENT_TYPE)
+			{
+				size_t length = strlen(statsStrings[peerIndex]);
+				snprintf(statsStrings[peerIndex] + length, sizeof(statsStrings[peerIndex]) - length, " interp %ums jitter %.1fms", gNetworkConnection->interpolationDelay, gNetworkConnection->movementArrivalJitter);
+			}
+			
+			previousStats[peerIndex] = stats;
+		}
+		
+		mat4_t modelViewMatrix = m4_translation((vec3_t){-9.5f, 6.48f - peerIndex * 0.7f, -18.0f});
+		drawStringLeftAligned(renderer, m4_mul(modelViewMatrix, m4_scaling((vec3_t){1.6f, 1.0f, 1.0f})), (color4_t){1.0f, 1.0f, 1.0f, 0.8f}, 0.0025f, statsStrings[peerIndex]);
+	}
+	
+	if (rebuildStrings)
+	{
+		lastStatsDisplayTime = currentTime;
+	}
+}
+
 static void drawScoreboardTextForCharacter(Renderer *renderer, Character *character, mat4_t iconModelViewMatrix)
 {
 	color4_t characterColor = (color4_t){character->red, character->green, character->blue, 0.7f};
@@ -1253,11 +1348,6 @@ static void drawScene(Renderer *renderer, void *context)
 						drawStringScaled(renderer, numModelViewMatrix, textColor, scale, numBuffer);
 					}
 				}
-				
-				else if (gGameStartNumber == 0)
-				{
-					gGameHasStarted = true;
-				}
 			}
 		}
 		popDebugGroup(renderer);
@@ -1316,28 +1406,28 @@ static void drawScene(Renderer *renderer, void *context)
 			if (gGameWinner == RED_ROVER)
 			{
 				char winBuffer[128] = {0};
-				snprintf(winBuffer, sizeof(winBuffer) - 1, "%s wins!", gRedRover.netName != NULL ? gRedRover.netName : "Red Rover");
+				snprintf(winBuffer, sizeof(winBuffer) - 1, "%s wins!", gRedRover.netName[0] != '\0' ? gRedRover.netName : "Red Rover");
 				
 				drawStringScaled(renderer, winLoseModelViewMatrix, (color4_t){gRedRover.red, gRedRover.green, gRedRover.blue, 1.0f}, 0.0027f, winBuffer);
 			}
 			else if (gGameWinner == GREEN_TREE)
 			{
 				char winBuffer[128] = {0};
-				snprintf(winBuffer, sizeof(winBuffer) - 1, "%s wins!", gGreenTree.netName != NULL ? gGreenTree.netName : "Green Tree");
+				snprintf(winBuffer, sizeof(winBuffer) - 1, "%s wins!", gGreenTree.netName[0] != '\0' ? gGreenTree.netName : "Green Tree");
 				
 				drawStringScaled(renderer, winLoseModelViewMatrix, (color4_t){gGreenTree.red, gGreenTree.green, gGreenTree.blue, 1.0f}, 0.0027f, winBuffer);
 			}
 			else if (gGameWinner == PINK_BUBBLE_GUM)
 			{
 				char winBuffer[128] = {0};
-				snprintf(winBuffer, sizeof(winBuffer) - 1, "%s wins!", gPinkBubbleGum.netName != NULL ? gPinkBubbleGum.netName : "Pink Bubblegum");
+				snprintf(winBuffer, sizeof(winBuffer) - 1, "%s wins!", gPinkBubbleGum.netName[0] != '\0' ? gPinkBubbleGum.netName : "Pink Bubblegum");
 				
 				drawStringScaled(renderer, winLoseModelViewMatrix, (color4_t){gPinkBubbleGum.red, gPinkBubbleGum.green, gPinkBubbleGum.blue, 1.0f}, 0.0027f, winBuffer);
 			}
 			else if (gGameWinner == BLUE_LIGHTNING)
 			{
 				char winBuffer[128] = {0};
-				snprintf(winBuffer, sizeof(winBuffer) - 1, "%s wins!", gBlueLightning.netName != NULL ? gBlueLightning.netName : "Blue Lightning");
+				snprintf(winBuffer, sizeof(winBuffer) - 1, "%s wins!", gBlueLightning.netName[0] != '\0' ? gBlueLightning.netName : "Blue Lightning");
 				
 				drawStringScaled(renderer, winLoseModelViewMatrix, (color4_t){gBlueLightning.red, gBlueLightning.green, gBlueLightning.blue, 1.0f}, 0.0027f, winBuffer);
 			}
@@ -1409,6 +1499,14 @@ static void drawScene(Renderer *renderer, void *context)
 			drawPings(renderer);
 			popDebugGroup(renderer);
 		}
+		
+		if (gDrawNetworkStats)
+		{
+			// Network stats render at z = -18.0f
+			pushDebugGroup(renderer, "Network Stats");
+			drawNetworkStats(renderer);
+			popDebugGroup(renderer);
+		}
 	}
 	else /* if (gGameState != GAME_STATE_ON && gGameState != GAME_STATE_TUTORIAL && gGameState != GAME_STATE_PAUSED) */
 	{
@@ -1883,8 +1981,8 @@ static ZGWindow *appLaunchedHandler(void *context)
 	AppContext *appContext = context;
 	
 	appContext->lastRunloopTime = 0;
-	appContext->lastFrameTime = 0.0;
-	appContext->cyclesLeftOver = 0.0;
+	appContext->timestep.lastFrameTime = 0.0;
+	appContext->timestep.cyclesLeftOver = 0.0;
 	appContext->needsToDrawScene = true;
 	
 	initAudio();
@@ -1994,18 +2092,32 @@ static void saveRenderState(void)
 	saveRenderTilesState();
 }
 
-static void runLoopHandler(void *context)
+// Advances the simulation by one fixed time step
+// Shared by the regular run loop and the dedicated server, so it must not depend on rendering
+static void updateGameState(ZGWindow *window)
 {
-	AppContext *appContext = context;
-	Renderer *renderer = &appContext->renderer;
+	syncNetworkState(window, (float)ANIMATION_TIMER_INTERVAL, gGameState);
 	
-	// Update game state
-	// http://ludobloom.com/tutorials/timestep.html
-	// https://gafferongames.com/post/fix_your_timestep/
+	if (gGameState == GAME_STATE_ON || gGameState == GAME_STATE_TUTORIAL || (gGameState == GAME_STATE_PAUSED && gNetworkConnection != NULL))
+	{
+		animate(window, ANIMATION_TIMER_INTERVAL, gGameState);
+	}
 	
+	if (gGameShouldReset)
+	{
+		endGame(window, false);
+		initGame(window, false, false);
+	}
+}
+
+// Runs as many simulation steps as the time since the last run calls for
+// http://ludobloom.com/tutorials/timestep.html
+// https://gafferongames.com/post/fix_your_timestep/
+static void runFixedTimesteps(FixedTimestep *timestep, void (*step)(void *context), void *context)
+{
 	double currentTime = (double)ZGGetTicks() / 1000.0;
 	
-	double updateIterations = ((currentTime - appContext->lastFrameTime) + appContext->cyclesLeftOver);
+	double updateIterations = ((currentTime - timestep->lastFrameTime) + timestep->cyclesLeftOver);
 	
 	if (updateIterations > MAX_ITERATIONS)
 	{
@@ -2016,26 +2128,60 @@ static void runLoopHandler(void *context)
 	{
 		updateIterations -= ANIMATION_TIMER_INTERVAL;
 		
-		saveRenderState();
-		
-		syncNetworkState(renderer->window, (float)ANIMATION_TIMER_INTERVAL, gGameState);
-		
-		if (gGameState == GAME_STATE_ON || gGameState == GAME_STATE_TUTORIAL || (gGameState == GAME_STATE_PAUSED && gNetworkConnection != NULL))
-		{
-			animate(renderer->window, ANIMATION_TIMER_INTERVAL, gGameState);
-		}
+		step(context);
+	}
+	
+	timestep->cyclesLeftOver = updateIterations;
+	timestep->lastFrameTime = currentTime;
+}
+
+// Steps the simulation in real time on a thread with nothing to draw, sleeping until each step is due, for as long as shouldContinue says to
+static void runFixedTimestepLoop(bool (*shouldContinue)(void *context), void (*step)(void *context), void *context)
+{
+	FixedTimestep timestep;
+	timestep.lastFrameTime = (double)ZGGetTicks() / 1000.0;
+	timestep.cyclesLeftOver = 0.0;
+	
+	while (shouldContinue(context))
+	{
+		runFixedTimesteps(&timestep, step, context);
 		
-		if (gGameShouldReset)
-		{
-			endGame(renderer->window, false);
-			initGame(renderer->window, false, false);
-		}
+		// Sleep until the next simulation step is due
+		uint32_t delay = (uint32_t)((ANIMATION_TIMER_INTERVAL - timestep.cyclesLeftOver) * 1000.0);
+		ZGDelay(delay > 0 ? delay : 1);
+	}
+}
+
+// Steps the simulation whenever a stepped network transport does instead of in real time, for as long as shouldContinue says to
+static void runSteppedTimestepLoop(NetworkTransport *transport, uint8_t endpointIndex, bool (*shouldContinue)(void *context), void (*step)(void *context), void *context)
+{
+	while (shouldContinue(context))
+	{
+		uint32_t transportStep = waitForNetworkTransportStep(transport, endpointIndex);
+		step(context);
+		finishNetworkTransportStep(transport, endpointIndex, transportStep);
 	}
 	
-	appContext->cyclesLeftOver = updateIterations;
-	appContext->lastFrameTime = currentTime;
+	leaveNetworkTransportStepping(transport, endpointIndex);
+}
+
+static void stepRenderedGame(void *context)
+{
+	ZGWindow *window = context;
+	
+	saveRenderState();
+	
+	updateGameState(window);
+}
+
+static void runLoopHandler(void *context)
+{
+	AppContext *appContext = context;
+	Renderer *renderer = &appContext->renderer;
+	
+	runFixedTimesteps(&appContext->timestep, stepRenderedGame, renderer->window);
 	
-	float renderAlpha = (float)(appContext->cyclesLeftOver / ANIMATION_TIMER_INTERVAL);
+	float renderAlpha = (float)(appContext->timestep.cyclesLeftOver / ANIMATION_TIMER_INTERVAL);
 	
 	if (appContext->needsToDrawScene)
 	{
@@ -2073,8 +2219,1140 @@ static void pollEventHandler(void *context, void *systemEvent)
 #endif
 }
 
-int main(int argc, char *argv[])
+#if !PLATFORM_IOS
+static void handleDedicatedServerSignal(int signalNumber)
+{
+	gDedicatedServerShouldQuit = 1;
+}
+
+// Sets up the calling thread's copy of the simulation for serving games
+static void initDedicatedServerSimulation(void)
+{
+	loadTiles();
+	initCharacters();
+	
+	gRedRoverInput.character = &gRedRover;
+	gGreenTreeInput.character = &gGreenTree;
+	gPinkBubbleGumInput.character = &gPinkBubbleGum;
+	gBlueLightningInput.character = &gBlueLightning;
+	
+	gGameState = GAME_STATE_OFF;
+	
+	initializeNetworkBuffers();
+}
+
+// What a stepped network test checks its clients against its server on once they have caught up to it
+// It's what the server keeps its clients in sync with, rather than where characters happen to be
+typedef struct
+{
+	uint8_t tileColors[NUMBER_OF_TILES];
+	uint8_t fallenTiles[NUMBER_OF_TILES];
+	uint8_t deadTiles[NUMBER_OF_TILES];
+	uint8_t lives[4];
+	uint8_t kills[4];
+} NetworkTestWorld;
+
+static void captureNetworkTestWorld(NetworkTestWorld *world)
+{
+	for (uint32_t tileIndex = 0; tileIndex < NUMBER_OF_TILES; tileIndex++)
+	{
+		world->tileColors[tileIndex] = (uint8_t)gTiles[tileIndex].coloredID;
+		world->fallenTiles[tileIndex] = !gTiles[tileIndex].state;
+		world->deadTiles[tileIndex] = gTiles[tileIndex].isDead;
+	}
+	
+	Character *characters[4] = {&gPinkBubbleGum, &gRedRover, &gGreenTree, &gBlueLightning};
+	for (uint32_t characterIndex = 0; characterIndex < 4; characterIndex++)
+	{
+		world->lives[characterIndex] = (uint8_t)characters[characterIndex]->lives;
+		world->kills[characterIndex] = (uint8_t)characters[characterIndex]->kills;
+	}
+}
+
+// What one end of a network test measured over all of its peers
+typedef struct
+{
+	uint32_t startTime;
+	uint32_t duration;
+	bool recorded;
+	
+	uint64_t bytesSent;
+	uint64_t bytesReceived;
+	uint32_t datagramsSent;
+	uint32_t datagramsReceived;
+	uint32_t messagesSent;
+	uint32_t messagesReceived;
+	
+	// Every message type's latencies merged together
+	NetworkLatencyHistogram latencies[NETWORK_LATENCY_STAGE_COUNT];
+	
+	// As the end's last step left it
+	NetworkTestWorld world;
+} NetworkTestResults;
+
+static void mergeNetworkLatencyHistogram(NetworkLatencyHistogram *histogram, const NetworkLatencyHistogram *otherHistogram)
+{
+	histogram->samples += otherHistogram->samples;
+	histogram->totalLatency += otherHistogram->totalLatency;
+	if (otherHistogram->maxLatency > histogram->maxLatency)
+	{
+		histogram->maxLatency = otherHistogram->maxLatency;
+	}
+	
+	for (uint32_t bucket = 0; bucket < NETWORK_LATENCY_HISTOGRAM_BUCKET_COUNT; bucket++)
+	{
+		histogram->histogram[bucket] += otherHistogram->histogram[bucket];
+	}
+}
+
+// Has to be called before the current connection quits, since its telemetry goes away with it
+static void recordNetworkTestResults(NetworkTestResults *results)
+{
+	results->duration = networkTicks() - results->startTime;
+	results->recorded = true;
+	
+	NetworkPeerStats stats;
+	for (uint8_t peerIndex = 0; copyNetworkPeerStats(peerIndex, &stats); peerIndex++)
+	{
+		results->bytesSent += stats.bytesSent;
+		results->bytesReceived += stats.bytesReceived;
+		results->datagramsSent += stats.datagramsSent;
+		results->datagramsReceived += stats.datagramsReceived;
+		
+		for (uint32_t channel = 0; channel < NETWORK_CHANNEL_COUNT; channel++)
+		{
+			results->messagesSent += stats.channels[channel].messagesSent;
+			results->messagesReceived += stats.channels[channel].messagesReceived;
+		}
+	}
+	
+	NetworkLatencyStats *latencyStats = malloc(sizeof(*latencyStats));
+	if (copyNetworkLatencyStats(latencyStats))
+	{
+		for (uint32_t stage = 0; stage < NETWORK_LATENCY_STAGE_COUNT; stage++)
+		{
+			for (uint32_t type = 0; type < NETWORK_LATENCY_MESSAGE_TYPE_COUNT; type++)
+			{
+				mergeNetworkLatencyHistogram(&results->latencies[stage], &latencyStats->stages[stage][type]);
+			}
+		}
+	}
+	free(latencyStats);
+}
+
+typedef struct
+{
+	bool endWhenEmpty;
+	NetworkTestResults *testResults;
+	double winnerTimer;
+	bool sentQuitMessage;
+} DedicatedServerLoop;
+
+static bool dedicatedServerShouldContinue(void *context)
+{
+	DedicatedServerLoop *loop = context;
+	
+	if (!loop->sentQuitMessage && (gDedicatedServerShouldQuit || (loop->endWhenEmpty && allNetworkClientsDisconnected())))
+	{
+		if (loop->testResults != NULL)
+		{
+			recordNetworkTestResults(loop->testResults);
+		}
+		
+		GameMessage message;
+		message.type = QUIT_MESSAGE_TYPE;
+		sendToClients(0, &message);
+		
+		loop->sentQuitMessage = true;
+	}
+	
+	return gNetworkConnection != NULL;
+}
+
+// There is no host to press a key after a game is won, so a server without one starts the next game on its own
+// Called after every simulation step with how long the current game has been won for
+static void startNextDedicatedGameWhenDue(double *winnerTimer)
+{
+	if (gGameState == GAME_STATE_ON && gGameWinner != NO_CHARACTER && !gGameShouldReset)
+	{
+		*winnerTimer += ANIMATION_TIMER_INTERVAL;
+		if (*winnerTimer >= DEDICATED_SERVER_NEW_GAME_DELAY)
+		{
+			*winnerTimer = 0.0;
+			resetGame();
+		}
+	}
+	else
+	{
+		*winnerTimer = 0.0;
+	}
+}
+
+static void stepDedicatedServer(void *context)
+{
+	DedicatedServerLoop *loop = context;
+	
+	updateGameState(NULL);
+	startNextDedicatedGameWhenDue(&loop->winnerTimer);
+}
+
+// Steps the simulation until the server's connection goes away
+// A match that is ended when it empties out frees up its slot for the next group of players
+// A network test's server records its results right before it tells its clients to quit
+static void runDedicatedServerLoop(bool endWhenEmpty, NetworkTestResults *testResults)
+{
+	// Nobody plays on the host, so its character is driven by the AI
+	gPinkBubbleGum.state = CHARACTER_AI_STATE;
+	
+	DedicatedServerLoop loop;
+	memset(&loop, 0, sizeof(loop));
+	loop.endWhenEmpty = endWhenEmpty;
+	loop.testResults = testResults;
+	
+	runFixedTimestepLoop(dedicatedServerShouldContinue, stepDedicatedServer, &loop);
+}
+
+typedef struct
+{
+	NetworkMatchRouter *router;
+	uint32_t matchIndex;
+	ZGThread thread;
+} DedicatedMatch;
+
+// Every match simulates its own game on its own thread with its own thread-local game state
+static int dedicatedMatchThread(void *context)
+{
+	DedicatedMatch *match = context;
+	
+	mt_init_seed((unsigned int)time(NULL) + match->matchIndex);
+	
+	initDedicatedServerSimulation();
+	
+	while (!gDedicatedServerShouldQuit)
+	{
+		if (!startNetworkMatch(match->router, match->matchIndex))
+		{
+			fprintf(stderr, "Failed to start dedicated server match %u\n", match->matchIndex);
+			return 1;
+		}
+		
+		runDedicatedServerLoop(true, NULL);
+	}
+	
+	return 0;
+}
+
+// Runs a headless server that only simulates the game and services clients
+// No window, renderer, fonts, audio, or gamepads are created, and SDL video is never initialized
+static int runDedicatedServer(int argc, char *argv[])
 {
+	mt_init();
+	
+	readDefaults();
+	
+	uint32_t numberOfMatches = 1;
+	
+	for (int argumentIndex = 1; argumentIndex + 1 < argc; argumentIndex++)
+	{
+		if (strcmp(argv[argumentIndex], "--players") == 0)
+		{
+			gNumberOfNetHumans = atoi(argv[argumentIndex + 1]);
+			if (gNumberOfNetHumans < 1 || gNumberOfNetHumans > 3)
+			{
+				fprintf(stderr, "Number of players must be between 1 and 3\n");
+				return 1;
+			}
+		}
+		else if (strcmp(argv[argumentIndex], "--lives") == 0)
+		{
+			gCharacterLives = atoi(argv[argumentIndex + 1]);
+			if (gCharacterLives < 1 || gCharacterLives > MAX_CHARACTER_LIVES)
+			{
+				fprintf(stderr, "Number of lives must be between 1 and %d\n", MAX_CHARACTER_LIVES);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[argumentIndex], "--matches") == 0)
+		{
+			int matches = atoi(argv[argumentIndex + 1]);
+			if (matches < 1 || matches > MAX_DEDICATED_SERVER_MATCHES)
+			{
+				fprintf(stderr, "Number of matches must be between 1 and %d\n", MAX_DEDICATED_SERVER_MATCHES);
+				return 1;
+			}
+			numberOfMatches = (uint32_t)matches;
+		}
+		else if (strcmp(argv[argumentIndex], "--max-rewind") == 0)
+		{
+			int maxRewind = atoi(argv[argumentIndex + 1]);
+			if (maxRewind < 0 || maxRewind > MAX_LAG_COMPENSATION_REWIND)
+			{
+				fprintf(stderr, "Maximum rewind must be between 0 and %d milliseconds\n", MAX_LAG_COMPENSATION_REWIND);
+				return 1;
+			}
+			gMaxLagCompensationRewind = (uint32_t)maxRewind;
+		}
+	}
+	
+	// Nothing can be heard on a dedicated server
+	gAudioEffectsFlag = false;
+	gAudioMusicFlag = false;
+	
+	signal(SIGINT, handleDedicatedServerSignal);
+	signal(SIGTERM, handleDedicatedServerSignal);
+	
+	if (numberOfMatches == 1)
+	{
+		initDedicatedServerSimulation();
+		
+		if (!startNetworkGame(NULL))
+		{
+			fprintf(stderr, "Failed to start dedicated server\n");
+			return 1;
+		}
+		
+		fprintf(stderr, "Dedicated server listening on port %s (players: %d, lives: %d)\n", NETWORK_PORT, gNumberOfNetHumans, gCharacterLives);
+		
+		runDedicatedServerLoop(false, NULL);
+		
+		return 0;
+	}
+	
+	// All matches share one socket and a router hands each of them the datagrams from their own clients
+	initializeNetwork();
+	
+	socket_t serverSocket;
+	if (!openServerSocket(&serverSocket))
+	{
+		fprintf(stderr, "Failed to start dedicated server\n");
+		deinitializeNetwork();
+		return 1;
+	}
+	
+	NetworkMatchRouter *router = createNetworkMatchRouter(serverSocket, numberOfMatches, (uint8_t)gNumberOfNetHumans);
+	ZGThread routerThread = ZGCreateThread(networkMatchRouterThread, "router-thread", router);
+	
+	DedicatedMatch *matches = calloc(numberOfMatches, sizeof(*matches));
+	for (uint32_t matchIndex = 0; matchIndex < numberOfMatches; matchIndex++)
+	{
+		matches[matchIndex].router = router;
+		matches[matchIndex].matchIndex = matchIndex;
+		matches[matchIndex].thread = ZGCreateThread(dedicatedMatchThread, "match-thread", &matches[matchIndex]);
+	}
+	
+	fprintf(stderr, "Dedicated server listening on port %s (matches: %u, players: %d, lives: %d)\n", NETWORK_PORT, numberOfMatches, gNumberOfNetHumans, gCharacterLives);
+	
+	for (uint32_t matchIndex = 0; matchIndex < numberOfMatches; matchIndex++)
+	{
+		ZGWaitThread(matches[matchIndex].thread);
+	}
+	free(matches);
+	
+	stopNetworkMatchRouter(router);
+	ZGWaitThread(routerThread);
+	
+	closeSocket(serverSocket);
+	deinitializeNetwork();
+	
+	return 0;
+}
+
+typedef struct
+{
+	uint32_t botIndex;
+	uint32_t duration;
+	bool scripted;
+	bool joined;
+	// Only set for the clients of a network test, which connect to an in-process server and record their results before quitting
+	NetworkTransport *transport;
+	NetworkTestResults *testResults;
+	// Whether the transport is stepped rather than the bot stepping itself in real time
+	bool stepped;
+	ZGThread thread;
+} BotClient;
+
+// Changes direction on a fixed cycle and fires on every third turn
+static void updateScriptedBotInput(Input *input, uint32_t *numberOfTurns)
+{
+	(*numberOfTurns)++;
+	
+	uint64_t ticks = ZGGetTicks();
+	uint32_t direction = *numberOfTurns % 4;
+	input->right_ticks = (direction == 0) ? ticks : 0;
+	input->left_ticks = (direction == 1) ? ticks : 0;
+	input->up_ticks = (direction == 2) ? ticks : 0;
+	input->down_ticks = (direction == 3) ? ticks : 0;
+	
+	if (*numberOfTurns % 3 == 0 && gGameHasStarted)
+	{
+		prepareFiringCharacterWeapon(input->character, input->character->x, input->character->y, input->character->pointing_direction, 0.0f, 0);
+	}
+}
+
+typedef struct
+{
+	BotClient *bot;
+	uint32_t startTime;
+	double botTime;
+	double nextTurnTime;
+	uint32_t numberOfTurns;
+	bool sentQuitMessage;
+} BotClientLoop;
+
+static bool botClientShouldContinue(void *context)
+{
+	BotClientLoop *loop = context;
+	BotClient *bot = loop->bot;
+	
+	if (!loop->sentQuitMessage && (gDedicatedServerShouldQuit || (bot->duration > 0 && ZGGetTicks() - loop->startTime >= bot->duration)))
+	{
+		if (bot->testResults != NULL)
+		{
+			recordNetworkTestResults(bot->testResults);
+		}
+		
+		GameMessage message;
+		message.type = QUIT_MESSAGE_TYPE;
+		sendToServer(message);
+		
+		loop->sentQuitMessage = true;
+	}
+	
+	return gNetworkConnection != NULL;
+}
+
+static void stepBotClient(void *context)
+{
+	BotClientLoop *loop = context;
+	BotClient *bot = loop->bot;
+	
+	loop->botTime += ANIMATION_TIMER_INTERVAL;
+	
+	// Every input steers the client's own character in a network game
+	Character *character = (gNetworkConnection != NULL) ? gNetworkConnection->character : NULL;
+	if (character != NULL && gGameState == GAME_STATE_ON && !loop->sentQuitMessage && !gNetworkTestSettling)
+	{
+		bot->joined = true;
+		gPinkBubbleGumInput.character = character;
+		
+		if (!bot->scripted)
+		{
+			updateAIInput(&gPinkBubbleGumInput, (float)loop->botTime, ANIMATION_TIMER_INTERVAL);
+		}
+		else if (loop->botTime >= loop->nextTurnTime)
+		{
+			loop->nextTurnTime = loop->botTime + BOT_SCRIPTED_TURN_INTERVAL;
+			updateScriptedBotInput(&gPinkBubbleGumInput, &loop->numberOfTurns);
+		}
+	}
+	
+	updateGameState(NULL);
+	
+	if (bot->testResults != NULL)
+	{
+		captureNetworkTestWorld(&bot->testResults->world);
+	}
+}
+
+// Every bot is a network client with its own thread-local game state, stepped like a dedicated server's
+static int botClientThread(void *context)
+{
+	BotClient *bot = context;
+	
+	mt_init_seed((unsigned int)time(NULL) + bot->botIndex);
+	
+	initDedicatedServerSimulation();
+	
+	uint32_t startTime = ZGGetTicks();
+	
+	// Client i of an in-process transport is its endpoint i + 1
+	uint8_t endpointIndex = (uint8_t)(bot->botIndex + 1);
+	
+	bool connected;
+	if (bot->transport != NULL)
+	{
+		connected = connectToInProcessNetworkGame(bot->transport, (uint8_t)bot->botIndex, &gGameState);
+	}
+	else
+	{
+		connected = connectToNetworkGame(&gGameState);
+	}
+	
+	if (!connected)
+	{
+		fprintf(stderr, "Failed to connect bot %u\n", bot->botIndex);
+		if (bot->stepped)
+		{
+			leaveNetworkTransportStepping(bot->transport, endpointIndex);
+		}
+		return 1;
+	}
+	
+	if (bot->testResults != NULL)
+	{
+		bot->testResults->startTime = networkTicks();
+	}
+	
+	BotClientLoop loop;
+	memset(&loop, 0, sizeof(loop));
+	loop.bot = bot;
+	loop.startTime = startTime;
+	
+	if (bot->stepped)
+	{
+		runSteppedTimestepLoop(bot->transport, endpointIndex, botClientShouldContinue, stepBotClient, &loop);
+	}
+	else
+	{
+		runFixedTimestepLoop(botClientShouldContinue, stepBotClient, &loop);
+	}
+	
+	return 0;
+}
+
+// Connects headless clients to a server to load test it
+// Each bot goes through the regular handshake and then plays through its input, either like the AI would or in a scripted pattern
+static int runBotClients(int argc, char *argv[])
+{
+	mt_init();
+	
+	readDefaults();
+	
+	uint32_t numberOfBots = 0;
+	uint32_t duration = 0;
+	bool scripted = false;
+	
+	for (int argumentIndex = 1; argumentIndex < argc; argumentIndex++)
+	{
+		if (strcmp(argv[argumentIndex], "--scripted") == 0)
+		{
+			scripted = true;
+		}
+		else if (argumentIndex + 1 >= argc)
+		{
+			break;
+		}
+		else if (strcmp(argv[argumentIndex], "--bots") == 0)
+		{
+			int bots = atoi(argv[argumentIndex + 1]);
+			if (bots < 1 || bots > MAX_BOT_CLIENTS)
+			{
+				fprintf(stderr, "Number of bots must be between 1 and %d\n", MAX_BOT_CLIENTS);
+				return 1;
+			}
+			numberOfBots = (uint32_t)bots;
+		}
+		else if (strcmp(argv[argumentIndex], "--connect") == 0)
+		{
+			strncpy(gServerAddressString, argv[argumentIndex + 1], sizeof(gServerAddressString) - 1);
+		}
+		else if (strcmp(argv[argumentIndex], "--duration") == 0)
+		{
+			int seconds = atoi(argv[argumentIndex + 1]);
+			if (seconds < 0)
+			{
+				fprintf(stderr, "Bot duration can't be negative\n");
+				return 1;
+			}
+			duration = (uint32_t)seconds * 1000;
+		}
+	}
+	
+	if (numberOfBots == 0)
+	{
+		fprintf(stderr, "A number of bots must be given after --bots\n");
+		return 1;
+	}
+	
+	gAudioEffectsFlag = false;
+	gAudioMusicFlag = false;
+	
+	strncpy(gUserNameString, "Bot", sizeof(gUserNameString) - 1);
+	
+	signal(SIGINT, handleDedicatedServerSignal);
+	signal(SIGTERM, handleDedicatedServerSignal);
+	
+	fprintf(stderr, "Connecting %u %s bots to %s\n", numberOfBots, scripted ? "scripted" : "AI", gServerAddressString);
+	
+	// Set up what's shared by every bot's connection before any of their threads can race to do it
+	initializeNetwork();
+	
+	BotClient *bots = calloc(numberOfBots, sizeof(*bots));
+	for (uint32_t botIndex = 0; botIndex < numberOfBots && !gDedicatedServerShouldQuit; botIndex++)
+	{
+		bots[botIndex].botIndex = botIndex;
+		bots[botIndex].duration = duration;
+		bots[botIndex].scripted = scripted;
+		bots[botIndex].thread = ZGCreateThread(botClientThread, "bot-thread", &bots[botIndex]);
+		
+		ZGDelay(BOT_CONNECT_INTERVAL);
+	}
+	
+	uint32_t numberOfJoinedBots = 0;
+	for (uint32_t botIndex = 0; botIndex < numberOfBots; botIndex++)
+	{
+		if (bots[botIndex].thread != NULL)
+		{
+			ZGWaitThread(bots[botIndex].thread);
+			numberOfJoinedBots += bots[botIndex].joined;
+		}
+	}
+	free(bots);
+	
+	deinitializeNetwork();
+	
+	fprintf(stderr, "%u of %u bots joined a game\n", numberOfJoinedBots, numberOfBots);
+	
+	return 0;
+}
+
+// Watches a match of a server without a window and checks every frame it streams against the ones before it
+// Runs until the server quits or the --duration is up, and fails if any frame couldn't be read or didn't line up
+typedef struct
+{
+	uint32_t startTime;
+	uint32_t duration;
+	bool sentQuitMessage;
+	// The connection is gone once the main thread handles its quit, so hold on to what it last published
+	SpectatorStats stats;
+} SpectatorLoop;
+
+static bool spectatorShouldContinue(void *context)
+{
+	SpectatorLoop *loop = context;
+	
+	if (gNetworkConnection == NULL)
+	{
+		return false;
+	}
+	
+	copySpectatorStats(&loop->stats);
+	
+	if (!loop->sentQuitMessage && (gDedicatedServerShouldQuit || (loop->duration > 0 && ZGGetTicks() - loop->startTime >= loop->duration)))
+	{
+		GameMessage message;
+		message.type = QUIT_MESSAGE_TYPE;
+		sendToServer(message);
+		
+		loop->sentQuitMessage = true;
+	}
+	
+	return true;
+}
+
+static void stepSpectator(void *context)
+{
+	updateGameState(NULL);
+}
+
+static int runSpectator(int argc, char *argv[])
+{
+	mt_init();
+	
+	readDefaults();
+	
+	int matchIndex = -1;
+	uint32_t duration = 0;
+	
+	for (int argumentIndex = 1; argumentIndex + 1 < argc; argumentIndex++)
+	{
+		if (strcmp(argv[argumentIndex], "--spectate") == 0)
+		{
+			matchIndex = atoi(argv[argumentIndex + 1]);
+			if (matchIndex < 0 || matchIndex >= MAX_DEDICATED_SERVER_MATCHES)
+			{
+				fprintf(stderr, "Match to spectate must be between 0 and %d\n", MAX_DEDICATED_SERVER_MATCHES - 1);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[argumentIndex], "--connect") == 0)
+		{
+			strncpy(gServerAddressString, argv[argumentIndex + 1], sizeof(gServerAddressString) - 1);
+		}
+		else if (strcmp(argv[argumentIndex], "--duration") == 0)
+		{
+			int seconds = atoi(argv[argumentIndex + 1]);
+			if (seconds < 0)
+			{
+				fprintf(stderr, "Spectating duration can't be negative\n");
+				return 1;
+			}
+			duration = (uint32_t)seconds * 1000;
+		}
+	}
+	
+	if (matchIndex == -1)
+	{
+		fprintf(stderr, "A match must be given after --spectate\n");
+		return 1;
+	}
+	
+	gAudioEffectsFlag = false;
+	gAudioMusicFlag = false;
+	
+	signal(SIGINT, handleDedicatedServerSignal);
+	signal(SIGTERM, handleDedicatedServerSignal);
+	
+	initDedicatedServerSimulation();
+	
+	if (!spectateNetworkGame((uint32_t)matchIndex, &gGameState))
+	{
+		fprintf(stderr, "Failed to spectate %s\n", gServerAddressString);
+		return 1;
+	}
+	
+	fprintf(stderr, "Spectating match %d of %s\n", matchIndex, gServerAddressString);
+	
+	SpectatorLoop loop;
+	memset(&loop, 0, sizeof(loop));
+	loop.startTime = ZGGetTicks();
+	loop.duration = duration;
+	
+	runFixedTimestepLoop(spectatorShouldContinue, stepSpectator, &loop);
+	
+	SpectatorStats stats = loop.stats;
+	
+	fprintf(stderr, "Received %u frames (%u lost, %u malformed) and %u events (%u missed)\n", stats.frames, stats.lostFrames, stats.malformedFrames, stats.events, stats.missedEvents);
+	fprintf(stderr, "World snapshots: %u after the wrong game reset, %u not matching the changes handed over\n", stats.resetMismatches, stats.snapshotMismatches);
+	
+	for (uint8_t characterIndex = 0; characterIndex < 4; characterIndex++)
+	{
+		const char *netName = stats.netNames[characterIndex];
+		fprintf(stderr, "Character %u: %s\n", characterIndex + 1, netName[0] != '\0' ? netName : "(not played over the network)");
+	}
+	
+	return (stats.frames > 0 && stats.malformedFrames == 0 && stats.resetMismatches == 0 && stats.snapshotMismatches == 0) ? 0 : 1;
+}
+
+typedef struct
+{
+	NetworkTransport *transport;
+	bool stepped;
+	NetworkTestResults results;
+	ZGThread thread;
+} NetworkTestServer;
+
+static void stepNetworkTestServer(void *context)
+{
+	DedicatedServerLoop *loop = context;
+	
+	// The world stays put while the clients catch up to it
+	if (!gNetworkTestSettling)
+	{
+		stepDedicatedServer(loop);
+	}
+	
+	captureNetworkTestWorld(&loop->testResults->world);
+}
+
+static int networkTestServerThread(void *context)
+{
+	NetworkTestServer *server = context;
+	
+	mt_init_seed((unsigned int)time(NULL) + NETWORK_TEST_CLIENT_COUNT);
+	
+	initDedicatedServerSimulation();
+	
+	if (!startInProcessNetworkGame(server->transport))
+	{
+		fprintf(stderr, "Failed to start network test server\n");
+		if (server->stepped)
+		{
+			leaveNetworkTransportStepping(server->transport, 0);
+		}
+		return 1;
+	}
+	
+	server->results.startTime = networkTicks();
+	
+	if (!server->stepped)
+	{
+		runDedicatedServerLoop(true, &server->results);
+		return 0;
+	}
+	
+	gPinkBubbleGum.state = CHARACTER_AI_STATE;
+	
+	DedicatedServerLoop loop;
+	memset(&loop, 0, sizeof(loop));
+	loop.endWhenEmpty = true;
+	loop.testResults = &server->results;
+	
+	runSteppedTimestepLoop(server->transport, 0, dedicatedServerShouldContinue, stepNetworkTestServer, &loop);
+	
+	return 0;
+}
+
+// Steps the test's transport until every end quits, playing for the given duration first and then letting the clients settle
+// Returns how many clients' worlds matched the server's once they settled
+static uint32_t runSteppedNetworkTest(NetworkTransport *transport, uint32_t startTicks, uint32_t duration, NetworkTestResults *serverResults, NetworkTestResults *clientResults)
+{
+	uint32_t wallStartTime = ZGGetTicks();
+	uint32_t numberOfSteps = 0;
+	
+	uint32_t settleDuration = (uint32_t)(NETWORK_TEST_SETTLE_DURATION * 1000.0);
+	while (!gDedicatedServerShouldQuit && (uint32_t)(numberOfSteps * ANIMATION_TIMER_INTERVAL * 1000.0) < duration + settleDuration)
+	{
+		gNetworkTestSettling = (uint32_t)(numberOfSteps * ANIMATION_TIMER_INTERVAL * 1000.0) >= duration;
+		
+		numberOfSteps++;
+		stepNetworkTransport(transport, startTicks + (uint32_t)(numberOfSteps * ANIMATION_TIMER_INTERVAL * 1000.0));
+	}
+	
+	// Every step has settled, so nothing writes the worlds until the next one
+	uint32_t numberOfMatchingClients = 0;
+	for (uint32_t clientIndex = 0; clientIndex < NETWORK_TEST_CLIENT_COUNT; clientIndex++)
+	{
+		const NetworkTestWorld *world = &clientResults[clientIndex].world;
+		const NetworkTestWorld *serverWorld = &serverResults->world;
+		
+		uint32_t mismatchedTiles = 0;
+		for (uint32_t tileIndex = 0; tileIndex < NUMBER_OF_TILES; tileIndex++)
+		{
+			if (world->tileColors[tileIndex] != serverWorld->tileColors[tileIndex] || world->fallenTiles[tileIndex] != serverWorld->fallenTiles[tileIndex] || world->deadTiles[tileIndex] != serverWorld->deadTiles[tileIndex])
+			{
+				mismatchedTiles++;
+			}
+		}
+		
+		uint32_t mismatchedCharacters = 0;
+		for (uint32_t characterIndex = 0; characterIndex < 4; characterIndex++)
+		{
+			if (world->lives[characterIndex] != serverWorld->lives[characterIndex] || world->kills[characterIndex] != serverWorld->kills[characterIndex])
+			{
+				mismatchedCharacters++;
+			}
+		}
+		
+		if (mismatchedTiles == 0 && mismatchedCharacters == 0)
+		{
+			numberOfMatchingClients++;
+		}
+		else
+		{
+			fprintf(stderr, "Client %u's world differs from the server's in %u tiles and %u characters\n", clientIndex + 1, mismatchedTiles, mismatchedCharacters);
+		}
+	}
+	
+	// The server has to step again to handle quitting
+	gNetworkTestSettling = false;
+	gDedicatedServerShouldQuit = 1;
+	
+	do
+	{
+		numberOfSteps++;
+	}
+	while (stepNetworkTransport(transport, startTicks + (uint32_t)(numberOfSteps * ANIMATION_TIMER_INTERVAL * 1000.0)) > 0);
+	
+	uint32_t wallDuration = ZGGetTicks() - wallStartTime;
+	double steppedSeconds = numberOfSteps * ANIMATION_TIMER_INTERVAL;
+	fprintf(stderr, "Took %u steps covering %.1f seconds in %.1f seconds (%.1fx real time)\n", numberOfSteps, steppedSeconds, wallDuration / 1000.0, wallDuration > 0 ? steppedSeconds * 1000.0 / wallDuration : 0.0);
+	
+	return numberOfMatchingClients;
+}
+
+static void printNetworkTestResults(const char *name, const NetworkTestResults *results)
+{
+	if (!results->recorded || results->duration == 0)
+	{
+		fprintf(stderr, "%s: didn't finish\n", name);
+		return;
+	}
+	
+	double seconds = results->duration / 1000.0;
+	fprintf(stderr, "%s: messages %.0f/s out, %.0f/s in; datagrams %.0f/s out, %.0f/s in; %.1f KB/s out, %.1f KB/s in\n", name, results->messagesSent / seconds, results->messagesReceived / seconds, results->datagramsSent / seconds, results->datagramsReceived / seconds, results->bytesSent / seconds / 1024.0, results->bytesReceived / seconds / 1024.0);
+}
+
+// Runs a server and its clients in one process over an in-process transport instead of sockets, with their messages traced
+// The clients are bots played by the AI, and the throughput and latency of every end's messages are reported once they quit
+// Unless --realtime is passed, every end is stepped in lockstep on the transport's clock as fast as they can go, so rates and latencies are in that clock's time
+// Stepped tests also check that every client ends up with the server's world once the server stops playing
+static int runNetworkTest(int argc, char *argv[])
+{
+	mt_init();
+	
+	readDefaults();
+	
+	uint32_t duration = DEFAULT_NETWORK_TEST_DURATION;
+	bool stepped = true;
+	
+	for (int argumentIndex = 1; argumentIndex < argc; argumentIndex++)
+	{
+		if (strcmp(argv[argumentIndex], "--realtime") == 0)
+		{
+			stepped = false;
+		}
+		else if (argumentIndex + 1 >= argc)
+		{
+			break;
+		}
+		else if (strcmp(argv[argumentIndex], "--duration") == 0)
+		{
+			int seconds = atoi(argv[argumentIndex + 1]);
+			if (seconds < 1)
+			{
+				fprintf(stderr, "Network test duration must be at least 1 second\n");
+				return 1;
+			}
+			duration = (uint32_t)seconds * 1000;
+		}
+	}
+	
+	gNumberOfNetHumans = NETWORK_TEST_CLIENT_COUNT;
+	
+	gAudioEffectsFlag = false;
+	gAudioMusicFlag = false;
+	
+	strncpy(gUserNameString, "Test", sizeof(gUserNameString) - 1);
+	
+	signal(SIGINT, handleDedicatedServerSignal);
+	signal(SIGTERM, handleDedicatedServerSignal);
+	
+	initializeNetwork();
+	enableNetworkTracing();
+	
+	NetworkTransport *transport = createInProcessNetworkTransport(NETWORK_TEST_CLIENT_COUNT);
+	
+	uint32_t startTicks = ZGGetTicks();
+	if (stepped)
+	{
+		enableNetworkTransportStepping(transport, startTicks);
+	}
+	
+	fprintf(stderr, "Running a server and %d clients over an in-process transport for %.1f seconds %s\n", NETWORK_TEST_CLIENT_COUNT, duration / 1000.0, stepped ? "as fast as they can go" : "in real time");
+	
+	NetworkTestServer *server = calloc(1, sizeof(*server));
+	server->transport = transport;
+	server->stepped = stepped;
+	server->thread = ZGCreateThread(networkTestServerThread, "server-thread", server);
+	
+	BotClient bots[NETWORK_TEST_CLIENT_COUNT];
+	NetworkTestResults *clientResults = calloc(NETWORK_TEST_CLIENT_COUNT, sizeof(*clientResults));
+	memset(bots, 0, sizeof(bots));
+	for (uint32_t botIndex = 0; botIndex < NETWORK_TEST_CLIENT_COUNT; botIndex++)
+	{
+		// Stepped bots only play once the transport is stepped, and quit when the test tells them to
+		if (!stepped)
+		{
+			ZGDelay(BOT_CONNECT_INTERVAL);
+		}
+		
+		bots[botIndex].botIndex = botIndex;
+		bots[botIndex].duration = stepped ? 0 : duration;
+		bots[botIndex].transport = transport;
+		bots[botIndex].testResults = &clientResults[botIndex];
+		bots[botIndex].stepped = stepped;
+		bots[botIndex].thread = ZGCreateThread(botClientThread, "bot-thread", &bots[botIndex]);
+	}
+	
+	uint32_t numberOfMatchingClients = stepped ? runSteppedNetworkTest(transport, startTicks, duration, &server->results, clientResults) : 0;
+	
+	uint32_t numberOfJoinedBots = 0;
+	for (uint32_t botIndex = 0; botIndex < NETWORK_TEST_CLIENT_COUNT; botIndex++)
+	{
+		ZGWaitThread(bots[botIndex].thread);
+		numberOfJoinedBots += bots[botIndex].joined;
+	}
+	
+	// The server quits on its own once every client has left, unless some never joined
+	gDedicatedServerShouldQuit = 1;
+	ZGWaitThread(server->thread);
+	
+	destroyNetworkTransport(transport);
+	deinitializeNetwork();
+	
+	printNetworkTestResults("server", &server->results);
+	
+	NetworkTestResults totalResults;
+	memset(&totalResults, 0, sizeof(totalResults));
+	for (uint32_t stage = 0; stage < NETWORK_LATENCY_STAGE_COUNT; stage++)
+	{
+		mergeNetworkLatencyHistogram(&totalResults.latencies[stage], &server->results.latencies[stage]);
+	}
+	
+	for (uint32_t botIndex = 0; botIndex < NETWORK_TEST_CLIENT_COUNT; botIndex++)
+	{
+		char name[16];
+		snprintf(name, sizeof(name), "client %u", botIndex + 1);
+		printNetworkTestResults(name, &clientResults[botIndex]);
+		
+		for (uint32_t stage = 0; stage < NETWORK_LATENCY_STAGE_COUNT; stage++)
+		{
+			mergeNetworkLatencyHistogram(&totalResults.latencies[stage], &clientResults[botIndex].latencies[stage]);
+		}
+	}
+	
+	fprintf(stderr, "Latency of every message p50/p99/max in microseconds%s:\n", stepped ? " of the transport's clock, which only moves between steps" : "");
+	for (uint32_t stage = 0; stage < NETWORK_LATENCY_STAGE_COUNT; stage++)
+	{
+		NetworkLatencyHistogram *histogram = &totalResults.latencies[stage];
+		fprintf(stderr, "  %s: %u/%u/%u (%u messages)\n", networkLatencyStageName((NetworkLatencyStage)stage), networkLatencyPercentile(histogram, 50), networkLatencyPercentile(histogram, 99), histogram->maxLatency, histogram->samples);
+	}
+	
+	fprintf(stderr, "%u of %d clients joined a game\n", numberOfJoinedBots, NETWORK_TEST_CLIENT_COUNT);
+	if (stepped)
+	{
+		fprintf(stderr, "%u of %d clients caught up to the server's world\n", numberOfMatchingClients, NETWORK_TEST_CLIENT_COUNT);
+	}
+	
+	free(clientResults);
+	free(server);
+	
+	return (numberOfJoinedBots == NETWORK_TEST_CLIENT_COUNT && (!stepped || numberOfMatchingClients == NETWORK_TEST_CLIENT_COUNT)) ? 0 : 1;
+}
+
+// Replays a capture made with SKYCHECKERS_NETWORK_CAPTURE without a window or any sockets
+// Captured datagrams are handled on the simulation step they were received on, as fast as possible unless a --speed is given
+static int runNetworkReplay(int argc, char *argv[])
+{
+	const char *capturePath = NULL;
+	double speed = 0.0;
+	
+	for (int argumentIndex = 1; argumentIndex + 1 < argc; argumentIndex++)
+	{
+		if (strcmp(argv[argumentIndex], "--replay") == 0)
+		{
+			capturePath = argv[argumentIndex + 1];
+		}
+		else if (strcmp(argv[argumentIndex], "--speed") == 0)
+		{
+			speed = atof(argv[argumentIndex + 1]);
+			if (speed < 0.0)
+			{
+				fprintf(stderr, "Replay speed can't be negative\n");
+				return 1;
+			}
+		}
+	}
+	
+	if (capturePath == NULL)
+	{
+		fprintf(stderr, "A capture file must be given after --replay\n");
+		return 1;
+	}
+	
+	// Every replay of a capture picks the same random numbers
+	mt_init_seed(0);
+	
+	readDefaults();
+	
+	gAudioEffectsFlag = false;
+	gAudioMusicFlag = false;
+	
+	NetworkCaptureInfo captureInfo;
+	NetworkReplay *replay = openNetworkReplay(capturePath, &captureInfo);
+	if (replay == NULL)
+	{
+		return 1;
+	}
+	
+	bool server = (captureInfo.type == NETWORK_SERVER_TYPE);
+	if (server)
+	{
+		gNumberOfNetHumans = captureInfo.numberOfPlayersToWaitFor;
+		gCharacterLives = captureInfo.characterLives;
+	}
+	
+	initDedicatedServerSimulation();
+	
+	if (!replayNetworkGame(replay, &captureInfo, &gGameState))
+	{
+		fprintf(stderr, "Failed to start replay\n");
+		closeNetworkReplay(replay);
+		return 1;
+	}
+	
+	// The host's input isn't captured, so it's played by the AI like on a dedicated server
+	if (server)
+	{
+		gPinkBubbleGum.state = CHARACTER_AI_STATE;
+	}
+	
+	fprintf(stderr, "Replaying %s capture with %u received datagrams over %.1f seconds\n", server ? "server" : "client", captureInfo.datagramsReceived, captureInfo.duration / 1000.0);
+	
+	uint32_t startTime = ZGGetTicks();
+	double replayTime = 0.0;
+	double winnerTimer = 0.0;
+	uint32_t numberOfSteps = 0;
+	bool sentQuitMessage = false;
+	
+	while (gNetworkConnection != NULL)
+	{
+		if (!sentQuitMessage && networkReplayFinished(replay))
+		{
+			GameMessage message;
+			message.type = QUIT_MESSAGE_TYPE;
+			if (server)
+			{
+				sendToClients(0, &message);
+			}
+			else
+			{
+				sendToServer(message);
+			}
+			
+			sentQuitMessage = true;
+		}
+		
+		replayTime += ANIMATION_TIMER_INTERVAL;
+		advanceNetworkReplay(replay, (uint32_t)(replayTime * 1000.0));
+		
+		updateGameState(NULL);
+		numberOfSteps++;
+		
+		// Start the next game like a dedicated server would
+		if (server)
+		{
+			startNextDedicatedGameWhenDue(&winnerTimer);
+		}
+		
+		if (speed > 0.0)
+		{
+			int32_t delay = (int32_t)(startTime + (uint32_t)(replayTime * 1000.0 / speed) - ZGGetTicks());
+			if (delay > 0)
+			{
+				ZGDelay((uint32_t)delay);
+			}
+		}
+	}
+	
+	uint32_t elapsedTime = ZGGetTicks() - startTime;
+	fprintf(stderr, "Replayed %u steps covering %.1f seconds in %.3f seconds (%.1fx real time)\n", numberOfSteps, replayTime, elapsedTime / 1000.0, elapsedTime > 0 ? replayTime * 1000.0 / elapsedTime : 0.0);
+	
+	closeNetworkReplay(replay);
+	
+	return 0;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+#if !PLATFORM_IOS
+	for (int argumentIndex = 1; argumentIndex < argc; argumentIndex++)
+	{
+		if (strcmp(argv[argumentIndex], "--dedicated") == 0)
+		{
+			return runDedicatedServer(argc, argv);
+		}
+		else if (strcmp(argv[argumentIndex], "--replay") == 0)
+		{
+			return runNetworkReplay(argc, argv);
+		}
+		else if (strcmp(argv[argumentIndex], "--bots") == 0)
+		{
+			return runBotClients(argc, argv);
+		}
+		else if (strcmp(argv[argumentIndex], "--nettest") == 0)
+		{
+			return runNetworkTest(argc, argv);
+		}
+		else if (strcmp(argv[argumentIndex], "--spectate") == 0)
+		{
+			return runSpectator(argc, argv);
+		}
+	}
+#endif
+	
 	AppContext appContext;
 	memset(&appContext, 0, sizeof(appContext));
 
@@ -43,86 +43,9 @@ void updateAudioMusic(ZGWindow *window, bool musicEnabled)
 	}
 }
 
-bool startNetworkGame(ZGWindow *window)
+// Sets up the characters and game for the server connection that was just created and starts its thread
+static void startServerGame(ZGWindow *window)
 {
-	if (gNetworkConnection != NULL && gNetworkConnection->thread != NULL)
-	{
-		fprintf(stderr, "game_menus: (server play) thread hasn't terminated yet.. Try again later.\n");
-		return false;
-	}
-	
-	initializeNetwork();
-	
-	gNetworkConnection = malloc(sizeof(*gNetworkConnection));
-	memset(gNetworkConnection, 0, sizeof(*gNetworkConnection));
-	
-	struct addrinfo hints;
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_DGRAM;
-	hints.ai_flags = AI_PASSIVE;
-	
-	struct addrinfo *serverInfoList;
-	
-	int getaddrinfoError;
-	if ((getaddrinfoError = getaddrinfo(NULL, NETWORK_PORT, &hints, &serverInfoList)) != 0)
-	{
-		fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(getaddrinfoError));
-		
-		free(gNetworkConnection);
-		gNetworkConnection = NULL;
-		
-		deinitializeNetwork();
-		
-		return false;
-	}
-	
-	struct addrinfo *serverInfo;
-	for (serverInfo = serverInfoList; serverInfo != NULL; serverInfo = serverInfo->ai_next)
-	{
-		if (serverInfo->ai_family != AF_INET && serverInfo->ai_family != AF_INET6)
-		{
-			continue;
-		}
-		
-		gNetworkConnection->socket = socket(serverInfo->ai_family, serverInfo->ai_socktype, serverInfo->ai_protocol);
-		if (gNetworkConnection->socket == -1)
-		{
-			perror("server: socket");
-			continue;
-		}
-		
-#if PLATFORM_WINDOWS
-		int addressLength = (int)serverInfo->ai_addrlen;
-#else
-		socklen_t addressLength = serverInfo->ai_addrlen;
-#endif
-		if (bind(gNetworkConnection->socket, serverInfo->ai_addr, addressLength) == -1)
-		{
-			perror("server: bind");
-			closeSocket(gNetworkConnection->socket);
-			continue;
-		}
-		
-		break;
-	}
-	
-	if (serverInfo == NULL)
-	{
-		fprintf(stderr, "Failed to create binding socket for server.\n");
-		
-		freeaddrinfo(serverInfoList);
-		
-		free(gNetworkConnection);
-		gNetworkConnection = NULL;
-		
-		deinitializeNetwork();
-		
-		return false;
-	}
-	
-	freeaddrinfo(serverInfoList);
-	
 	retrieveLocalIPAddress(gNetworkConnection->ipAddress, sizeof(gNetworkConnection->ipAddress) - 1);
 	
 	gPinkBubbleGum.backup_state = gPinkBubbleGum.state;
@@ -140,43 +63,72 @@ bool startNetworkGame(ZGWindow *window)
 	gGreenTree.netState = gGreenTree.state == CHARACTER_HUMAN_STATE ? NETWORK_PENDING_STATE : NETWORK_PLAYING_STATE;
 	gBlueLightning.netState = gBlueLightning.state == CHARACTER_HUMAN_STATE ? NETWORK_PENDING_STATE : NETWORK_PLAYING_STATE;
 	
-	gNetworkConnection->type = NETWORK_SERVER_TYPE;
 	gNetworkConnection->character = &gPinkBubbleGum;
-	gPinkBubbleGum.netName = gUserNameString;
+	copyNetName(gPinkBubbleGum.netName, gUserNameString);
 	
 	gNetworkConnection->numberOfPlayersToWaitFor = 0;
 	gNetworkConnection->numberOfPlayersToWaitFor += (gRedRover.netState == NETWORK_PENDING_STATE);
 	gNetworkConnection->numberOfPlayersToWaitFor += (gGreenTree.netState == NETWORK_PENDING_STATE);
 	gNetworkConnection->numberOfPlayersToWaitFor += (gBlueLightning.netState == NETWORK_PENDING_STATE);
 	
-	gCurrentSlot = 0;
-	memset(gClientStates, 0, sizeof(gClientStates));
-	
 	initGame(window, true, false);
 	
 	gRedRoverInput.character = gNetworkConnection->character;
 	gBlueLightningInput.character = gNetworkConnection->character;
 	gGreenTreeInput.character = gNetworkConnection->character;
 	
-	gNetworkConnection->thread = ZGCreateThread(serverNetworkThread, "server-thread", &gNetworkConnection->numberOfPlayersToWaitFor);
+	gNetworkConnection->thread = ZGCreateThread(serverNetworkThread, "server-thread", gNetworkConnection);
+}
+
+bool startNetworkGame(ZGWindow *window)
+{
+	if (gNetworkConnection != NULL && gNetworkConnection->thread != NULL)
+	{
+		fprintf(stderr, "game_menus: (server play) thread hasn't terminated yet.. Try again later.\n");
+		return false;
+	}
+	
+	initializeNetwork();
+	
+	gNetworkConnection = createNetworkConnection(NETWORK_SERVER_TYPE);
+	
+	if (!openServerSocket(&gNetworkConnection->socket))
+	{
+		free(gNetworkConnection);
+		gNetworkConnection = NULL;
+		
+		deinitializeNetwork();
+		
+		return false;
+	}
+	
+	startServerGame(window);
 	
 	return true;
 }
 
-bool connectToNetworkGame(GameState *gameState)
+bool startNetworkMatch(NetworkMatchRouter *router, uint32_t matchIndex)
 {
 	if (gNetworkConnection != NULL && gNetworkConnection->thread != NULL)
 	{
-		fprintf(stderr, "game_menus: (connect to server) thread hasn't terminated yet.. Try again later.\n");
+		fprintf(stderr, "game_menus: (match play) thread hasn't terminated yet.. Try again later.\n");
 		return false;
 	}
 	
 	initializeNetwork();
 	
-	gNetworkConnection = malloc(sizeof(*gNetworkConnection));
-	memset(gNetworkConnection, 0, sizeof(*gNetworkConnection));
-	gNetworkConnection->type = NETWORK_CLIENT_TYPE;
+	gNetworkConnection = createNetworkConnection(NETWORK_SERVER_TYPE);
+	attachNetworkMatch(gNetworkConnection, router, matchIndex);
+	
+	startServerGame(NULL);
 	
+	return true;
+}
+
+// Resolves gServerAddressString and opens the connection's socket to send to it with
+// Returns false if there's no server to be found there
+static bool openConnectionToServer(NetworkConnection *connection)
+{
 	struct addrinfo hints;
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_UNSPEC;
@@ -189,12 +141,6 @@ bool connectToNetworkGame(GameState *gameState)
 	if ((getaddrinfoError = getaddrinfo(gServerAddressString, NETWORK_PORT, &hints, &serverInfoList)) != 0)
 	{
 		fprintf(stderr, "getaddrinfo client error: %s\n", gai_strerror(getaddrinfoError));
-		
-		free(gNetworkConnection);
-		gNetworkConnection = NULL;
-		
-		deinitializeNetwork();
-		
 		return false;
 	}
 	
@@ -206,8 +152,8 @@ bool connectToNetworkGame(GameState *gameState)
 			continue;
 		}
 		
-		gNetworkConnection->socket = socket(serverInfo->ai_family, serverInfo->ai_socktype, serverInfo->ai_protocol);
-		if (gNetworkConnection->socket == -1)
+		connection->socket = socket(serverInfo->ai_family, serverInfo->ai_socktype, serverInfo->ai_protocol);
+		if (connection->socket == -1)
 		{
 			perror("client: socket");
 			continue;
@@ -222,6 +168,30 @@ bool connectToNetworkGame(GameState *gameState)
 		
 		freeaddrinfo(serverInfoList);
 		
+		return false;
+	}
+	
+	memcpy(&connection->hostAddress.storage, serverInfo->ai_addr, serverInfo->ai_addrlen);
+	
+	freeaddrinfo(serverInfoList);
+	
+	return true;
+}
+
+bool connectToNetworkGame(GameState *gameState)
+{
+	if (gNetworkConnection != NULL && gNetworkConnection->thread != NULL)
+	{
+		fprintf(stderr, "game_menus: (connect to server) thread hasn't terminated yet.. Try again later.\n");
+		return false;
+	}
+	
+	initializeNetwork();
+	
+	gNetworkConnection = createNetworkConnection(NETWORK_CLIENT_TYPE);
+	
+	if (!openConnectionToServer(gNetworkConnection))
+	{
 		free(gNetworkConnection);
 		gNetworkConnection = NULL;
 		
@@ -230,13 +200,105 @@ bool connectToNetworkGame(GameState *gameState)
 		return false;
 	}
 	
-	memcpy(&gNetworkConnection->hostAddress.storage, serverInfo->ai_addr, serverInfo->ai_addrlen);
+	*gameState = GAME_STATE_CONNECTING;
 	
-	freeaddrinfo(serverInfoList);
+	gNetworkConnection->thread = ZGCreateThread(clientNetworkThread, "client-thread", gNetworkConnection);
+	
+	return true;
+}
+
+bool spectateNetworkGame(uint32_t matchIndex, GameState *gameState)
+{
+	if (gNetworkConnection != NULL && gNetworkConnection->thread != NULL)
+	{
+		fprintf(stderr, "game_menus: (spectate server) thread hasn't terminated yet.. Try again later.\n");
+		return false;
+	}
+	
+	initializeNetwork();
+	
+	gNetworkConnection = createNetworkConnection(NETWORK_CLIENT_TYPE);
+	gNetworkConnection->spectating = true;
+	gNetworkConnection->spectatedMatchIndex = matchIndex;
+	
+	if (!openConnectionToServer(gNetworkConnection))
+	{
+		free(gNetworkConnection);
+		gNetworkConnection = NULL;
+		
+		deinitializeNetwork();
+		
+		return false;
+	}
 	
 	*gameState = GAME_STATE_CONNECTING;
 	
-	gNetworkConnection->thread = ZGCreateThread(clientNetworkThread, "client-thread", NULL);
+	gNetworkConnection->thread = ZGCreateThread(spectatorNetworkThread, "spectator-thread", gNetworkConnection);
+	
+	return true;
+}
+
+bool startInProcessNetworkGame(NetworkTransport *transport)
+{
+	if (gNetworkConnection != NULL && gNetworkConnection->thread != NULL)
+	{
+		fprintf(stderr, "game_menus: (in-process server play) thread hasn't terminated yet.. Try again later.\n");
+		return false;
+	}
+	
+	initializeNetwork();
+	
+	gNetworkConnection = createNetworkConnection(NETWORK_SERVER_TYPE);
+	attachNetworkTransport(gNetworkConnection, transport, 0);
+	
+	startServerGame(NULL);
+	
+	return true;
+}
+
+bool connectToInProcessNetworkGame(NetworkTransport *transport, uint8_t clientIndex, GameState *gameState)
+{
+	if (gNetworkConnection != NULL && gNetworkConnection->thread != NULL)
+	{
+		fprintf(stderr, "game_menus: (connect to in-process server) thread hasn't terminated yet.. Try again later.\n");
+		return false;
+	}
+	
+	initializeNetwork();
+	
+	gNetworkConnection = createNetworkConnection(NETWORK_CLIENT_TYPE);
+	attachNetworkTransport(gNetworkConnection, transport, clientIndex + 1);
+	
+	*gameState = GAME_STATE_CONNECTING;
+	
+	gNetworkConnection->thread = ZGCreateThread(clientNetworkThread, "client-thread", gNetworkConnection);
+	
+	return true;
+}
+
+bool replayNetworkGame(NetworkReplay *replay, const NetworkCaptureInfo *info, GameState *gameState)
+{
+	if (gNetworkConnection != NULL && gNetworkConnection->thread != NULL)
+	{
+		fprintf(stderr, "game_menus: (replay) thread hasn't terminated yet.. Try again later.\n");
+		return false;
+	}
+	
+	initializeNetwork();
+	
+	gNetworkConnection = createNetworkConnection(info->type);
+	gNetworkConnection->replay = replay;
+	
+	if (info->type == NETWORK_SERVER_TYPE)
+	{
+		startServerGame(NULL);
+	}
+	else
+	{
+		*gameState = GAME_STATE_CONNECTING;
+		
+		gNetworkConnection->thread = ZGCreateThread(clientNetworkThread, "client-thread", gNetworkConnection);
+	}
 	
 	return true;
 }
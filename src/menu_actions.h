@@ -21,14 +21,29 @@
 
 #include "globals.h"
 #include "window.h"
+#include "network.h"
 #include <stdbool.h>
 
 void updateAudioMusic(ZGWindow *window, bool musicEnabled);
 
 bool startNetworkGame(ZGWindow *window);
 
+// Starts a match of a dedicated server that receives its clients from a router
+bool startNetworkMatch(NetworkMatchRouter *router, uint32_t matchIndex);
+
 bool connectToNetworkGame(GameState *gameState);
 
+// Watches a match of the server at gServerAddressString without playing in it
+// A server running a single match ignores the match index
+bool spectateNetworkGame(uint32_t matchIndex, GameState *gameState);
+
+// Like startNetworkGame() and connectToNetworkGame() but over an in-process transport, so a server and its clients can run in one process
+bool startInProcessNetworkGame(NetworkTransport *transport);
+bool connectToInProcessNetworkGame(NetworkTransport *transport, uint8_t clientIndex, GameState *gameState);
+
+// Starts a game whose network thread handles the datagrams of a capture instead of using a socket
+bool replayNetworkGame(NetworkReplay *replay, const NetworkCaptureInfo *info, GameState *gameState);
+
 void playTutorial(ZGWindow *window);
 
 GameState pauseGame(GameState *newGameState);
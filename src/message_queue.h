@@ -0,0 +1,112 @@
+/*
+ * Copyright 2010 Mayur Pawashe
+ * https://zgcoder.net
+ 
+ * This file is part of skycheckers.
+ * skycheckers is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ 
+ * skycheckers is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with skycheckers.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "network.h"
+
+#if PLATFORM_WINDOWS
+#include <intrin.h> // for _InterlockedExchange8()
+#endif
+
+// Loads and stores for state shared between the main thread and a network thread without a lock
+// A release store makes every write before it visible to a thread that acquire loads the stored value
+static inline uint32_t loadAcquireUInt32(uint32_t *value)
+{
+#if PLATFORM_WINDOWS
+	return (uint32_t)InterlockedCompareExchange((volatile LONG *)value, 0, 0);
+#else
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static inline void storeReleaseUInt32(uint32_t *value, uint32_t newValue)
+{
+#if PLATFORM_WINDOWS
+	InterlockedExchange((volatile LONG *)value, (LONG)newValue);
+#else
+	__atomic_store_n(value, newValue, __ATOMIC_RELEASE);
+#endif
+}
+
+static inline uint8_t loadAcquireUInt8(uint8_t *value)
+{
+#if PLATFORM_WINDOWS
+	return (uint8_t)_InterlockedCompareExchange8((volatile char *)value, 0, 0);
+#else
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static inline void storeReleaseUInt8(uint8_t *value, uint8_t newValue)
+{
+#if PLATFORM_WINDOWS
+	_InterlockedExchange8((volatile char *)value, (char)newValue);
+#else
+	__atomic_store_n(value, newValue, __ATOMIC_RELEASE);
+#endif
+}
+
+// GameMessageQueue functions live here so network.c can inline them and the queue benchmark can use them without the rest of the game
+
+// Only to be called from the producer thread
+// Returns false without queueing the message if the queue is full, leaving it to the caller to wait for room or give up on the peer
+static inline bool pushNetworkMessage(GameMessageQueue *messageQueue, GameMessage message)
+{
+	uint32_t writeIndex = messageQueue->writeIndex;
+	if (writeIndex - messageQueue->cachedReadIndex >= GAME_MESSAGE_QUEUE_CAPACITY)
+	{
+		messageQueue->cachedReadIndex = loadAcquireUInt32(&messageQueue->readIndex);
+		if (writeIndex - messageQueue->cachedReadIndex >= GAME_MESSAGE_QUEUE_CAPACITY)
+		{
+			return false;
+		}
+	}
+	
+	messageQueue->messages[writeIndex & (GAME_MESSAGE_QUEUE_CAPACITY - 1)] = message;
+	storeReleaseUInt32(&messageQueue->writeIndex, writeIndex + 1);
+	
+	return true;
+}
+
+// Only to be called from the consumer thread
+// Returns how many messages can be read in place with networkMessageAtIndex() until finishReadingNetworkMessages() is called
+static inline uint32_t beginReadingNetworkMessages(GameMessageQueue *messageQueue)
+{
+	return loadAcquireUInt32(&messageQueue->writeIndex) - messageQueue->readIndex;
+}
+
+static inline GameMessage *networkMessageAtIndex(GameMessageQueue *messageQueue, uint32_t index)
+{
+	return &messageQueue->messages[(messageQueue->readIndex + index) & (GAME_MESSAGE_QUEUE_CAPACITY - 1)];
+}
+
+// Hands the space of the first count messages back to the producer
+static inline void finishReadingNetworkMessages(GameMessageQueue *messageQueue, uint32_t count)
+{
+	storeReleaseUInt32(&messageQueue->readIndex, messageQueue->readIndex + count);
+}
+
+// Only to be called when no other thread can be accessing the queue
+static inline void depleteNetworkMessages(GameMessageQueue *messageQueue)
+{
+	messageQueue->writeIndex = 0;
+	messageQueue->cachedReadIndex = 0;
+	messageQueue->readIndex = 0;
+}
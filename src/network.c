@@ -17,9 +17,14 @@
  * along with skycheckers.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+// For recvmmsg() and sendmmsg()
+#define _GNU_SOURCE
+
 #include "network.h"
+#include "message_queue.h"
 #include "platforms.h"
 #include "animation.h"
+#include "collision.h"
 #include "audio.h"
 #include "zgtime.h"
 
@@ -33,15 +38,31 @@
 #include <iphlpapi.h> // for GetAdaptersAddresses()
 #endif
 
+#if !PLATFORM_WINDOWS
+#include <poll.h>
+#include <fcntl.h>
+#endif
+
+#if PLATFORM_LINUX
+#include <sys/eventfd.h>
+#endif
+
+#if defined(SO_TIMESTAMPNS)
+#include <time.h> // for clock_gettime()
+#endif
+
 #define MAX_PACKET_SIZE 500
 
+// How many datagrams the server reads or sends with one system call at most
+#define DATAGRAM_BATCH_CAPACITY 32
+
 // If we make an incompatible network change, bump this
-#define NETWORK_VERSION 2
+#define NETWORK_VERSION 12
 
-#define CAN_I_PLAY_MESSAGE_TAG 1 // previously "cp"
+#define CAN_I_PLAY_MESSAGE_TAG 1 // previously "cp", ends with the handshake cookie the server last gave us or 0
 #define REQUEST_MOVEMENT_MESSAGE_TAG 2 // previously "rm"
 #define SHOOT_WEAPON_MESSAGE_TAG 3 // previously "sw"
-#define ACK_MESSAGE_TAG 4 // previously "ak"
+#define ACK_MESSAGE_TAG 4 // previously "ak", now carries a cumulative ack and an ack bitfield
 #define PING_MESSAGE_TAG 5 // previously "pi"
 #define PONG_MESSAGE_TAG 6 // previously "po"
 #define QUIT_MESSAGE_TAG 7 // previously "qu"
@@ -52,36 +73,628 @@
 #define START_GAME_MESSAGE_TAG 12 // previously "sg"
 #define GAME_START_NUMBER_MESSAGE_TAG 13 // previously "gs"
 #define MOVEMENT_MESSAGE_TAG 14 // previously "mo"
-#define PLAYER_KILLED_MESSAGE_TAG 15 // previously "pk"
-#define CHARACTER_KILLS_MESSAGE_TAG 16 // previously "ck"
-#define COLOR_TILE_MESSAGE_TAG 17 // previously "ct"
-#define TILE_FALLING_MESSAGE_TAG 18 // previously "tf"
-#define RECOVER_TILE_MESSAGE_TAG 19 // previously "rt"
+// 15 to 19 were used for character deaths, kills and tile changes which are now sent as world snapshots
 #define NEW_GAME_MESSAGE_TAG 20 // previously "ng"
 #define LAGGED_OUT_MESSAGE_TAG 21
+#define WORLD_SNAPSHOT_MESSAGE_TAG 22
+#define WORLD_SNAPSHOT_ACK_MESSAGE_TAG 23
+#define SPECTATE_MESSAGE_TAG 24 // network version, match index, and handshake cookie, sent again every so often to keep watching
+#define SPECTATOR_FRAME_MESSAGE_TAG 25
+#define HANDSHAKE_COOKIE_MESSAGE_TAG 26 // sent in place of an answer to a request to play or spectate that didn't echo back a valid cookie
+#define SEND_TIME_MESSAGE_TAG 27 // first in datagrams sent while latency is traced, with when the datagram was sent by the server's clock in microseconds
 
 #define CLIENT_STATE_ALIVE 0
 #define CLIENT_STATE_DEAD 1
 
-uint8_t gCurrentSlot;
-uint8_t gClientStates[3];
+// Reliable messages are delivered in order. Ones that arrive at most this many sequence numbers ahead
+// are held on to until the gap before them is filled and are reported back in the ack bitfield
+#define RELIABLE_WINDOW_SIZE 32
+
+// Bounds for how long we wait for an ack before re-sending a reliable message, in milliseconds
+// The timeout starts out at RELIABLE_INITIAL_RESEND_TIMEOUT until we have a round trip time from a ping
+// and doubles every time the same message has to be sent again
+#define RELIABLE_INITIAL_RESEND_TIMEOUT 100
+#define RELIABLE_MIN_RESEND_TIMEOUT 15
+#define RELIABLE_MAX_RESEND_TIMEOUT 1000
+
+// A handshake cookie is made for a window of time and is also accepted in the window after, in milliseconds
+#define HANDSHAKE_COOKIE_WINDOW 5000
+
+// Every source of datagrams gets tokens back at this rate per second up to a burst, and every datagram it sends costs one
+#define SOURCE_TOKEN_RATE 1000
+#define SOURCE_TOKEN_BURST 500
+// A source that isn't playing or spectating yet pays this much for every datagram, so it can only ask to a few times a second
+#define HANDSHAKE_TOKEN_COST 100
+// Must be a power of two
+#define SOURCE_RATE_LIMITER_SIZE 256
+// Cookies and rejections sent to sources that aren't playing or spectating, across all of them per second and as a burst
+#define HANDSHAKE_REPLY_RATE 1000
+#define HANDSHAKE_REPLY_BURST 200
+
+// How long a network thread waits before checking for queued messages when it can't be woken up
+#define NETWORK_POLL_DELAY 5
+// How long a network thread may block when it has nothing left to re-send
+// This only needs to be small enough to notice timed out peers in time
+#define NETWORK_IDLE_WAIT_DELAY 100
+
+// Environment variable the network conditioner's profile is read from, e.g. "mobile,loss=3.5,seed=7"
+#define NETWORK_CONDITIONER_ENVIRONMENT_VARIABLE "SKYCHECKERS_NETWORK_CONDITIONER"
+// How many outgoing datagrams a network thread holds back at most before dropping new ones
+#define NETWORK_CONDITIONER_CAPACITY 512
+// How much longer than the others a datagram picked for reordering is held back, in milliseconds
+#define NETWORK_CONDITIONER_REORDER_DELAY 25
+
+// How often a network thread publishes its telemetry for the main thread, in milliseconds of networkTicks()
+#define NETWORK_STATS_PUBLISH_INTERVAL 250
+// Environment variable naming a file that telemetry of every connection is appended to as JSON lines, or - for stderr
+#define NETWORK_STATS_ENVIRONMENT_VARIABLE "SKYCHECKERS_NETWORK_STATS"
+// How often telemetry is appended to that file, in milliseconds
+#define NETWORK_STATS_DUMP_INTERVAL 5000
+// Environment variable that turns on tracing how long messages spend in every stage between the games, when set to anything but 0
+#define NETWORK_TRACE_ENVIRONMENT_VARIABLE "SKYCHECKERS_NETWORK_TRACE"
+
+// Environment variable naming a file that network threads capture every datagram they send and receive to
+// Connections after the first one capture to the same path with a number appended, e.g. capture.bin.1
+#define NETWORK_CAPTURE_ENVIRONMENT_VARIABLE "SKYCHECKERS_NETWORK_CAPTURE"
+// A capture starts with a header and is followed by one record per datagram, all in host byte order
+// Header: "SCNC", format version, NETWORK_VERSION, connection type, number of players to wait for, character lives, uint32 network ticks when the capture started
+// Record: uint32 milliseconds since the capture started, uint8 flags, uint8 peer index, uint16 size, then the datagram
+#define NETWORK_CAPTURE_MAGIC "SCNC"
+#define NETWORK_CAPTURE_FORMAT_VERSION 1
+#define NETWORK_CAPTURE_HEADER_SIZE 13
+#define NETWORK_CAPTURE_RECORD_HEADER_SIZE 8
+#define NETWORK_CAPTURE_SENT_FLAG 0x1
+// Peers are numbered in the order their addresses are first seen
+#define NETWORK_CAPTURE_MAX_PEERS 32
+#define NETWORK_CAPTURE_UNKNOWN_PEER 255
+
+// Remote characters are rendered far enough behind the server that their next movement has usually arrived
+// That's the average time between movement updates plus this many times how much that time varies by
+#define INTERPOLATION_JITTER_MULTIPLIER 3
+// Longest delay remote characters are rendered with, in milliseconds
+#define MAX_INTERPOLATION_DELAY 250
+// Longer gaps between movement updates are pauses rather than jitter, in milliseconds
+#define MAX_MOVEMENT_ARRIVAL_INTERVAL 250
+// How long a remote character keeps moving on its own past its latest movement before it's stopped, in milliseconds
+#define MAX_EXTRAPOLATION_TIME 100
+
+// Reliable state for messages we receive from a peer, only used from the network thread
+typedef struct
+{
+	// Every sequence number up to and including this one has been received
+	uint32_t sequence;
+	// Bit i is set if sequence + 1 + i has been received ahead of time
+	uint32_t receivedBits;
+	// Bit i is set if pendingMessages holds a message for sequence + 1 + i to deliver
+	uint32_t pendingMessageBits;
+	// Set when we have received reliable messages the peer hasn't been sent an ack for yet
+	bool needsToSendAcks;
+	GameMessage pendingMessages[RELIABLE_WINDOW_SIZE];
+	// Telemetry for the peer
+	NetworkPeerStats *stats;
+} ReliableReceiveState;
+
+// Reliable state for messages we send to a peer, only used from the network thread
+typedef struct
+{
+	// Latest acks the peer has sent us, in the same form as ReliableReceiveState's sequence and receivedBits
+	uint32_t ack;
+	uint32_t ackBits;
+	
+	// Round trip time estimate from pings, used for deciding when to re-send (see RFC 6298)
+	bool hasRoundTripTime;
+	uint32_t smoothedRoundTripTime;
+	uint32_t roundTripTimeVariance;
+	uint32_t resendTimeout;
+	
+	// Telemetry for the peer
+	NetworkPeerStats *stats;
+} ReliableSendState;
+
+// How many past world snapshots are kept around to be used as a base for deltas
+// Must be a power of two that fits in WORLD_SNAPSHOT_BASELINE_AGE_BITS
+#define WORLD_SNAPSHOT_HISTORY_SIZE 32
+
+// Authoritative state of the board and characters that the server keeps clients converged to
+// Everything is a byte so snapshots can be compared and copied as a whole
+typedef struct
+{
+	// ID of character that colored the tile or NO_CHARACTER
+	uint8_t coloredID;
+	// Tile was destroyed by a character and is waiting to be recovered
+	uint8_t fallen;
+	// Tile fell down for good as the board shrinks
+	uint8_t dead;
+} TileSnapshot;
+
+typedef struct
+{
+	uint8_t lives;
+	uint8_t kills;
+	// Wraps around; a client only needs to notice it changed to know a character died
+	uint8_t deaths;
+} CharacterSnapshot;
+
+typedef struct
+{
+	TileSnapshot tiles[NUMBER_OF_TILES];
+	CharacterSnapshot characters[4];
+} WorldSnapshot;
+
+// Server's view of which world snapshot a client has, only used from the server thread
+typedef struct
+{
+	// Latest snapshot the client has acked, which it keeps around as a base for our deltas
+	uint32_t ackedSnapshotNumber;
+	uint32_t sentSnapshotNumber;
+	uint32_t resendTime;
+	// Reliable sequence number of the last game reset sent to the client
+	// The client doesn't apply snapshots taken after a reset until it has been delivered the reset
+	uint32_t requiredSequence;
+} WorldSnapshotSendState;
+
+// How often the server reconsiders how fast it sends movement to a client, in milliseconds
+#define SEND_RATE_ADJUSTMENT_INTERVAL 250
+// Range of how many movement updates per second a client is sent, starting off at the most, which is the rate the simulation runs at
+#define MIN_MOVEMENT_SEND_RATE 10.0f
+#define MAX_MOVEMENT_SEND_RATE (float)(1.0 / ANIMATION_TIMER_INTERVAL)
+// The rate goes up by this much every adjustment while the link copes, and is cut down by this factor when it doesn't
+#define MOVEMENT_SEND_RATE_INCREASE 5.0f
+#define MOVEMENT_SEND_RATE_DECREASE 0.7f
+// Pings whose pong may still be coming back aren't counted, and loss isn't judged on fewer than this many
+#define SEND_RATE_MIN_MEASURED_PINGS 10
+// Losing more than this percentage of pings counts as congestion
+#define SEND_RATE_LOSS_PERCENTAGE 10
+// The round trip time rising this far above the lowest one recently seen, on top of its usual variation, counts as queues building up, in milliseconds
+#define SEND_RATE_QUEUEING_DELAY 40
+// How long the lowest round trip time is trusted before it's measured again, in milliseconds
+#define SEND_RATE_MIN_ROUND_TRIP_TIME_WINDOW 10000
+// Must be a power of two
+#define SEND_RATE_PING_HISTORY_SIZE 128
 
-GameMessageArray gGameMessagesFromNet;
-GameMessageArray gGameMessagesToNet;
+// Paces the movement the server sends a client by how well its link is coping, only used from the server thread
+// Rate is raised additively and cut multiplicatively (AIMD) from the loss of pings and the trend of their round trip times
+// Reliable messages, snapshots, pings and pongs are never held back by it
+typedef struct
+{
+	float movementRate;
+	uint32_t nextMovementTime;
+	
+	// Latest movement of each character that was held back, sent together once the rate allows
+	GameMessage pendingMovements[4];
+	uint8_t pendingMovementCharacters;
+	
+	// Pings sent to the client and whether their pong came back
+	uint32_t pingTimestamps[SEND_RATE_PING_HISTORY_SIZE];
+	bool pongedPings[SEND_RATE_PING_HISTORY_SIZE];
+	uint32_t pingCount;
+	// Pings before this one were already counted towards the loss measured so far
+	uint32_t measuredPingCount;
+	uint32_t measuredPings;
+	uint32_t lostPings;
+	
+	bool hasMinRoundTripTime;
+	uint32_t minRoundTripTime;
+	uint32_t minRoundTripTimeTime;
+	uint32_t lastAdjustmentTime;
+} SendRateController;
+
+// Address index the server's own copy of a message is queued at, which is kept for world snapshots and spectators rather than sent to a client
+#define SPECTATORS_ADDRESS_INDEX -2
+
+#define MAX_SPECTATORS 64
+// Spectators that haven't asked to keep watching for this long are dropped, in milliseconds
+#define SPECTATOR_TIMEOUT 4000
+// Spectators should ask to keep watching this often, in milliseconds
+#define SPECTATE_INTERVAL 1000
+#define SPECTATOR_FRAME_INTERVAL (uint32_t)(ANIMATION_TIMER_INTERVAL * 1000)
+// Must be a power of two that fits in SPECTATOR_EVENT_COUNT_BITS
+#define SPECTATOR_EVENT_HISTORY_SIZE 16
+// How many frames an event is repeated in, since spectators never ack anything
+#define SPECTATOR_EVENT_REDUNDANCY 8
+// Net names are sent in every frame this many frames apart, and in every frame for SPECTATOR_EVENT_REDUNDANCY frames after one changes
+#define SPECTATOR_NET_NAMES_INTERVAL 30
+
+typedef enum
+{
+	SPECTATOR_GAME_RESET_EVENT = 0,
+	SPECTATOR_START_GAME_EVENT,
+	SPECTATOR_GAME_START_NUMBER_EVENT,
+	SPECTATOR_CHARACTER_FIRED_EVENT,
+	SPECTATOR_LAGGED_OUT_EVENT
+} SpectatorEventType;
+
+typedef struct
+{
+	GameMessage message;
+	// Spectators tell events they already have apart by their number
+	uint32_t eventNumber;
+	uint32_t frameNumber;
+} SpectatorEvent;
+
+// Every spectator is sent the same frame of the whole match once per simulation step, so nothing is kept per spectator but where to send it
+// A frame is the full world snapshot, every character's latest movement, the events of the last few frames and every so often the net names
+// Only used from the server thread
+typedef struct
+{
+	SocketAddress addresses[MAX_SPECTATORS];
+	uint32_t lastHeardTimes[MAX_SPECTATORS];
+	uint32_t count;
+	
+	CharacterMovedUpdate movements[4];
+	uint8_t movedCharacters;
+	
+	SpectatorEvent events[SPECTATOR_EVENT_HISTORY_SIZE];
+	uint32_t eventCount;
+	// Event number of the last game reset, or 0 if there was none
+	uint32_t resetEventNumber;
+	
+	// Empty for characters no one is playing over the network
+	char netNames[4][MAX_USER_NAME_SIZE];
+	uint32_t netNamesFrameNumber;
+	
+	uint32_t frameNumber;
+	uint32_t nextFrameTime;
+} SpectatorStream;
+
+struct NetworkBuffers
+{
+	// Pushed to from the network thread and read from the main thread
+	GameMessageQueue gameMessagesFromNet;
+	// Pushed to from the main thread and read from the network thread
+	GameMessageQueue gameMessagesToNet;
+	// Messages the network thread queues for its own next pass, such as re-sends, acks and pongs
+	// Only accessed from the network thread
+	GameMessageQueue networkThreadMessages;
+	
+#if !PLATFORM_WINDOWS
+	// Used by the main thread to wake up a network thread that is blocked waiting on its socket
+	// On Linux this is an eventfd and both descriptors are the same, elsewhere it's a self-pipe
+	int wakeupReadDescriptor;
+	int wakeupWriteDescriptor;
+#endif
+};
+
+// Buffers of the game running on the current thread, or of the connection a network thread was handed
+static ZG_THREAD_LOCAL NetworkBuffers *gNetworkBuffers;
+
+// Clients a server's network thread couldn't queue a message for, which it drops since they'd never be sent that message
+// The connection as a whole is given up on if the message wasn't for a client we can drop, or the main thread couldn't be handed one
+#define OVERFLOWED_CONNECTION_MASK 0x80
+static ZG_THREAD_LOCAL uint8_t gOverflowedNetworkPeers;
+
+ZG_THREAD_LOCAL NetworkConnection *gNetworkConnection = NULL;
 
-NetworkConnection *gNetworkConnection = NULL;
+uint32_t gMaxLagCompensationRewind = DEFAULT_MAX_LAG_COMPENSATION_REWIND;
 
-static ZGMutex gCurrentSlotAndClientStatesMutex;
+// Guards the telemetry network threads publish to their connections, and the number of captures started
+// It's held just long enough to copy the telemetry in or out
+static ZGMutex gNetworkStatsMutex;
+// Where telemetry is dumped to, if anywhere
+static FILE *gNetworkStatsFile;
+// Where network threads capture their datagrams to, if anywhere
+static const char *gNetworkCapturePath;
+static uint32_t gNetworkCaptureCount;
+static ZG_THREAD_LOCAL uint32_t gLastNetworkStatsDumpTime;
+static bool gNetworkTracing;
+static bool gInitializedNetworkOnce;
 
-static void pushNetworkMessage(GameMessageArray *messageArray, GameMessage message);
-static void depleteNetworkMessages(GameMessageArray *messageArray);
+// When the datagram a network thread is handling arrived and how long it took to, or -1 if that isn't known, for tracing the messages delivered from it
+static ZG_THREAD_LOCAL uint64_t gTracedDatagramReceiveTime;
+static ZG_THREAD_LOCAL int64_t gTracedDatagramWireTime;
+// What a network thread adds to its clock to get the server's while tracing, if it knows yet
+static ZG_THREAD_LOCAL int64_t gTracedServerClockOffset;
+static ZG_THREAD_LOCAL bool gTracedServerClockSynchronized;
+
+// Step of a stepped transport that a network thread's current pass started at
+static ZG_THREAD_LOCAL uint32_t gSteppedNetworkPassStep;
+
+static void queueMessageToClients(GameMessageQueue *messageQueue, int exception, GameMessage *message);
+
+static void wakeNetworkThread(NetworkBuffers *buffers);
+
+// Whether an endpoint's network thread is handling a pass, waiting for something to happen, or gone, as a stepped transport sees it
+#define STEPPED_NETWORK_BUSY 0
+#define STEPPED_NETWORK_IDLE 1
+#define STEPPED_NETWORK_STOPPED 2
+
+static void publishSteppedNetworkThreadState(uint8_t networkState);
 
 static void cleanupStateFromNetwork(void);
 
-void setPredictedDirection(Character *character, int direction)
+static void dumpNetworkStats(FILE *file);
+
+static void recordMessageLatency(NetworkLatencyStats *stats, NetworkLatencyStage stage, MessageType type, int64_t latency)
+{
+	if ((uint32_t)type >= NETWORK_LATENCY_MESSAGE_TYPE_COUNT)
+	{
+		return;
+	}
+	
+	// Clocks of different hosts are only synchronized so well, so the wire can look faster than instant
+	uint32_t clampedLatency = latency < 0 ? 0 : (latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency);
+	
+	uint32_t bucket = clampedLatency;
+	if (clampedLatency >= 4)
+	{
+		uint32_t powerOfTwo = 2;
+		while ((clampedLatency >> (powerOfTwo + 1)) != 0)
+		{
+			powerOfTwo++;
+		}
+		bucket = (powerOfTwo - 1) * 4 + ((clampedLatency >> (powerOfTwo - 2)) & 3);
+	}
+	if (bucket >= NETWORK_LATENCY_HISTOGRAM_BUCKET_COUNT)
+	{
+		bucket = NETWORK_LATENCY_HISTOGRAM_BUCKET_COUNT - 1;
+	}
+	
+	NetworkLatencyHistogram *histogram = &stats->stages[stage][type];
+	histogram->histogram[bucket]++;
+	histogram->samples++;
+	histogram->totalLatency += clampedLatency;
+	if (clampedLatency > histogram->maxLatency)
+	{
+		histogram->maxLatency = clampedLatency;
+	}
+}
+
+// Called from the main thread as a message is queued to the network thread
+static void traceCreatedMessage(GameMessage *message)
+{
+	memset(&message->trace, 0, sizeof(message->trace));
+	if (gNetworkTracing)
+	{
+		message->trace.createdTime = networkMicroTicks();
+	}
+}
+
+// Called from the network thread as it takes a message the main thread queued
+static void traceDequeuedMessage(GameMessage *message)
+{
+	if (gNetworkTracing && message->trace.createdTime != 0)
+	{
+		message->trace.dequeuedTime = networkMicroTicks();
+		recordMessageLatency(&gNetworkConnection->networkThreadLatencyStats, NETWORK_LATENCY_TO_NET_QUEUE, message->type, (int64_t)(message->trace.dequeuedTime - message->trace.createdTime));
+	}
+}
+
+// Called from the network thread whenever a message is written to a datagram, though only its first send is measured
+static void traceSentMessage(GameMessage *message)
+{
+	if (gNetworkTracing && message->trace.dequeuedTime != 0)
+	{
+		recordMessageLatency(&gNetworkConnection->networkThreadLatencyStats, NETWORK_LATENCY_SEND, message->type, (int64_t)(networkMicroTicks() - message->trace.dequeuedTime));
+		message->trace.dequeuedTime = 0;
+	}
+}
+
+// Called from the network thread before handling a datagram it received, and with a receiveTime of 0 once it's done with it
+static void traceReceivedDatagram(uint64_t receiveTime)
+{
+	gTracedDatagramReceiveTime = receiveTime;
+	gTracedDatagramWireTime = -1;
+}
+
+// Reads the send time stamped on the datagram being handled
+static void traceDatagramSendTime(uint64_t sendTime)
+{
+	if (gNetworkTracing && sendTime != 0 && gTracedServerClockSynchronized && gTracedDatagramReceiveTime != 0)
+	{
+		gTracedDatagramWireTime = (int64_t)(gTracedDatagramReceiveTime + (uint64_t)gTracedServerClockOffset - sendTime);
+	}
+}
+
+// Hands a message to the main thread from the network thread
+static void deliverNetworkMessage(GameMessage message)
+{
+	memset(&message.trace, 0, sizeof(message.trace));
+	if (gNetworkTracing)
+	{
+		message.trace.deliveredTime = networkMicroTicks();
+		
+		// Messages that aren't from a datagram, such as ones about peers timing out, only spend time in the main thread's queue
+		if (gTracedDatagramReceiveTime != 0)
+		{
+			recordMessageLatency(&gNetworkConnection->networkThreadLatencyStats, NETWORK_LATENCY_RECEIVE, message.type, (int64_t)(message.trace.deliveredTime - gTracedDatagramReceiveTime));
+		}
+		if (gTracedDatagramWireTime != -1)
+		{
+			recordMessageLatency(&gNetworkConnection->networkThreadLatencyStats, NETWORK_LATENCY_WIRE, message.type, gTracedDatagramWireTime);
+		}
+	}
+	
+	if (!pushNetworkMessage(&gNetworkBuffers->gameMessagesFromNet, message))
+	{
+		storeReleaseUInt8(&gNetworkConnection->deliveryOverflowed, 1);
+		gOverflowedNetworkPeers |= OVERFLOWED_CONNECTION_MASK;
+	}
+}
+
+// Queues a message for the network thread to send, either from the main thread or from the network thread for its own next pass
+// The main thread waits for room since the network thread never waits on it, but the network thread can't wait on itself,
+// so it instead gives up on the peer the message is for rather than leave a hole in what that peer is sent
+static void queueOutgoingMessage(GameMessageQueue *messageQueue, GameMessage *message)
+{
+	if (messageQueue == &gNetworkBuffers->networkThreadMessages)
+	{
+		if (!pushNetworkMessage(messageQueue, *message))
+		{
+			int addressIndex = message->addressIndex;
+			if (gNetworkConnection->type == NETWORK_SERVER_TYPE && addressIndex >= 0 && addressIndex < (int)(sizeof(gNetworkConnection->clientStates) / sizeof(gNetworkConnection->clientStates[0])))
+			{
+				gOverflowedNetworkPeers |= (1 << addressIndex);
+			}
+			// Spectators are only sent events as well as they can be, and a frame's snapshot still catches them up
+			else if (addressIndex != SPECTATORS_ADDRESS_INDEX || gNetworkConnection->type != NETWORK_SERVER_TYPE)
+			{
+				gOverflowedNetworkPeers |= OVERFLOWED_CONNECTION_MASK;
+			}
+		}
+	}
+	else
+	{
+		while (!pushNetworkMessage(messageQueue, *message) && loadAcquireUInt8(&gNetworkConnection->networkThreadStopped) == 0)
+		{
+			wakeNetworkThread(gNetworkBuffers);
+			ZGDelay(1);
+		}
+	}
+}
+
+// Called from the main thread as syncNetworkState() applies a message the network thread delivered
+static void traceAppliedMessage(GameMessage *message)
+{
+	if (gNetworkTracing && message->trace.deliveredTime != 0)
+	{
+		recordMessageLatency(&gNetworkConnection->appliedLatencyStats, NETWORK_LATENCY_FROM_NET_QUEUE, message->type, (int64_t)(networkMicroTicks() - message->trace.deliveredTime));
+	}
+}
+
+uint16_t predictCharacterDirection(Character *character, int direction)
+{
+	character->direction = direction;
+	turnCharacter(character, direction);
+	
+	// 0 is left for meaning no request has been applied yet
+	gNetworkConnection->lastInputSequence++;
+	if (gNetworkConnection->lastInputSequence == 0)
+	{
+		gNetworkConnection->lastInputSequence = 1;
+	}
+	
+	// The character first moves with the new direction in the current step, which is recorded once it's over
+	PredictedInput *input = &gNetworkConnection->predictedInputs[gNetworkConnection->lastInputSequence & (PREDICTED_INPUTS_CAPACITY - 1)];
+	input->inputSequence = gNetworkConnection->lastInputSequence;
+	input->step = gNetworkConnection->predictedStep;
+	
+	return gNetworkConnection->lastInputSequence;
+}
+
+#define PREDICTION_WARP_DISCREPANCY 0.5f
+
+// Moves our own character to where it should be now given the server's state of it after the steps it acknowledged
+static void reconcilePredictedCharacter(Character *character, CharacterMovedUpdate *movedUpdate, float timeDelta)
+{
+	PredictedInput *input = &gNetworkConnection->predictedInputs[movedUpdate->inputSequence & (PREDICTED_INPUTS_CAPACITY - 1)];
+	if (movedUpdate->inputSequence == 0 || input->inputSequence != movedUpdate->inputSequence || movedUpdate->inputSteps == UINT16_MAX)
+	{
+		// Nothing to line the server's state up with
+		return;
+	}
+	
+	// The server's state is of the character after it moved in the step its request was applied at and the acknowledged number of steps after it
+	// The server may also be a step or so ahead of us if it was given the request sooner than expected
+	uint32_t acknowledgedStep = input->step + movedUpdate->inputSteps;
+	if ((int32_t)(gNetworkConnection->predictedStep - acknowledgedStep) > PREDICTED_STEPS_CAPACITY)
+	{
+		return;
+	}
+	
+	float x = character->x;
+	float y = character->y;
+	int direction = character->direction;
+	int pointingDirection = character->pointing_direction;
+	float distance = character->distance;
+	float nonstopDistance = character->nonstopDistance;
+	
+	// Simulate the steps the server hasn't acknowledged again starting from its state
+	character->x = movedUpdate->x;
+	character->y = movedUpdate->y;
+	for (uint32_t step = acknowledgedStep + 1; (int32_t)(gNetworkConnection->predictedStep - step) > 0; step++)
+	{
+		character->direction = gNetworkConnection->predictedStepDirections[step & (PREDICTED_STEPS_CAPACITY - 1)];
+		moveCharacter(character, timeDelta);
+	}
+	
+	float reconciledX = character->x;
+	float reconciledY = character->y;
+	
+	character->x = x;
+	character->y = y;
+	character->direction = direction;
+	character->pointing_direction = pointingDirection;
+	character->distance = distance;
+	character->nonstopDistance = nonstopDistance;
+	
+	// Small errors are corrected gradually so they aren't noticeable, while larger ones warp the character
+	// Our character keeps moving from where it's shown, so it's warped sooner than others to not let the error build up
+	float warpDiscrepancy = PREDICTION_WARP_DISCREPANCY;
+	if (fabsf(reconciledX - character->x) >= warpDiscrepancy || fabsf(reconciledY - character->y) >= warpDiscrepancy)
+	{
+		character->x = reconciledX;
+		character->y = reconciledY;
+		
+		character->xDiscrepancy = 0.0f;
+		character->yDiscrepancy = 0.0f;
+	}
+	else
+	{
+		character->xDiscrepancy = reconciledX - character->x;
+		character->yDiscrepancy = reconciledY - character->y;
+	}
+}
+
+// Remembers where everything was at the end of the last simulation step
+static void recordLagCompensationFrame(void)
+{
+	LagCompensationFrame *frame = &gNetworkConnection->lagCompensationFrames[gNetworkConnection->lagCompensationFrameCount & (LAG_COMPENSATION_HISTORY_CAPACITY - 1)];
+	frame->ticks = networkTicks();
+	frame->aliveCharacters = 0;
+	frame->aliveTiles = 0;
+	
+	for (uint8_t characterID = RED_ROVER; characterID <= PINK_BUBBLE_GUM; characterID++)
+	{
+		Character *character = getCharacter(characterID);
+		
+		frame->characterXs[characterID - 1] = character->x;
+		frame->characterYs[characterID - 1] = character->y;
+		if (CHARACTER_IS_ALIVE(character))
+		{
+			frame->aliveCharacters |= (uint8_t)(1 << (characterID - 1));
+		}
+	}
+	
+	for (int tileIndex = 0; tileIndex < NUMBER_OF_TILES; tileIndex++)
+	{
+		if (gTiles[tileIndex].state)
+		{
+			frame->aliveTiles |= ((uint64_t)1 << tileIndex);
+		}
+	}
+	
+	gNetworkConnection->lagCompensationFrameCount++;
+}
+
+int rewoundCharacterTileIndex(Character *character, uint32_t rewindTime)
 {
-	character->predictedDirection = direction;
-	character->predictedDirectionTime = ZGGetTicks() + gNetworkConnection->serverHalfPing;
+	uint32_t frameCount = gNetworkConnection->lagCompensationFrameCount;
+	uint32_t oldestFrameIndex = (frameCount > LAG_COMPENSATION_HISTORY_CAPACITY) ? frameCount - LAG_COMPENSATION_HISTORY_CAPACITY : 0;
+	uint32_t rewoundTicks = networkTicks() - rewindTime;
+	
+	// Find the newest step that was over by the time rewound to
+	for (uint32_t frameIndex = frameCount; frameIndex > oldestFrameIndex; frameIndex--)
+	{
+		LagCompensationFrame *frame = &gNetworkConnection->lagCompensationFrames[(frameIndex - 1) & (LAG_COMPENSATION_HISTORY_CAPACITY - 1)];
+		if ((int32_t)(rewoundTicks - frame->ticks) >= 0)
+		{
+			uint8_t characterIndex = (uint8_t)(IDOfCharacter(character) - 1);
+			if ((frame->aliveCharacters & (1 << characterIndex)) == 0)
+			{
+				return -1;
+			}
+			
+			int tileIndex = getTileIndexLocation((int)frame->characterXs[characterIndex], (int)frame->characterYs[characterIndex]);
+			if (tileIndex < 0 || tileIndex >= NUMBER_OF_TILES || (frame->aliveTiles & ((uint64_t)1 << tileIndex)) == 0)
+			{
+				return -1;
+			}
+			
+			return tileIndex;
+		}
+	}
+	
+	return -1;
 }
 
 // previousMovement->ticks <= renderTime < nextMovement->ticks
@@ -100,35 +713,6 @@ static void interpolateCharacter(Character *character, CharacterMovement *previo
 			character->active = false;
 		}
 		
-		bool checkDiscrepancy = true;
-		// Alter the previous movement to our prediction
-		if (character->predictedDirectionTime > 0)
-		{
-			uint32_t predictionTimeWithErrorMargin = character->predictedDirectionTime + gNetworkConnection->serverHalfPing * 3;
-			
-			if (predictionTimeWithErrorMargin >= previousMovement->ticks)
-			{
-				previousMovement->direction = character->predictedDirection;
-				if (character->predictedDirection != NO_DIRECTION)
-				{
-					previousMovement->pointing_direction = character->predictedDirection;
-				}
-				else
-				{
-					previousMovement->pointing_direction = character->pointing_direction;
-				}
-				
-				character->movementConsumedCounter = 0;
-				
-				if (predictionTimeWithErrorMargin < nextMovement->ticks)
-				{
-					character->predictedDirectionTime = 0;
-				}
-				
-				checkDiscrepancy = false;
-			}
-		}
-		
 		if (characterShouldBeAlive != characterAlive)
 		{
 			character->x = previousMovement->x;
@@ -139,39 +723,31 @@ static void interpolateCharacter(Character *character, CharacterMovement *previo
 		}
 		else
 		{
-			if (checkDiscrepancy)
+			if (character->direction == previousMovement->direction)
 			{
-				if (character->direction == previousMovement->direction)
+				character->movementConsumedCounter++;
+			}
+			
+			if (character->movementConsumedCounter >= 2)
+			{
+				// If the character is too far away, warp them back to a known previous movement
+				// Otherwise interpolate the character to compensate for the difference
+				float warpDiscrepancy = 3.0f;
+				if (fabsf(character->x - previousMovement->x) >= warpDiscrepancy || fabsf(character->y - previousMovement->y) >= warpDiscrepancy)
 				{
-					character->movementConsumedCounter++;
+					character->x = previousMovement->x;
+					character->y = previousMovement->y;
+					
+					character->xDiscrepancy = 0.0f;
+					character->yDiscrepancy = 0.0f;
 				}
-				
-				if (character->movementConsumedCounter >= 2)
+				else
 				{
-					// If the character is too far away, warp them back to a known previous movement
-					// Otherwise interpolate the character to compensate for the difference
-					float warpDiscrepancy = 3.0f;
-					if (fabsf(character->x - previousMovement->x) >= warpDiscrepancy || fabsf(character->y - previousMovement->y) >= warpDiscrepancy)
-					{
-						character->x = previousMovement->x;
-						character->y = previousMovement->y;
-						
-						character->xDiscrepancy = 0.0f;
-						character->yDiscrepancy = 0.0f;
-					}
-					else
-					{
-						character->xDiscrepancy = previousMovement->x - character->x;
-						character->yDiscrepancy = previousMovement->y - character->y;
-					}
-					
-					character->movementConsumedCounter = 0;
+					character->xDiscrepancy = previousMovement->x - character->x;
+					character->yDiscrepancy = previousMovement->y - character->y;
 				}
-			}
-			else
-			{
-				character->xDiscrepancy = 0.0f;
-				character->yDiscrepancy = 0.0f;
+				
+				character->movementConsumedCounter = 0;
 			}
 		}
 		
@@ -192,51 +768,361 @@ static void interpolateCharacter(Character *character, CharacterMovement *previo
 	}
 }
 
-void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
+// Called for every movement update with the time the network thread received it
+static void updateMovementArrivalJitter(uint32_t arrivalTime)
 {
-	if (gNetworkConnection == NULL)
+	// Movements in the same datagram arrive together
+	uint32_t lastArrivalTime = gNetworkConnection->lastMovementArrivalTime;
+	if (arrivalTime == lastArrivalTime)
 	{
 		return;
 	}
 	
-	uint32_t messagesCount = 0;
-	GameMessage *messagesToRead = popNetworkMessages(&gGameMessagesFromNet, &messagesCount);
-	if (messagesToRead != NULL)
+	gNetworkConnection->lastMovementArrivalTime = arrivalTime;
+	
+	uint32_t interval = arrivalTime - lastArrivalTime;
+	if (lastArrivalTime == 0 || interval > MAX_MOVEMENT_ARRIVAL_INTERVAL)
 	{
-		for (uint32_t messageIndex = 0; messageIndex < messagesCount && (gNetworkConnection != NULL); messageIndex++)
+		return;
+	}
+	
+	if (gNetworkConnection->movementArrivalInterval == 0.0f)
+	{
+		gNetworkConnection->movementArrivalInterval = (float)interval;
+		return;
+	}
+	
+	// Smoothed the same way as RTP's interarrival jitter (RFC 3550)
+	float deviation = fabsf((float)interval - gNetworkConnection->movementArrivalInterval);
+	gNetworkConnection->movementArrivalInterval += ((float)interval - gNetworkConnection->movementArrivalInterval) / 16.0f;
+	gNetworkConnection->movementArrivalJitter += (deviation - gNetworkConnection->movementArrivalJitter) / 16.0f;
+}
+
+static uint32_t characterInterpolationDelay(void)
+{
+	// Until updates have arrived a couple of times, fall back to a multiple of the ping
+	if (gNetworkConnection->movementArrivalInterval == 0.0f)
+	{
+		return 2 * gNetworkConnection->serverHalfPing;
+	}
+	
+	uint32_t delay = (uint32_t)(gNetworkConnection->movementArrivalInterval + INTERPOLATION_JITTER_MULTIPLIER * gNetworkConnection->movementArrivalJitter + 0.5f);
+	return (delay < MAX_INTERPOLATION_DELAY) ? delay : MAX_INTERPOLATION_DELAY;
+}
+
+// Returns true if it's the first movement of the character
+static bool pushCharacterMovement(CharacterMovementBuffer *movementBuffer, CharacterMovement movement)
+{
+	// A ping that dropped since the previous movement shouldn't put this one before it
+	if (movementBuffer->count > 0)
+	{
+		uint32_t newestTicks = movementBuffer->movements[(movementBuffer->count - 1) & (CHARACTER_MOVEMENTS_CAPACITY - 1)].ticks;
+		if (movement.ticks < newestTicks)
 		{
-			GameMessage message = messagesToRead[messageIndex];
-			switch (message.type)
-			{
+			movement.ticks = newestTicks;
+		}
+	}
+	
+	movementBuffer->movements[movementBuffer->count & (CHARACTER_MOVEMENTS_CAPACITY - 1)] = movement;
+	movementBuffer->count++;
+	
+	return (movementBuffer->count == 1);
+}
+
+// Newest movement at or before the time, which is where renderIndex is left at
+// Returns NULL if every movement is newer
+static CharacterMovement *characterMovementAtTime(CharacterMovementBuffer *movementBuffer, uint32_t time)
+{
+	if (movementBuffer->count == 0)
+	{
+		return NULL;
+	}
+	
+	// Skip movements that have been overwritten
+	uint32_t oldestIndex = (movementBuffer->count > CHARACTER_MOVEMENTS_CAPACITY) ? movementBuffer->count - CHARACTER_MOVEMENTS_CAPACITY : 0;
+	if (movementBuffer->renderIndex < oldestIndex)
+	{
+		movementBuffer->renderIndex = oldestIndex;
+	}
+	
+	while (movementBuffer->renderIndex + 1 < movementBuffer->count && movementBuffer->movements[(movementBuffer->renderIndex + 1) & (CHARACTER_MOVEMENTS_CAPACITY - 1)].ticks <= time)
+	{
+		movementBuffer->renderIndex++;
+	}
+	
+	CharacterMovement *movement = &movementBuffer->movements[movementBuffer->renderIndex & (CHARACTER_MOVEMENTS_CAPACITY - 1)];
+	return (movement->ticks <= time) ? movement : NULL;
+}
+
+static bool characterTriggerMessageIsEarlier(const CharacterTriggerMessage *triggerMessage, const CharacterTriggerMessage *otherTriggerMessage)
+{
+	if (triggerMessage->message.ticks != otherTriggerMessage->message.ticks)
+	{
+		return (triggerMessage->message.ticks < otherTriggerMessage->message.ticks);
+	}
+	
+	return ((int32_t)(triggerMessage->order - otherTriggerMessage->order) < 0);
+}
+
+// Trigger messages are a min-heap so the earliest due one is always first
+static void pushCharacterTriggerMessage(GameMessage message)
+{
+	if (gNetworkConnection->characterTriggerMessagesCount >= gNetworkConnection->characterTriggerMessagesCapacity)
+	{
+		gNetworkConnection->characterTriggerMessagesCapacity = (uint32_t)(gNetworkConnection->characterTriggerMessagesCapacity * 1.6f);
+		gNetworkConnection->characterTriggerMessages = realloc(gNetworkConnection->characterTriggerMessages, sizeof(*gNetworkConnection->characterTriggerMessages) * gNetworkConnection->characterTriggerMessagesCapacity);
+	}
+	
+	CharacterTriggerMessage *triggerMessages = gNetworkConnection->characterTriggerMessages;
+	CharacterTriggerMessage triggerMessage = {.message = message, .order = gNetworkConnection->nextCharacterTriggerMessageOrder++};
+	
+	uint32_t index = gNetworkConnection->characterTriggerMessagesCount;
+	gNetworkConnection->characterTriggerMessagesCount++;
+	
+	while (index > 0)
+	{
+		uint32_t parentIndex = (index - 1) / 2;
+		if (!characterTriggerMessageIsEarlier(&triggerMessage, &triggerMessages[parentIndex]))
+		{
+			break;
+		}
+		
+		triggerMessages[index] = triggerMessages[parentIndex];
+		index = parentIndex;
+	}
+	
+	triggerMessages[index] = triggerMessage;
+}
+
+static CharacterTriggerMessage popCharacterTriggerMessage(void)
+{
+	CharacterTriggerMessage *triggerMessages = gNetworkConnection->characterTriggerMessages;
+	CharacterTriggerMessage earliestTriggerMessage = triggerMessages[0];
+	
+	gNetworkConnection->characterTriggerMessagesCount--;
+	uint32_t count = gNetworkConnection->characterTriggerMessagesCount;
+	CharacterTriggerMessage lastTriggerMessage = triggerMessages[count];
+	
+	uint32_t index = 0;
+	while (true)
+	{
+		uint32_t childIndex = 2 * index + 1;
+		if (childIndex >= count)
+		{
+			break;
+		}
+		
+		if (childIndex + 1 < count && characterTriggerMessageIsEarlier(&triggerMessages[childIndex + 1], &triggerMessages[childIndex]))
+		{
+			childIndex++;
+		}
+		
+		if (!characterTriggerMessageIsEarlier(&triggerMessages[childIndex], &lastTriggerMessage))
+		{
+			break;
+		}
+		
+		triggerMessages[index] = triggerMessages[childIndex];
+		index = childIndex;
+	}
+	
+	if (count > 0)
+	{
+		triggerMessages[index] = lastTriggerMessage;
+	}
+	
+	return earliestTriggerMessage;
+}
+
+// Pings that take longer than this to come back aren't used to estimate the server's clock, in microseconds
+#define CLOCK_SYNC_MAX_ROUND_TRIP_TIME 1000000
+// The server clock's skew is measured over at least this long, in microseconds
+#define CLOCK_SYNC_MIN_SKEW_INTERVAL 10000000
+// Most the server's clock is believed to run faster or slower than ours by
+#define CLOCK_SYNC_MAX_SKEW 0.0005
+
+// How long a ping and its pong took to travel, not counting how long the peer held on to the ping, in microseconds
+static uint32_t pongRoundTripTime(const PongMessage *pong)
+{
+	uint32_t roundTripTime = (uint32_t)pong->arrivalTime - pong->pingTimestamp;
+	return (roundTripTime > pong->holdTime) ? (roundTripTime - pong->holdTime) : 0;
+}
+
+// Estimates the server's clock like NTP does from the times a ping and its pong were sent and received
+static void updateServerClock(const PongMessage *pong)
+{
+	uint32_t roundTripTime = pongRoundTripTime(pong);
+	if (roundTripTime > CLOCK_SYNC_MAX_ROUND_TRIP_TIME)
+	{
+		return;
+	}
+	
+	// Only the low bits of when we sent the ping made the round trip
+	uint64_t pingTime = pong->arrivalTime - (uint32_t)((uint32_t)pong->arrivalTime - pong->pingTimestamp);
+	
+	// Halfway between how far ahead the server's clock was when the ping arrived and when the pong left
+	ClockSyncSample sample;
+	sample.localTime = pong->arrivalTime;
+	sample.roundTripTime = roundTripTime;
+	sample.offset = ((int64_t)(pong->receiveTime - pingTime) + (int64_t)(pong->receiveTime + pong->holdTime - pong->arrivalTime)) / 2;
+	
+	gNetworkConnection->clockSyncSamples[gNetworkConnection->clockSyncSampleCount & (CLOCK_SYNC_SAMPLES_CAPACITY - 1)] = sample;
+	gNetworkConnection->clockSyncSampleCount++;
+	
+	// The quickest exchange had the least queueing to make one way take longer than the other, so its offset is trusted most
+	// The rest are outliers
+	uint32_t sampleCount = (gNetworkConnection->clockSyncSampleCount < CLOCK_SYNC_SAMPLES_CAPACITY) ? gNetworkConnection->clockSyncSampleCount : CLOCK_SYNC_SAMPLES_CAPACITY;
+	ClockSyncSample *bestSample = NULL;
+	for (uint32_t sampleIndex = 0; sampleIndex < sampleCount; sampleIndex++)
+	{
+		ClockSyncSample *candidateSample = &gNetworkConnection->clockSyncSamples[sampleIndex];
+		if (bestSample == NULL || candidateSample->roundTripTime < bestSample->roundTripTime || (candidateSample->roundTripTime == bestSample->roundTripTime && candidateSample->localTime > bestSample->localTime))
+		{
+			bestSample = candidateSample;
+		}
+	}
+	
+	if (!gNetworkConnection->serverClockSynchronized)
+	{
+		gNetworkConnection->serverClockOffset = bestSample->offset;
+		gNetworkConnection->serverClockOffsetTime = bestSample->localTime;
+		gNetworkConnection->serverClockSkew = 0.0;
+		gNetworkConnection->serverClockSkewReferenceOffset = bestSample->offset;
+		gNetworkConnection->serverClockSkewReferenceTime = bestSample->localTime;
+		gNetworkConnection->serverClockSynchronized = true;
+		return;
+	}
+	
+	if (bestSample->localTime <= gNetworkConnection->serverClockOffsetTime)
+	{
+		return;
+	}
+	
+	// Measure how fast the server's clock drifts away from ours over long enough that the error of each offset doesn't dominate
+	uint64_t skewInterval = bestSample->localTime - gNetworkConnection->serverClockSkewReferenceTime;
+	if (skewInterval >= CLOCK_SYNC_MIN_SKEW_INTERVAL)
+	{
+		double measuredSkew = (double)(bestSample->offset - gNetworkConnection->serverClockSkewReferenceOffset) / (double)skewInterval;
+		double skew = gNetworkConnection->serverClockSkew + (measuredSkew - gNetworkConnection->serverClockSkew) / 8.0;
+		
+		if (skew > CLOCK_SYNC_MAX_SKEW)
+		{
+			skew = CLOCK_SYNC_MAX_SKEW;
+		}
+		else if (skew < -CLOCK_SYNC_MAX_SKEW)
+		{
+			skew = -CLOCK_SYNC_MAX_SKEW;
+		}
+		
+		gNetworkConnection->serverClockSkew = skew;
+		gNetworkConnection->serverClockSkewReferenceOffset = bestSample->offset;
+		gNetworkConnection->serverClockSkewReferenceTime = bestSample->localTime;
+	}
+	
+	gNetworkConnection->serverClockOffset = bestSample->offset;
+	gNetworkConnection->serverClockOffsetTime = bestSample->localTime;
+}
+
+// Server clock minus ours at the given time by our clock, in microseconds
+static int64_t serverClockOffsetAtTime(uint64_t currentTime)
+{
+	int64_t elapsedTime = (int64_t)(currentTime - gNetworkConnection->serverClockOffsetTime);
+	return gNetworkConnection->serverClockOffset + (int64_t)(gNetworkConnection->serverClockSkew * (double)elapsedTime);
+}
+
+uint32_t serverTimeNow(void)
+{
+	if (gNetworkConnection == NULL || gNetworkConnection->type != NETWORK_CLIENT_TYPE || !gNetworkConnection->serverClockSynchronized)
+	{
+		return networkTicks();
+	}
+	
+	uint64_t currentTime = networkMicroTicks();
+	return (uint32_t)((currentTime + (uint64_t)serverClockOffsetAtTime(currentTime)) / 1000);
+}
+
+// Called from the main thread once the network thread quits or gives up on the connection
+static void closeNetworkConnection(ZGWindow *window)
+{
+	endNetworkGame(window);
+	cleanupStateFromNetwork();
+	
+	if (gNetworkConnection->thread != NULL)
+	{
+		// We need to wait for the thread to exit, otherwise we'll have a resource leak
+		// The thread may still be using the connection until then
+		ZGWaitThread(gNetworkConnection->thread);
+	}
+	
+	// A router's socket is shared by all of its matches and outlives them, and a replayed connection or one over a transport never opened one
+	if (gNetworkConnection->replay == NULL && gNetworkConnection->transport == NULL && (gNetworkConnection->type == NETWORK_CLIENT_TYPE || gNetworkConnection->router == NULL))
+	{
+		closeSocket(gNetworkConnection->socket);
+	}
+	
+	deinitializeNetwork();
+	
+	free(gNetworkConnection->characterTriggerMessages);
+	free(gNetworkConnection);
+	gNetworkConnection = NULL;
+	
+	// The queues can only be safely emptied from here once the network thread is gone
+	depleteNetworkMessages(&gNetworkBuffers->gameMessagesFromNet);
+	depleteNetworkMessages(&gNetworkBuffers->gameMessagesToNet);
+	depleteNetworkMessages(&gNetworkBuffers->networkThreadMessages);
+}
+
+void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
+{
+	if (gNetworkConnection == NULL)
+	{
+		return;
+	}
+	
+	if (gNetworkStatsFile != NULL && ZGGetTicks() - gLastNetworkStatsDumpTime >= NETWORK_STATS_DUMP_INTERVAL)
+	{
+		dumpNetworkStats(gNetworkStatsFile);
+		gLastNetworkStatsDumpTime = ZGGetTicks();
+	}
+	
+	if (gNetworkConnection->type == NETWORK_SERVER_TYPE)
+	{
+		recordLagCompensationFrame();
+	}
+	else if (gNetworkTracing)
+	{
+		// For the client thread to stamp datagrams with and to time the ones from the server by
+		int64_t offset = gNetworkConnection->serverClockSynchronized ? serverClockOffsetAtTime(networkMicroTicks()) : 0;
+		
+		ZGLockMutex(gNetworkStatsMutex);
+		gNetworkConnection->tracedServerClockOffset = offset;
+		gNetworkConnection->tracedServerClockSynchronized = gNetworkConnection->serverClockSynchronized;
+		ZGUnlockMutex(gNetworkStatsMutex);
+	}
+	
+	// The newest state of our own character that acknowledges one of our movement requests
+	CharacterMovedUpdate inputAcknowledgement = {0};
+	bool receivedInputAcknowledgement = false;
+	
+	// Checked before reading so every message handed to us before the network thread gave up is applied first
+	bool deliveryOverflowed = (loadAcquireUInt8(&gNetworkConnection->deliveryOverflowed) != 0);
+	
+	uint32_t messagesCount = beginReadingNetworkMessages(&gNetworkBuffers->gameMessagesFromNet);
+	if (messagesCount > 0)
+	{
+		for (uint32_t messageIndex = 0; messageIndex < messagesCount && (gNetworkConnection != NULL); messageIndex++)
+		{
+			GameMessage message = *networkMessageAtIndex(&gNetworkBuffers->gameMessagesFromNet, messageIndex);
+			traceAppliedMessage(&message);
+			
+			switch (message.type)
+			{
 				case WELCOME_MESSAGE_TO_SERVER_MESSAGE_TYPE:
 					break;
-				case ACK_MESSAGE_TYPE:
-					break;
 				case PING_MESSAGE_TYPE:
 					break;
 				case QUIT_MESSAGE_TYPE:
-					endNetworkGame(window);
-					cleanupStateFromNetwork();
-					
-					closeSocket(gNetworkConnection->socket);
-					
-					deinitializeNetwork();
-					
-					ZGThread thread = gNetworkConnection->thread;
-					
-					free(gNetworkConnection->characterTriggerMessages);
-					free(gNetworkConnection);
-					gNetworkConnection = NULL;
-					
-					depleteNetworkMessages(&gGameMessagesFromNet);
-					depleteNetworkMessages(&gGameMessagesToNet);
-					
-					if (thread != NULL)
-					{
-						// We need to wait for the thread to exit, otherwise we'll have a resource leak
-						ZGWaitThread(thread);
-					}
-					
+					closeNetworkConnection(window);
 					break;
 				case MOVEMENT_REQUEST_MESSAGE_TYPE:
 				{
@@ -247,6 +1133,9 @@ void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
 					character->direction = direction;
 					turnCharacter(character, direction);
 					
+					gNetworkConnection->clientInputSequences[message.addressIndex] = message.movementRequest.inputSequence;
+					gNetworkConnection->clientInputSteps[message.addressIndex] = 0;
+					
 					break;
 				}
 				case CHARACTER_FIRED_REQUEST_MESSAGE_TYPE:
@@ -258,7 +1147,18 @@ void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
 					
 					float compensation = (halfPing > 110 ? 110.0f : (float)halfPing) / 1000.0f;
 					
-					prepareFiringCharacterWeapon(character, character->x, character->y, character->pointing_direction, compensation);
+					// Look back to when our clock was at what the client was showing the other characters at
+					uint32_t rewindTime = 0;
+					if (message.firedRequest.renderTime != 0)
+					{
+						int32_t renderAge = (int32_t)(networkTicks() - message.firedRequest.renderTime);
+						if (renderAge > 0)
+						{
+							rewindTime = ((uint32_t)renderAge > gMaxLagCompensationRewind) ? gMaxLagCompensationRewind : (uint32_t)renderAge;
+						}
+					}
+					
+					prepareFiringCharacterWeapon(character, character->x, character->y, character->pointing_direction, compensation, rewindTime);
 					
 					break;
 				}
@@ -267,9 +1167,9 @@ void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
 					uint8_t characterID = message.laggedUpdate.characterID;
 					Character *character = getCharacter(characterID);
 					
-					if (character->netName != NULL)
+					if (character->netName[0] != '\0')
 					{
-						strncpy(character->netName, "DISCON", MAX_USER_NAME_SIZE - 1);
+						copyNetName(character->netName, "DISCON");
 					}
 					
 					if (gNetworkConnection->type == NETWORK_SERVER_TYPE)
@@ -297,32 +1197,9 @@ void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
 							gNetworkConnection->characterTriggerMessages = malloc(sizeof(*gNetworkConnection->characterTriggerMessages) * gNetworkConnection->characterTriggerMessagesCapacity);
 						}
 						
-						message.ticks = ZGGetTicks() - gNetworkConnection->serverHalfPing;
-						
-						bool foundReusableMessage = false;
-						for (uint32_t messageIndex = 0; messageIndex < gNetworkConnection->characterTriggerMessagesCount; messageIndex++)
-						{
-							if (gNetworkConnection->characterTriggerMessages[messageIndex].ticks == 0)
-							{
-								// Found a message we can reuse
-								gNetworkConnection->characterTriggerMessages[messageIndex] = message;
-								foundReusableMessage = true;
-								break;
-							}
-						}
+						message.ticks = networkTicks() - gNetworkConnection->serverHalfPing;
 						
-						if (!foundReusableMessage)
-						{
-							if (gNetworkConnection->characterTriggerMessagesCount >= gNetworkConnection->characterTriggerMessagesCapacity)
-							{
-								gNetworkConnection->characterTriggerMessagesCapacity = (uint32_t)(gNetworkConnection->characterTriggerMessagesCapacity * 1.6f);
-								gNetworkConnection->characterTriggerMessages = realloc(gNetworkConnection->characterTriggerMessages, gNetworkConnection->characterTriggerMessagesCapacity * sizeof(*gNetworkConnection->characterTriggerMessages));
-							}
-							
-							gNetworkConnection->characterTriggerMessages[gNetworkConnection->characterTriggerMessagesCount] = message;
-							
-							gNetworkConnection->characterTriggerMessagesCount++;
-						}
+						pushCharacterTriggerMessage(message);
 					}
 					
 					break;
@@ -333,7 +1210,7 @@ void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
 				case NET_NAME_MESSAGE_TYPE:
 				{
 					Character *character = getCharacter(message.netNameRequest.characterID);
-					character->netName = message.netNameRequest.netName;
+					memcpy(character->netName, message.netNameRequest.netName, sizeof(character->netName));
 					break;
 				}
 				case START_GAME_MESSAGE_TYPE:
@@ -344,11 +1221,12 @@ void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
 					break;
 				case PONG_MESSAGE_TYPE:
 				{
-					uint32_t currentTicks = ZGGetTicks();
-					uint32_t halfPingTime = (uint32_t)((currentTicks - message.pongTimestamp) / 2.0f);
+					uint32_t halfPingTime = pongRoundTripTime(&message.pong) / 2000;
 					
 					if (gNetworkConnection->type == NETWORK_CLIENT_TYPE)
 					{
+						updateServerClock(&message.pong);
+						
 						const size_t capacity = sizeof(gNetworkConnection->recentServerHalfPings) / sizeof(*gNetworkConnection->recentServerHalfPings);
 						
 						gNetworkConnection->recentServerHalfPings[gNetworkConnection->recentServerHalfPingIndex % capacity] = halfPingTime;
@@ -410,10 +1288,18 @@ void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
 				}
 				case CHARACTER_MOVED_UPDATE_MESSAGE_TYPE:
 				{
-					uint32_t currentTicks = ZGGetTicks();
+					// Stamped by the network thread when it received the movement
+					uint32_t arrivalTicks = message.ticks;
+					updateMovementArrivalJitter(arrivalTicks);
 					
-					if (!gGameShouldReset && currentTicks >= gNetworkConnection->serverHalfPing)
+					if (!gGameShouldReset && arrivalTicks >= gNetworkConnection->serverHalfPing)
 					{
+						if (message.movedUpdate.inputSequence != 0 && gNetworkConnection->character != NULL && IDOfCharacter(gNetworkConnection->character) == message.movedUpdate.characterID)
+						{
+							inputAcknowledgement = message.movedUpdate;
+							receivedInputAcknowledgement = true;
+						}
+						
 						bool shouldSetCharacterPosition = false;
 						if (gNetworkConnection->serverHalfPing > 0)
 						{
@@ -423,18 +1309,11 @@ void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
 							newMovement.dead = message.movedUpdate.dead;
 							newMovement.direction = message.movedUpdate.direction;
 							newMovement.pointing_direction = message.movedUpdate.pointing_direction;
-							newMovement.ticks = currentTicks - gNetworkConnection->serverHalfPing;
+							newMovement.ticks = arrivalTicks - gNetworkConnection->serverHalfPing;
 							
 							uint8_t characterIndex = message.movedUpdate.characterID - 1;
 							
-							gNetworkConnection->characterMovements[characterIndex][gNetworkConnection->characterMovementCounts[characterIndex] % CHARACTER_MOVEMENTS_CAPACITY] = newMovement;
-							
-							if (gNetworkConnection->characterMovementCounts[characterIndex] == 0)
-							{
-								shouldSetCharacterPosition = true;
-							}
-							
-							gNetworkConnection->characterMovementCounts[characterIndex]++;
+							shouldSetCharacterPosition = pushCharacterMovement(&gNetworkConnection->characterMovementBuffers[characterIndex], newMovement);
 						}
 						else
 						{
@@ -478,8 +1357,11 @@ void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
 				case GAME_RESET_MESSAGE_TYPE:
 					gGameShouldReset = true;
 					
-					memset(gNetworkConnection->characterMovements, 0, sizeof(gNetworkConnection->characterMovements));
-					memset(gNetworkConnection->characterMovementCounts, 0, sizeof(gNetworkConnection->characterMovementCounts));
+					memset(gNetworkConnection->characterMovementBuffers, 0, sizeof(gNetworkConnection->characterMovementBuffers));
+					gNetworkConnection->lastMovementArrivalTime = 0;
+					
+					memset(gNetworkConnection->predictedInputs, 0, sizeof(gNetworkConnection->predictedInputs));
+					receivedInputAcknowledgement = false;
 					
 					gNetworkConnection->characterTriggerMessagesCount = 0;
 					
@@ -504,7 +1386,7 @@ void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
 						gNetworkConnection->character = &gBlueLightning;
 					}
 					
-					gNetworkConnection->character->netName = gUserNameString;
+					copyNetName(gNetworkConnection->character->netName, gUserNameString);
 					
 					gPinkBubbleGumInput.character = gNetworkConnection->character;
 					gRedRoverInput.character = gNetworkConnection->character;
@@ -526,9 +1408,12 @@ void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
 				case FIRST_CLIENT_RESPONSE_MESSAGE_TYPE:
 				{
 					Character *character = getCharacter(message.firstClientResponse.slotID);
-					character->netName = message.firstClientResponse.netName;
+					memcpy(character->netName, message.firstClientResponse.netName, sizeof(character->netName));
 					character->netState = NETWORK_PLAYING_STATE;
 					
+					gNetworkConnection->clientInputSequences[message.addressIndex] = 0;
+					gNetworkConnection->clientInputSteps[message.addressIndex] = 0;
+					
 					GameMessage messageBack;
 					messageBack.type = FIRST_DATA_TO_CLIENT_MESSAGE_TYPE;
 					messageBack.packetNumber = 0;
@@ -539,10 +1424,12 @@ void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
 					for (uint8_t characterIndex = RED_ROVER; characterIndex <= PINK_BUBBLE_GUM; characterIndex++)
 					{
 						Character *character = getCharacter(characterIndex);
-						messageBack.firstDataToClient.netNames[characterIndex - 1] = character->netName;
+						memcpy(messageBack.firstDataToClient.netNames[characterIndex - 1], character->netName, sizeof(character->netName));
 					}
 					
-					pushNetworkMessage(&gGameMessagesToNet, messageBack);
+					traceCreatedMessage(&messageBack);
+					queueOutgoingMessage(&gNetworkBuffers->gameMessagesToNet, &messageBack);
+					wakeNetworkThread(gNetworkBuffers);
 					
 					break;
 				}
@@ -550,127 +1437,144 @@ void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
 					break;
 			}
 		}
-		free(messagesToRead);
+		
+		// If we quit, the queue was already emptied
+		if (gNetworkConnection != NULL)
+		{
+			finishReadingNetworkMessages(&gNetworkBuffers->gameMessagesFromNet, messagesCount);
+		}
+	}
+	
+	// The network thread couldn't hand us a message without dropping it, so it quit rather than leave us out of sync
+	if (deliveryOverflowed && gNetworkConnection != NULL)
+	{
+		fprintf(stderr, "Error: fell too far behind the network thread, disconnecting\n");
+		closeNetworkConnection(window);
+	}
+	
+	if (gNetworkConnection != NULL && gNetworkConnection->type == NETWORK_CLIENT_TYPE && gNetworkConnection->character != NULL)
+	{
+		// Remember the direction our character moved in during the step that just finished
+		gNetworkConnection->predictedStepDirections[gNetworkConnection->predictedStep & (PREDICTED_STEPS_CAPACITY - 1)] = (uint8_t)gNetworkConnection->character->direction;
+		gNetworkConnection->predictedStep++;
+		
+		if (receivedInputAcknowledgement && !gGameShouldReset && CHARACTER_IS_ALIVE(gNetworkConnection->character) && !inputAcknowledgement.dead)
+		{
+			reconcilePredictedCharacter(gNetworkConnection->character, &inputAcknowledgement, timeDelta);
+		}
 	}
 	
 	if (gNetworkConnection != NULL && gNetworkConnection->type == NETWORK_CLIENT_TYPE)
 	{
-		uint32_t currentTime = ZGGetTicks();
+		uint32_t currentTime = networkTicks();
 		if (currentTime > 0)
 		{
-			uint32_t renderTime = currentTime - (uint32_t)(3 * gNetworkConnection->serverHalfPing);
+			// Render everything from the server as it was a little before the newest update we likely have of it
+			// The delay adapts to how regularly updates arrive rather than to the ping
+			gNetworkConnection->interpolationDelay = characterInterpolationDelay();
+			uint32_t renderTime = currentTime - gNetworkConnection->serverHalfPing - gNetworkConnection->interpolationDelay;
 			
-			for (uint32_t triggerMessageIndex = 0; triggerMessageIndex < gNetworkConnection->characterTriggerMessagesCount; triggerMessageIndex++)
+			while (gNetworkConnection->characterTriggerMessagesCount > 0 && renderTime >= gNetworkConnection->characterTriggerMessages[0].message.ticks)
 			{
-				GameMessage *message = &gNetworkConnection->characterTriggerMessages[triggerMessageIndex];
-				if (message->ticks != 0 && renderTime >= message->ticks)
+				CharacterTriggerMessage triggerMessage = popCharacterTriggerMessage();
+				GameMessage *message = &triggerMessage.message;
+				
+				if (message->type == CHARACTER_FIRED_UPDATE_MESSAGE_TYPE)
 				{
-					if (message->type == CHARACTER_FIRED_UPDATE_MESSAGE_TYPE)
-					{
-						uint8_t characterID = message->firedUpdate.characterID;
-						Character *character = getCharacter(characterID);
-						
-						character->pointing_direction = message->firedUpdate.direction;
-						prepareFiringCharacterWeapon(character, message->firedUpdate.x, message->firedUpdate.y, character->pointing_direction, 0.0f);
-					}
-					else if (message->type == COLOR_TILE_MESSAGE_TYPE)
+					uint8_t characterID = message->firedUpdate.characterID;
+					Character *character = getCharacter(characterID);
+					
+					character->pointing_direction = message->firedUpdate.direction;
+					prepareFiringCharacterWeapon(character, message->firedUpdate.x, message->firedUpdate.y, character->pointing_direction, 0.0f, 0);
+				}
+				else if (message->type == COLOR_TILE_MESSAGE_TYPE)
+				{
+					uint8_t characterID = message->colorTile.characterID;
+					uint8_t tileIndex = message->colorTile.tileIndex;
+					Character *character = getCharacter(characterID);
+					
+					gTiles[tileIndex].red = character->weap->red;
+					gTiles[tileIndex].green = character->weap->green;
+					gTiles[tileIndex].blue = character->weap->blue;
+					gTiles[tileIndex].coloredID = characterID;
+					
+					// Unless there's a prediction, make tile cracked immediately
+					if (gTiles[tileIndex].crackedTime == 0.0f)
 					{
-						uint8_t characterID = message->colorTile.characterID;
-						uint8_t tileIndex = message->colorTile.tileIndex;
-						Character *character = getCharacter(characterID);
-						
-						gTiles[tileIndex].red = character->weap->red;
-						gTiles[tileIndex].green = character->weap->green;
-						gTiles[tileIndex].blue = character->weap->blue;
-						gTiles[tileIndex].coloredID = characterID;
-						
-						// Unless there's a prediction, make tile cracked immediately
-						if (gTiles[tileIndex].crackedTime == 0.0f)
-						{
-							gTiles[tileIndex].cracked = true;
-						}
-						
-						// Clear this particular tile's predicted color regardless of who set it
-						clearPredictedColor(tileIndex);
-						
-						// Clear all of this character's predicted colors across the board
-						clearPredictedColorsForCharacter(characterID);
+						gTiles[tileIndex].cracked = true;
 					}
-					else if (message->type == TILE_FALLING_DOWN_MESSAGE_TYPE)
+					
+					// Clear this particular tile's predicted color regardless of who set it
+					clearPredictedColor(tileIndex);
+					
+					// Clear all of this character's predicted colors across the board
+					clearPredictedColorsForCharacter(characterID);
+				}
+				else if (message->type == TILE_FALLING_DOWN_MESSAGE_TYPE)
+				{
+					uint8_t tileIndex = message->fallingTile.tileIndex;
+					if (message->fallingTile.dead)
 					{
-						uint8_t tileIndex = message->fallingTile.tileIndex;
-						if (message->fallingTile.dead)
-						{
-							gTiles[tileIndex].isDead = true;
-						}
-						else
-						{
-							gTiles[tileIndex].state = false;
-						}
-						
-						gTiles[tileIndex].z -= OBJECT_FALLING_STEP;
-						
-						if (ZGWindowHasFocus(window) && gAudioEffectsFlag && gameState != GAME_STATE_PAUSED)
-						{
-							playTileFallingSound();
-						}
+						gTiles[tileIndex].isDead = true;
 					}
-					else if (message->type == RECOVER_TILE_MESSAGE_TYPE)
+					else
 					{
-						recoverDestroyedTile(message->recoverTile.tileIndex);
+						gTiles[tileIndex].state = false;
 					}
-					else if (message->type == CHARACTER_DIED_UPDATE_MESSAGE_TYPE)
+					
+					gTiles[tileIndex].z -= OBJECT_FALLING_STEP;
+					
+					if (gAudioEffectsFlag && gameState != GAME_STATE_PAUSED && ZGWindowHasFocus(window))
 					{
-						Character *character = getCharacter(message->diedUpdate.characterID);
-						character->lives = message->diedUpdate.characterLives;
-						
-						prepareCharactersDeath(character);
-						
-						decideWhetherToMakeAPlayerAWinner(character);
-						
-						character->z -= OBJECT_FALLING_STEP;
+						playTileFallingSound();
 					}
+				}
+				else if (message->type == RECOVER_TILE_MESSAGE_TYPE)
+				{
+					recoverDestroyedTile(message->recoverTile.tileIndex);
+				}
+				else if (message->type == CHARACTER_DIED_UPDATE_MESSAGE_TYPE)
+				{
+					Character *character = getCharacter(message->diedUpdate.characterID);
+					character->lives = message->diedUpdate.characterLives;
+					
+					prepareCharactersDeath(character);
+					
+					decideWhetherToMakeAPlayerAWinner(character);
 					
-					// Mark message as already visited
-					message->ticks = 0;
+					character->z -= OBJECT_FALLING_STEP;
 				}
 			}
 			
 			for (uint8_t characterID = RED_ROVER; characterID <= PINK_BUBBLE_GUM; characterID++)
 			{
-				uint8_t characterIndex = characterID - 1;
-
-				// Find the two points that will tell us where the client was 100ms ago?
-				uint32_t initialCount = gNetworkConnection->characterMovementCounts[characterIndex] < CHARACTER_MOVEMENTS_CAPACITY ? gNetworkConnection->characterMovementCounts[characterIndex] : CHARACTER_MOVEMENTS_CAPACITY;
-
-				if (initialCount > 0)
+				CharacterMovementBuffer *movementBuffer = &gNetworkConnection->characterMovementBuffers[characterID - 1];
+				CharacterMovement *movement = characterMovementAtTime(movementBuffer, renderTime);
+				if (movement == NULL)
 				{
-					uint32_t count = initialCount;
-					uint32_t characterMovementIndex = gNetworkConnection->characterMovementCounts[characterIndex] - 1;
-					uint32_t firstCharacterMovementIndex = characterMovementIndex;
-
-					while (count > 0)
+					continue;
+				}
+				
+				Character *character = getCharacter(characterID);
+				
+				if (movementBuffer->renderIndex + 1 < movementBuffer->count)
+				{
+					CharacterMovement previousMovement = *movement;
+					CharacterMovement nextMovement = movementBuffer->movements[(movementBuffer->renderIndex + 1) & (CHARACTER_MOVEMENTS_CAPACITY - 1)];
+					
+					// Our own character is predicted while it's alive, but still dies and revives when the server says so
+					if (character == gNetworkConnection->character && !previousMovement.dead && CHARACTER_IS_ALIVE(character))
 					{
-						uint32_t wrappedCharacterMovementIndex = characterMovementIndex % CHARACTER_MOVEMENTS_CAPACITY;
-
-						CharacterMovement previousMovement = gNetworkConnection->characterMovements[characterIndex][wrappedCharacterMovementIndex];
-
-						if (previousMovement.ticks <= renderTime)
-						{
-							if (characterMovementIndex != firstCharacterMovementIndex)
-							{
-								CharacterMovement nextMovement = gNetworkConnection->characterMovements[characterIndex][(characterMovementIndex + 1) % CHARACTER_MOVEMENTS_CAPACITY];
-
-								Character *character = getCharacter(characterID);
-								
-								interpolateCharacter(character, &previousMovement, &nextMovement, renderTime);
-							}
-							break;
-						}
-
-						characterMovementIndex--;
-						count--;
+						continue;
 					}
+					
+					interpolateCharacter(character, &previousMovement, &nextMovement, renderTime);
+				}
+				else if (character != gNetworkConnection->character && renderTime - movement->ticks > MAX_EXTRAPOLATION_TIME)
+				{
+					// The next movement is late, so the character has been extrapolated by moving on its own since the latest one
+					// Stop it before it goes too far; it's brought back in line once movements arrive again
+					character->direction = NO_DIRECTION;
 				}
 			}
 		}
@@ -731,139 +1635,3584 @@ void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState)
 	}
 }
 
-static void sendData(socket_t socket, void *data, size_t size, SocketAddress *address)
+// The network conditioner emulates a bad network by holding back, dropping, duplicating and reordering outgoing datagrams
+// It is meant for testing netcode over loopback; configure both the server and clients to impair both directions
+// Settings are shared by every network thread and can be changed from the main thread at any time
+// Rates are stored in hundredths of a percent
+static uint32_t gNetworkConditionerSettings[NETWORK_CONDITIONER_SETTINGS_COUNT];
+
+typedef struct
 {
+	char buffer[MAX_PACKET_SIZE];
+	size_t size;
+	SocketAddress address;
+	socket_t socket;
+	uint32_t dueTime;
+} ConditionedDatagram;
+
+// Datagrams held back by the current network thread, kept in the order they're due in
+typedef struct
+{
+	ConditionedDatagram datagrams[NETWORK_CONDITIONER_CAPACITY];
+	uint32_t count;
+	// Datagrams that aren't picked to be reordered are never due before the ones sent ahead of them, even with jitter
+	uint32_t latestInOrderDueTime;
+	
+	// Decisions only depend on the seed and the order datagrams are sent in, so seeded runs are reproducible
+	uint32_t seed;
+	uint32_t randomState;
+} NetworkConditioner;
+
+static ZG_THREAD_LOCAL NetworkConditioner *gNetworkConditioner;
+
+typedef struct
+{
+	const char *name;
+	float settings[NETWORK_CONDITIONER_SETTINGS_COUNT - 1];
+} NetworkConditionerProfile;
+
+// Latency (ms), jitter (ms), loss (%), duplication (%), reordering (%)
+static const NetworkConditionerProfile gNetworkConditionerProfiles[] =
+{
+	{"off", {0.0f, 0.0f, 0.0f, 0.0f, 0.0f}},
+	{"lan", {1.0f, 1.0f, 0.0f, 0.0f, 0.0f}},
+	{"broadband", {30.0f, 5.0f, 0.5f, 0.0f, 0.5f}},
+	{"wifi", {15.0f, 10.0f, 1.0f, 0.1f, 1.0f}},
+	{"mobile", {90.0f, 30.0f, 2.0f, 0.5f, 2.0f}},
+	{"congested", {150.0f, 60.0f, 5.0f, 1.0f, 5.0f}}
+};
+
+static const char *gNetworkConditionerSettingNames[NETWORK_CONDITIONER_SETTINGS_COUNT] = {"latency", "jitter", "loss", "duplicate", "reorder", "seed"};
+
+static bool isNetworkConditionerRate(NetworkConditionerSetting setting)
+{
+	return setting == NETWORK_CONDITIONER_LOSS || setting == NETWORK_CONDITIONER_DUPLICATE || setting == NETWORK_CONDITIONER_REORDER;
+}
+
+void setNetworkConditionerSetting(NetworkConditionerSetting setting, float value)
+{
+	if (value < 0.0f)
+	{
+		value = 0.0f;
+	}
+	
+	uint32_t storedValue;
+	if (isNetworkConditionerRate(setting))
+	{
+		storedValue = (uint32_t)(((value > 100.0f) ? 100.0f : value) * 100.0f + 0.5f);
+	}
+	else
+	{
+		storedValue = (uint32_t)value;
+	}
+	
+	storeReleaseUInt32(&gNetworkConditionerSettings[setting], storedValue);
+}
+
+float networkConditionerSetting(NetworkConditionerSetting setting)
+{
+	uint32_t storedValue = loadAcquireUInt32(&gNetworkConditionerSettings[setting]);
+	return isNetworkConditionerRate(setting) ? (float)storedValue / 100.0f : (float)storedValue;
+}
+
+// Profiles are a comma separated list of a preset name and/or setting=value pairs applied in order
+bool configureNetworkConditioner(const char *profile)
+{
+	char profileCopy[256] = {0};
+	strncpy(profileCopy, profile, sizeof(profileCopy) - 1);
+	
+	bool validProfile = true;
+	for (char *token = strtok(profileCopy, ", "); token != NULL; token = strtok(NULL, ", "))
+	{
+		char *separator = strchr(token, '=');
+		if (separator == NULL)
+		{
+			bool foundProfile = false;
+			for (size_t profileIndex = 0; profileIndex < sizeof(gNetworkConditionerProfiles) / sizeof(gNetworkConditionerProfiles[0]); profileIndex++)
+			{
+				if (strcmp(token, gNetworkConditionerProfiles[profileIndex].name) == 0)
+				{
+					for (int setting = 0; setting < NETWORK_CONDITIONER_SEED; setting++)
+					{
+						setNetworkConditionerSetting((NetworkConditionerSetting)setting, gNetworkConditionerProfiles[profileIndex].settings[setting]);
+					}
+					foundProfile = true;
+					break;
+				}
+			}
+			
+			if (!foundProfile)
+			{
+				fprintf(stderr, "Unknown network conditioner profile: %s\n", token);
+				validProfile = false;
+			}
+			continue;
+		}
+		
+		*separator = '\0';
+		
+		bool foundSetting = false;
+		for (int setting = 0; setting < NETWORK_CONDITIONER_SETTINGS_COUNT; setting++)
+		{
+			if (strcmp(token, gNetworkConditionerSettingNames[setting]) == 0)
+			{
+				setNetworkConditionerSetting((NetworkConditionerSetting)setting, (float)atof(separator + 1));
+				foundSetting = true;
+				break;
+			}
+		}
+		
+		if (!foundSetting)
+		{
+			fprintf(stderr, "Unknown network conditioner setting: %s\n", token);
+			validProfile = false;
+		}
+	}
+	
+	fprintf(stderr, "Network conditioner: latency %.0f ms, jitter %.0f ms, loss %.2f%%, duplicate %.2f%%, reorder %.2f%%, seed %.0f\n", networkConditionerSetting(NETWORK_CONDITIONER_LATENCY), networkConditionerSetting(NETWORK_CONDITIONER_JITTER), networkConditionerSetting(NETWORK_CONDITIONER_LOSS), networkConditionerSetting(NETWORK_CONDITIONER_DUPLICATE), networkConditionerSetting(NETWORK_CONDITIONER_REORDER), networkConditionerSetting(NETWORK_CONDITIONER_SEED));
+	
+	return validProfile;
+}
+
+// xorshift32, so the conditioner doesn't disturb the game's own random number generator
+static uint32_t nextNetworkConditionerRandom(NetworkConditioner *conditioner)
+{
+	uint32_t state = conditioner->randomState;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	conditioner->randomState = state;
+	return state;
+}
+
+static bool networkConditionerChance(NetworkConditioner *conditioner, uint32_t rate)
+{
+	// Always draw a number so that changing one rate doesn't shift the decisions made for the others
+	uint32_t randomValue = nextNetworkConditionerRandom(conditioner) % 10000;
+	return randomValue < rate;
+}
+
+static void sendDataImmediately(socket_t socket, void *data, size_t size, SocketAddress *address);
+
+static void holdConditionedDatagram(NetworkConditioner *conditioner, socket_t socket, const void *data, size_t size, SocketAddress *address, uint32_t currentTime, uint32_t latency, uint32_t jitter, bool reorder)
+{
+	int32_t delay = (int32_t)latency;
+	if (jitter > 0)
+	{
+		delay += (int32_t)(nextNetworkConditionerRandom(conditioner) % (2 * jitter + 1)) - (int32_t)jitter;
+	}
+	if (reorder)
+	{
+		delay += NETWORK_CONDITIONER_REORDER_DELAY;
+	}
+	
+	if (conditioner->count >= NETWORK_CONDITIONER_CAPACITY || size > MAX_PACKET_SIZE)
+	{
+		// Like a router with a full queue
+		return;
+	}
+	
+	uint32_t dueTime = currentTime + (uint32_t)(delay > 0 ? delay : 0);
+	if (!reorder)
+	{
+		if (conditioner->count > 0 && (int32_t)(dueTime - conditioner->latestInOrderDueTime) < 0)
+		{
+			dueTime = conditioner->latestInOrderDueTime;
+		}
+		conditioner->latestInOrderDueTime = dueTime;
+	}
+	
+	// Insert after every datagram due at the same time or earlier so ties keep the order they were sent in
+	uint32_t insertionIndex = conditioner->count;
+	while (insertionIndex > 0 && (int32_t)(dueTime - conditioner->datagrams[insertionIndex - 1].dueTime) < 0)
+	{
+		insertionIndex--;
+	}
+	memmove(&conditioner->datagrams[insertionIndex + 1], &conditioner->datagrams[insertionIndex], (conditioner->count - insertionIndex) * sizeof(*conditioner->datagrams));
+	
+	ConditionedDatagram *datagram = &conditioner->datagrams[insertionIndex];
+	memcpy(datagram->buffer, data, size);
+	datagram->size = size;
+	datagram->address = *address;
+	datagram->socket = socket;
+	datagram->dueTime = dueTime;
+	conditioner->count++;
+}
+
+// Sends the held back datagrams that are due and returns how long until the next one is, capped to the timeout
+static uint32_t releaseConditionedDatagrams(uint32_t timeoutMilliseconds)
+{
+	NetworkConditioner *conditioner = gNetworkConditioner;
+	if (conditioner == NULL || conditioner->count == 0)
+	{
+		return timeoutMilliseconds;
+	}
+	
+	uint32_t currentTime = ZGGetTicks();
+	
+	// The datagrams are sorted by when they're due, so the due ones are all at the front
+	uint32_t releasedCount = 0;
+	while (releasedCount < conditioner->count && (int32_t)(conditioner->datagrams[releasedCount].dueTime - currentTime) <= 0)
+	{
+		ConditionedDatagram *datagram = &conditioner->datagrams[releasedCount];
+		sendDataImmediately(datagram->socket, datagram->buffer, datagram->size, &datagram->address);
+		releasedCount++;
+	}
+	
+	if (releasedCount > 0)
+	{
+		conditioner->count -= releasedCount;
+		memmove(&conditioner->datagrams[0], &conditioner->datagrams[releasedCount], conditioner->count * sizeof(*conditioner->datagrams));
+	}
+	
+	if (conditioner->count == 0)
+	{
+		return timeoutMilliseconds;
+	}
+	
+	uint32_t timeUntilDue = conditioner->datagrams[0].dueTime - currentTime;
+	return (timeUntilDue < timeoutMilliseconds) ? timeUntilDue : timeoutMilliseconds;
+}
+
+// Returns true if the conditioner took over sending (or dropping) the datagram
+static bool conditionOutgoingDatagram(socket_t socket, const void *data, size_t size, SocketAddress *address)
+{
+	uint32_t latency = loadAcquireUInt32(&gNetworkConditionerSettings[NETWORK_CONDITIONER_LATENCY]);
+	uint32_t jitter = loadAcquireUInt32(&gNetworkConditionerSettings[NETWORK_CONDITIONER_JITTER]);
+	uint32_t lossRate = loadAcquireUInt32(&gNetworkConditionerSettings[NETWORK_CONDITIONER_LOSS]);
+	uint32_t duplicateRate = loadAcquireUInt32(&gNetworkConditionerSettings[NETWORK_CONDITIONER_DUPLICATE]);
+	uint32_t reorderRate = loadAcquireUInt32(&gNetworkConditionerSettings[NETWORK_CONDITIONER_REORDER]);
+	uint32_t seed = loadAcquireUInt32(&gNetworkConditionerSettings[NETWORK_CONDITIONER_SEED]);
+	
+	if (latency == 0 && jitter == 0 && lossRate == 0 && duplicateRate == 0 && reorderRate == 0)
+	{
+		return false;
+	}
+	
+	if (gNetworkConditioner == NULL)
+	{
+		gNetworkConditioner = calloc(1, sizeof(*gNetworkConditioner));
+		// Force a reseed below
+		gNetworkConditioner->seed = ~seed;
+	}
+	
+	NetworkConditioner *conditioner = gNetworkConditioner;
+	if (conditioner->seed != seed)
+	{
+		conditioner->seed = seed;
+		// xorshift needs a non-zero state
+		conditioner->randomState = seed * 2654435761u + 0x9E3779B9u;
+		if (conditioner->randomState == 0)
+		{
+			conditioner->randomState = 1;
+		}
+	}
+	
+	// Datagrams are only released when we send or wait, and a busy network thread may not wait for a while
+	releaseConditionedDatagrams(0);
+	
+	bool lose = networkConditionerChance(conditioner, lossRate);
+	bool duplicate = networkConditionerChance(conditioner, duplicateRate);
+	bool reorder = networkConditionerChance(conditioner, reorderRate);
+	
+	if (!lose)
+	{
+		uint32_t currentTime = ZGGetTicks();
+		
+		holdConditionedDatagram(conditioner, socket, data, size, address, currentTime, latency, jitter, reorder);
+		if (duplicate)
+		{
+			holdConditionedDatagram(conditioner, socket, data, size, address, currentTime, latency, jitter, false);
+		}
+	}
+	
+	return true;
+}
+
+// Called when a network thread exits so that datagrams it held back (like a quit) still go out
+static void finishNetworkConditioner(void)
+{
+	while (gNetworkConditioner != NULL && gNetworkConditioner->count > 0)
+	{
+		ZGDelay(releaseConditionedDatagrams(NETWORK_POLL_DELAY));
+	}
+	
+	free(gNetworkConditioner);
+	gNetworkConditioner = NULL;
+}
+
+typedef struct
+{
+	FILE *file;
+	uint32_t startTime;
+	SocketAddress peerAddresses[NETWORK_CAPTURE_MAX_PEERS];
+	uint8_t numberOfPeers;
+} NetworkCapture;
+
+// Capture of the datagrams of the current network thread, if it's capturing them
+static ZG_THREAD_LOCAL NetworkCapture *gNetworkCapture;
+
+struct NetworkReplay
+{
+	// Only used by the network thread once it's created
+	FILE *file;
+	bool reachedEnd;
+	uint32_t handledTime;
+	
+	// Network ticks of the captured session when the capture started
+	uint32_t captureStartTime;
+	
+	// Next received datagram in the capture, read ahead so we know when it's due
+	uint32_t nextTime;
+	uint16_t nextSize;
+	uint8_t nextPeerIndex;
+	char nextBuffer[MAX_PACKET_SIZE];
+	
+	// Written by the main thread, datagrams captured up to this time may be handled
+	uint32_t releasedTime;
+	// Written by the network thread once it has handled every datagram up to this time
+	uint32_t replayedTime;
+	// Written by the network thread after it handles the last datagram, or when it exits
+	uint8_t finished;
+	uint8_t stopped;
+};
+
+// Called when a network thread starts
+static void startNetworkCapture(void)
+{
+	if (gNetworkCapturePath == NULL || gNetworkConnection->replay != NULL)
+	{
+		return;
+	}
+	
+	ZGLockMutex(gNetworkStatsMutex);
+	uint32_t captureNumber = gNetworkCaptureCount;
+	gNetworkCaptureCount++;
+	ZGUnlockMutex(gNetworkStatsMutex);
+	
+	// Restarted games and other matches don't overwrite the first capture
+	char path[1024];
+	if (captureNumber == 0)
+	{
+		snprintf(path, sizeof(path), "%s", gNetworkCapturePath);
+	}
+	else
+	{
+		snprintf(path, sizeof(path), "%s.%u", gNetworkCapturePath, captureNumber);
+	}
+	
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Failed to open network capture file %s\n", path);
+		return;
+	}
+	
+	uint8_t header[NETWORK_CAPTURE_HEADER_SIZE];
+	memcpy(header, NETWORK_CAPTURE_MAGIC, 4);
+	header[4] = NETWORK_CAPTURE_FORMAT_VERSION;
+	header[5] = NETWORK_VERSION;
+	header[6] = (uint8_t)gNetworkConnection->type;
+	header[7] = (gNetworkConnection->type == NETWORK_SERVER_TYPE) ? gNetworkConnection->numberOfPlayersToWaitFor : 0;
+	header[8] = (uint8_t)gCharacterLives;
+	
+	uint32_t startTime = ZGGetTicks();
+	memcpy(header + 9, &startTime, sizeof(startTime));
+	
+	fwrite(header, sizeof(header), 1, file);
+	
+	gNetworkCapture = calloc(1, sizeof(*gNetworkCapture));
+	gNetworkCapture->file = file;
+	gNetworkCapture->startTime = startTime;
+}
+
+static void captureDatagram(bool sent, SocketAddress *address, const void *data, size_t size)
+{
+	NetworkCapture *capture = gNetworkCapture;
+	if (capture == NULL)
+	{
+		return;
+	}
+	
+	uint8_t peerIndex = NETWORK_CAPTURE_UNKNOWN_PEER;
+	for (uint8_t index = 0; index < capture->numberOfPeers; index++)
+	{
+		if (memcmp(address, &capture->peerAddresses[index], sizeof(*address)) == 0)
+		{
+			peerIndex = index;
+			break;
+		}
+	}
+	
+	if (peerIndex == NETWORK_CAPTURE_UNKNOWN_PEER && capture->numberOfPeers < NETWORK_CAPTURE_MAX_PEERS)
+	{
+		peerIndex = capture->numberOfPeers;
+		capture->peerAddresses[peerIndex] = *address;
+		capture->numberOfPeers++;
+	}
+	
+	uint32_t time = ZGGetTicks() - capture->startTime;
+	uint16_t datagramSize = (uint16_t)size;
+	
+	uint8_t recordHeader[NETWORK_CAPTURE_RECORD_HEADER_SIZE];
+	memcpy(recordHeader, &time, sizeof(time));
+	recordHeader[4] = sent ? NETWORK_CAPTURE_SENT_FLAG : 0;
+	recordHeader[5] = peerIndex;
+	memcpy(recordHeader + 6, &datagramSize, sizeof(datagramSize));
+	
+	fwrite(recordHeader, sizeof(recordHeader), 1, capture->file);
+	fwrite(data, size, 1, capture->file);
+}
+
+// Called when a network thread exits
+static void finishNetworkCapture(void)
+{
+	if (gNetworkCapture != NULL)
+	{
+		fclose(gNetworkCapture->file);
+		free(gNetworkCapture);
+		gNetworkCapture = NULL;
+	}
+	
+	if (gNetworkConnection->replay != NULL)
+	{
+		storeReleaseUInt8(&gNetworkConnection->replay->stopped, 1);
+	}
+}
+
+// Returns false at the end of the capture or if the record is damaged
+static bool readNetworkCaptureRecord(FILE *file, uint32_t *time, uint8_t *flags, uint8_t *peerIndex, uint16_t *size, char *buffer)
+{
+	uint8_t recordHeader[NETWORK_CAPTURE_RECORD_HEADER_SIZE];
+	if (fread(recordHeader, sizeof(recordHeader), 1, file) != 1)
+	{
+		return false;
+	}
+	
+	memcpy(time, recordHeader, sizeof(*time));
+	*flags = recordHeader[4];
+	*peerIndex = recordHeader[5];
+	memcpy(size, recordHeader + 6, sizeof(*size));
+	
+	if (*size > MAX_PACKET_SIZE)
+	{
+		return false;
+	}
+	
+	return (*size == 0 || fread(buffer, *size, 1, file) == 1);
+}
+
+// Skips over datagrams that were sent, since only received ones are handled again
+static void readNextReplayedDatagram(NetworkReplay *replay)
+{
+	uint8_t flags = 0;
+	while (readNetworkCaptureRecord(replay->file, &replay->nextTime, &flags, &replay->nextPeerIndex, &replay->nextSize, replay->nextBuffer))
+	{
+		if ((flags & NETWORK_CAPTURE_SENT_FLAG) == 0 && replay->nextPeerIndex != NETWORK_CAPTURE_UNKNOWN_PEER)
+		{
+			return;
+		}
+	}
+	
+	replay->reachedEnd = true;
+}
+
+NetworkReplay *openNetworkReplay(const char *path, NetworkCaptureInfo *info)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Failed to open network capture file %s\n", path);
+		return NULL;
+	}
+	
+	uint8_t header[NETWORK_CAPTURE_HEADER_SIZE];
+	if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, NETWORK_CAPTURE_MAGIC, 4) != 0 || header[4] != NETWORK_CAPTURE_FORMAT_VERSION)
+	{
+		fprintf(stderr, "%s is not a network capture\n", path);
+		fclose(file);
+		return NULL;
+	}
+	
+	// The wire format changes between network versions
+	if (header[5] != NETWORK_VERSION)
+	{
+		fprintf(stderr, "%s was captured with network version %d, but this is version %d\n", path, header[5], NETWORK_VERSION);
+		fclose(file);
+		return NULL;
+	}
+	
+	memset(info, 0, sizeof(*info));
+	info->type = header[6];
+	info->numberOfPlayersToWaitFor = header[7];
+	info->characterLives = header[8];
+	
+	uint32_t captureStartTime = 0;
+	memcpy(&captureStartTime, header + 9, sizeof(captureStartTime));
+	
+	// Go through the capture once up front to know how much there is to replay
+	long datagramsOffset = ftell(file);
+	
+	char buffer[MAX_PACKET_SIZE];
+	uint32_t time = 0;
+	uint8_t flags = 0;
+	uint8_t peerIndex = 0;
+	uint16_t size = 0;
+	while (readNetworkCaptureRecord(file, &time, &flags, &peerIndex, &size, buffer))
+	{
+		if ((flags & NETWORK_CAPTURE_SENT_FLAG) != 0)
+		{
+			info->datagramsSent++;
+		}
+		else
+		{
+			info->datagramsReceived++;
+		}
+		info->duration = time;
+	}
+	
+	fseek(file, datagramsOffset, SEEK_SET);
+	
+	NetworkReplay *replay = calloc(1, sizeof(*replay));
+	replay->file = file;
+	replay->captureStartTime = captureStartTime;
+	readNextReplayedDatagram(replay);
+	
+	return replay;
+}
+
+void closeNetworkReplay(NetworkReplay *replay)
+{
+	fclose(replay->file);
+	free(replay);
+}
+
+void advanceNetworkReplay(NetworkReplay *replay, uint32_t replayTime)
+{
+	storeReleaseUInt32(&replay->releasedTime, replayTime);
+	wakeNetworkThread(gNetworkBuffers);
+	
+	while (loadAcquireUInt32(&replay->replayedTime) != replayTime && loadAcquireUInt8(&replay->stopped) == 0)
+	{
+		ZGDelay(0);
+	}
+}
+
+bool networkReplayFinished(NetworkReplay *replay)
+{
+	return loadAcquireUInt8(&replay->finished) != 0 || loadAcquireUInt8(&replay->stopped) != 0;
+}
+
+// Whether the main thread has let us handle the next captured datagram yet
+// If it hasn't, everything it let us handle was received, so remember that up to when we're done
+static bool hasReplayedDatagram(NetworkReplay *replay)
+{
+	uint32_t releasedTime = loadAcquireUInt32(&replay->releasedTime);
+	if (!replay->reachedEnd && replay->nextTime <= releasedTime)
+	{
+		return true;
+	}
+	
+	replay->handledTime = releasedTime;
+	return false;
+}
+
+// Only to be called after hasReplayedDatagram() returns true
+static size_t readReplayedDatagram(NetworkReplay *replay, char *buffer, SocketAddress *address)
+{
+	size_t size = replay->nextSize;
+	memcpy(buffer, replay->nextBuffer, size);
+	
+	// Peers get made up addresses that are only used to tell them apart
+	memset(address, 0, sizeof(*address));
+	address->sa_in.sin_family = AF_INET;
+	address->sa_in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address->sa_in.sin_port = htons((uint16_t)(replay->nextPeerIndex + 1));
+	
+	readNextReplayedDatagram(replay);
+	
+	return size;
+}
+
+// Called by a network thread after it handles the datagrams it received in a pass
+static void publishReplayProgress(void)
+{
+	NetworkReplay *replay = gNetworkConnection->replay;
+	if (replay == NULL)
+	{
+		return;
+	}
+	
+	if (replay->reachedEnd)
+	{
+		storeReleaseUInt8(&replay->finished, 1);
+	}
+	storeReleaseUInt32(&replay->replayedTime, replay->handledTime);
+}
+
+// Backends fill these in; a connection's socket is passed along as the index of its endpoint
+struct NetworkTransport
+{
+	void (*attachPtr)(NetworkTransport *, NetworkConnection *);
+	// Sends a datagram without blocking, and like UDP it may be dropped if the receiver isn't keeping up
+	void (*sendDatagramPtr)(NetworkTransport *, socket_t, const void *, size_t, SocketAddress *);
+	// Reads a datagram without blocking and returns its size, or -1 if none is pending
+	int (*receiveDatagramPtr)(NetworkTransport *, socket_t, void *, size_t, SocketAddress *, uint64_t *);
+	bool (*hasPendingDatagramPtr)(NetworkTransport *, socket_t);
+	void (*destroyPtr)(NetworkTransport *);
+	
+	// Set for transports whose connections share a clock that only moves when the transport is stepped, in milliseconds
+	bool stepped;
+	uint32_t steppedTicks;
+};
+
+// Transport of the connection the calling thread runs, or NULL if it uses sockets
+static NetworkTransport *currentNetworkTransport(void)
+{
+	return (gNetworkConnection != NULL) ? gNetworkConnection->transport : NULL;
+}
+
+uint32_t networkTicks(void)
+{
+	NetworkReplay *replay = (gNetworkConnection != NULL) ? gNetworkConnection->replay : NULL;
+	if (replay != NULL)
+	{
+		return replay->captureStartTime + loadAcquireUInt32(&replay->releasedTime);
+	}
+	
+	NetworkTransport *transport = currentNetworkTransport();
+	if (transport != NULL && transport->stepped)
+	{
+		return loadAcquireUInt32(&transport->steppedTicks);
+	}
+	
+	return ZGGetTicks();
+}
+
+uint64_t networkMicroTicks(void)
+{
+	NetworkReplay *replay = (gNetworkConnection != NULL) ? gNetworkConnection->replay : NULL;
+	NetworkTransport *transport = currentNetworkTransport();
+	if (replay != NULL || (transport != NULL && transport->stepped))
+	{
+		return (uint64_t)networkTicks() * 1000;
+	}
+	
+	return ZGGetNanoTicks() / 1000;
+}
+
+static void sendDataImmediately(socket_t socket, void *data, size_t size, SocketAddress *address)
+{
+	NetworkTransport *transport = currentNetworkTransport();
+	if (transport != NULL)
+	{
+		transport->sendDatagramPtr(transport, socket, data, size, address);
+		return;
+	}
+	
 	// Don't use sa_len to get the size because it could not be portable
 	if (address->sa.sa_family == AF_INET)
 	{
-		sendto(socket, data, (socket_size_t)size, 0, &address->sa, sizeof(address->sa_in));
+		sendto(socket, data, (socket_size_t)size, 0, &address->sa, sizeof(address->sa_in));
+	}
+	else if (address->sa.sa_family == AF_INET6)
+	{
+		sendto(socket, data, (socket_size_t)size, 0, &address->sa, sizeof(address->sa_in6));
+	}
+}
+
+static void sendData(socket_t socket, void *data, size_t size, SocketAddress *address)
+{
+	captureDatagram(true, address, data, size);
+	
+	if (gNetworkConnection != NULL && gNetworkConnection->replay != NULL)
+	{
+		return;
+	}
+	
+	if (!conditionOutgoingDatagram(socket, data, size, address))
+	{
+		sendDataImmediately(socket, data, size, address);
+	}
+}
+
+// Asks the kernel to stamp datagrams with when they arrived, so time spent waiting to be read isn't counted in pings
+static void enableReceiveTimestamps(socket_t socket)
+{
+#if defined(SO_TIMESTAMPNS)
+	int enabled = 1;
+	if (setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPNS, &enabled, sizeof(enabled)) == -1)
+	{
+		fprintf(stderr, "setsockopt() failed to enable receive timestamps: %d - %s\n", errno, strerror(errno));
+	}
+#else
+	(void)socket;
+#endif
+}
+
+#if defined(SO_TIMESTAMPNS)
+#define RECEIVE_TIMESTAMP_CONTROL_SIZE CMSG_SPACE(sizeof(struct timespec))
+
+// When a datagram arrived by networkMicroTicks(), or the current time if the kernel didn't stamp it
+static uint64_t receiveTimestamp(struct msghdr *messageHeader)
+{
+	uint64_t currentTime = networkMicroTicks();
+	
+	for (struct cmsghdr *controlMessage = CMSG_FIRSTHDR(messageHeader); controlMessage != NULL; controlMessage = CMSG_NXTHDR(messageHeader, controlMessage))
+	{
+		if (controlMessage->cmsg_level == SOL_SOCKET && controlMessage->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			struct timespec arrivalTime;
+			memcpy(&arrivalTime, CMSG_DATA(controlMessage), sizeof(arrivalTime));
+			
+			// The kernel stamps by the wall clock, so only how long ago the datagram arrived carries over to our clock
+			struct timespec wallTime;
+			clock_gettime(CLOCK_REALTIME, &wallTime);
+			
+			int64_t age = ((int64_t)wallTime.tv_sec - (int64_t)arrivalTime.tv_sec) * 1000000 + ((int64_t)wallTime.tv_nsec - (int64_t)arrivalTime.tv_nsec) / 1000;
+			if (age >= 0 && (uint64_t)age <= currentTime)
+			{
+				return currentTime - (uint64_t)age;
+			}
+			break;
+		}
+	}
+	
+	return currentTime;
+}
+#endif
+
+#if PLATFORM_WINDOWS
+static int
+#else
+static ssize_t
+#endif
+receiveData(socket_t socket, void *buffer, size_t length, SocketAddress *address, uint64_t *receiveTime)
+{
+	memset(address, 0, sizeof(*address));
+	
+	NetworkTransport *transport = currentNetworkTransport();
+	if (transport != NULL)
+	{
+		return transport->receiveDatagramPtr(transport, socket, buffer, length, address, receiveTime);
+	}
+	
+#if defined(SO_TIMESTAMPNS)
+	struct iovec messageVector;
+	messageVector.iov_base = buffer;
+	messageVector.iov_len = length;
+	
+	char controlBuffer[RECEIVE_TIMESTAMP_CONTROL_SIZE];
+	
+	struct msghdr messageHeader;
+	memset(&messageHeader, 0, sizeof(messageHeader));
+	messageHeader.msg_name = &address->sa;
+	messageHeader.msg_namelen = sizeof(*address);
+	messageHeader.msg_iov = &messageVector;
+	messageHeader.msg_iovlen = 1;
+	messageHeader.msg_control = controlBuffer;
+	messageHeader.msg_controllen = sizeof(controlBuffer);
+	
+	ssize_t numberOfBytes = recvmsg(socket, &messageHeader, 0);
+	*receiveTime = receiveTimestamp(&messageHeader);
+	return numberOfBytes;
+#else
+	socklen_t addressLength = sizeof(*address);
+	*receiveTime = networkMicroTicks();
+	return recvfrom(socket, buffer, (socket_size_t)length, 0, &address->sa, &addressLength);
+#endif
+}
+
+// Datagrams the server receives or sends together in one system call where batched calls are available
+typedef struct
+{
+	char buffers[DATAGRAM_BATCH_CAPACITY][MAX_PACKET_SIZE];
+	size_t sizes[DATAGRAM_BATCH_CAPACITY];
+	SocketAddress addresses[DATAGRAM_BATCH_CAPACITY];
+	// When each received datagram arrived by networkMicroTicks()
+	uint64_t receiveTimes[DATAGRAM_BATCH_CAPACITY];
+	uint32_t count;
+} DatagramBatch;
+
+#if PLATFORM_LINUX
+static socklen_t socketAddressLength(SocketAddress *address)
+{
+	return (address->sa.sa_family == AF_INET6) ? sizeof(address->sa_in6) : sizeof(address->sa_in);
+}
+#endif
+
+// Reads as many pending datagrams as fit in the batch without blocking and returns how many were read
+static uint32_t receiveDatagrams(socket_t socket, DatagramBatch *batch)
+{
+	batch->count = 0;
+	
+	NetworkTransport *transport = currentNetworkTransport();
+	if (transport != NULL)
+	{
+		while (batch->count < DATAGRAM_BATCH_CAPACITY)
+		{
+			int numberOfBytes = transport->receiveDatagramPtr(transport, socket, batch->buffers[batch->count], sizeof(batch->buffers[batch->count]), &batch->addresses[batch->count], &batch->receiveTimes[batch->count]);
+			if (numberOfBytes == -1)
+			{
+				break;
+			}
+			
+			batch->sizes[batch->count] = (size_t)numberOfBytes;
+			batch->count++;
+		}
+		
+		return batch->count;
+	}
+	
+#if PLATFORM_LINUX
+	struct mmsghdr messageHeaders[DATAGRAM_BATCH_CAPACITY];
+	struct iovec messageVectors[DATAGRAM_BATCH_CAPACITY];
+	memset(messageHeaders, 0, sizeof(messageHeaders));
+	
+#if defined(SO_TIMESTAMPNS)
+	char controlBuffers[DATAGRAM_BATCH_CAPACITY][RECEIVE_TIMESTAMP_CONTROL_SIZE];
+#endif
+	
+	for (uint32_t datagramIndex = 0; datagramIndex < DATAGRAM_BATCH_CAPACITY; datagramIndex++)
+	{
+		messageVectors[datagramIndex].iov_base = batch->buffers[datagramIndex];
+		messageVectors[datagramIndex].iov_len = sizeof(batch->buffers[datagramIndex]);
+		
+		memset(&batch->addresses[datagramIndex], 0, sizeof(batch->addresses[datagramIndex]));
+		messageHeaders[datagramIndex].msg_hdr.msg_name = &batch->addresses[datagramIndex].sa;
+		messageHeaders[datagramIndex].msg_hdr.msg_namelen = sizeof(batch->addresses[datagramIndex]);
+		messageHeaders[datagramIndex].msg_hdr.msg_iov = &messageVectors[datagramIndex];
+		messageHeaders[datagramIndex].msg_hdr.msg_iovlen = 1;
+#if defined(SO_TIMESTAMPNS)
+		messageHeaders[datagramIndex].msg_hdr.msg_control = controlBuffers[datagramIndex];
+		messageHeaders[datagramIndex].msg_hdr.msg_controllen = sizeof(controlBuffers[datagramIndex]);
+#endif
+	}
+	
+	int numberOfMessages = recvmmsg(socket, messageHeaders, DATAGRAM_BATCH_CAPACITY, MSG_DONTWAIT, NULL);
+	if (numberOfMessages >= 0)
+	{
+		for (int messageIndex = 0; messageIndex < numberOfMessages; messageIndex++)
+		{
+			batch->sizes[messageIndex] = messageHeaders[messageIndex].msg_len;
+#if defined(SO_TIMESTAMPNS)
+			batch->receiveTimes[messageIndex] = receiveTimestamp(&messageHeaders[messageIndex].msg_hdr);
+#else
+			batch->receiveTimes[messageIndex] = networkMicroTicks();
+#endif
+		}
+		batch->count = (uint32_t)numberOfMessages;
+		return batch->count;
+	}
+	
+	if (errno != ENOSYS)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		{
+			fprintf(stderr, "recvmmsg() failed: %d - %s\n", errno, strerror(errno));
+		}
+		return 0;
+	}
+	// Otherwise fall back to reading one datagram at a time
+#endif
+	
+	while (batch->count < DATAGRAM_BATCH_CAPACITY)
+	{
+		fd_set socketSet;
+		FD_ZERO(&socketSet);
+		FD_SET(socket, &socketSet);
+		
+		struct timeval waitValue;
+		waitValue.tv_sec = 0;
+		waitValue.tv_usec = 0;
+		
+		if (select((int)(socket + 1), &socketSet, NULL, NULL, &waitValue) <= 0)
+		{
+			break;
+		}
+		
+		int numberOfBytes = (int)receiveData(socket, batch->buffers[batch->count], sizeof(batch->buffers[batch->count]), &batch->addresses[batch->count], &batch->receiveTimes[batch->count]);
+		if (numberOfBytes == -1)
+		{
+			// Ignore it and continue on
+			fprintf(stderr, "receiveData() actually returned -1\n");
+			break;
+		}
+		
+		batch->sizes[batch->count] = (size_t)numberOfBytes;
+		batch->count++;
+	}
+	
+	return batch->count;
+}
+
+// Sends every datagram queued in the batch and empties it
+#if PLATFORM_LINUX
+// Returns how many of the datagrams went out, which is less than count if sendmmsg() isn't available
+static uint32_t sendMessageHeaders(socket_t socket, struct mmsghdr *messageHeaders, uint32_t count)
+{
+	uint32_t datagramsSent = 0;
+	while (datagramsSent < count)
+	{
+		int numberOfMessages = sendmmsg(socket, &messageHeaders[datagramsSent], count - datagramsSent, 0);
+		if (numberOfMessages <= 0)
+		{
+			if (errno != ENOSYS)
+			{
+				// Skip the datagram that failed like sendto() failures are ignored
+				datagramsSent++;
+				continue;
+			}
+			// Otherwise the rest need to be sent one at a time
+			break;
+		}
+		datagramsSent += (uint32_t)numberOfMessages;
+	}
+	return datagramsSent;
+}
+#endif
+
+static void flushDatagrams(socket_t socket, DatagramBatch *batch)
+{
+	uint32_t datagramsSent = 0;
+	
+#if PLATFORM_LINUX
+	struct mmsghdr messageHeaders[DATAGRAM_BATCH_CAPACITY];
+	struct iovec messageVectors[DATAGRAM_BATCH_CAPACITY];
+	memset(messageHeaders, 0, sizeof(messageHeaders));
+	
+	for (uint32_t datagramIndex = 0; datagramIndex < batch->count; datagramIndex++)
+	{
+		messageVectors[datagramIndex].iov_base = batch->buffers[datagramIndex];
+		messageVectors[datagramIndex].iov_len = batch->sizes[datagramIndex];
+		
+		messageHeaders[datagramIndex].msg_hdr.msg_name = &batch->addresses[datagramIndex].sa;
+		messageHeaders[datagramIndex].msg_hdr.msg_namelen = socketAddressLength(&batch->addresses[datagramIndex]);
+		messageHeaders[datagramIndex].msg_hdr.msg_iov = &messageVectors[datagramIndex];
+		messageHeaders[datagramIndex].msg_hdr.msg_iovlen = 1;
+	}
+	
+	// A transport takes datagrams one at a time
+	if (currentNetworkTransport() == NULL)
+	{
+		datagramsSent = sendMessageHeaders(socket, messageHeaders, batch->count);
+	}
+#endif
+	
+	for (uint32_t datagramIndex = datagramsSent; datagramIndex < batch->count; datagramIndex++)
+	{
+		sendDataImmediately(socket, batch->buffers[datagramIndex], batch->sizes[datagramIndex], &batch->addresses[datagramIndex]);
+	}
+	
+	batch->count = 0;
+}
+
+static void queueDatagram(socket_t socket, DatagramBatch *batch, const void *data, size_t size, SocketAddress *address)
+{
+	// Like sendData(), skip addresses we don't know how to send to (e.g, cleared addresses of disconnected clients)
+	if (address->sa.sa_family != AF_INET && address->sa.sa_family != AF_INET6)
+	{
+		return;
+	}
+	
+	captureDatagram(true, address, data, size);
+	
+	if (gNetworkConnection->replay != NULL)
+	{
+		return;
+	}
+	
+	if (conditionOutgoingDatagram(socket, data, size, address))
+	{
+		return;
+	}
+	
+	if (batch->count >= DATAGRAM_BATCH_CAPACITY)
+	{
+		flushDatagrams(socket, batch);
+	}
+	
+	memcpy(batch->buffers[batch->count], data, size);
+	batch->sizes[batch->count] = size;
+	batch->addresses[batch->count] = *address;
+	batch->count++;
+}
+
+// Sends the same datagram to every address, pointing every send at the one buffer rather than copying it for each
+static void fanOutDatagram(socket_t socket, void *data, size_t size, SocketAddress *addresses, uint32_t numberOfAddresses)
+{
+#if PLATFORM_LINUX
+	struct mmsghdr messageHeaders[DATAGRAM_BATCH_CAPACITY];
+	SocketAddress *headerAddresses[DATAGRAM_BATCH_CAPACITY];
+	uint32_t headerCount = 0;
+	
+	struct iovec messageVector;
+	messageVector.iov_base = data;
+	messageVector.iov_len = size;
+#endif
+	
+	for (uint32_t addressIndex = 0; addressIndex < numberOfAddresses; addressIndex++)
+	{
+		SocketAddress *address = &addresses[addressIndex];
+		if (address->sa.sa_family == AF_INET || address->sa.sa_family == AF_INET6)
+		{
+			captureDatagram(true, address, data, size);
+			
+			if (gNetworkConnection->replay == NULL && !conditionOutgoingDatagram(socket, data, size, address))
+			{
+#if PLATFORM_LINUX
+				memset(&messageHeaders[headerCount], 0, sizeof(messageHeaders[headerCount]));
+				messageHeaders[headerCount].msg_hdr.msg_name = &address->sa;
+				messageHeaders[headerCount].msg_hdr.msg_namelen = socketAddressLength(address);
+				messageHeaders[headerCount].msg_hdr.msg_iov = &messageVector;
+				messageHeaders[headerCount].msg_hdr.msg_iovlen = 1;
+				headerAddresses[headerCount] = address;
+				headerCount++;
+#else
+				sendDataImmediately(socket, data, size, address);
+#endif
+			}
+		}
+		
+#if PLATFORM_LINUX
+		if (headerCount == DATAGRAM_BATCH_CAPACITY || (headerCount > 0 && addressIndex + 1 == numberOfAddresses))
+		{
+			for (uint32_t headerIndex = (currentNetworkTransport() == NULL) ? sendMessageHeaders(socket, messageHeaders, headerCount) : 0; headerIndex < headerCount; headerIndex++)
+			{
+				sendDataImmediately(socket, data, size, headerAddresses[headerIndex]);
+			}
+			headerCount = 0;
+		}
+#endif
+	}
+}
+
+static void createNetworkWakeup(NetworkBuffers *buffers)
+{
+#if !PLATFORM_WINDOWS
+	buffers->wakeupReadDescriptor = -1;
+	buffers->wakeupWriteDescriptor = -1;
+#endif
+	
+#if PLATFORM_LINUX
+	buffers->wakeupReadDescriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (buffers->wakeupReadDescriptor == -1)
+	{
+		fprintf(stderr, "Error: failed to create eventfd(): %d - %s\n", errno, strerror(errno));
+	}
+	buffers->wakeupWriteDescriptor = buffers->wakeupReadDescriptor;
+#elif !PLATFORM_WINDOWS
+	int pipeDescriptors[2];
+	if (pipe(pipeDescriptors) != 0)
+	{
+		fprintf(stderr, "Error: failed to create pipe(): %d - %s\n", errno, strerror(errno));
+	}
+	else
+	{
+		for (int pipeIndex = 0; pipeIndex < 2; pipeIndex++)
+		{
+			fcntl(pipeDescriptors[pipeIndex], F_SETFL, fcntl(pipeDescriptors[pipeIndex], F_GETFL) | O_NONBLOCK);
+			fcntl(pipeDescriptors[pipeIndex], F_SETFD, FD_CLOEXEC);
+		}
+		
+		buffers->wakeupReadDescriptor = pipeDescriptors[0];
+		buffers->wakeupWriteDescriptor = pipeDescriptors[1];
+	}
+#endif
+}
+
+// Called after queueing messages for the network thread to send
+static void wakeNetworkThread(NetworkBuffers *buffers)
+{
+#if PLATFORM_LINUX
+	if (buffers->wakeupWriteDescriptor != -1)
+	{
+		uint64_t value = 1;
+		// If this fails the counter is already saturated and the thread will wake up anyway
+		ssize_t __attribute__((unused)) result = write(buffers->wakeupWriteDescriptor, &value, sizeof(value));
+	}
+#elif !PLATFORM_WINDOWS
+	if (buffers->wakeupWriteDescriptor != -1)
+	{
+		uint8_t value = 1;
+		// If the pipe is full the thread already has a pending wakeup
+		ssize_t __attribute__((unused)) result = write(buffers->wakeupWriteDescriptor, &value, sizeof(value));
+	}
+#endif
+}
+
+// Blocks until the socket has data to read, the main thread wakes us up, or the timeout expires
+// Matches of a router don't read the socket, so they only wait for the router or the main thread to wake them up
+static void waitForNetworkEvents(socket_t socket, bool pollSocket, uint32_t timeoutMilliseconds)
+{
+	// Don't sleep past when the next held back datagram is due
+	timeoutMilliseconds = releaseConditionedDatagrams(timeoutMilliseconds);
+	
+	publishSteppedNetworkThreadState(STEPPED_NETWORK_IDLE);
+	
+#if PLATFORM_WINDOWS
+	// We don't have a wakeup descriptor we can select() on, so don't let queued messages wait any longer than before
+	uint32_t maxTimeoutMilliseconds = NETWORK_POLL_DELAY;
+	uint32_t clampedTimeoutMilliseconds = timeoutMilliseconds < maxTimeoutMilliseconds ? timeoutMilliseconds : maxTimeoutMilliseconds;
+	
+	if (!pollSocket)
+	{
+		ZGDelay(clampedTimeoutMilliseconds);
+		publishSteppedNetworkThreadState(STEPPED_NETWORK_BUSY);
+		return;
+	}
+	
+	fd_set socketSet;
+	FD_ZERO(&socketSet);
+	FD_SET(socket, &socketSet);
+	
+	struct timeval waitValue;
+	waitValue.tv_sec = 0;
+	waitValue.tv_usec = (long)(clampedTimeoutMilliseconds * 1000);
+	
+	select((int)(socket + 1), &socketSet, NULL, NULL, &waitValue);
+#else
+	// The router thread has no buffers to be woken up with
+	int wakeupReadDescriptor = (gNetworkBuffers != NULL) ? gNetworkBuffers->wakeupReadDescriptor : -1;
+	
+	// poll() ignores negative descriptors
+	struct pollfd pollDescriptors[2];
+	pollDescriptors[0].fd = pollSocket ? socket : -1;
+	pollDescriptors[0].events = POLLIN;
+	pollDescriptors[0].revents = 0;
+	pollDescriptors[1].fd = wakeupReadDescriptor;
+	pollDescriptors[1].events = POLLIN;
+	pollDescriptors[1].revents = 0;
+	
+	int pollResult = poll(pollDescriptors, 2, (int)timeoutMilliseconds);
+	if (pollResult > 0 && (pollDescriptors[1].revents & POLLIN) != 0)
+	{
+		// Drain the wakeup so we block again next time around
+		// Anything queued before the wakeup was signaled will be popped when we loop back
+		uint8_t drainBuffer[64];
+		while (read(wakeupReadDescriptor, drainBuffer, sizeof(drainBuffer)) > 0)
+		{
+		}
+	}
+#endif
+	
+	publishSteppedNetworkThreadState(STEPPED_NETWORK_BUSY);
+}
+
+static uint32_t networkWaitTimeout(bool hasPendingResends, uint32_t nextResendTime)
+{
+	if (!hasPendingResends)
+	{
+		return NETWORK_IDLE_WAIT_DELAY;
+	}
+	
+	int32_t timeUntilResend = (int32_t)(nextResendTime - networkTicks());
+	if (timeUntilResend <= 0)
+	{
+		return 0;
+	}
+	return (uint32_t)timeUntilResend < NETWORK_IDLE_WAIT_DELAY ? (uint32_t)timeUntilResend : NETWORK_IDLE_WAIT_DELAY;
+}
+
+// Index into the messages a network thread is processing in a pass, which are its own queued messages followed by the main thread's
+static GameMessage *pendingNetworkMessageAtIndex(uint32_t index, uint32_t networkThreadMessagesCount)
+{
+	if (index < networkThreadMessagesCount)
+	{
+		return networkMessageAtIndex(&gNetworkBuffers->networkThreadMessages, index);
+	}
+	return networkMessageAtIndex(&gNetworkBuffers->gameMessagesToNet, index - networkThreadMessagesCount);
+}
+
+static uint8_t characterIDForClientAddress(SocketAddress *address)
+{
+	for (uint8_t clientIndex = 0; clientIndex < gNetworkConnection->currentSlot; clientIndex++)
+	{
+		if (memcmp(address, &gNetworkConnection->clientAddresses[clientIndex], sizeof(*address)) == 0)
+		{
+			return clientIndex + 1;
+		}
+	}
+	return NO_CHARACTER;
+}
+
+static void advanceSendBuffer(char **sendBufferPtr, const void *data, size_t size)
+{
+	memcpy(*sendBufferPtr, data, size);
+	*sendBufferPtr += size;
+}
+
+#define ADVANCE_SEND_BUFFER(sendBufferPtr, data) advanceSendBuffer((sendBufferPtr), &(data), sizeof(data))
+
+static void advanceSendBufferForInitialMessage(char **sendBufferPtr, uint8_t tag, uint32_t packetNumber)
+{
+	ADVANCE_SEND_BUFFER(sendBufferPtr, tag);
+	ADVANCE_SEND_BUFFER(sendBufferPtr, packetNumber);
+}
+
+// Names are sent as MAX_USER_NAME_SIZE - 1 bytes, which are only NUL terminated if the name is shorter
+static void readNetName(char *netName, const char *buffer)
+{
+	memset(netName, 0, MAX_USER_NAME_SIZE);
+	strncpy(netName, buffer, MAX_USER_NAME_SIZE - 1);
+}
+
+void copyNetName(char *netName, const char *name)
+{
+	snprintf(netName, MAX_USER_NAME_SIZE, "%s", name);
+}
+
+static void writeRequestToPlay(char **sendBufferPtr, uint32_t packetNumber, uint8_t networkVersion, const char *netName, uint64_t cookie)
+{
+	advanceSendBufferForInitialMessage(sendBufferPtr, CAN_I_PLAY_MESSAGE_TAG, packetNumber);
+	
+	ADVANCE_SEND_BUFFER(sendBufferPtr, networkVersion);
+	advanceSendBuffer(sendBufferPtr, netName, MAX_USER_NAME_SIZE - 1);
+	ADVANCE_SEND_BUFFER(sendBufferPtr, cookie);
+}
+
+// Packs values into a byte buffer using only as many bits as each value needs
+// Bits are written least significant first and the last byte is padded with zeros
+typedef struct
+{
+	uint8_t *buffer;
+	uint32_t byteIndex;
+	uint64_t scratch;
+	uint32_t scratchBitCount;
+} BitWriter;
+
+// Reads values written by a BitWriter
+// Reading past the end of the buffer yields zeros and sets overflowed
+typedef struct
+{
+	const uint8_t *buffer;
+	uint32_t size;
+	uint32_t byteIndex;
+	uint64_t scratch;
+	uint32_t scratchBitCount;
+	bool overflowed;
+} BitReader;
+
+static void initializeBitWriter(BitWriter *writer, void *buffer)
+{
+	writer->buffer = buffer;
+	writer->byteIndex = 0;
+	writer->scratch = 0;
+	writer->scratchBitCount = 0;
+}
+
+// numberOfBits must be at most 32
+static void writeBits(BitWriter *writer, uint32_t value, uint32_t numberOfBits)
+{
+	uint64_t mask = (((uint64_t)1) << numberOfBits) - 1;
+	writer->scratch |= (((uint64_t)value) & mask) << writer->scratchBitCount;
+	writer->scratchBitCount += numberOfBits;
+	
+	while (writer->scratchBitCount >= 8)
+	{
+		writer->buffer[writer->byteIndex] = (uint8_t)(writer->scratch & 0xFF);
+		writer->byteIndex++;
+		writer->scratch >>= 8;
+		writer->scratchBitCount -= 8;
+	}
+}
+
+// Writes out any remaining bits and returns the number of bytes written
+static uint32_t finishBitWriter(BitWriter *writer)
+{
+	if (writer->scratchBitCount > 0)
+	{
+		writer->buffer[writer->byteIndex] = (uint8_t)(writer->scratch & 0xFF);
+		writer->byteIndex++;
+		writer->scratch = 0;
+		writer->scratchBitCount = 0;
+	}
+	return writer->byteIndex;
+}
+
+static void initializeBitReader(BitReader *reader, const void *buffer, uint32_t size)
+{
+	reader->buffer = buffer;
+	reader->size = size;
+	reader->byteIndex = 0;
+	reader->scratch = 0;
+	reader->scratchBitCount = 0;
+	reader->overflowed = false;
+}
+
+// numberOfBits must be at most 32
+static uint32_t readBits(BitReader *reader, uint32_t numberOfBits)
+{
+	while (reader->scratchBitCount < numberOfBits)
+	{
+		if (reader->byteIndex >= reader->size)
+		{
+			reader->overflowed = true;
+			return 0;
+		}
+		reader->scratch |= ((uint64_t)reader->buffer[reader->byteIndex]) << reader->scratchBitCount;
+		reader->byteIndex++;
+		reader->scratchBitCount += 8;
+	}
+	
+	uint32_t value = (uint32_t)(reader->scratch & ((((uint64_t)1) << numberOfBits) - 1));
+	reader->scratch >>= numberOfBits;
+	reader->scratchBitCount -= numberOfBits;
+	return value;
+}
+
+// Maps value from [minimum, maximum] onto an integer that fits in numberOfBits, clamping values out of range
+static uint32_t quantizeFloat(float value, float minimum, float maximum, uint32_t numberOfBits)
+{
+	uint32_t maxQuantizedValue = (uint32_t)((((uint64_t)1) << numberOfBits) - 1);
+	float normalizedValue = (value - minimum) / (maximum - minimum);
+	if (!(normalizedValue > 0.0f))
+	{
+		return 0;
+	}
+	if (normalizedValue >= 1.0f)
+	{
+		return maxQuantizedValue;
+	}
+	return (uint32_t)(normalizedValue * maxQuantizedValue + 0.5f);
+}
+
+static float dequantizeFloat(uint32_t quantizedValue, float minimum, float maximum, uint32_t numberOfBits)
+{
+	uint32_t maxQuantizedValue = (uint32_t)((((uint64_t)1) << numberOfBits) - 1);
+	return minimum + ((float)quantizedValue / maxQuantizedValue) * (maximum - minimum);
+}
+
+// Characters only move between tiles which lie on [0, 14] for both x and y, but give them some room
+// 15 bits over this range is precise to less than a thousandth of a unit
+#define MOVEMENT_POSITION_MIN -2.0f
+#define MOVEMENT_POSITION_MAX 16.0f
+#define MOVEMENT_POSITION_BITS 15
+
+// Only the low bits of real-time packet numbers are sent; the receiver infers the rest from the last one it accepted
+#define MOVEMENT_PACKET_NUMBER_BITS 16
+
+// packet number, character ID (2), direction (3), pointing direction (2), dead (1), x, y, has input acknowledgement (1)
+#define MOVEMENT_MESSAGE_BIT_COUNT (MOVEMENT_PACKET_NUMBER_BITS + 9 + 2 * MOVEMENT_POSITION_BITS)
+#define MOVEMENT_MESSAGE_SIZE ((MOVEMENT_MESSAGE_BIT_COUNT + 7) / 8)
+
+// Movements of a client's own character also carry the input sequence and steps since it was applied
+#define MOVEMENT_INPUT_SEQUENCE_BITS 16
+#define MOVEMENT_INPUT_STEPS_BITS 12
+#define MOVEMENT_MESSAGE_WITH_INPUT_SIZE ((MOVEMENT_MESSAGE_BIT_COUNT + MOVEMENT_INPUT_SEQUENCE_BITS + MOVEMENT_INPUT_STEPS_BITS + 7) / 8)
+
+// Clients send up to this many of their latest movement inputs in every datagram until the server acknowledges them
+// Must be a power of two
+#define MOVEMENT_INPUT_REDUNDANCY 4
+
+typedef struct
+{
+	uint16_t inputSequence;
+	uint8_t direction;
+} MovementInput;
+
+// Reconstructs a full packet number from its low bits by picking the value closest to a recent packet number
+static uint32_t expandPacketNumber(uint32_t lowBits, uint32_t numberOfBits, uint32_t recentPacketNumber)
+{
+	// Sign extend the difference in low bits so packet numbers slightly older than the recent one are handled too
+	uint32_t unusedBits = 32 - numberOfBits;
+	int32_t difference = ((int32_t)((lowBits - recentPacketNumber) << unusedBits)) >> unusedBits;
+	return recentPacketNumber + (uint32_t)difference;
+}
+
+// Our largest message size so far is around 20 bytes.
+// This should be plenty for now.
+#define MAX_MESSAGE_SIZE 32
+
+// Space to leave at the end of every packet for our acks (tag, cumulative ack, ack bitfield)
+#define ACKS_MESSAGE_SIZE (sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t))
+
+// Tag and send time, which is only put in packets that still have room for it
+#define SEND_TIME_MESSAGE_SIZE (sizeof(uint8_t) + sizeof(uint64_t))
+
+// Compares sequence numbers in a way that keeps working after they wrap around
+static bool sequenceGreaterThan(uint32_t sequence1, uint32_t sequence2)
+{
+	return (int32_t)(sequence1 - sequence2) > 0;
+}
+
+static bool inputSequenceGreaterThan(uint16_t sequence1, uint16_t sequence2)
+{
+	return (int16_t)(sequence1 - sequence2) > 0;
+}
+
+// Input sequences skip 0 when they wrap around since it means no input
+static uint16_t previousInputSequence(uint16_t sequence)
+{
+	return (sequence == 1) ? UINT16_MAX : sequence - 1;
+}
+
+static bool isReliableMessageAcked(ReliableSendState *sendState, uint32_t sequence)
+{
+	if (!sequenceGreaterThan(sequence, sendState->ack))
+	{
+		return true;
+	}
+	
+	uint32_t offset = sequence - sendState->ack - 1;
+	return (offset < RELIABLE_WINDOW_SIZE && (sendState->ackBits & (1u << offset)) != 0);
+}
+
+static void receiveReliableAcks(ReliableSendState *sendState, uint32_t ack, uint32_t ackBits)
+{
+	if (sequenceGreaterThan(ack, sendState->ack))
+	{
+		uint32_t shift = ack - sendState->ack;
+		sendState->ackBits = (shift < RELIABLE_WINDOW_SIZE ? (sendState->ackBits >> shift) : 0) | ackBits;
+		sendState->ack = ack;
+	}
+	else if (ack == sendState->ack)
+	{
+		sendState->ackBits |= ackBits;
+	}
+}
+
+static void initializeReliableSendState(ReliableSendState *sendState, NetworkPeerStats *stats)
+{
+	memset(sendState, 0, sizeof(*sendState));
+	sendState->resendTimeout = RELIABLE_INITIAL_RESEND_TIMEOUT;
+	sendState->stats = stats;
+}
+
+static void updateRoundTripTime(ReliableSendState *sendState, uint32_t roundTripTime)
+{
+	uint32_t histogramBucket = roundTripTime / NETWORK_RTT_HISTOGRAM_BUCKET_SIZE;
+	sendState->stats->roundTripTimeHistogram[histogramBucket < NETWORK_RTT_HISTOGRAM_BUCKET_COUNT ? histogramBucket : NETWORK_RTT_HISTOGRAM_BUCKET_COUNT - 1]++;
+	sendState->stats->roundTripTimeSamples++;
+	
+	if (!sendState->hasRoundTripTime)
+	{
+		sendState->hasRoundTripTime = true;
+		sendState->smoothedRoundTripTime = roundTripTime;
+		sendState->roundTripTimeVariance = roundTripTime / 2;
+	}
+	else
+	{
+		uint32_t deviation = (roundTripTime > sendState->smoothedRoundTripTime) ? (roundTripTime - sendState->smoothedRoundTripTime) : (sendState->smoothedRoundTripTime - roundTripTime);
+		
+		sendState->roundTripTimeVariance = (3 * sendState->roundTripTimeVariance + deviation) / 4;
+		sendState->smoothedRoundTripTime = (7 * sendState->smoothedRoundTripTime + roundTripTime) / 8;
+	}
+	
+	uint32_t resendTimeout = sendState->smoothedRoundTripTime + 4 * sendState->roundTripTimeVariance;
+	if (resendTimeout < RELIABLE_MIN_RESEND_TIMEOUT)
+	{
+		resendTimeout = RELIABLE_MIN_RESEND_TIMEOUT;
+	}
+	else if (resendTimeout > RELIABLE_MAX_RESEND_TIMEOUT)
+	{
+		resendTimeout = RELIABLE_MAX_RESEND_TIMEOUT;
+	}
+	sendState->resendTimeout = resendTimeout;
+}
+
+// Decides if a reliable message should go out in the packet we're building, and queues it again for later passes until it's acked
+// At most RELIABLE_WINDOW_SIZE messages past the peer's latest ack are ever in flight since the peer would drop anything further ahead
+// nextResendTime is lowered to when this message is due to be sent again, if it's in flight
+static bool scheduleReliableMessage(ReliableSendState *sendState, GameMessage *message, uint32_t currentTime, bool *hasPendingResends, uint32_t *nextResendTime)
+{
+	if (isReliableMessageAcked(sendState, message->packetNumber))
+	{
+		// This is the one pass that notices the ack, since the message isn't queued again
+		if (message->sendCount > 0)
+		{
+			uint32_t ackLatency = currentTime - message->firstSendTime;
+			sendState->stats->totalAckLatency += ackLatency;
+			sendState->stats->ackLatencySamples++;
+			if (ackLatency > sendState->stats->maxAckLatency)
+			{
+				sendState->stats->maxAckLatency = ackLatency;
+			}
+		}
+		return false;
+	}
+	
+	bool withinPeerWindow = (message->packetNumber - sendState->ack <= RELIABLE_WINDOW_SIZE);
+	bool shouldSend = withinPeerWindow && (int32_t)(currentTime - message->resendTime) >= 0;
+	if (shouldSend)
+	{
+		uint32_t backoffShift = message->sendCount < 6 ? message->sendCount : 6;
+		uint32_t resendTimeout = sendState->resendTimeout << backoffShift;
+		
+		message->resendTime = currentTime + (resendTimeout < RELIABLE_MAX_RESEND_TIMEOUT ? resendTimeout : RELIABLE_MAX_RESEND_TIMEOUT);
+		
+		if (message->sendCount == 0)
+		{
+			message->firstSendTime = currentTime;
+			traceSentMessage(message);
+		}
+		else
+		{
+			sendState->stats->retransmissions++;
+		}
+		message->sendCount++;
+	}
+	
+	if (withinPeerWindow && (!*hasPendingResends || (int32_t)(message->resendTime - *nextResendTime) < 0))
+	{
+		*nextResendTime = message->resendTime;
+		*hasPendingResends = true;
+	}
+	
+	queueOutgoingMessage(&gNetworkBuffers->networkThreadMessages, message);
+	
+	return shouldSend;
+}
+
+// Delivers reliable messages to the main thread in order, holding on to ones that arrive early
+// A NULL message (e.g, one that failed validation) still uses up its sequence number but nothing is delivered for it
+// Returns false if the message wasn't kept because it was a duplicate or too far ahead
+static bool receiveReliableMessage(ReliableReceiveState *receiveState, uint32_t sequence, GameMessage *message)
+{
+	// Even duplicates need to be acked again in case our last ack was lost
+	receiveState->needsToSendAcks = true;
+	
+	if (!sequenceGreaterThan(sequence, receiveState->sequence))
+	{
+		receiveState->stats->duplicates++;
+		return false;
+	}
+	
+	uint32_t offset = sequence - receiveState->sequence - 1;
+	if (offset >= RELIABLE_WINDOW_SIZE || (receiveState->receivedBits & (1u << offset)) != 0)
+	{
+		if (offset < RELIABLE_WINDOW_SIZE)
+		{
+			receiveState->stats->duplicates++;
+		}
+		return false;
+	}
+	
+	// Something sent before this message hasn't arrived yet
+	if (offset > 0)
+	{
+		receiveState->stats->outOfOrder++;
+	}
+	
+	receiveState->receivedBits |= (1u << offset);
+	if (message != NULL)
+	{
+		receiveState->pendingMessages[sequence % RELIABLE_WINDOW_SIZE] = *message;
+		receiveState->pendingMessageBits |= (1u << offset);
+	}
+	
+	while ((receiveState->receivedBits & 1) != 0)
+	{
+		receiveState->sequence++;
+		
+		if ((receiveState->pendingMessageBits & 1) != 0)
+		{
+			deliverNetworkMessage(receiveState->pendingMessages[receiveState->sequence % RELIABLE_WINDOW_SIZE]);
+		}
+		
+		receiveState->receivedBits >>= 1;
+		receiveState->pendingMessageBits >>= 1;
+	}
+	
+	return true;
+}
+
+static NetworkChannel networkChannelForMessageTag(uint8_t messageTag)
+{
+	switch (messageTag)
+	{
+		case ACK_MESSAGE_TAG:
+		case PING_MESSAGE_TAG:
+		case PONG_MESSAGE_TAG:
+		case QUIT_MESSAGE_TAG:
+		case SERVER_REJECTION_MESSAGE_TAG:
+		case SPECTATE_MESSAGE_TAG:
+		case HANDSHAKE_COOKIE_MESSAGE_TAG:
+		case SEND_TIME_MESSAGE_TAG:
+			return NETWORK_CHANNEL_CONTROL;
+		case MOVEMENT_MESSAGE_TAG:
+		case REQUEST_MOVEMENT_MESSAGE_TAG:
+			return NETWORK_CHANNEL_MOVEMENT;
+		case WORLD_SNAPSHOT_MESSAGE_TAG:
+		case WORLD_SNAPSHOT_ACK_MESSAGE_TAG:
+		case SPECTATOR_FRAME_MESSAGE_TAG:
+			return NETWORK_CHANNEL_SNAPSHOT;
+		default:
+			return NETWORK_CHANNEL_RELIABLE;
+	}
+}
+
+// Every message starts with its tag
+static void countSentMessage(NetworkPeerStats *stats, const char *messageStart, const char *messageEnd)
+{
+	NetworkChannelStats *channelStats = &stats->channels[networkChannelForMessageTag((uint8_t)messageStart[0])];
+	channelStats->bytesSent += (size_t)(messageEnd - messageStart);
+	channelStats->messagesSent++;
+}
+
+static void countReceivedMessage(NetworkChannelStats *channels, uint8_t messageTag, size_t size)
+{
+	NetworkChannelStats *channelStats = &channels[networkChannelForMessageTag(messageTag)];
+	channelStats->bytesReceived += size;
+	channelStats->messagesReceived++;
+}
+
+static void countReceivedDatagram(NetworkPeerStats *stats, NetworkChannelStats *channels, size_t size)
+{
+	stats->datagramsReceived++;
+	stats->bytesReceived += size;
+	
+	for (uint32_t channel = 0; channel < NETWORK_CHANNEL_COUNT; channel++)
+	{
+		stats->channels[channel].bytesReceived += channels[channel].bytesReceived;
+		stats->channels[channel].messagesReceived += channels[channel].messagesReceived;
+	}
+}
+
+// Makes the network thread's telemetry visible to copyNetworkPeerStats() and copyNetworkLatencyStats()
+static void publishNetworkPeerStats(NetworkPeerStats *peerStats, uint32_t numberOfPeers)
+{
+	ZGLockMutex(gNetworkStatsMutex);
+	memcpy(gNetworkConnection->peerStats, peerStats, numberOfPeers * sizeof(*peerStats));
+	if (gNetworkTracing)
+	{
+		gNetworkConnection->publishedLatencyStats = gNetworkConnection->networkThreadLatencyStats;
+	}
+	ZGUnlockMutex(gNetworkStatsMutex);
+}
+
+// Sends the packet built so far, appending our latest acks for the peer once we have received anything from them
+// If outgoingDatagrams is not NULL, the packet is queued there to be sent later with other packets
+static void sendPacket(char *sendBuffer, char **sendBufferPtr, SocketAddress *address, ReliableReceiveState *receiveState, DatagramBatch *outgoingDatagrams)
+{
+	// While tracing, the send time goes first so the peer knows it before handling the messages after it
+	size_t messagesSize = (size_t)(*sendBufferPtr - sendBuffer);
+	if (gNetworkTracing && gTracedServerClockSynchronized && messagesSize > 0 && messagesSize + SEND_TIME_MESSAGE_SIZE + ACKS_MESSAGE_SIZE <= MAX_PACKET_SIZE)
+	{
+		memmove(sendBuffer + SEND_TIME_MESSAGE_SIZE, sendBuffer, messagesSize);
+		
+		char *sendTimePtr = sendBuffer;
+		uint8_t sendTimeTag = SEND_TIME_MESSAGE_TAG;
+		uint64_t sendTime = networkMicroTicks() + (uint64_t)gTracedServerClockOffset;
+		ADVANCE_SEND_BUFFER(&sendTimePtr, sendTimeTag);
+		ADVANCE_SEND_BUFFER(&sendTimePtr, sendTime);
+		
+		countSentMessage(receiveState->stats, sendBuffer, sendTimePtr);
+		*sendBufferPtr += SEND_TIME_MESSAGE_SIZE;
+	}
+	
+	if (receiveState->sequence != 0 || receiveState->receivedBits != 0)
+	{
+		char *messageStart = *sendBufferPtr;
+		
+		uint8_t ackTag = ACK_MESSAGE_TAG;
+		ADVANCE_SEND_BUFFER(sendBufferPtr, ackTag);
+		ADVANCE_SEND_BUFFER(sendBufferPtr, receiveState->sequence);
+		ADVANCE_SEND_BUFFER(sendBufferPtr, receiveState->receivedBits);
+		
+		countSentMessage(receiveState->stats, messageStart, *sendBufferPtr);
+		
+		receiveState->needsToSendAcks = false;
+	}
+	
+	if ((size_t)(*sendBufferPtr - sendBuffer) > 0)
+	{
+		receiveState->stats->datagramsSent++;
+		receiveState->stats->bytesSent += (size_t)(*sendBufferPtr - sendBuffer);
+		
+		if (outgoingDatagrams != NULL)
+		{
+			queueDatagram(gNetworkConnection->socket, outgoingDatagrams, sendBuffer, (size_t)(*sendBufferPtr - sendBuffer), address);
+		}
+		else
+		{
+			sendData(gNetworkConnection->socket, sendBuffer, (size_t)(*sendBufferPtr - sendBuffer), address);
+		}
+	}
+	
+	*sendBufferPtr = sendBuffer;
+}
+
+// Call after appending a message that starts at messageStart
+static void sendAndResetBufferIfNeeded(char *sendBuffer, size_t sendBufferSize, char **sendBufferPtr, char *messageStart, SocketAddress *address, ReliableReceiveState *receiveState, DatagramBatch *outgoingDatagrams)
+{
+	countSentMessage(receiveState->stats, messageStart, *sendBufferPtr);
+	
+	if ((size_t)(*sendBufferPtr - sendBuffer) >= sendBufferSize - MAX_MESSAGE_SIZE - ACKS_MESSAGE_SIZE)
+	{
+		sendPacket(sendBuffer, sendBufferPtr, address, receiveState, outgoingDatagrams);
+	}
+}
+
+#define WORLD_SNAPSHOT_NUMBER_BITS 16
+#define WORLD_SNAPSHOT_BASELINE_AGE_BITS 5
+#define WORLD_SNAPSHOT_REQUIRED_SEQUENCE_BITS 16
+#define WORLD_SNAPSHOT_TILE_COUNT_BITS 7
+#define WORLD_SNAPSHOT_TILE_INDEX_BITS 6
+#define WORLD_SNAPSHOT_TILE_BITS (WORLD_SNAPSHOT_TILE_INDEX_BITS + 3 + 1 + 1)
+#define WORLD_SNAPSHOT_CHARACTER_BITS (4 + 8 + 4)
+
+// Size of a snapshot message where every tile and character changed
+#define MAX_WORLD_SNAPSHOT_MESSAGE_SIZE (sizeof(uint8_t) + (WORLD_SNAPSHOT_NUMBER_BITS + WORLD_SNAPSHOT_BASELINE_AGE_BITS + WORLD_SNAPSHOT_REQUIRED_SEQUENCE_BITS + WORLD_SNAPSHOT_TILE_COUNT_BITS + NUMBER_OF_TILES * WORLD_SNAPSHOT_TILE_BITS + 4 * (1 + WORLD_SNAPSHOT_CHARACTER_BITS) + 7) / 8)
+
+// Messages from the main thread that change the world are folded into snapshots instead of being sent on their own
+static bool isWorldSnapshotMessage(MessageType type)
+{
+	return (type == COLOR_TILE_MESSAGE_TYPE || type == TILE_FALLING_DOWN_MESSAGE_TYPE || type == RECOVER_TILE_MESSAGE_TYPE || type == CHARACTER_DIED_UPDATE_MESSAGE_TYPE || type == CHARACTER_KILLED_UPDATE_MESSAGE_TYPE);
+}
+
+static void resetWorldSnapshotTiles(WorldSnapshot *snapshot)
+{
+	memset(snapshot->tiles, 0, sizeof(snapshot->tiles));
+}
+
+static void applyMessageToWorldSnapshot(WorldSnapshot *snapshot, GameMessage *message)
+{
+	switch (message->type)
+	{
+		case COLOR_TILE_MESSAGE_TYPE:
+			if (message->colorTile.tileIndex < NUMBER_OF_TILES)
+			{
+				snapshot->tiles[message->colorTile.tileIndex].coloredID = message->colorTile.characterID;
+			}
+			break;
+		case TILE_FALLING_DOWN_MESSAGE_TYPE:
+			if (message->fallingTile.tileIndex < NUMBER_OF_TILES)
+			{
+				if (message->fallingTile.dead)
+				{
+					snapshot->tiles[message->fallingTile.tileIndex].dead = true;
+				}
+				else
+				{
+					snapshot->tiles[message->fallingTile.tileIndex].fallen = true;
+				}
+			}
+			break;
+		case RECOVER_TILE_MESSAGE_TYPE:
+			if (message->recoverTile.tileIndex < NUMBER_OF_TILES)
+			{
+				snapshot->tiles[message->recoverTile.tileIndex].coloredID = NO_CHARACTER;
+				snapshot->tiles[message->recoverTile.tileIndex].fallen = false;
+			}
+			break;
+		case CHARACTER_DIED_UPDATE_MESSAGE_TYPE:
+			if (message->diedUpdate.characterID > NO_CHARACTER && message->diedUpdate.characterID <= PINK_BUBBLE_GUM)
+			{
+				CharacterSnapshot *character = &snapshot->characters[message->diedUpdate.characterID - 1];
+				character->lives = message->diedUpdate.characterLives;
+				character->deaths++;
+			}
+			break;
+		case CHARACTER_KILLED_UPDATE_MESSAGE_TYPE:
+			if (message->killedUpdate.characterID > NO_CHARACTER && message->killedUpdate.characterID <= PINK_BUBBLE_GUM)
+			{
+				snapshot->characters[message->killedUpdate.characterID - 1].kills = (uint8_t)(message->killedUpdate.kills < UINT8_MAX ? message->killedUpdate.kills : UINT8_MAX);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+// Decides if a client should be sent the latest snapshot in the packet we're building
+// A snapshot goes out as soon as the world changes and again every resend timeout until the client acks it
+static bool scheduleWorldSnapshot(WorldSnapshotSendState *sendState, uint32_t latestSnapshotNumber, uint32_t resendTimeout, uint32_t currentTime, bool *hasPendingResends, uint32_t *nextResendTime)
+{
+	if (sendState->ackedSnapshotNumber == latestSnapshotNumber)
+	{
+		return false;
+	}
+	
+	bool shouldSend = (sendState->sentSnapshotNumber != latestSnapshotNumber || (int32_t)(currentTime - sendState->resendTime) >= 0);
+	if (shouldSend)
+	{
+		sendState->sentSnapshotNumber = latestSnapshotNumber;
+		sendState->resendTime = currentTime + resendTimeout;
+	}
+	
+	if (!*hasPendingResends || (int32_t)(sendState->resendTime - *nextResendTime) < 0)
+	{
+		*nextResendTime = sendState->resendTime;
+		*hasPendingResends = true;
+	}
+	
+	return shouldSend;
+}
+
+static void initializeSendRateController(SendRateController *controller, uint32_t currentTime)
+{
+	memset(controller, 0, sizeof(*controller));
+	controller->movementRate = MAX_MOVEMENT_SEND_RATE;
+	controller->lastAdjustmentTime = currentTime;
+}
+
+static void recordSentPing(SendRateController *controller, uint32_t pingTimestamp)
+{
+	uint32_t pingIndex = controller->pingCount & (SEND_RATE_PING_HISTORY_SIZE - 1);
+	controller->pingTimestamps[pingIndex] = pingTimestamp;
+	controller->pongedPings[pingIndex] = false;
+	controller->pingCount++;
+}
+
+static void recordReceivedPong(SendRateController *controller, const PongMessage *pong, uint32_t currentTime)
+{
+	uint32_t historyCount = (controller->pingCount < SEND_RATE_PING_HISTORY_SIZE) ? controller->pingCount : SEND_RATE_PING_HISTORY_SIZE;
+	for (uint32_t pingAge = 0; pingAge < historyCount; pingAge++)
+	{
+		uint32_t pingIndex = (controller->pingCount - 1 - pingAge) & (SEND_RATE_PING_HISTORY_SIZE - 1);
+		if (controller->pingTimestamps[pingIndex] == pong->pingTimestamp)
+		{
+			controller->pongedPings[pingIndex] = true;
+			break;
+		}
+	}
+	
+	uint32_t roundTripTime = pongRoundTripTime(pong) / 1000;
+	if (!controller->hasMinRoundTripTime || roundTripTime < controller->minRoundTripTime || currentTime - controller->minRoundTripTimeTime >= SEND_RATE_MIN_ROUND_TRIP_TIME_WINDOW)
+	{
+		controller->hasMinRoundTripTime = true;
+		controller->minRoundTripTime = roundTripTime;
+		controller->minRoundTripTimeTime = currentTime;
+	}
+}
+
+static void adjustSendRate(SendRateController *controller, ReliableSendState *sendState, uint32_t currentTime)
+{
+	if (currentTime - controller->lastAdjustmentTime < SEND_RATE_ADJUSTMENT_INTERVAL || !sendState->hasRoundTripTime)
+	{
+		return;
+	}
+	controller->lastAdjustmentTime = currentTime;
+	
+	// A pong that hasn't come back within a resend timeout isn't coming back
+	uint32_t currentMicroTime = (uint32_t)networkMicroTicks();
+	uint32_t oldestPingCount = (controller->pingCount > SEND_RATE_PING_HISTORY_SIZE) ? controller->pingCount - SEND_RATE_PING_HISTORY_SIZE : 0;
+	if (sequenceGreaterThan(oldestPingCount, controller->measuredPingCount))
+	{
+		controller->measuredPingCount = oldestPingCount;
+	}
+	
+	while (controller->measuredPingCount != controller->pingCount)
+	{
+		uint32_t pingIndex = controller->measuredPingCount & (SEND_RATE_PING_HISTORY_SIZE - 1);
+		if ((currentMicroTime - controller->pingTimestamps[pingIndex]) / 1000 < sendState->resendTimeout)
+		{
+			break;
+		}
+		
+		controller->measuredPings++;
+		if (!controller->pongedPings[pingIndex])
+		{
+			controller->lostPings++;
+			sendState->stats->lostPings++;
+		}
+		controller->measuredPingCount++;
+	}
+	
+	bool losingPings = (controller->measuredPings >= SEND_RATE_MIN_MEASURED_PINGS && controller->lostPings * 100 > controller->measuredPings * SEND_RATE_LOSS_PERCENTAGE);
+	bool queueing = (controller->hasMinRoundTripTime && sendState->smoothedRoundTripTime > controller->minRoundTripTime + SEND_RATE_QUEUEING_DELAY + 2 * sendState->roundTripTimeVariance);
+	
+	if (losingPings || queueing)
+	{
+		controller->movementRate *= MOVEMENT_SEND_RATE_DECREASE;
+		if (controller->movementRate < MIN_MOVEMENT_SEND_RATE)
+		{
+			controller->movementRate = MIN_MOVEMENT_SEND_RATE;
+		}
+		
+		// Loss from before the cut shouldn't count against the new rate
+		controller->measuredPings = 0;
+		controller->lostPings = 0;
+	}
+	else
+	{
+		controller->movementRate += MOVEMENT_SEND_RATE_INCREASE;
+		if (controller->movementRate > MAX_MOVEMENT_SEND_RATE)
+		{
+			controller->movementRate = MAX_MOVEMENT_SEND_RATE;
+		}
+		
+		if (controller->measuredPings >= SEND_RATE_MIN_MEASURED_PINGS)
+		{
+			controller->measuredPings = 0;
+			controller->lostPings = 0;
+		}
+	}
+	
+	sendState->stats->movementSendRate = (uint32_t)controller->movementRate;
+}
+
+static bool movementSendIsDue(SendRateController *controller, uint32_t currentTime)
+{
+	return controller->movementRate >= MAX_MOVEMENT_SEND_RATE || (int32_t)(currentTime - controller->nextMovementTime) >= 0;
+}
+
+// Movement is sent very often so it is bit-packed rather than using the usual packet number and float layout
+static void writeMovementMessage(char **sendBufferPtr, GameMessage *message, int addressIndex)
+{
+	uint8_t tag = MOVEMENT_MESSAGE_TAG;
+	ADVANCE_SEND_BUFFER(sendBufferPtr, tag);
+	
+	BitWriter writer;
+	initializeBitWriter(&writer, *sendBufferPtr);
+	
+	writeBits(&writer, message->packetNumber, MOVEMENT_PACKET_NUMBER_BITS);
+	writeBits(&writer, message->movedUpdate.characterID - 1, 2);
+	writeBits(&writer, message->movedUpdate.direction, 3);
+	writeBits(&writer, message->movedUpdate.pointing_direction - 1, 2);
+	writeBits(&writer, message->movedUpdate.dead, 1);
+	writeBits(&writer, quantizeFloat(message->movedUpdate.x, MOVEMENT_POSITION_MIN, MOVEMENT_POSITION_MAX, MOVEMENT_POSITION_BITS), MOVEMENT_POSITION_BITS);
+	writeBits(&writer, quantizeFloat(message->movedUpdate.y, MOVEMENT_POSITION_MIN, MOVEMENT_POSITION_MAX, MOVEMENT_POSITION_BITS), MOVEMENT_POSITION_BITS);
+	
+	// Only the client playing the character needs to know which of its requests the movement follows from
+	bool hasInputAcknowledgement = (message->movedUpdate.inputSequence != 0 && message->movedUpdate.characterID == addressIndex + 1);
+	writeBits(&writer, hasInputAcknowledgement, 1);
+	if (hasInputAcknowledgement)
+	{
+		uint32_t maxInputSteps = (1 << MOVEMENT_INPUT_STEPS_BITS) - 1;
+		writeBits(&writer, message->movedUpdate.inputSequence, MOVEMENT_INPUT_SEQUENCE_BITS);
+		writeBits(&writer, message->movedUpdate.inputSteps < maxInputSteps ? message->movedUpdate.inputSteps : maxInputSteps, MOVEMENT_INPUT_STEPS_BITS);
+	}
+	
+	*sendBufferPtr += finishBitWriter(&writer);
+}
+
+// Writes only the tiles and characters that differ from the baseline
+// A baselineAge of 0 means the baseline is the default world, otherwise it's the snapshot that many snapshots before this one
+static void writeWorldSnapshot(BitWriter *writer, uint32_t snapshotNumber, uint32_t baselineAge, uint32_t requiredSequence, WorldSnapshot *snapshot, WorldSnapshot *baseline)
+{
+	writeBits(writer, snapshotNumber, WORLD_SNAPSHOT_NUMBER_BITS);
+	writeBits(writer, baselineAge, WORLD_SNAPSHOT_BASELINE_AGE_BITS);
+	writeBits(writer, requiredSequence, WORLD_SNAPSHOT_REQUIRED_SEQUENCE_BITS);
+	
+	uint32_t changedTilesCount = 0;
+	for (uint32_t tileIndex = 0; tileIndex < NUMBER_OF_TILES; tileIndex++)
+	{
+		if (memcmp(&snapshot->tiles[tileIndex], &baseline->tiles[tileIndex], sizeof(snapshot->tiles[tileIndex])) != 0)
+		{
+			changedTilesCount++;
+		}
+	}
+	
+	writeBits(writer, changedTilesCount, WORLD_SNAPSHOT_TILE_COUNT_BITS);
+	for (uint32_t tileIndex = 0; tileIndex < NUMBER_OF_TILES; tileIndex++)
+	{
+		TileSnapshot *tile = &snapshot->tiles[tileIndex];
+		if (memcmp(tile, &baseline->tiles[tileIndex], sizeof(*tile)) != 0)
+		{
+			writeBits(writer, tileIndex, WORLD_SNAPSHOT_TILE_INDEX_BITS);
+			writeBits(writer, tile->coloredID, 3);
+			writeBits(writer, tile->fallen, 1);
+			writeBits(writer, tile->dead, 1);
+		}
+	}
+	
+	for (uint32_t characterIndex = 0; characterIndex < 4; characterIndex++)
+	{
+		CharacterSnapshot *character = &snapshot->characters[characterIndex];
+		if (memcmp(character, &baseline->characters[characterIndex], sizeof(*character)) != 0)
+		{
+			writeBits(writer, 1, 1);
+			writeBits(writer, character->lives, 4);
+			writeBits(writer, character->kills, 8);
+			writeBits(writer, character->deaths, 4);
+		}
+		else
+		{
+			writeBits(writer, 0, 1);
+		}
+	}
+}
+
+// Reads the changes in a snapshot on top of snapshot, which should be filled with the baseline beforehand
+// Returns false if the snapshot is malformed
+static bool readWorldSnapshotChanges(BitReader *reader, WorldSnapshot *snapshot)
+{
+	uint32_t changedTilesCount = readBits(reader, WORLD_SNAPSHOT_TILE_COUNT_BITS);
+	if (changedTilesCount > NUMBER_OF_TILES)
+	{
+		return false;
+	}
+	
+	for (uint32_t changedTileIndex = 0; changedTileIndex < changedTilesCount; changedTileIndex++)
+	{
+		TileSnapshot *tile = &snapshot->tiles[readBits(reader, WORLD_SNAPSHOT_TILE_INDEX_BITS)];
+		tile->coloredID = (uint8_t)readBits(reader, 3);
+		tile->fallen = (uint8_t)readBits(reader, 1);
+		tile->dead = (uint8_t)readBits(reader, 1);
+		
+		if (tile->coloredID > PINK_BUBBLE_GUM)
+		{
+			return false;
+		}
+	}
+	
+	for (uint32_t characterIndex = 0; characterIndex < 4; characterIndex++)
+	{
+		if (readBits(reader, 1) != 0)
+		{
+			CharacterSnapshot *character = &snapshot->characters[characterIndex];
+			character->lives = (uint8_t)readBits(reader, 4);
+			character->kills = (uint8_t)readBits(reader, 8);
+			character->deaths = (uint8_t)readBits(reader, 4);
+		}
+	}
+	
+	return !reader->overflowed;
+}
+
+// Most messages the differences between two snapshots can turn into: a tile can recover, be colored and fall, and a character can die and kill
+#define MAX_WORLD_SNAPSHOT_CHANGE_MESSAGES (NUMBER_OF_TILES * 3 + 4 * 2)
+
+// Turns the differences between two snapshots back into the messages the main thread expects from the server
+// If a game reset happened between them, the main thread already reset its tiles so they're compared against the default world
+// messages needs room for MAX_WORLD_SNAPSHOT_CHANGE_MESSAGES messages; returns how many were written to it
+static uint32_t worldSnapshotChangeMessages(WorldSnapshot *previousSnapshot, WorldSnapshot *snapshot, bool gameWasReset, GameMessage *messages)
+{
+	uint32_t messagesCount = 0;
+	
+	for (uint8_t tileIndex = 0; tileIndex < NUMBER_OF_TILES; tileIndex++)
+	{
+		TileSnapshot previousTile = {0};
+		if (!gameWasReset)
+		{
+			previousTile = previousSnapshot->tiles[tileIndex];
+		}
+		TileSnapshot *tile = &snapshot->tiles[tileIndex];
+		
+		if ((previousTile.fallen && !tile->fallen) || (previousTile.coloredID != NO_CHARACTER && tile->coloredID == NO_CHARACTER))
+		{
+			GameMessage message;
+			message.type = RECOVER_TILE_MESSAGE_TYPE;
+			message.recoverTile.tileIndex = tileIndex;
+			messages[messagesCount++] = message;
+			
+			previousTile.coloredID = NO_CHARACTER;
+			previousTile.fallen = false;
+		}
+		
+		if (tile->coloredID != NO_CHARACTER && tile->coloredID != previousTile.coloredID)
+		{
+			GameMessage message;
+			message.type = COLOR_TILE_MESSAGE_TYPE;
+			message.colorTile.characterID = tile->coloredID;
+			message.colorTile.tileIndex = tileIndex;
+			messages[messagesCount++] = message;
+		}
+		
+		if ((!previousTile.fallen && tile->fallen) || (!previousTile.dead && tile->dead))
+		{
+			GameMessage message;
+			message.type = TILE_FALLING_DOWN_MESSAGE_TYPE;
+			message.fallingTile.dead = (!previousTile.dead && tile->dead);
+			message.fallingTile.tileIndex = tileIndex;
+			messages[messagesCount++] = message;
+		}
+	}
+	
+	for (uint8_t characterIndex = 0; characterIndex < 4; characterIndex++)
+	{
+		CharacterSnapshot *previousCharacter = &previousSnapshot->characters[characterIndex];
+		CharacterSnapshot *character = &snapshot->characters[characterIndex];
+		
+		if (character->deaths != previousCharacter->deaths)
+		{
+			GameMessage message;
+			message.type = CHARACTER_DIED_UPDATE_MESSAGE_TYPE;
+			message.diedUpdate.characterID = characterIndex + 1;
+			message.diedUpdate.characterLives = character->lives;
+			messages[messagesCount++] = message;
+		}
+		
+		if (character->kills != previousCharacter->kills)
+		{
+			GameMessage message;
+			message.type = CHARACTER_KILLED_UPDATE_MESSAGE_TYPE;
+			message.killedUpdate.characterID = characterIndex + 1;
+			message.killedUpdate.kills = character->kills;
+			messages[messagesCount++] = message;
+		}
+	}
+	
+	return messagesCount;
+}
+
+static void pushWorldSnapshotChanges(WorldSnapshot *previousSnapshot, WorldSnapshot *snapshot, bool gameWasReset)
+{
+	GameMessage messages[MAX_WORLD_SNAPSHOT_CHANGE_MESSAGES];
+	uint32_t messagesCount = worldSnapshotChangeMessages(previousSnapshot, snapshot, gameWasReset, messages);
+	for (uint32_t messageIndex = 0; messageIndex < messagesCount; messageIndex++)
+	{
+		deliverNetworkMessage(messages[messageIndex]);
+	}
+}
+
+#define SPECTATOR_FRAME_NUMBER_BITS 16
+#define SPECTATOR_EVENT_NUMBER_BITS 16
+#define SPECTATOR_EVENT_COUNT_BITS 5
+#define SPECTATOR_EVENT_TYPE_BITS 3
+
+// Messages the server keeps its own copy of, for its world snapshot and spectators
+static bool isSpectatorMessage(MessageType type)
+{
+	return (isWorldSnapshotMessage(type) || type == CHARACTER_MOVED_UPDATE_MESSAGE_TYPE || type == GAME_RESET_MESSAGE_TYPE || type == START_GAME_MESSAGE_TYPE || type == GAME_START_NUMBER_UPDATE_MESSAGE_TYPE || type == CHARACTER_FIRED_UPDATE_MESSAGE_TYPE || type == LAGGED_OUT_MESSAGE_TYPE);
+}
+
+// Returns -1 if the address isn't spectating
+static int spectatorIndexForAddress(SpectatorStream *stream, SocketAddress *address)
+{
+	for (uint32_t spectatorIndex = 0; spectatorIndex < stream->count; spectatorIndex++)
+	{
+		if (memcmp(address, &stream->addresses[spectatorIndex], sizeof(*address)) == 0)
+		{
+			return (int)spectatorIndex;
+		}
+	}
+	return -1;
+}
+
+// Returns false if there's no room for another spectator
+static bool addSpectator(SpectatorStream *stream, SocketAddress *address, uint32_t currentTime)
+{
+	int spectatorIndex = spectatorIndexForAddress(stream, address);
+	if (spectatorIndex == -1)
+	{
+		if (stream->count >= MAX_SPECTATORS)
+		{
+			return false;
+		}
+		
+		spectatorIndex = (int)stream->count;
+		stream->addresses[spectatorIndex] = *address;
+		stream->count++;
+	}
+	
+	stream->lastHeardTimes[spectatorIndex] = currentTime;
+	
+	return true;
+}
+
+static void removeSpectator(SpectatorStream *stream, uint32_t spectatorIndex)
+{
+	stream->count--;
+	stream->addresses[spectatorIndex] = stream->addresses[stream->count];
+	stream->lastHeardTimes[spectatorIndex] = stream->lastHeardTimes[stream->count];
+}
+
+static void setSpectatorNetName(SpectatorStream *stream, uint8_t characterIndex, const char *netName)
+{
+	if (strncmp(stream->netNames[characterIndex], netName, MAX_USER_NAME_SIZE) != 0)
+	{
+		copyNetName(stream->netNames[characterIndex], netName);
+		stream->netNamesFrameNumber = stream->frameNumber;
+	}
+}
+
+static void recordSpectatorMessage(SpectatorStream *stream, GameMessage *message)
+{
+	if (message->type == CHARACTER_MOVED_UPDATE_MESSAGE_TYPE)
+	{
+		uint8_t characterIndex = message->movedUpdate.characterID - 1;
+		if (characterIndex < 4)
+		{
+			stream->movements[characterIndex] = message->movedUpdate;
+			stream->movedCharacters |= (1 << characterIndex);
+		}
+	}
+	else if (!isWorldSnapshotMessage(message->type))
+	{
+		// Event numbers start at 1
+		stream->eventCount++;
+		
+		SpectatorEvent *event = &stream->events[stream->eventCount & (SPECTATOR_EVENT_HISTORY_SIZE - 1)];
+		event->message = *message;
+		event->eventNumber = stream->eventCount;
+		event->frameNumber = stream->frameNumber;
+		
+		if (message->type == GAME_RESET_MESSAGE_TYPE)
+		{
+			stream->resetEventNumber = stream->eventCount;
+		}
+		else if (message->type == LAGGED_OUT_MESSAGE_TYPE)
+		{
+			// Like the main thread, keep showing that someone left
+			uint8_t characterIndex = message->laggedUpdate.characterID - 1;
+			if (characterIndex < 4 && stream->netNames[characterIndex][0] != '\0')
+			{
+				setSpectatorNetName(stream, characterIndex, "DISCON");
+			}
+		}
+	}
+}
+
+static void writeSpectatorEvent(BitWriter *writer, SpectatorEvent *event)
+{
+	writeBits(writer, event->eventNumber, SPECTATOR_EVENT_NUMBER_BITS);
+	
+	GameMessage *message = &event->message;
+	switch (message->type)
+	{
+		case GAME_RESET_MESSAGE_TYPE:
+			writeBits(writer, SPECTATOR_GAME_RESET_EVENT, SPECTATOR_EVENT_TYPE_BITS);
+			break;
+		case START_GAME_MESSAGE_TYPE:
+			writeBits(writer, SPECTATOR_START_GAME_EVENT, SPECTATOR_EVENT_TYPE_BITS);
+			break;
+		case GAME_START_NUMBER_UPDATE_MESSAGE_TYPE:
+			writeBits(writer, SPECTATOR_GAME_START_NUMBER_EVENT, SPECTATOR_EVENT_TYPE_BITS);
+			writeBits(writer, message->gameStartNumber, 8);
+			break;
+		case CHARACTER_FIRED_UPDATE_MESSAGE_TYPE:
+			writeBits(writer, SPECTATOR_CHARACTER_FIRED_EVENT, SPECTATOR_EVENT_TYPE_BITS);
+			writeBits(writer, message->firedUpdate.characterID - 1, 2);
+			writeBits(writer, message->firedUpdate.direction - 1, 2);
+			writeBits(writer, quantizeFloat(message->firedUpdate.x, MOVEMENT_POSITION_MIN, MOVEMENT_POSITION_MAX, MOVEMENT_POSITION_BITS), MOVEMENT_POSITION_BITS);
+			writeBits(writer, quantizeFloat(message->firedUpdate.y, MOVEMENT_POSITION_MIN, MOVEMENT_POSITION_MAX, MOVEMENT_POSITION_BITS), MOVEMENT_POSITION_BITS);
+			break;
+		case LAGGED_OUT_MESSAGE_TYPE:
+			writeBits(writer, SPECTATOR_LAGGED_OUT_EVENT, SPECTATOR_EVENT_TYPE_BITS);
+			writeBits(writer, message->laggedUpdate.characterID - 1, 2);
+			break;
+		default:
+			break;
+	}
+}
+
+// Writes the next frame for spectators into buffer, which needs to hold MAX_PACKET_SIZE bytes, and returns its size
+// A frame with every tile, character, event and net name in it is still only about 260 bytes
+// The world snapshot is against the default world so a spectator can pick up from any frame, and its required sequence is the event number of the last game reset
+static size_t writeSpectatorFrame(SpectatorStream *stream, uint32_t snapshotNumber, WorldSnapshot *worldSnapshot, char *buffer)
+{
+	char *bufferPtr = buffer;
+	uint8_t tag = SPECTATOR_FRAME_MESSAGE_TAG;
+	ADVANCE_SEND_BUFFER(&bufferPtr, tag);
+	
+	BitWriter writer;
+	initializeBitWriter(&writer, bufferPtr);
+	
+	writeBits(&writer, stream->frameNumber, SPECTATOR_FRAME_NUMBER_BITS);
+	
+	WorldSnapshot defaultSnapshot;
+	memset(&defaultSnapshot, 0, sizeof(defaultSnapshot));
+	writeWorldSnapshot(&writer, snapshotNumber, 0, stream->resetEventNumber, worldSnapshot, &defaultSnapshot);
+	
+	for (uint8_t characterIndex = 0; characterIndex < 4; characterIndex++)
+	{
+		bool moved = (stream->movedCharacters & (1 << characterIndex)) != 0;
+		writeBits(&writer, moved, 1);
+		if (moved)
+		{
+			CharacterMovedUpdate *movement = &stream->movements[characterIndex];
+			writeBits(&writer, movement->direction, 3);
+			writeBits(&writer, movement->pointing_direction - 1, 2);
+			writeBits(&writer, movement->dead, 1);
+			writeBits(&writer, quantizeFloat(movement->x, MOVEMENT_POSITION_MIN, MOVEMENT_POSITION_MAX, MOVEMENT_POSITION_BITS), MOVEMENT_POSITION_BITS);
+			writeBits(&writer, quantizeFloat(movement->y, MOVEMENT_POSITION_MIN, MOVEMENT_POSITION_MAX, MOVEMENT_POSITION_BITS), MOVEMENT_POSITION_BITS);
+		}
+	}
+	
+	// Events from the last few frames that are still in the history, oldest first
+	uint32_t firstEventNumber = stream->eventCount + 1;
+	while (firstEventNumber > 1 && stream->eventCount - (firstEventNumber - 1) < SPECTATOR_EVENT_HISTORY_SIZE && stream->frameNumber - stream->events[(firstEventNumber - 1) & (SPECTATOR_EVENT_HISTORY_SIZE - 1)].frameNumber < SPECTATOR_EVENT_REDUNDANCY)
+	{
+		firstEventNumber--;
+	}
+	
+	writeBits(&writer, stream->eventCount + 1 - firstEventNumber, SPECTATOR_EVENT_COUNT_BITS);
+	for (uint32_t eventNumber = firstEventNumber; eventNumber <= stream->eventCount; eventNumber++)
+	{
+		writeSpectatorEvent(&writer, &stream->events[eventNumber & (SPECTATOR_EVENT_HISTORY_SIZE - 1)]);
+	}
+	
+	bool sendsNetNames = (stream->frameNumber % SPECTATOR_NET_NAMES_INTERVAL == 0 || stream->frameNumber - stream->netNamesFrameNumber < SPECTATOR_EVENT_REDUNDANCY);
+	writeBits(&writer, sendsNetNames, 1);
+	if (sendsNetNames)
+	{
+		for (uint8_t characterIndex = 0; characterIndex < 4; characterIndex++)
+		{
+			for (uint32_t characterOffset = 0; characterOffset < MAX_USER_NAME_SIZE - 1; characterOffset++)
+			{
+				writeBits(&writer, (uint8_t)stream->netNames[characterIndex][characterOffset], 8);
+			}
+		}
+	}
+	
+	stream->frameNumber++;
+	
+	return (size_t)(bufferPtr - buffer) + finishBitWriter(&writer);
+}
+
+// A spectator frame as read back, with frame and event numbers only as many bits as they're sent with
+typedef struct
+{
+	uint32_t frameNumber;
+	uint32_t requiredSequence;
+	WorldSnapshot worldSnapshot;
+	
+	CharacterMovedUpdate movements[4];
+	uint8_t movedCharacters;
+	
+	SpectatorEvent events[SPECTATOR_EVENT_HISTORY_SIZE];
+	uint32_t eventCount;
+	
+	bool hasNetNames;
+	char netNames[4][MAX_USER_NAME_SIZE];
+} SpectatorFrame;
+
+// Returns false if the event is malformed
+static bool readSpectatorEvent(BitReader *reader, SpectatorEvent *event)
+{
+	event->eventNumber = readBits(reader, SPECTATOR_EVENT_NUMBER_BITS);
+	
+	GameMessage *message = &event->message;
+	memset(message, 0, sizeof(*message));
+	
+	switch (readBits(reader, SPECTATOR_EVENT_TYPE_BITS))
+	{
+		case SPECTATOR_GAME_RESET_EVENT:
+			message->type = GAME_RESET_MESSAGE_TYPE;
+			break;
+		case SPECTATOR_START_GAME_EVENT:
+			message->type = START_GAME_MESSAGE_TYPE;
+			break;
+		case SPECTATOR_GAME_START_NUMBER_EVENT:
+			message->type = GAME_START_NUMBER_UPDATE_MESSAGE_TYPE;
+			message->gameStartNumber = (uint8_t)readBits(reader, 8);
+			break;
+		case SPECTATOR_CHARACTER_FIRED_EVENT:
+			message->type = CHARACTER_FIRED_UPDATE_MESSAGE_TYPE;
+			message->firedUpdate.characterID = (uint8_t)readBits(reader, 2) + 1;
+			message->firedUpdate.direction = (int8_t)readBits(reader, 2) + 1;
+			message->firedUpdate.x = dequantizeFloat(readBits(reader, MOVEMENT_POSITION_BITS), MOVEMENT_POSITION_MIN, MOVEMENT_POSITION_MAX, MOVEMENT_POSITION_BITS);
+			message->firedUpdate.y = dequantizeFloat(readBits(reader, MOVEMENT_POSITION_BITS), MOVEMENT_POSITION_MIN, MOVEMENT_POSITION_MAX, MOVEMENT_POSITION_BITS);
+			break;
+		case SPECTATOR_LAGGED_OUT_EVENT:
+			message->type = LAGGED_OUT_MESSAGE_TYPE;
+			message->laggedUpdate.characterID = (uint8_t)readBits(reader, 2) + 1;
+			break;
+		default:
+			return false;
+	}
+	
+	return !reader->overflowed;
+}
+
+// Reads a frame written by writeSpectatorFrame() without its tag
+// Returns false if the frame is malformed or doesn't take up exactly size bytes
+static bool readSpectatorFrame(const char *buffer, uint32_t size, SpectatorFrame *frame)
+{
+	BitReader reader;
+	initializeBitReader(&reader, buffer, size);
+	
+	frame->frameNumber = readBits(&reader, SPECTATOR_FRAME_NUMBER_BITS);
+	
+	// The snapshot number only matters to clients that ack snapshots
+	readBits(&reader, WORLD_SNAPSHOT_NUMBER_BITS);
+	uint32_t baselineAge = readBits(&reader, WORLD_SNAPSHOT_BASELINE_AGE_BITS);
+	frame->requiredSequence = readBits(&reader, WORLD_SNAPSHOT_REQUIRED_SEQUENCE_BITS);
+	
+	// Frames are always against the default world
+	memset(&frame->worldSnapshot, 0, sizeof(frame->worldSnapshot));
+	if (baselineAge != 0 || !readWorldSnapshotChanges(&reader, &frame->worldSnapshot))
+	{
+		return false;
+	}
+	
+	frame->movedCharacters = 0;
+	for (uint8_t characterIndex = 0; characterIndex < 4; characterIndex++)
+	{
+		if (readBits(&reader, 1) != 0)
+		{
+			CharacterMovedUpdate *movement = &frame->movements[characterIndex];
+			memset(movement, 0, sizeof(*movement));
+			
+			movement->characterID = characterIndex + 1;
+			movement->direction = (uint8_t)readBits(&reader, 3);
+			movement->pointing_direction = (uint8_t)readBits(&reader, 2) + 1;
+			movement->dead = readBits(&reader, 1) != 0;
+			movement->x = dequantizeFloat(readBits(&reader, MOVEMENT_POSITION_BITS), MOVEMENT_POSITION_MIN, MOVEMENT_POSITION_MAX, MOVEMENT_POSITION_BITS);
+			movement->y = dequantizeFloat(readBits(&reader, MOVEMENT_POSITION_BITS), MOVEMENT_POSITION_MIN, MOVEMENT_POSITION_MAX, MOVEMENT_POSITION_BITS);
+			
+			frame->movedCharacters |= (1 << characterIndex);
+		}
+	}
+	
+	frame->eventCount = readBits(&reader, SPECTATOR_EVENT_COUNT_BITS);
+	if (frame->eventCount > SPECTATOR_EVENT_HISTORY_SIZE)
+	{
+		return false;
 	}
-	else if (address->sa.sa_family == AF_INET6)
+	
+	for (uint32_t eventIndex = 0; eventIndex < frame->eventCount; eventIndex++)
+	{
+		if (!readSpectatorEvent(&reader, &frame->events[eventIndex]))
+		{
+			return false;
+		}
+	}
+	
+	frame->hasNetNames = readBits(&reader, 1) != 0;
+	if (frame->hasNetNames)
+	{
+		for (uint8_t characterIndex = 0; characterIndex < 4; characterIndex++)
+		{
+			char netNameBuffer[MAX_USER_NAME_SIZE - 1];
+			for (uint32_t characterOffset = 0; characterOffset < sizeof(netNameBuffer); characterOffset++)
+			{
+				netNameBuffer[characterOffset] = (char)readBits(&reader, 8);
+			}
+			readNetName(frame->netNames[characterIndex], netNameBuffer);
+		}
+	}
+	
+	// Only the padding of the last byte may be left over
+	return !reader.overflowed && reader.byteIndex == size;
+}
+
+static void advanceReceiveBuffer(char **buffer, void *receiveData, size_t receiveDataSize)
+{
+	memcpy(receiveData, *buffer, receiveDataSize);
+	*buffer += receiveDataSize;
+}
+
+#define ADVANCE_RECEIVE_BUFFER(buffer, data) advanceReceiveBuffer(buffer, &(data), sizeof((data)))
+
+typedef struct
+{
+	uint64_t keys[2];
+} NetworkHashKeys;
+
+typedef struct
+{
+	uint32_t tokens;
+	uint32_t lastRefillTime;
+} TokenBucket;
+
+// Buckets are found by a hash of the source's address, and a source whose hash lands on another's bucket takes it over
+typedef struct
+{
+	NetworkHashKeys keys;
+	uint64_t sourceKeys[SOURCE_RATE_LIMITER_SIZE];
+	TokenBucket sourceBuckets[SOURCE_RATE_LIMITER_SIZE];
+	
+	TokenBucket handshakeReplyBucket;
+} SourceRateLimiter;
+
+// Keys only the server knows, so nobody else can make its cookies or pick addresses that share a bucket
+static void generateNetworkHashKeys(NetworkHashKeys *hashKeys)
+{
+#if !PLATFORM_WINDOWS
+	FILE *randomFile = fopen("/dev/urandom", "rb");
+	if (randomFile != NULL)
+	{
+		size_t readCount = fread(hashKeys->keys, sizeof(hashKeys->keys), 1, randomFile);
+		fclose(randomFile);
+		
+		if (readCount == 1)
+		{
+			return;
+		}
+	}
+#endif
+	
+	// Easier to guess, but still different for every server
+	uint64_t seed = networkMicroTicks() ^ (uint64_t)(uintptr_t)hashKeys;
+	for (uint32_t keyIndex = 0; keyIndex < 2; keyIndex++)
+	{
+		seed += 0x9E3779B97F4A7C15ull;
+		uint64_t value = seed;
+		value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+		value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+		hashKeys->keys[keyIndex] = value ^ (value >> 31);
+	}
+}
+
+#define SIPHASH_ROTATE(value, bits) (((value) << (bits)) | ((value) >> (64 - (bits))))
+
+static void sipHashRound(uint64_t *state)
+{
+	state[0] += state[1]; state[1] = SIPHASH_ROTATE(state[1], 13); state[1] ^= state[0]; state[0] = SIPHASH_ROTATE(state[0], 32);
+	state[2] += state[3]; state[3] = SIPHASH_ROTATE(state[3], 16); state[3] ^= state[2];
+	state[0] += state[3]; state[3] = SIPHASH_ROTATE(state[3], 21); state[3] ^= state[0];
+	state[2] += state[1]; state[1] = SIPHASH_ROTATE(state[1], 17); state[1] ^= state[2]; state[2] = SIPHASH_ROTATE(state[2], 32);
+}
+
+// SipHash-2-4
+static uint64_t sipHash(const NetworkHashKeys *hashKeys, const uint8_t *data, size_t length)
+{
+	uint64_t state[4];
+	state[0] = hashKeys->keys[0] ^ 0x736f6d6570736575ull;
+	state[1] = hashKeys->keys[1] ^ 0x646f72616e646f6dull;
+	state[2] = hashKeys->keys[0] ^ 0x6c7967656e657261ull;
+	state[3] = hashKeys->keys[1] ^ 0x7465646279746573ull;
+	
+	size_t fullBlocksLength = length - (length % 8);
+	for (size_t offset = 0; offset < fullBlocksLength; offset += 8)
+	{
+		uint64_t block = 0;
+		for (size_t byteIndex = 0; byteIndex < 8; byteIndex++)
+		{
+			block |= (uint64_t)data[offset + byteIndex] << (8 * byteIndex);
+		}
+		
+		state[3] ^= block;
+		sipHashRound(state);
+		sipHashRound(state);
+		state[0] ^= block;
+	}
+	
+	uint64_t lastBlock = (uint64_t)length << 56;
+	for (size_t byteIndex = 0; byteIndex < length % 8; byteIndex++)
+	{
+		lastBlock |= (uint64_t)data[fullBlocksLength + byteIndex] << (8 * byteIndex);
+	}
+	
+	state[3] ^= lastBlock;
+	sipHashRound(state);
+	sipHashRound(state);
+	state[0] ^= lastBlock;
+	
+	state[2] ^= 0xFF;
+	for (uint32_t roundIndex = 0; roundIndex < 4; roundIndex++)
+	{
+		sipHashRound(state);
+	}
+	
+	return state[0] ^ state[1] ^ state[2] ^ state[3];
+}
+
+#define MAX_SOURCE_ADDRESS_BYTES 18
+
+// The port and address that tell sources apart, leaving out whatever else the socket filled in
+static size_t sourceAddressBytes(const SocketAddress *address, uint8_t *bytes)
+{
+	if (address->sa.sa_family == AF_INET6)
+	{
+		memcpy(bytes, &address->sa_in6.sin6_port, sizeof(address->sa_in6.sin6_port));
+		memcpy(bytes + sizeof(address->sa_in6.sin6_port), &address->sa_in6.sin6_addr, sizeof(address->sa_in6.sin6_addr));
+		return sizeof(address->sa_in6.sin6_port) + sizeof(address->sa_in6.sin6_addr);
+	}
+	
+	memcpy(bytes, &address->sa_in.sin_port, sizeof(address->sa_in.sin_port));
+	memcpy(bytes + sizeof(address->sa_in.sin_port), &address->sa_in.sin_addr, sizeof(address->sa_in.sin_addr));
+	return sizeof(address->sa_in.sin_port) + sizeof(address->sa_in.sin_addr);
+}
+
+// Never 0, which is what a client sends before it has been given a cookie
+static uint64_t handshakeCookie(const NetworkHashKeys *cookieKeys, const SocketAddress *address, uint32_t window)
+{
+	uint8_t bytes[MAX_SOURCE_ADDRESS_BYTES + sizeof(window)];
+	size_t length = sourceAddressBytes(address, bytes);
+	memcpy(bytes + length, &window, sizeof(window));
+	
+	uint64_t cookie = sipHash(cookieKeys, bytes, length + sizeof(window));
+	return (cookie != 0) ? cookie : 1;
+}
+
+// A cookie can only be echoed back by someone who received it, so a valid one means the sender's address isn't spoofed
+static bool acceptsHandshakeCookie(const NetworkHashKeys *cookieKeys, const SocketAddress *address, uint64_t cookie, uint32_t currentTime)
+{
+	// A replay doesn't know the keys the cookies were made with, but the server that was captured only sent them back valid ones
+	if (gNetworkConnection != NULL && gNetworkConnection->replay != NULL)
+	{
+		return cookie != 0;
+	}
+	
+	uint32_t window = currentTime / HANDSHAKE_COOKIE_WINDOW;
+	return cookie != 0 && (cookie == handshakeCookie(cookieKeys, address, window) || cookie == handshakeCookie(cookieKeys, address, window - 1));
+}
+
+static void sendHandshakeCookie(socket_t socket, const NetworkHashKeys *cookieKeys, SocketAddress *address, uint32_t currentTime)
+{
+	char cookieBuffer[sizeof(uint8_t) + sizeof(uint64_t)];
+	
+	uint8_t cookieTag = HANDSHAKE_COOKIE_MESSAGE_TAG;
+	uint64_t cookie = handshakeCookie(cookieKeys, address, currentTime / HANDSHAKE_COOKIE_WINDOW);
+	memcpy(cookieBuffer, &cookieTag, sizeof(cookieTag));
+	memcpy(cookieBuffer + sizeof(cookieTag), &cookie, sizeof(cookie));
+	
+	sendData(socket, cookieBuffer, sizeof(cookieBuffer), address);
+}
+
+static void initializeSourceRateLimiter(SourceRateLimiter *rateLimiter, uint32_t currentTime)
+{
+	memset(rateLimiter, 0, sizeof(*rateLimiter));
+	generateNetworkHashKeys(&rateLimiter->keys);
+	
+	rateLimiter->handshakeReplyBucket.tokens = HANDSHAKE_REPLY_BURST;
+	rateLimiter->handshakeReplyBucket.lastRefillTime = currentTime;
+}
+
+// Returns false if the bucket doesn't have enough tokens left, in which case none are taken
+static bool takeTokens(TokenBucket *bucket, uint32_t cost, uint32_t rate, uint32_t burst, uint32_t currentTime)
+{
+	uint32_t elapsedTime = currentTime - bucket->lastRefillTime;
+	uint64_t refill = (uint64_t)elapsedTime * rate / 1000;
+	if (refill >= burst - bucket->tokens)
+	{
+		bucket->tokens = burst;
+		bucket->lastRefillTime = currentTime;
+	}
+	else if (refill > 0)
+	{
+		// Leftover time towards the next token isn't lost
+		bucket->tokens += (uint32_t)refill;
+		bucket->lastRefillTime += (uint32_t)(refill * 1000 / rate);
+	}
+	
+	if (bucket->tokens < cost)
+	{
+		return false;
+	}
+	
+	bucket->tokens -= cost;
+	return true;
+}
+
+static bool takeSourceTokens(SourceRateLimiter *rateLimiter, const SocketAddress *address, uint32_t cost, uint32_t currentTime)
+{
+	uint8_t bytes[MAX_SOURCE_ADDRESS_BYTES];
+	size_t length = sourceAddressBytes(address, bytes);
+	
+	// 0 marks a bucket nobody has used yet
+	uint64_t sourceKey = sipHash(&rateLimiter->keys, bytes, length) | 1;
+	uint32_t bucketIndex = (uint32_t)(sourceKey >> 32) & (SOURCE_RATE_LIMITER_SIZE - 1);
+	
+	TokenBucket *bucket = &rateLimiter->sourceBuckets[bucketIndex];
+	if (rateLimiter->sourceKeys[bucketIndex] != sourceKey)
+	{
+		rateLimiter->sourceKeys[bucketIndex] = sourceKey;
+		bucket->tokens = SOURCE_TOKEN_BURST;
+		bucket->lastRefillTime = currentTime;
+	}
+	
+	return takeTokens(bucket, cost, SOURCE_TOKEN_RATE, SOURCE_TOKEN_BURST, currentTime);
+}
+
+// Spoofed sources never run out of fresh buckets, so what we send back to all of them together is limited too
+static bool takeHandshakeReplyToken(SourceRateLimiter *rateLimiter, uint32_t currentTime)
+{
+	return takeTokens(&rateLimiter->handshakeReplyBucket, 1, HANDSHAKE_REPLY_RATE, HANDSHAKE_REPLY_BURST, currentTime);
+}
+
+// Must be a power of two
+#define ROUTED_DATAGRAM_QUEUE_CAPACITY 256
+
+typedef struct
+{
+	char buffer[MAX_PACKET_SIZE];
+	size_t size;
+	SocketAddress address;
+	uint64_t receiveTime;
+} RoutedDatagram;
+
+// Bounded lock-free queue of datagrams that is only pushed to from the router thread and only read from a match's network thread
+typedef struct
+{
+	uint32_t writeIndex;
+	uint8_t producerPadding[CACHE_LINE_SIZE - sizeof(uint32_t)];
+	
+	uint32_t readIndex;
+	uint8_t consumerPadding[CACHE_LINE_SIZE - sizeof(uint32_t)];
+	
+	RoutedDatagram datagrams[ROUTED_DATAGRAM_QUEUE_CAPACITY];
+} RoutedDatagramQueue;
+
+typedef struct
+{
+	RoutedDatagramQueue routedDatagrams;
+	
+	// Written by attachNetworkMatch() every time the match starts
+	// Generation is stored last with release semantics, and 0 means the match hasn't started yet
+	NetworkBuffers *buffers;
+	uint32_t generation;
+	
+	// Only used from the router thread
+	uint32_t routedGeneration;
+	SocketAddress clientAddresses[3];
+	uint8_t numberOfClients;
+	bool needsWakeup;
+} NetworkMatch;
+
+struct NetworkMatchRouter
+{
+	// Only writable before the router thread is created
+	socket_t socket;
+	uint32_t numberOfMatches;
+	uint8_t playersPerMatch;
+	NetworkMatch *matches;
+	
+	// Matches check the cookies of spectators with the same keys
+	NetworkHashKeys cookieKeys;
+	
+	// Only used from the router thread
+	SourceRateLimiter rateLimiter;
+	
+	uint8_t needsToQuit;
+};
+
+NetworkMatchRouter *createNetworkMatchRouter(socket_t socket, uint32_t numberOfMatches, uint8_t playersPerMatch)
+{
+	NetworkMatchRouter *router = calloc(1, sizeof(*router));
+	router->socket = socket;
+	router->numberOfMatches = numberOfMatches;
+	router->playersPerMatch = playersPerMatch;
+	router->matches = calloc(numberOfMatches, sizeof(*router->matches));
+	
+	generateNetworkHashKeys(&router->cookieKeys);
+	initializeSourceRateLimiter(&router->rateLimiter, networkTicks());
+	
+	return router;
+}
+
+void stopNetworkMatchRouter(NetworkMatchRouter *router)
+{
+	storeReleaseUInt8(&router->needsToQuit, 1);
+}
+
+void attachNetworkMatch(NetworkConnection *connection, NetworkMatchRouter *router, uint32_t matchIndex)
+{
+	NetworkMatch *match = &router->matches[matchIndex];
+	
+	connection->socket = router->socket;
+	connection->router = router;
+	connection->matchIndex = matchIndex;
+	
+	// Nothing is reading the queue until the match's network thread is created, so drop what was routed to the previous game
+	storeReleaseUInt32(&match->routedDatagrams.readIndex, loadAcquireUInt32(&match->routedDatagrams.writeIndex));
+	
+	match->buffers = connection->buffers;
+	storeReleaseUInt32(&match->generation, match->generation + 1);
+}
+
+// Returns false and drops the datagram if the match isn't keeping up
+static bool pushRoutedDatagram(RoutedDatagramQueue *queue, const char *buffer, size_t size, SocketAddress *address, uint64_t receiveTime)
+{
+	uint32_t writeIndex = queue->writeIndex;
+	if (writeIndex - loadAcquireUInt32(&queue->readIndex) >= ROUTED_DATAGRAM_QUEUE_CAPACITY)
+	{
+		return false;
+	}
+	
+	RoutedDatagram *datagram = &queue->datagrams[writeIndex & (ROUTED_DATAGRAM_QUEUE_CAPACITY - 1)];
+	memcpy(datagram->buffer, buffer, size);
+	datagram->size = size;
+	datagram->address = *address;
+	datagram->receiveTime = receiveTime;
+	
+	storeReleaseUInt32(&queue->writeIndex, writeIndex + 1);
+	
+	return true;
+}
+
+// Takes the oldest datagram off a queue filled by pushRoutedDatagram()
+// Returns false if the queue is empty
+static bool popRoutedDatagram(RoutedDatagramQueue *queue, void *buffer, size_t length, size_t *size, SocketAddress *address, uint64_t *receiveTime)
+{
+	uint32_t readIndex = queue->readIndex;
+	if (readIndex == loadAcquireUInt32(&queue->writeIndex))
+	{
+		return false;
+	}
+	
+	RoutedDatagram *datagram = &queue->datagrams[readIndex & (ROUTED_DATAGRAM_QUEUE_CAPACITY - 1)];
+	*size = (datagram->size < length) ? datagram->size : length;
+	memcpy(buffer, datagram->buffer, *size);
+	*address = datagram->address;
+	*receiveTime = datagram->receiveTime;
+	
+	storeReleaseUInt32(&queue->readIndex, readIndex + 1);
+	
+	return true;
+}
+
+// Every client has a queue of datagrams to the server and one of datagrams from it, each with a single thread pushing and a single thread reading
+typedef struct
+{
+	NetworkTransport transport;
+	uint8_t numberOfClients;
+	RoutedDatagramQueue *serverQueues;
+	RoutedDatagramQueue *clientQueues;
+	
+	// Threads of the endpoints' games, for waking their network threads when a datagram is sent to them
+	// An endpoint's buffers are written before it's marked as attached with release semantics
+	NetworkBuffers **endpointBuffers;
+	uint8_t *attachedEndpoints;
+	
+	// Only used from the server's network thread, so every client gets to be read from first in turn
+	uint8_t nextServerQueueIndex;
+	
+	// Only allocated once the transport is stepped, and indexed by endpoint
+	// The stepping thread writes the step, each game thread the last step it took and whether it takes steps, and each network thread the rest
+	uint32_t step;
+	uint32_t *gameSteps;
+	uint8_t *gameStates;
+	uint8_t *networkStates;
+	uint32_t *idleSteps;
+	// A step settles once none of these change while every endpoint is checked
+	uint32_t *networkPasses;
+	uint32_t *sentDatagrams;
+} InProcessNetworkTransport;
+
+// Whether an endpoint's game thread takes the steps of a stepped transport
+#define STEPPED_GAME_NOT_JOINED 0
+#define STEPPED_GAME_JOINED 1
+#define STEPPED_GAME_LEFT 2
+
+// Endpoints are told apart by port like captured peers are
+static void inProcessEndpointAddress(uint8_t endpointIndex, SocketAddress *address)
+{
+	memset(address, 0, sizeof(*address));
+	address->sa_in.sin_family = AF_INET;
+	address->sa_in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address->sa_in.sin_port = htons((uint16_t)(endpointIndex + 1));
+}
+
+static void attachInProcessEndpoint(NetworkTransport *transport, NetworkConnection *connection)
+{
+	InProcessNetworkTransport *inProcessTransport = (InProcessNetworkTransport *)transport;
+	uint8_t endpointIndex = (uint8_t)connection->socket;
+	
+	if (connection->type == NETWORK_CLIENT_TYPE)
+	{
+		inProcessEndpointAddress(0, &connection->hostAddress);
+	}
+	
+	inProcessTransport->endpointBuffers[endpointIndex] = connection->buffers;
+	storeReleaseUInt8(&inProcessTransport->attachedEndpoints[endpointIndex], 1);
+}
+
+static void sendInProcessDatagram(NetworkTransport *transport, socket_t socket, const void *data, size_t size, SocketAddress *address)
+{
+	InProcessNetworkTransport *inProcessTransport = (InProcessNetworkTransport *)transport;
+	uint8_t senderIndex = (uint8_t)socket;
+	
+	// Clients can only talk to the server
+	uint8_t receiverIndex = 0;
+	RoutedDatagramQueue *queue = NULL;
+	if (senderIndex == 0)
+	{
+		receiverIndex = (uint8_t)(ntohs(address->sa_in.sin_port) - 1);
+		if (address->sa.sa_family != AF_INET || receiverIndex == 0 || receiverIndex > inProcessTransport->numberOfClients)
+		{
+			return;
+		}
+		queue = &inProcessTransport->clientQueues[receiverIndex - 1];
+	}
+	else
+	{
+		queue = &inProcessTransport->serverQueues[senderIndex - 1];
+	}
+	
+	SocketAddress senderAddress;
+	inProcessEndpointAddress(senderIndex, &senderAddress);
+	
+	bool pushed = pushRoutedDatagram(queue, data, size, &senderAddress, networkMicroTicks());
+	
+	if (transport->stepped)
+	{
+		storeReleaseUInt32(&inProcessTransport->sentDatagrams[senderIndex], inProcessTransport->sentDatagrams[senderIndex] + 1);
+	}
+	
+	if (pushed && loadAcquireUInt8(&inProcessTransport->attachedEndpoints[receiverIndex]) != 0)
+	{
+		wakeNetworkThread(inProcessTransport->endpointBuffers[receiverIndex]);
+	}
+}
+
+static int receiveInProcessDatagram(NetworkTransport *transport, socket_t socket, void *buffer, size_t length, SocketAddress *address, uint64_t *receiveTime)
+{
+	InProcessNetworkTransport *inProcessTransport = (InProcessNetworkTransport *)transport;
+	uint8_t endpointIndex = (uint8_t)socket;
+	
+	size_t size = 0;
+	if (endpointIndex != 0)
+	{
+		return popRoutedDatagram(&inProcessTransport->clientQueues[endpointIndex - 1], buffer, length, &size, address, receiveTime) ? (int)size : -1;
+	}
+	
+	for (uint8_t clientOffset = 0; clientOffset < inProcessTransport->numberOfClients; clientOffset++)
+	{
+		uint8_t clientIndex = (inProcessTransport->nextServerQueueIndex + clientOffset) % inProcessTransport->numberOfClients;
+		if (popRoutedDatagram(&inProcessTransport->serverQueues[clientIndex], buffer, length, &size, address, receiveTime))
+		{
+			inProcessTransport->nextServerQueueIndex = (clientIndex + 1) % inProcessTransport->numberOfClients;
+			return (int)size;
+		}
+	}
+	
+	return -1;
+}
+
+static bool hasPendingInProcessDatagram(NetworkTransport *transport, socket_t socket)
+{
+	InProcessNetworkTransport *inProcessTransport = (InProcessNetworkTransport *)transport;
+	uint8_t endpointIndex = (uint8_t)socket;
+	
+	RoutedDatagramQueue *queues = (endpointIndex == 0) ? inProcessTransport->serverQueues : &inProcessTransport->clientQueues[endpointIndex - 1];
+	uint8_t numberOfQueues = (endpointIndex == 0) ? inProcessTransport->numberOfClients : 1;
+	for (uint8_t queueIndex = 0; queueIndex < numberOfQueues; queueIndex++)
+	{
+		if (queues[queueIndex].readIndex != loadAcquireUInt32(&queues[queueIndex].writeIndex))
+		{
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+static void destroyInProcessNetworkTransport(NetworkTransport *transport)
+{
+	InProcessNetworkTransport *inProcessTransport = (InProcessNetworkTransport *)transport;
+	
+	free(inProcessTransport->serverQueues);
+	free(inProcessTransport->clientQueues);
+	free(inProcessTransport->endpointBuffers);
+	free(inProcessTransport->attachedEndpoints);
+	free(inProcessTransport->gameSteps);
+	free(inProcessTransport->gameStates);
+	free(inProcessTransport->networkStates);
+	free(inProcessTransport->idleSteps);
+	free(inProcessTransport->networkPasses);
+	free(inProcessTransport->sentDatagrams);
+	free(inProcessTransport);
+}
+
+NetworkTransport *createInProcessNetworkTransport(uint8_t numberOfClients)
+{
+	InProcessNetworkTransport *inProcessTransport = calloc(1, sizeof(*inProcessTransport));
+	inProcessTransport->transport.attachPtr = attachInProcessEndpoint;
+	inProcessTransport->transport.sendDatagramPtr = sendInProcessDatagram;
+	inProcessTransport->transport.receiveDatagramPtr = receiveInProcessDatagram;
+	inProcessTransport->transport.hasPendingDatagramPtr = hasPendingInProcessDatagram;
+	inProcessTransport->transport.destroyPtr = destroyInProcessNetworkTransport;
+	
+	inProcessTransport->numberOfClients = numberOfClients;
+	inProcessTransport->serverQueues = calloc(numberOfClients, sizeof(*inProcessTransport->serverQueues));
+	inProcessTransport->clientQueues = calloc(numberOfClients, sizeof(*inProcessTransport->clientQueues));
+	inProcessTransport->endpointBuffers = calloc(numberOfClients + 1, sizeof(*inProcessTransport->endpointBuffers));
+	inProcessTransport->attachedEndpoints = calloc(numberOfClients + 1, sizeof(*inProcessTransport->attachedEndpoints));
+	
+	return &inProcessTransport->transport;
+}
+
+void destroyNetworkTransport(NetworkTransport *transport)
+{
+	transport->destroyPtr(transport);
+}
+
+void attachNetworkTransport(NetworkConnection *connection, NetworkTransport *transport, uint8_t endpointIndex)
+{
+	connection->transport = transport;
+	connection->socket = (socket_t)endpointIndex;
+	
+	transport->attachPtr(transport, connection);
+}
+
+void enableNetworkTransportStepping(NetworkTransport *transport, uint32_t startTicks)
+{
+	InProcessNetworkTransport *inProcessTransport = (InProcessNetworkTransport *)transport;
+	uint32_t numberOfEndpoints = inProcessTransport->numberOfClients + 1;
+	
+	inProcessTransport->gameSteps = calloc(numberOfEndpoints, sizeof(*inProcessTransport->gameSteps));
+	inProcessTransport->gameStates = calloc(numberOfEndpoints, sizeof(*inProcessTransport->gameStates));
+	inProcessTransport->networkStates = calloc(numberOfEndpoints, sizeof(*inProcessTransport->networkStates));
+	inProcessTransport->idleSteps = calloc(numberOfEndpoints, sizeof(*inProcessTransport->idleSteps));
+	inProcessTransport->networkPasses = calloc(numberOfEndpoints, sizeof(*inProcessTransport->networkPasses));
+	inProcessTransport->sentDatagrams = calloc(numberOfEndpoints, sizeof(*inProcessTransport->sentDatagrams));
+	
+	transport->steppedTicks = startTicks;
+	transport->stepped = true;
+}
+
+// Called by a network thread right before it waits for something to happen, right after it's done waiting, and once it exits
+static void publishSteppedNetworkThreadState(uint8_t networkState)
+{
+	NetworkTransport *transport = currentNetworkTransport();
+	if (transport == NULL || !transport->stepped)
+	{
+		return;
+	}
+	
+	InProcessNetworkTransport *inProcessTransport = (InProcessNetworkTransport *)transport;
+	uint8_t endpointIndex = (uint8_t)gNetworkConnection->socket;
+	
+	if (networkState == STEPPED_NETWORK_BUSY)
+	{
+		storeReleaseUInt8(&inProcessTransport->networkStates[endpointIndex], STEPPED_NETWORK_BUSY);
+		storeReleaseUInt32(&inProcessTransport->networkPasses[endpointIndex], inProcessTransport->networkPasses[endpointIndex] + 1);
+		gSteppedNetworkPassStep = loadAcquireUInt32(&inProcessTransport->step);
+	}
+	else
+	{
+		storeReleaseUInt32(&inProcessTransport->idleSteps[endpointIndex], gSteppedNetworkPassStep);
+		storeReleaseUInt8(&inProcessTransport->networkStates[endpointIndex], networkState);
+	}
+}
+
+static uint32_t steppedNetworkActivity(InProcessNetworkTransport *inProcessTransport)
+{
+	uint32_t activity = 0;
+	for (uint32_t endpointIndex = 0; endpointIndex <= inProcessTransport->numberOfClients; endpointIndex++)
 	{
-		sendto(socket, data, (socket_size_t)size, 0, &address->sa, sizeof(address->sa_in6));
+		activity += loadAcquireUInt32(&inProcessTransport->networkPasses[endpointIndex]) + loadAcquireUInt32(&inProcessTransport->sentDatagrams[endpointIndex]);
 	}
+	return activity;
 }
 
-#if PLATFORM_WINDOWS
-static int
-#else
-static ssize_t
-#endif
-receiveData(socket_t socket, void *buffer, size_t length, SocketAddress *address)
+static bool hasQueuedNetworkMessages(GameMessageQueue *messageQueue)
 {
-	memset(address, 0, sizeof(*address));
-	socklen_t addressLength = sizeof(*address);
-	return recvfrom(socket, buffer, (socket_size_t)length, 0, &address->sa, &addressLength);
+	return loadAcquireUInt32(&messageQueue->writeIndex) != loadAcquireUInt32(&messageQueue->readIndex);
 }
 
-static uint8_t characterIDForClientAddress(SocketAddress *address)
+// Checks that every running network thread went idle during this step with nothing left to read or send
+// Wakes up the ones that went idle during an earlier step, since they have yet to see this step's clock
+static bool steppedNetworkThreadsSettled(InProcessNetworkTransport *inProcessTransport, uint32_t step)
 {
-	for (uint8_t clientIndex = 0; clientIndex < gCurrentSlot; clientIndex++)
+	bool settled = true;
+	for (uint8_t endpointIndex = 0; endpointIndex <= inProcessTransport->numberOfClients; endpointIndex++)
 	{
-		if (memcmp(address, &gNetworkConnection->clientAddresses[clientIndex], sizeof(*address)) == 0)
+		if (loadAcquireUInt8(&inProcessTransport->attachedEndpoints[endpointIndex]) == 0)
 		{
-			return clientIndex + 1;
+			continue;
+		}
+		
+		uint8_t networkState = loadAcquireUInt8(&inProcessTransport->networkStates[endpointIndex]);
+		if (networkState == STEPPED_NETWORK_STOPPED)
+		{
+			continue;
+		}
+		
+		NetworkBuffers *buffers = inProcessTransport->endpointBuffers[endpointIndex];
+		if (networkState == STEPPED_NETWORK_BUSY)
+		{
+			settled = false;
+		}
+		else if (loadAcquireUInt32(&inProcessTransport->idleSteps[endpointIndex]) != step)
+		{
+			settled = false;
+			wakeNetworkThread(buffers);
+		}
+		else if (hasPendingInProcessDatagram(&inProcessTransport->transport, endpointIndex) || hasQueuedNetworkMessages(&buffers->gameMessagesToNet) || hasQueuedNetworkMessages(&buffers->networkThreadMessages))
+		{
+			settled = false;
 		}
 	}
-	return NO_CHARACTER;
+	return settled;
 }
 
-static void advanceSendBuffer(char **sendBufferPtr, const void *data, size_t size)
+uint32_t stepNetworkTransport(NetworkTransport *transport, uint32_t ticks)
 {
-	memcpy(*sendBufferPtr, data, size);
-	*sendBufferPtr += size;
+	InProcessNetworkTransport *inProcessTransport = (InProcessNetworkTransport *)transport;
+	uint32_t numberOfEndpoints = inProcessTransport->numberOfClients + 1;
+	
+	storeReleaseUInt32(&transport->steppedTicks, ticks);
+	uint32_t step = inProcessTransport->step + 1;
+	storeReleaseUInt32(&inProcessTransport->step, step);
+	
+	// Games take their step first, so the messages they queue are sent within the same step
+	// Ones that haven't started taking steps yet are waited for as well, so none of them miss out on any
+	for (uint32_t endpointIndex = 0; endpointIndex < numberOfEndpoints; endpointIndex++)
+	{
+		uint8_t gameState;
+		while ((gameState = loadAcquireUInt8(&inProcessTransport->gameStates[endpointIndex])) == STEPPED_GAME_NOT_JOINED || (gameState == STEPPED_GAME_JOINED && loadAcquireUInt32(&inProcessTransport->gameSteps[endpointIndex]) != step))
+		{
+			ZGDelay(0);
+		}
+	}
+	
+	for (;;)
+	{
+		uint32_t activity = steppedNetworkActivity(inProcessTransport);
+		if (steppedNetworkThreadsSettled(inProcessTransport, step) && steppedNetworkActivity(inProcessTransport) == activity)
+		{
+			break;
+		}
+		ZGDelay(0);
+	}
+	
+	uint32_t numberOfSteppingEndpoints = 0;
+	for (uint32_t endpointIndex = 0; endpointIndex < numberOfEndpoints; endpointIndex++)
+	{
+		if (loadAcquireUInt8(&inProcessTransport->gameStates[endpointIndex]) != STEPPED_GAME_LEFT)
+		{
+			numberOfSteppingEndpoints++;
+		}
+	}
+	return numberOfSteppingEndpoints;
 }
 
-#define ADVANCE_SEND_BUFFER(sendBufferPtr, data) advanceSendBuffer((sendBufferPtr), &(data), sizeof(data))
+uint32_t waitForNetworkTransportStep(NetworkTransport *transport, uint8_t endpointIndex)
+{
+	InProcessNetworkTransport *inProcessTransport = (InProcessNetworkTransport *)transport;
+	
+	if (inProcessTransport->gameStates[endpointIndex] == STEPPED_GAME_NOT_JOINED)
+	{
+		storeReleaseUInt32(&inProcessTransport->gameSteps[endpointIndex], loadAcquireUInt32(&inProcessTransport->step));
+		storeReleaseUInt8(&inProcessTransport->gameStates[endpointIndex], STEPPED_GAME_JOINED);
+	}
+	
+	uint32_t step;
+	while ((step = loadAcquireUInt32(&inProcessTransport->step)) == inProcessTransport->gameSteps[endpointIndex])
+	{
+		ZGDelay(0);
+	}
+	return step;
+}
 
-static void advanceSendBufferForInitialMessage(char **sendBufferPtr, uint8_t tag, uint32_t packetNumber)
+void finishNetworkTransportStep(NetworkTransport *transport, uint8_t endpointIndex, uint32_t step)
 {
-	ADVANCE_SEND_BUFFER(sendBufferPtr, tag);
-	ADVANCE_SEND_BUFFER(sendBufferPtr, packetNumber);
+	InProcessNetworkTransport *inProcessTransport = (InProcessNetworkTransport *)transport;
+	storeReleaseUInt32(&inProcessTransport->gameSteps[endpointIndex], step);
 }
 
-// Our largest message size so far is around 20 bytes.
-// This should be plenty for now.
-#define MAX_MESSAGE_SIZE 32
-static void sendAndResetBufferIfNeeded(char *sendBuffer, size_t sendBufferSize, char **sendBufferPtr, SocketAddress *address)
+void leaveNetworkTransportStepping(NetworkTransport *transport, uint8_t endpointIndex)
+{
+	InProcessNetworkTransport *inProcessTransport = (InProcessNetworkTransport *)transport;
+	storeReleaseUInt8(&inProcessTransport->gameStates[endpointIndex], STEPPED_GAME_LEFT);
+}
+
+// Reads pending datagrams from the server's socket, or the ones routed to its match if a router owns the socket
+// When replaying a capture, the datagrams that are due are read from it instead
+static uint32_t receiveServerDatagrams(DatagramBatch *batch)
 {
-	if ((size_t)(*sendBufferPtr - sendBuffer) >= sendBufferSize - MAX_MESSAGE_SIZE)
+	NetworkReplay *replay = gNetworkConnection->replay;
+	NetworkMatchRouter *router = gNetworkConnection->router;
+	
+	batch->count = 0;
+	if (replay != NULL)
+	{
+		while (batch->count < DATAGRAM_BATCH_CAPACITY && hasReplayedDatagram(replay))
+		{
+			batch->sizes[batch->count] = readReplayedDatagram(replay, batch->buffers[batch->count], &batch->addresses[batch->count]);
+			batch->receiveTimes[batch->count] = networkMicroTicks();
+			batch->count++;
+		}
+		
+		return batch->count;
+	}
+	else if (router == NULL)
+	{
+		receiveDatagrams(gNetworkConnection->socket, batch);
+	}
+	else
+	{
+		RoutedDatagramQueue *queue = &router->matches[gNetworkConnection->matchIndex].routedDatagrams;
+		
+		uint32_t readIndex = queue->readIndex;
+		uint32_t writeIndex = loadAcquireUInt32(&queue->writeIndex);
+		
+		while (batch->count < DATAGRAM_BATCH_CAPACITY && readIndex != writeIndex)
+		{
+			RoutedDatagram *datagram = &queue->datagrams[readIndex & (ROUTED_DATAGRAM_QUEUE_CAPACITY - 1)];
+			memcpy(batch->buffers[batch->count], datagram->buffer, datagram->size);
+			batch->sizes[batch->count] = datagram->size;
+			batch->addresses[batch->count] = datagram->address;
+			batch->receiveTimes[batch->count] = datagram->receiveTime;
+			batch->count++;
+			
+			readIndex++;
+		}
+		
+		storeReleaseUInt32(&queue->readIndex, readIndex);
+	}
+	
+	for (uint32_t datagramIndex = 0; datagramIndex < batch->count; datagramIndex++)
 	{
-		sendData(gNetworkConnection->socket, sendBuffer, (size_t)(*sendBufferPtr - sendBuffer), address);
-		*sendBufferPtr = sendBuffer;
+		captureDatagram(false, &batch->addresses[datagramIndex], batch->buffers[datagramIndex], batch->sizes[datagramIndex]);
 	}
+	
+	return batch->count;
 }
 
-static void advanceReceiveBuffer(char **buffer, void *receiveData, size_t receiveDataSize)
+// Whether a datagram from the server is waiting to be read by the client, or is due to be replayed
+static bool clientDatagramIsPending(void)
 {
-	memcpy(receiveData, *buffer, receiveDataSize);
-	*buffer += receiveDataSize;
+	if (gNetworkConnection->replay != NULL)
+	{
+		return hasReplayedDatagram(gNetworkConnection->replay);
+	}
+	
+	NetworkTransport *transport = gNetworkConnection->transport;
+	if (transport != NULL)
+	{
+		return transport->hasPendingDatagramPtr(transport, gNetworkConnection->socket);
+	}
+	
+	fd_set socketSet;
+	FD_ZERO(&socketSet);
+	FD_SET(gNetworkConnection->socket, &socketSet);
+	
+	struct timeval waitValue;
+	waitValue.tv_sec = 0;
+	waitValue.tv_usec = 0;
+	
+	return (select((int)(gNetworkConnection->socket + 1), &socketSet, NULL, NULL, &waitValue) > 0);
 }
 
-#define ADVANCE_RECEIVE_BUFFER(buffer, data) advanceReceiveBuffer(buffer, &(data), sizeof((data)))
+// Only to be called after clientDatagramIsPending() returns true
+static int receiveClientDatagram(char *buffer, size_t length, uint64_t *receiveTime)
+{
+	if (gNetworkConnection->replay != NULL)
+	{
+		SocketAddress replayedAddress;
+		*receiveTime = networkMicroTicks();
+		return (int)readReplayedDatagram(gNetworkConnection->replay, buffer, &replayedAddress);
+	}
+	
+	int numberOfBytes = (int)receiveData(gNetworkConnection->socket, buffer, length, &gNetworkConnection->hostAddress, receiveTime);
+	if (numberOfBytes != -1)
+	{
+		captureDatagram(false, &gNetworkConnection->hostAddress, buffer, (size_t)numberOfBytes);
+	}
+	
+	return numberOfBytes;
+}
 
-static void disconnectClient(uint8_t addressIndex, uint32_t *lastPongReceivedTimestamps)
+// Finds the match a datagram belongs to, assigning a new client to the first match with room for it
+// Returns NULL if the datagram should be dropped
+static NetworkMatch *routeDatagram(NetworkMatchRouter *router, const char *buffer, size_t size, SocketAddress *address)
 {
-	ZGLockMutex(gCurrentSlotAndClientStatesMutex);
+	for (uint32_t matchIndex = 0; matchIndex < router->numberOfMatches; matchIndex++)
+	{
+		NetworkMatch *match = &router->matches[matchIndex];
+		for (uint8_t clientIndex = 0; clientIndex < match->numberOfClients; clientIndex++)
+		{
+			if (memcmp(address, &match->clientAddresses[clientIndex], sizeof(*address)) == 0)
+			{
+				return match;
+			}
+		}
+	}
+	
+	// Only a request to play can introduce a client
+	uint8_t messageTag = 0;
+	uint32_t packetNumber = 0;
+	uint8_t networkVersion = 0;
+	if (size < sizeof(messageTag) + sizeof(packetNumber) + sizeof(networkVersion))
+	{
+		return NULL;
+	}
 	
-	gClientStates[addressIndex] = CLIENT_STATE_DEAD;
+	// Sources that aren't playing yet can only ask to play or spectate every so often
+	uint32_t currentTime = networkTicks();
+	if (!takeSourceTokens(&router->rateLimiter, address, HANDSHAKE_TOKEN_COST, currentTime))
+	{
+		return NULL;
+	}
 	
-	ZGUnlockMutex(gCurrentSlotAndClientStatesMutex);
+	memcpy(&messageTag, buffer, sizeof(messageTag));
 	
-	GameMessage message;
+	// Spectators aren't remembered here, so every request to keep watching names the match it's for
+	if (messageTag == SPECTATE_MESSAGE_TAG)
+	{
+		uint32_t matchIndex = 0;
+		memcpy(&matchIndex, buffer + sizeof(messageTag) + sizeof(networkVersion), sizeof(matchIndex));
+		
+		return (matchIndex < router->numberOfMatches && router->matches[matchIndex].routedGeneration != 0) ? &router->matches[matchIndex] : NULL;
+	}
+	
+	memcpy(&networkVersion, buffer + sizeof(messageTag) + sizeof(packetNumber), sizeof(networkVersion));
+	if (messageTag != CAN_I_PLAY_MESSAGE_TAG)
+	{
+		return NULL;
+	}
+	
+	if (networkVersion == NETWORK_VERSION)
+	{
+		// A client only gets a place in a match once it echoes back a cookie, so spoofed requests can't fill them up
+		uint64_t cookie = 0;
+		size_t cookieOffset = sizeof(messageTag) + sizeof(packetNumber) + sizeof(networkVersion) + (MAX_USER_NAME_SIZE - 1);
+		if (size >= cookieOffset + sizeof(cookie))
+		{
+			memcpy(&cookie, buffer + cookieOffset, sizeof(cookie));
+		}
+		
+		if (!acceptsHandshakeCookie(&router->cookieKeys, address, cookie, currentTime))
+		{
+			if (takeHandshakeReplyToken(&router->rateLimiter, currentTime))
+			{
+				sendHandshakeCookie(router->socket, &router->cookieKeys, address, currentTime);
+			}
+			return NULL;
+		}
+		
+		for (uint32_t matchIndex = 0; matchIndex < router->numberOfMatches; matchIndex++)
+		{
+			NetworkMatch *match = &router->matches[matchIndex];
+			if (match->routedGeneration != 0 && match->numberOfClients < router->playersPerMatch)
+			{
+				match->clientAddresses[match->numberOfClients] = *address;
+				match->numberOfClients++;
+				return match;
+			}
+		}
+	}
+	
+	// Every match is full or the client can't play with us
+	if (takeHandshakeReplyToken(&router->rateLimiter, currentTime))
+	{
+		uint8_t rejectionTag = SERVER_REJECTION_MESSAGE_TAG;
+		sendData(router->socket, &rejectionTag, sizeof(rejectionTag), address);
+	}
+	
+	return NULL;
+}
+
+// Reads the shared socket and hands datagrams to the network threads of the matches they're for
+int networkMatchRouterThread(void *context)
+{
+	NetworkMatchRouter *router = context;
+	
+	DatagramBatch receivedDatagrams;
+	receivedDatagrams.count = 0;
+	
+	while (loadAcquireUInt8(&router->needsToQuit) == 0)
+	{
+		// Matches that restarted have a new set of clients
+		for (uint32_t matchIndex = 0; matchIndex < router->numberOfMatches; matchIndex++)
+		{
+			NetworkMatch *match = &router->matches[matchIndex];
+			uint32_t generation = loadAcquireUInt32(&match->generation);
+			if (generation != match->routedGeneration)
+			{
+				match->routedGeneration = generation;
+				match->numberOfClients = 0;
+				memset(match->clientAddresses, 0, sizeof(match->clientAddresses));
+			}
+		}
+		
+		uint32_t numberOfDatagrams = receiveDatagrams(router->socket, &receivedDatagrams);
+		if (numberOfDatagrams == 0)
+		{
+			waitForNetworkEvents(router->socket, true, NETWORK_IDLE_WAIT_DELAY);
+			continue;
+		}
+		
+		for (uint32_t datagramIndex = 0; datagramIndex < numberOfDatagrams; datagramIndex++)
+		{
+			NetworkMatch *match = routeDatagram(router, receivedDatagrams.buffers[datagramIndex], receivedDatagrams.sizes[datagramIndex], &receivedDatagrams.addresses[datagramIndex]);
+			if (match != NULL && pushRoutedDatagram(&match->routedDatagrams, receivedDatagrams.buffers[datagramIndex], receivedDatagrams.sizes[datagramIndex], &receivedDatagrams.addresses[datagramIndex], receivedDatagrams.receiveTimes[datagramIndex]))
+			{
+				match->needsWakeup = true;
+			}
+		}
+		
+		// Wake each match once per batch rather than once per datagram
+		for (uint32_t matchIndex = 0; matchIndex < router->numberOfMatches; matchIndex++)
+		{
+			NetworkMatch *match = &router->matches[matchIndex];
+			if (match->needsWakeup)
+			{
+				wakeNetworkThread(match->buffers);
+				match->needsWakeup = false;
+			}
+		}
+	}
+	
+	finishNetworkConditioner();
+	
+	return 0;
+}
+
+bool allNetworkClientsDisconnected(void)
+{
+	uint8_t currentSlot = loadAcquireUInt8(&gNetworkConnection->currentSlot);
+	if (currentSlot == 0)
+	{
+		return false;
+	}
+	
+	for (uint8_t clientIndex = 0; clientIndex < currentSlot; clientIndex++)
+	{
+		if (loadAcquireUInt8(&gNetworkConnection->clientStates[clientIndex]) == CLIENT_STATE_ALIVE)
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+static void disconnectClient(uint8_t addressIndex, uint32_t *lastPongReceivedTimestamps)
+{
+	storeReleaseUInt8(&gNetworkConnection->clientStates[addressIndex], CLIENT_STATE_DEAD);
+	
+	GameMessage message = {0};
 	message.type = LAGGED_OUT_MESSAGE_TYPE;
 	message.laggedUpdate.characterID = addressIndex + 1;
-	sendToClients(addressIndex + 1, &message);
+	queueMessageToClients(&gNetworkBuffers->networkThreadMessages, addressIndex + 1, &message);
 	
-	pushNetworkMessage(&gGameMessagesFromNet, message);
+	deliverNetworkMessage(message);
 	
 	lastPongReceivedTimestamps[addressIndex] = 0;
 	
 	memset(&gNetworkConnection->clientAddresses[addressIndex], 0, sizeof(gNetworkConnection->clientAddresses[addressIndex]));
 }
 
-int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
+int serverNetworkThread(void *context)
 {
-	uint8_t numberOfPlayersToWaitFor = *(uint8_t *)initialNumberOfPlayersToWaitForPtr;
+	gNetworkConnection = context;
+	gNetworkBuffers = gNetworkConnection->buffers;
+	
+	gOverflowedNetworkPeers = 0;
+	
+	uint8_t numberOfPlayersToWaitFor = gNetworkConnection->numberOfPlayersToWaitFor;
+	
+	startNetworkCapture();
+	
+	// Our clock is the server's
+	gTracedServerClockOffset = 0;
+	gTracedServerClockSynchronized = true;
 	
 	uint32_t triggerOutgoingPacketNumbers[] = {1, 1, 1};
 	uint32_t realTimeOutgoingPacketNumbers[] = {1, 1, 1};
 	
-	uint32_t triggerIncomingPacketNumbers[] = {0, 0, 0};
+	NetworkPeerStats peerStats[3];
+	memset(peerStats, 0, sizeof(peerStats));
+	uint32_t lastStatsPublishTime = networkTicks();
 	
-	size_t receivedAckPacketsCapacity = 512;
-	uint32_t *receivedAckPacketNumbers[3];
-	for (size_t receivedAckPacketNumberIndex = 0; receivedAckPacketNumberIndex < sizeof(receivedAckPacketNumbers) / sizeof(receivedAckPacketNumbers[0]); receivedAckPacketNumberIndex++)
+	ReliableReceiveState reliableReceiveStates[3];
+	memset(reliableReceiveStates, 0, sizeof(reliableReceiveStates));
+	
+	ReliableSendState reliableSendStates[3];
+	for (uint8_t addressIndex = 0; addressIndex < 3; addressIndex++)
+	{
+		reliableReceiveStates[addressIndex].stats = &peerStats[addressIndex];
+		initializeReliableSendState(&reliableSendStates[addressIndex], &peerStats[addressIndex]);
+	}
+	
+	SendRateController sendRateControllers[3];
+	for (uint8_t addressIndex = 0; addressIndex < 3; addressIndex++)
 	{
-		receivedAckPacketNumbers[receivedAckPacketNumberIndex] = calloc(sizeof(*receivedAckPacketNumbers[receivedAckPacketNumberIndex]), receivedAckPacketsCapacity);
+		initializeSendRateController(&sendRateControllers[addressIndex], networkTicks());
 	}
 	
-	uint32_t receivedAckPacketCount = 0;
+	// The world as of the messages we've processed so far, and the snapshots of it clients may still be acking
+	// Snapshot 0 is the default world
+	WorldSnapshot worldSnapshot;
+	memset(&worldSnapshot, 0, sizeof(worldSnapshot));
+	WorldSnapshot worldSnapshotHistory[WORLD_SNAPSHOT_HISTORY_SIZE];
+	worldSnapshotHistory[0] = worldSnapshot;
+	uint32_t latestWorldSnapshotNumber = 0;
+	
+	WorldSnapshotSendState worldSnapshotSendStates[3];
+	memset(worldSnapshotSendStates, 0, sizeof(worldSnapshotSendStates));
+	
+	SpectatorStream spectatorStream;
+	memset(&spectatorStream, 0, sizeof(spectatorStream));
+	
+	// A routed match checks cookies made by the router
+	NetworkHashKeys serverCookieKeys;
+	generateNetworkHashKeys(&serverCookieKeys);
+	const NetworkHashKeys *cookieKeys = (gNetworkConnection->router != NULL) ? &gNetworkConnection->router->cookieKeys : &serverCookieKeys;
+	
+	SourceRateLimiter rateLimiter;
+	initializeSourceRateLimiter(&rateLimiter, networkTicks());
+	
+	// Everything we send or receive in one pass goes through these so it takes as few system calls as possible
+	DatagramBatch outgoingDatagrams;
+	outgoingDatagrams.count = 0;
+	DatagramBatch receivedDatagrams;
+	receivedDatagrams.count = 0;
 	
 	uint32_t lastPongReceivedTimestamps[3] = {0, 0, 0};
 	
+	// Newest movement input passed on from each client
+	uint16_t lastInputSequences[3] = {0, 0, 0};
+	
 	bool needsToQuit = false;
 	
 	while (!needsToQuit)
 	{
-		uint32_t timeBeforeProcessing = ZGGetTicks();
+		// Clients we couldn't queue a message for would be left with a hole in what they're sent, so they're dropped instead
+		while ((gOverflowedNetworkPeers & ~OVERFLOWED_CONNECTION_MASK) != 0)
+		{
+			uint8_t addressIndex = 0;
+			while ((gOverflowedNetworkPeers & (1 << addressIndex)) == 0)
+			{
+				addressIndex++;
+			}
+			gOverflowedNetworkPeers &= ~(1 << addressIndex);
+			
+			if (gNetworkConnection->clientStates[addressIndex] == CLIENT_STATE_ALIVE)
+			{
+				fprintf(stderr, "Error: too many messages are queued for client %d, disconnecting it\n", addressIndex + 1);
+				disconnectClient(addressIndex, lastPongReceivedTimestamps);
+			}
+		}
+		
+		if (gOverflowedNetworkPeers != 0)
+		{
+			fprintf(stderr, "Error: too many network messages are queued, quitting\n");
+			
+			GameMessage quitMessage;
+			quitMessage.type = QUIT_MESSAGE_TYPE;
+			deliverNetworkMessage(quitMessage);
+			
+			break;
+		}
+		
+		uint32_t currentTime = networkTicks();
 		
-		uint32_t messagesCount = 0;
-		GameMessage *messagesAvailable = popNetworkMessages(&gGameMessagesToNet, &messagesCount);
+		bool hasPendingResends = false;
+		uint32_t nextResendTime = 0;
+		bool receivedData = false;
 		
-		if (messagesAvailable != NULL)
+		// Our own queued messages were queued on an earlier pass, so they come first
+		uint32_t networkThreadMessagesCount = beginReadingNetworkMessages(&gNetworkBuffers->networkThreadMessages);
+		uint32_t queuedMessagesCount = beginReadingNetworkMessages(&gNetworkBuffers->gameMessagesToNet);
+		uint32_t messagesCount = networkThreadMessagesCount + queuedMessagesCount;
+		
+		// Acks ride along with whatever we send, but still need to go out on their own if there's nothing else
+		bool hasAcksToSend = reliableReceiveStates[0].needsToSendAcks || reliableReceiveStates[1].needsToSendAcks || reliableReceiveStates[2].needsToSendAcks;
+		
+		// Snapshots clients haven't acked yet may be due to be sent again
+		bool hasUnackedWorldSnapshots = false;
+		for (uint8_t addressIndex = 0; addressIndex < gNetworkConnection->currentSlot; addressIndex++)
+		{
+			if (gNetworkConnection->clientStates[addressIndex] == CLIENT_STATE_ALIVE && worldSnapshotSendStates[addressIndex].ackedSnapshotNumber != latestWorldSnapshotNumber)
+			{
+				hasUnackedWorldSnapshots = true;
+			}
+		}
+		
+		// Movement is paced to what each client's link can take, which may have left some held back that are due now
+		bool movementsDue[3] = {true, true, true};
+		bool hasDuePendingMovements = false;
+		for (uint8_t addressIndex = 0; addressIndex < gNetworkConnection->currentSlot; addressIndex++)
+		{
+			if (gNetworkConnection->clientStates[addressIndex] == CLIENT_STATE_ALIVE)
+			{
+				SendRateController *rateController = &sendRateControllers[addressIndex];
+				adjustSendRate(rateController, &reliableSendStates[addressIndex], currentTime);
+				
+				movementsDue[addressIndex] = movementSendIsDue(rateController, currentTime);
+				if (movementsDue[addressIndex] && rateController->pendingMovementCharacters != 0)
+				{
+					hasDuePendingMovements = true;
+				}
+			}
+		}
+		
+		if (messagesCount > 0 || hasAcksToSend || hasUnackedWorldSnapshots || hasDuePendingMovements)
 		{
 			char sendBuffers[3][MAX_PACKET_SIZE];
 			char *sendBufferPtrs[] = {sendBuffers[0], sendBuffers[1], sendBuffers[2]};
 			
+			bool sentMovements[3] = {false, false, false};
+			
 			// Only keep one movement message per character per packet
 			uint32_t trackedMovementIndices[3][4] = {{0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}};
 			// Only keep one ping message per character per packet
 			uint32_t trackedPingIndices[3] = {0, 0, 0};
 			for (uint32_t messagesLeft = messagesCount; messagesLeft > 0; messagesLeft--)
 			{
-				GameMessage message = messagesAvailable[messagesLeft - 1];
-				if (message.type == CHARACTER_MOVED_UPDATE_MESSAGE_TYPE)
+				GameMessage *messagePtr = pendingNetworkMessageAtIndex(messagesLeft - 1, networkThreadMessagesCount);
+				GameMessage message = *messagePtr;
+				if (message.type == CHARACTER_MOVED_UPDATE_MESSAGE_TYPE && message.addressIndex != SPECTATORS_ADDRESS_INDEX)
 				{
 					int addressIndex = message.addressIndex;
 					uint8_t characterIndex = message.movedUpdate.characterID - 1;
@@ -874,7 +5223,7 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 					}
 					else
 					{
-						messagesAvailable[messagesLeft - 1].addressIndex = -1;
+						messagePtr->addressIndex = -1;
 					}
 				}
 				else if (message.type == PING_MESSAGE_TYPE)
@@ -887,18 +5236,85 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 					}
 					else
 					{
-						messagesAvailable[messagesLeft - 1].addressIndex = -1;
+						messagePtr->addressIndex = -1;
 					}
 				}
 			}
 			
+			// Held back movements go out first unless this pass has a newer one for the same character
+			for (uint8_t addressIndex = 0; addressIndex < gNetworkConnection->currentSlot && !needsToQuit; addressIndex++)
+			{
+				SendRateController *rateController = &sendRateControllers[addressIndex];
+				if (!movementsDue[addressIndex] || rateController->pendingMovementCharacters == 0)
+				{
+					continue;
+				}
+				
+				SocketAddress *address = &gNetworkConnection->clientAddresses[addressIndex];
+				for (uint8_t characterIndex = 0; characterIndex < 4; characterIndex++)
+				{
+					if ((rateController->pendingMovementCharacters & (1 << characterIndex)) != 0 && trackedMovementIndices[addressIndex][characterIndex] == 0)
+					{
+						GameMessage *pendingMovement = &rateController->pendingMovements[characterIndex];
+						pendingMovement->packetNumber = realTimeOutgoingPacketNumbers[addressIndex];
+						realTimeOutgoingPacketNumbers[addressIndex]++;
+						
+						char *messageStart = sendBufferPtrs[addressIndex];
+						writeMovementMessage(&sendBufferPtrs[addressIndex], pendingMovement, addressIndex);
+						traceSentMessage(pendingMovement);
+						
+						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], messageStart, address, &reliableReceiveStates[addressIndex], &outgoingDatagrams);
+						
+						sentMovements[addressIndex] = true;
+					}
+				}
+				rateController->pendingMovementCharacters = 0;
+			}
+			
 			for (uint32_t messageIndex = 0; messageIndex < messagesCount; messageIndex++)
 			{
-				GameMessage message = messagesAvailable[messageIndex];
+				GameMessage message = *pendingNetworkMessageAtIndex(messageIndex, networkThreadMessagesCount);
+				if (messageIndex >= networkThreadMessagesCount)
+				{
+					traceDequeuedMessage(&message);
+				}
 				int addressIndex = message.addressIndex;
+				
+				// Nothing is sent to clients we dropped, so their messages aren't kept around to take up room either
+				if (addressIndex >= 0 && gNetworkConnection->clientStates[addressIndex] == CLIENT_STATE_DEAD)
+				{
+					continue;
+				}
+				
+				if (addressIndex == SPECTATORS_ADDRESS_INDEX)
+				{
+					if (isWorldSnapshotMessage(message.type))
+					{
+						applyMessageToWorldSnapshot(&worldSnapshot, &message);
+					}
+					else if (message.type == GAME_RESET_MESSAGE_TYPE)
+					{
+						// Resetting the world before the messages after the reset are applied to it
+						resetWorldSnapshotTiles(&worldSnapshot);
+					}
+					
+					recordSpectatorMessage(&spectatorStream, &message);
+					continue;
+				}
+				
 				SocketAddress *address = (addressIndex == -1) ? NULL : &gNetworkConnection->clientAddresses[addressIndex];
 				
-				if (!needsToQuit && message.type != QUIT_MESSAGE_TYPE && message.type != ACK_MESSAGE_TYPE && message.type != FIRST_DATA_TO_CLIENT_MESSAGE_TYPE && message.type != PING_MESSAGE_TYPE && message.type != PONG_MESSAGE_TYPE)
+				// Hold on to the character's latest movement until the client's link can take more, rather than queueing behind it
+				if (message.type == CHARACTER_MOVED_UPDATE_MESSAGE_TYPE && addressIndex != -1 && !movementsDue[addressIndex])
+				{
+					SendRateController *rateController = &sendRateControllers[addressIndex];
+					uint8_t characterIndex = message.movedUpdate.characterID - 1;
+					rateController->pendingMovements[characterIndex] = message;
+					rateController->pendingMovementCharacters |= (1 << characterIndex);
+					continue;
+				}
+				
+				if (!needsToQuit && message.type != QUIT_MESSAGE_TYPE && message.type != FIRST_DATA_TO_CLIENT_MESSAGE_TYPE && message.type != PING_MESSAGE_TYPE && message.type != PONG_MESSAGE_TYPE)
 				{
 					if (message.packetNumber == 0)
 					{
@@ -919,32 +5335,20 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 							message.packetNumber = triggerOutgoingPacketNumbers[addressIndex];
 							triggerOutgoingPacketNumbers[addressIndex]++;
 							
-							// Re-send message until we receive an ack
-							pushNetworkMessage(&gGameMessagesToNet, message);
-						}
-					}
-					else if (message.type != CHARACTER_MOVED_UPDATE_MESSAGE_TYPE)
-					{
-						bool foundAck = false;
-						uint32_t maxPacketCount = receivedAckPacketCount < (uint32_t)receivedAckPacketsCapacity ? receivedAckPacketCount : (uint32_t)receivedAckPacketsCapacity;
-						for (uint32_t packetIndex = 0; packetIndex < maxPacketCount; packetIndex++)
-						{
-							if (message.packetNumber == receivedAckPacketNumbers[addressIndex][packetIndex])
+							message.resendTime = currentTime;
+							message.sendCount = 0;
+							
+							if (message.type == GAME_RESET_MESSAGE_TYPE)
 							{
-								foundAck = true;
-								break;
+								worldSnapshotSendStates[addressIndex].requiredSequence = message.packetNumber;
 							}
 						}
-						
-						if (foundAck)
-						{
-							continue;
-						}
-						else
-						{
-							// Re-send message until we receive an ack
-							pushNetworkMessage(&gGameMessagesToNet, message);
-						}
+					}
+					
+					// Re-send message until we receive an ack
+					if (message.type != CHARACTER_MOVED_UPDATE_MESSAGE_TYPE && !scheduleReliableMessage(&reliableSendStates[addressIndex], &message, currentTime, &hasPendingResends, &nextResendTime))
+					{
+						continue;
 					}
 				}
 				
@@ -953,6 +5357,8 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 					continue;
 				}
 				
+				char *messageStart = (addressIndex == -1) ? NULL : sendBufferPtrs[addressIndex];
+				
 				switch (message.type)
 				{
 					case WELCOME_MESSAGE_TO_SERVER_MESSAGE_TYPE:
@@ -983,7 +5389,7 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], message.firedUpdate.y);
 						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], flags);
 						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
+						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], messageStart, address, &reliableReceiveStates[addressIndex], &outgoingDatagrams);
 						
 						break;
 					}
@@ -995,7 +5401,7 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 						
 						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], message.numberOfWaitingPlayers);
 						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
+						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], messageStart, address, &reliableReceiveStates[addressIndex], &outgoingDatagrams);
 						
 						break;
 					}
@@ -1005,11 +5411,9 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 						
 						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], message.netNameRequest.characterID);
 						
-						char netName[MAX_USER_NAME_SIZE] = {0};
-						strncpy(netName, message.netNameRequest.netName, MAX_USER_NAME_SIZE - 1);
-						advanceSendBuffer(&sendBufferPtrs[addressIndex], netName, sizeof(netName) - 1);
+						advanceSendBuffer(&sendBufferPtrs[addressIndex], message.netNameRequest.netName, MAX_USER_NAME_SIZE - 1);
 						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
+						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], messageStart, address, &reliableReceiveStates[addressIndex], &outgoingDatagrams);
 						
 						break;
 					}
@@ -1017,7 +5421,7 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 					{
 						advanceSendBufferForInitialMessage(&sendBufferPtrs[addressIndex], START_GAME_MESSAGE_TAG, message.packetNumber);
 						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
+						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], messageStart, address, &reliableReceiveStates[addressIndex], &outgoingDatagrams);
 						
 						break;
 					}
@@ -1027,59 +5431,7 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 						
 						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], message.gameStartNumber);
 						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
-						
-						break;
-					}
-					case CHARACTER_DIED_UPDATE_MESSAGE_TYPE:
-					{
-						advanceSendBufferForInitialMessage(&sendBufferPtrs[addressIndex], PLAYER_KILLED_MESSAGE_TAG, message.packetNumber);
-						
-						uint8_t flags = 0;
-						flags |= ((message.diedUpdate.characterID - 1) << 0); // 2 bits needed
-						flags |= (message.diedUpdate.characterLives << 2); // 4 bits needed
-						
-						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], flags);
-						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
-						
-						break;
-					}
-					case COLOR_TILE_MESSAGE_TYPE:
-					{
-						advanceSendBufferForInitialMessage(&sendBufferPtrs[addressIndex], COLOR_TILE_MESSAGE_TAG, message.packetNumber);
-						
-						uint8_t flags = 0;
-						flags |= ((message.colorTile.characterID - 1) << 0); // 2 bits needed
-						flags |= (message.colorTile.tileIndex << 2); // 6 bits needed
-						
-						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], flags);
-						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
-						
-						break;
-					}
-					case TILE_FALLING_DOWN_MESSAGE_TYPE:
-					{
-						advanceSendBufferForInitialMessage(&sendBufferPtrs[addressIndex], TILE_FALLING_MESSAGE_TAG, message.packetNumber);
-						
-						uint8_t flags = 0;
-						flags |= (message.fallingTile.dead << 0); // 1 bit needed
-						flags |= (message.fallingTile.tileIndex << 1); // 6 bits needed
-						
-						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], flags);
-						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
-						
-						break;
-					}
-					case RECOVER_TILE_MESSAGE_TYPE:
-					{
-						advanceSendBufferForInitialMessage(&sendBufferPtrs[addressIndex], RECOVER_TILE_MESSAGE_TAG, message.packetNumber);
-						
-						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], message.recoverTile.tileIndex);
-						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
+						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], messageStart, address, &reliableReceiveStates[addressIndex], &outgoingDatagrams);
 						
 						break;
 					}
@@ -1090,40 +5442,17 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 						uint8_t flags = message.laggedUpdate.characterID - 1;
 						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], flags);
 						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
+						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], messageStart, address, &reliableReceiveStates[addressIndex], &outgoingDatagrams);
 						
 						break;
 					}
 					case CHARACTER_MOVED_UPDATE_MESSAGE_TYPE:
 					{
-						advanceSendBufferForInitialMessage(&sendBufferPtrs[addressIndex], MOVEMENT_MESSAGE_TAG, message.packetNumber);
-						
-						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], message.movedUpdate.x);
-						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], message.movedUpdate.y);
-						
-						uint8_t flags = 0;
-						flags |= ((message.movedUpdate.characterID - 1) << 0); // 2 bits needed
-						flags |= (message.movedUpdate.direction << 2); // 3 bits needed
-						flags |= ((message.movedUpdate.pointing_direction - 1) << 5); // 2 bits needed
-						flags |= (message.movedUpdate.dead << 7); // 1 bit needed
-						
-						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], flags);
-						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
-						
-						break;
-					}
-					case CHARACTER_KILLED_UPDATE_MESSAGE_TYPE:
-					{
-						advanceSendBufferForInitialMessage(&sendBufferPtrs[addressIndex], CHARACTER_KILLS_MESSAGE_TAG, message.packetNumber);
-						
-						uint8_t flags = 0;
-						flags |= ((message.killedUpdate.characterID - 1) << 0); // 2 bits needed
-						flags |= (message.killedUpdate.kills << 2); // 5 bits needed
+						writeMovementMessage(&sendBufferPtrs[addressIndex], &message, addressIndex);
 						
-						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], flags);
+						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], messageStart, address, &reliableReceiveStates[addressIndex], &outgoingDatagrams);
 						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
+						sentMovements[addressIndex] = true;
 						
 						break;
 					}
@@ -1131,15 +5460,7 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 					{
 						advanceSendBufferForInitialMessage(&sendBufferPtrs[addressIndex], NEW_GAME_MESSAGE_TAG, message.packetNumber);
 						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
-						
-						break;
-					}
-					case ACK_MESSAGE_TYPE:
-					{
-						advanceSendBufferForInitialMessage(&sendBufferPtrs[addressIndex], ACK_MESSAGE_TAG, message.packetNumber);
-						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
+						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], messageStart, address, &reliableReceiveStates[addressIndex], &outgoingDatagrams);
 						
 						break;
 					}
@@ -1151,18 +5472,24 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 							ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], pingTag);
 							ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], message.pingTimestamp);
 							
-							sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
+							recordSentPing(&sendRateControllers[addressIndex], message.pingTimestamp);
+							
+							sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], messageStart, address, &reliableReceiveStates[addressIndex], &outgoingDatagrams);
 						}
 						
 						break;
 					}
 					case PONG_MESSAGE_TYPE:
 					{
+						uint32_t holdTime = (uint32_t)(networkMicroTicks() - message.pong.receiveTime);
+						
 						uint8_t pongTag = PONG_MESSAGE_TAG;
 						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], pongTag);
-						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], message.pongTimestamp);
+						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], message.pong.pingTimestamp);
+						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], message.pong.receiveTime);
+						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], holdTime);
 						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
+						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], messageStart, address, &reliableReceiveStates[addressIndex], &outgoingDatagrams);
 						
 						break;
 					}
@@ -1176,42 +5503,54 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 						
 						ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], flags);
 						
-						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], address);
+						sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], messageStart, address, &reliableReceiveStates[addressIndex], &outgoingDatagrams);
 						
 						break;
 					}
 					case FIRST_CLIENT_RESPONSE_MESSAGE_TYPE:
 						break;
+					case CHARACTER_DIED_UPDATE_MESSAGE_TYPE:
+					case COLOR_TILE_MESSAGE_TYPE:
+					case TILE_FALLING_DOWN_MESSAGE_TYPE:
+					case RECOVER_TILE_MESSAGE_TYPE:
+					case CHARACTER_KILLED_UPDATE_MESSAGE_TYPE:
+						// Sent as part of world snapshots
+						break;
 					case FIRST_DATA_TO_CLIENT_MESSAGE_TYPE:
 					{
 						uint8_t clientCharacterID = message.firstDataToClient.characterID;
 						
+						for (uint8_t characterIndex = 0; characterIndex < 4; characterIndex++)
+						{
+							setSpectatorNetName(&spectatorStream, characterIndex, message.firstDataToClient.netNames[characterIndex]);
+						}
+						
 						// send client its initial info
 						{
-							GameMessage responseMessage;
+							GameMessage responseMessage = {0};
 							responseMessage.type = FIRST_SERVER_RESPONSE_MESSAGE_TYPE;
 							responseMessage.packetNumber = 0;
 							responseMessage.firstServerResponse.slotID = clientCharacterID - 1;
 							responseMessage.firstServerResponse.characterLives = gCharacterLives;
 							
 							responseMessage.addressIndex = message.addressIndex;
-							pushNetworkMessage(&gGameMessagesToNet, responseMessage);
+							queueOutgoingMessage(&gNetworkBuffers->networkThreadMessages, &responseMessage);
 						}
 						
 						{
 							// send all other clients the new client's net name
-							GameMessage netNameMessage;
+							GameMessage netNameMessage = {0};
 							netNameMessage.type = NET_NAME_MESSAGE_TYPE;
 							netNameMessage.packetNumber = 0;
 							netNameMessage.netNameRequest.characterID = clientCharacterID;
-							netNameMessage.netNameRequest.netName = message.firstDataToClient.netNames[clientCharacterID - 1];
+							memcpy(netNameMessage.netNameRequest.netName, message.firstDataToClient.netNames[clientCharacterID - 1], MAX_USER_NAME_SIZE);
 							
-							sendToClients(message.addressIndex + 1, &netNameMessage);
+							queueMessageToClients(&gNetworkBuffers->networkThreadMessages, message.addressIndex + 1, &netNameMessage);
 							
 							// also tell new client our net name
 							netNameMessage.netNameRequest.characterID = PINK_BUBBLE_GUM;
 							netNameMessage.addressIndex = message.addressIndex;
-							pushNetworkMessage(&gGameMessagesToNet, netNameMessage);
+							queueOutgoingMessage(&gNetworkBuffers->networkThreadMessages, &netNameMessage);
 						}
 						
 						for (uint8_t characterIndex = RED_ROVER; characterIndex <= PINK_BUBBLE_GUM; characterIndex++)
@@ -1219,16 +5558,16 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 							if (characterIndex != clientCharacterID)
 							{
 								char *netName = message.firstDataToClient.netNames[characterIndex - 1];
-								if (netName != NULL)
+								if (netName[0] != '\0')
 								{
-									GameMessage netNameMessage;
+									GameMessage netNameMessage = {0};
 									netNameMessage.type = NET_NAME_MESSAGE_TYPE;
 									netNameMessage.packetNumber = 0;
 									netNameMessage.netNameRequest.characterID = characterIndex;
-									netNameMessage.netNameRequest.netName = netName;
+									memcpy(netNameMessage.netNameRequest.netName, netName, MAX_USER_NAME_SIZE);
 									
 									netNameMessage.addressIndex = message.addressIndex;
-									pushNetworkMessage(&gGameMessagesToNet, netNameMessage);
+									queueOutgoingMessage(&gNetworkBuffers->networkThreadMessages, &netNameMessage);
 								}
 							}
 						}
@@ -1237,47 +5576,141 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 						if (numPlayersToWaitFor == 0)
 						{
 							// tell all other clients the game has started
-							GameMessage startedMessage;
+							GameMessage startedMessage = {0};
 							startedMessage.type = START_GAME_MESSAGE_TYPE;
-							sendToClients(0, &startedMessage);
+							queueMessageToClients(&gNetworkBuffers->networkThreadMessages, 0, &startedMessage);
 						}
 						else
 						{
 							// tell clients how many players we are now waiting for
 							
-							GameMessage numberOfPlayersMessage;
+							GameMessage numberOfPlayersMessage = {0};
 							numberOfPlayersMessage.type = NUMBER_OF_PLAYERS_WAITING_FOR_MESSAGE_TYPE;
 							numberOfPlayersMessage.numberOfWaitingPlayers = numPlayersToWaitFor;
-							pushNetworkMessage(&gGameMessagesFromNet, numberOfPlayersMessage);
+							deliverNetworkMessage(numberOfPlayersMessage);
 							
-							sendToClients(0, &numberOfPlayersMessage);
+							queueMessageToClients(&gNetworkBuffers->networkThreadMessages, 0, &numberOfPlayersMessage);
 						}
 						
 						break;
 					}
 				}
+				
+				traceSentMessage(&message);
+			}
+			
+			if (memcmp(&worldSnapshot, &worldSnapshotHistory[latestWorldSnapshotNumber % WORLD_SNAPSHOT_HISTORY_SIZE], sizeof(worldSnapshot)) != 0)
+			{
+				latestWorldSnapshotNumber++;
+				worldSnapshotHistory[latestWorldSnapshotNumber % WORLD_SNAPSHOT_HISTORY_SIZE] = worldSnapshot;
+			}
+			
+			for (uint8_t addressIndex = 0; addressIndex < gNetworkConnection->currentSlot && !needsToQuit; addressIndex++)
+			{
+				WorldSnapshotSendState *snapshotSendState = &worldSnapshotSendStates[addressIndex];
+				if (gNetworkConnection->clientStates[addressIndex] == CLIENT_STATE_ALIVE && scheduleWorldSnapshot(snapshotSendState, latestWorldSnapshotNumber, reliableSendStates[addressIndex].resendTimeout, currentTime, &hasPendingResends, &nextResendTime))
+				{
+					SocketAddress *address = &gNetworkConnection->clientAddresses[addressIndex];
+					
+					// Delta against the last snapshot the client acked if we still have it, otherwise send the whole world
+					WorldSnapshot defaultSnapshot;
+					memset(&defaultSnapshot, 0, sizeof(defaultSnapshot));
+					
+					uint32_t baselineAge = latestWorldSnapshotNumber - snapshotSendState->ackedSnapshotNumber;
+					WorldSnapshot *baseline = &worldSnapshotHistory[snapshotSendState->ackedSnapshotNumber % WORLD_SNAPSHOT_HISTORY_SIZE];
+					if (baselineAge >= WORLD_SNAPSHOT_HISTORY_SIZE)
+					{
+						baselineAge = 0;
+						baseline = &defaultSnapshot;
+					}
+					
+					if ((size_t)(sendBufferPtrs[addressIndex] - sendBuffers[addressIndex]) + MAX_WORLD_SNAPSHOT_MESSAGE_SIZE + ACKS_MESSAGE_SIZE > sizeof(sendBuffers[addressIndex]))
+					{
+						sendPacket(sendBuffers[addressIndex], &sendBufferPtrs[addressIndex], address, &reliableReceiveStates[addressIndex], &outgoingDatagrams);
+					}
+					
+					char *messageStart = sendBufferPtrs[addressIndex];
+					
+					uint8_t tag = WORLD_SNAPSHOT_MESSAGE_TAG;
+					ADVANCE_SEND_BUFFER(&sendBufferPtrs[addressIndex], tag);
+					
+					BitWriter writer;
+					initializeBitWriter(&writer, sendBufferPtrs[addressIndex]);
+					writeWorldSnapshot(&writer, latestWorldSnapshotNumber, baselineAge, snapshotSendState->requiredSequence, &worldSnapshot, baseline);
+					sendBufferPtrs[addressIndex] += finishBitWriter(&writer);
+					
+					sendAndResetBufferIfNeeded(sendBuffers[addressIndex], sizeof(sendBuffers[addressIndex]), &sendBufferPtrs[addressIndex], messageStart, address, &reliableReceiveStates[addressIndex], &outgoingDatagrams);
+				}
 			}
 			
 			for (int addressIndex = 0; addressIndex < 3; addressIndex++)
 			{
-				if ((size_t)(sendBufferPtrs[addressIndex] - sendBuffers[addressIndex]) > 0)
+				bool sendingOnlyAcks = reliableReceiveStates[addressIndex].needsToSendAcks && addressIndex < gNetworkConnection->currentSlot && gNetworkConnection->clientStates[addressIndex] == CLIENT_STATE_ALIVE;
+				if ((size_t)(sendBufferPtrs[addressIndex] - sendBuffers[addressIndex]) > 0 || sendingOnlyAcks)
+				{
+					sendPacket(sendBuffers[addressIndex], &sendBufferPtrs[addressIndex], &gNetworkConnection->clientAddresses[addressIndex], &reliableReceiveStates[addressIndex], &outgoingDatagrams);
+				}
+			}
+			
+			flushDatagrams(gNetworkConnection->socket, &outgoingDatagrams);
+			
+			for (uint8_t addressIndex = 0; addressIndex < 3; addressIndex++)
+			{
+				SendRateController *rateController = &sendRateControllers[addressIndex];
+				if (sentMovements[addressIndex] && rateController->movementRate < MAX_MOVEMENT_SEND_RATE)
 				{
-					sendData(gNetworkConnection->socket, sendBuffers[addressIndex], (size_t)(sendBufferPtrs[addressIndex] - sendBuffers[addressIndex]), &gNetworkConnection->clientAddresses[addressIndex]);
+					rateController->nextMovementTime = currentTime + (uint32_t)(1000.0f / rateController->movementRate);
 				}
 			}
 			
-			free(messagesAvailable);
+			finishReadingNetworkMessages(&gNetworkBuffers->networkThreadMessages, networkThreadMessagesCount);
+			finishReadingNetworkMessages(&gNetworkBuffers->gameMessagesToNet, queuedMessagesCount);
 			
 			if (needsToQuit)
 			{
 				GameMessage quitMessage;
 				quitMessage.type = QUIT_MESSAGE_TYPE;
-				pushNetworkMessage(&gGameMessagesFromNet, quitMessage);
+				deliverNetworkMessage(quitMessage);
+			}
+		}
+		
+		// Spectators are all sent the same frame every simulation step after clients have been sent what they need
+		if (spectatorStream.count > 0 && !needsToQuit && (int32_t)(currentTime - spectatorStream.nextFrameTime) >= 0)
+		{
+			for (uint32_t spectatorIndex = spectatorStream.count; spectatorIndex > 0; spectatorIndex--)
+			{
+				if ((int32_t)(currentTime - spectatorStream.lastHeardTimes[spectatorIndex - 1]) >= SPECTATOR_TIMEOUT)
+				{
+					removeSpectator(&spectatorStream, spectatorIndex - 1);
+				}
+			}
+			
+			char frameBuffer[MAX_PACKET_SIZE];
+			size_t frameSize = writeSpectatorFrame(&spectatorStream, latestWorldSnapshotNumber, &worldSnapshot, frameBuffer);
+			fanOutDatagram(gNetworkConnection->socket, frameBuffer, frameSize, spectatorStream.addresses, spectatorStream.count);
+			
+			spectatorStream.nextFrameTime = currentTime + SPECTATOR_FRAME_INTERVAL;
+		}
+		
+		if (spectatorStream.count > 0 && (!hasPendingResends || (int32_t)(spectatorStream.nextFrameTime - nextResendTime) < 0))
+		{
+			nextResendTime = spectatorStream.nextFrameTime;
+			hasPendingResends = true;
+		}
+		
+		// Wake up in time to send movements we held back
+		for (uint8_t addressIndex = 0; addressIndex < gNetworkConnection->currentSlot; addressIndex++)
+		{
+			SendRateController *rateController = &sendRateControllers[addressIndex];
+			if (rateController->pendingMovementCharacters != 0 && (!hasPendingResends || (int32_t)(rateController->nextMovementTime - nextResendTime) < 0))
+			{
+				nextResendTime = rateController->nextMovementTime;
+				hasPendingResends = true;
 			}
 		}
 		
 		// 4 seconds is a long time without hearing back from a client
-		uint32_t currentTime = ZGGetTicks();
+		currentTime = networkTicks();
 		for (uint8_t addressIndex = 0; addressIndex < (int)(sizeof(lastPongReceivedTimestamps) / sizeof(lastPongReceivedTimestamps[0])); addressIndex++)
 		{
 			if (lastPongReceivedTimestamps[addressIndex] != 0 && currentTime - lastPongReceivedTimestamps[addressIndex] >= 4000)
@@ -1288,339 +5721,516 @@ int serverNetworkThread(void *initialNumberOfPlayersToWaitForPtr)
 		
 		while (!needsToQuit)
 		{
-			fd_set socketSet;
-			FD_ZERO(&socketSet);
-			FD_SET(gNetworkConnection->socket, &socketSet);
-			
-			struct timeval waitValue;
-			waitValue.tv_sec = 0;
-			waitValue.tv_usec = 0;
-			
-			if (select((int)(gNetworkConnection->socket + 1), &socketSet, NULL, NULL, &waitValue) <= 0)
+			uint32_t numberOfDatagrams = receiveServerDatagrams(&receivedDatagrams);
+			if (numberOfDatagrams == 0)
 			{
 				break;
 			}
-			else
+			
+			receivedData = true;
+			
+			for (uint32_t datagramIndex = 0; datagramIndex < numberOfDatagrams && !needsToQuit; datagramIndex++)
 			{
-				char packetBuffer[MAX_PACKET_SIZE];
-				SocketAddress address;
-				int numberOfBytes;
-				if ((numberOfBytes = (int)receiveData(gNetworkConnection->socket, packetBuffer, sizeof(packetBuffer), &address)) == -1)
+				char *packetBuffer = receivedDatagrams.buffers[datagramIndex];
+				int numberOfBytes = (int)receivedDatagrams.sizes[datagramIndex];
+				SocketAddress address = receivedDatagrams.addresses[datagramIndex];
+				uint64_t receiveTime = receivedDatagrams.receiveTimes[datagramIndex];
+				
+				// Sources we haven't let in yet pay more for asking to be, so they can't keep us busy making cookies or turning them away
+				uint32_t tokenCost = 1;
+				if (numberOfBytes > 0 && (packetBuffer[0] == CAN_I_PLAY_MESSAGE_TAG || packetBuffer[0] == SPECTATE_MESSAGE_TAG) && characterIDForClientAddress(&address) == NO_CHARACTER && spectatorIndexForAddress(&spectatorStream, &address) == -1)
 				{
-					// Ignore it and continue on
-					fprintf(stderr, "receiveData() actually returned -1\n");
+					tokenCost = HANDSHAKE_TOKEN_COST;
 				}
-				else
+				
+				if (!takeSourceTokens(&rateLimiter, &address, tokenCost, currentTime))
 				{
-					char *buffer = packetBuffer;
-					uint8_t messageTag = 0;
-					while (buffer + sizeof(messageTag) <= packetBuffer + numberOfBytes)
+					continue;
+				}
+				
+				// Counted up first since we may not know who sent the datagram until a request to play in it is handled
+				NetworkChannelStats receivedChannels[NETWORK_CHANNEL_COUNT];
+				memset(receivedChannels, 0, sizeof(receivedChannels));
+				
+				traceReceivedDatagram(receiveTime);
+				
+				char *buffer = packetBuffer;
+				uint8_t messageTag = 0;
+				while (buffer + sizeof(messageTag) <= packetBuffer + numberOfBytes)
+				{
+					char *messageStart = buffer;
+					ADVANCE_RECEIVE_BUFFER(&buffer, messageTag);
+					
+					if (messageTag == CAN_I_PLAY_MESSAGE_TAG)
 					{
-						ADVANCE_RECEIVE_BUFFER(&buffer, messageTag);
+						uint32_t packetNumber = 0;
+						uint8_t networkVersion = 0;
 						
-						if (messageTag == CAN_I_PLAY_MESSAGE_TAG)
+						if (buffer + sizeof(packetNumber) + sizeof(networkVersion) + (MAX_USER_NAME_SIZE - 1) <= packetBuffer + numberOfBytes)
 						{
-							uint32_t packetNumber = 0;
-							uint8_t networkVersion = 0;
+							ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
+							ADVANCE_RECEIVE_BUFFER(&buffer, networkVersion);
 							
-							if (buffer + sizeof(packetNumber) + sizeof(networkVersion) + (MAX_USER_NAME_SIZE - 1) <= packetBuffer + numberOfBytes)
+							const char *netNameBuffer = buffer;
+							buffer += (MAX_USER_NAME_SIZE - 1);
+							
+							// Requests from older versions don't end with a cookie
+							uint64_t cookie = 0;
+							if (networkVersion == NETWORK_VERSION && buffer + sizeof(cookie) <= packetBuffer + numberOfBytes)
 							{
-								ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
-								ADVANCE_RECEIVE_BUFFER(&buffer, networkVersion);
-								
-								char *netName = calloc(MAX_USER_NAME_SIZE, 1);
-								strncpy(netName, buffer, MAX_USER_NAME_SIZE - 1);
-								buffer += (MAX_USER_NAME_SIZE - 1);
-								
-								uint8_t existingCharacterID = characterIDForClientAddress(&address);
-								if (networkVersion == NETWORK_VERSION && ((packetNumber == 1 && existingCharacterID == NO_CHARACTER && numberOfPlayersToWaitFor > 0) || (packetNumber == 1 && existingCharacterID != NO_CHARACTER)))
-								{
-									int addressIndex;
-									if (existingCharacterID == NO_CHARACTER)
-									{
-										// yes
-										// sr == server response
-										addressIndex = gCurrentSlot;
-										gNetworkConnection->clientAddresses[addressIndex] = address;
-										triggerIncomingPacketNumbers[addressIndex]++;
-										lastPongReceivedTimestamps[addressIndex] = ZGGetTicks();
-										
-										ZGLockMutex(gCurrentSlotAndClientStatesMutex);
-										gCurrentSlot++;
-										ZGUnlockMutex(gCurrentSlotAndClientStatesMutex);
-										
-										numberOfPlayersToWaitFor--;
-										
-										GameMessage message;
-										message.type = FIRST_CLIENT_RESPONSE_MESSAGE_TYPE;
-										message.addressIndex = gCurrentSlot - 1;
-										message.firstClientResponse.netName = netName;
-										message.firstClientResponse.numberOfPlayersToWaitFor = numberOfPlayersToWaitFor;
-										message.firstClientResponse.slotID = gCurrentSlot;
-										
-										pushNetworkMessage(&gGameMessagesFromNet, message);
-									}
-									else
-									{
-										addressIndex = existingCharacterID - 1;
-										free(netName);
-									}
-									
-									if (packetNumber <= triggerIncomingPacketNumbers[addressIndex])
-									{
-										GameMessage ackMessage;
-										ackMessage.type = ACK_MESSAGE_TYPE;
-										ackMessage.packetNumber = packetNumber;
-										ackMessage.addressIndex = addressIndex;
-										pushNetworkMessage(&gGameMessagesToNet, ackMessage);
-									}
-								}
-								else
+								ADVANCE_RECEIVE_BUFFER(&buffer, cookie);
+							}
+							
+							uint8_t existingCharacterID = characterIDForClientAddress(&address);
+							if (existingCharacterID == NO_CHARACTER && networkVersion == NETWORK_VERSION && !acceptsHandshakeCookie(cookieKeys, &address, cookie, currentTime))
+							{
+								// Nothing is kept for a sender until it shows it can receive from us by echoing a cookie back
+								if (takeHandshakeReplyToken(&rateLimiter, currentTime))
 								{
-									free(netName);
-									
-									if (existingCharacterID == NO_CHARACTER)
-									{
-										// no
-										// sn == server no rejection response
-										uint8_t rejectionTag = SERVER_REJECTION_MESSAGE_TAG;
-										sendData(gNetworkConnection->socket, &rejectionTag, sizeof(rejectionTag), &address);
-									}
+									sendHandshakeCookie(gNetworkConnection->socket, cookieKeys, &address, currentTime);
 								}
 							}
-						}
-						
-						else if (messageTag == REQUEST_MOVEMENT_MESSAGE_TAG)
-						{
-							// request movement
-							uint8_t characterID = characterIDForClientAddress(&address);
-							if (characterID > NO_CHARACTER && characterID <= PINK_BUBBLE_GUM)
+							else if (networkVersion == NETWORK_VERSION && ((packetNumber == 1 && existingCharacterID == NO_CHARACTER && numberOfPlayersToWaitFor > 0) || (packetNumber == 1 && existingCharacterID != NO_CHARACTER)))
 							{
-								uint8_t direction = 0;
-								uint32_t packetNumber = 0;
-								if (buffer + sizeof(packetNumber) + sizeof(direction) <= packetBuffer + numberOfBytes)
+								int addressIndex;
+								if (existingCharacterID == NO_CHARACTER)
 								{
-									uint8_t addressIndex = characterID - 1;
+									// yes
+									// sr == server response
+									addressIndex = gNetworkConnection->currentSlot;
+									gNetworkConnection->clientAddresses[addressIndex] = address;
+									reliableReceiveStates[addressIndex].sequence = packetNumber;
+									reliableReceiveStates[addressIndex].needsToSendAcks = true;
+									memset(&worldSnapshotSendStates[addressIndex], 0, sizeof(worldSnapshotSendStates[addressIndex]));
+									lastPongReceivedTimestamps[addressIndex] = networkTicks();
+									lastInputSequences[addressIndex] = 0;
+									initializeSendRateController(&sendRateControllers[addressIndex], networkTicks());
 									
-									ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
-									ADVANCE_RECEIVE_BUFFER(&buffer, direction);
+									storeReleaseUInt8(&gNetworkConnection->currentSlot, gNetworkConnection->currentSlot + 1);
+									
+									numberOfPlayersToWaitFor--;
 									
 									GameMessage message;
-									message.packetNumber = packetNumber;
-									message.type = MOVEMENT_REQUEST_MESSAGE_TYPE;
-									message.addressIndex = addressIndex;
-									message.movementRequest.direction = direction;
+									message.type = FIRST_CLIENT_RESPONSE_MESSAGE_TYPE;
+									message.addressIndex = gNetworkConnection->currentSlot - 1;
+									readNetName(message.firstClientResponse.netName, netNameBuffer);
+									message.firstClientResponse.numberOfPlayersToWaitFor = numberOfPlayersToWaitFor;
+									message.firstClientResponse.slotID = gNetworkConnection->currentSlot;
 									
-									if (packetNumber == triggerIncomingPacketNumbers[addressIndex] + 1)
-									{
-										triggerIncomingPacketNumbers[addressIndex]++;
-										
-										if (direction == LEFT || direction == RIGHT || direction == UP || direction == DOWN || direction == NO_DIRECTION)
-										{
-											pushNetworkMessage(&gGameMessagesFromNet, message);
-										}
-									}
+									deliverNetworkMessage(message);
+								}
+								else
+								{
+									addressIndex = existingCharacterID - 1;
 									
-									if (packetNumber <= triggerIncomingPacketNumbers[addressIndex])
-									{
-										GameMessage ackMessage;
-										ackMessage.type = ACK_MESSAGE_TYPE;
-										ackMessage.packetNumber = packetNumber;
-										ackMessage.addressIndex = addressIndex;
-										pushNetworkMessage(&gGameMessagesToNet, ackMessage);
-									}
+									// Our ack must have been lost
+									receiveReliableMessage(&reliableReceiveStates[addressIndex], packetNumber, NULL);
 								}
 							}
+							else if (existingCharacterID == NO_CHARACTER && takeHandshakeReplyToken(&rateLimiter, currentTime))
+							{
+								// no
+								// sn == server no rejection response
+								uint8_t rejectionTag = SERVER_REJECTION_MESSAGE_TAG;
+								sendData(gNetworkConnection->socket, &rejectionTag, sizeof(rejectionTag), &address);
+							}
 						}
-						
-						else if (messageTag == SHOOT_WEAPON_MESSAGE_TAG)
+					}
+					
+					else if (messageTag == REQUEST_MOVEMENT_MESSAGE_TAG)
+					{
+						// request movement
+						uint16_t newestInputSequence = 0;
+						uint8_t inputCount = 0;
+						if (buffer + sizeof(newestInputSequence) + sizeof(inputCount) <= packetBuffer + numberOfBytes)
 						{
-							// shoot weapon
-							uint32_t packetNumber = 0;
-							if (buffer + sizeof(packetNumber) <= packetBuffer + numberOfBytes)
+							ADVANCE_RECEIVE_BUFFER(&buffer, newestInputSequence);
+							ADVANCE_RECEIVE_BUFFER(&buffer, inputCount);
+							
+							uint8_t directions[MOVEMENT_INPUT_REDUNDANCY];
+							if (newestInputSequence != 0 && inputCount <= MOVEMENT_INPUT_REDUNDANCY && buffer + inputCount * sizeof(*directions) <= packetBuffer + numberOfBytes)
 							{
-								ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
+								advanceReceiveBuffer(&buffer, directions, inputCount * sizeof(*directions));
 								
 								uint8_t characterID = characterIDForClientAddress(&address);
 								if (characterID > NO_CHARACTER && characterID <= PINK_BUBBLE_GUM)
 								{
 									uint8_t addressIndex = characterID - 1;
 									
-									GameMessage message;
-									message.packetNumber = packetNumber;
-									message.type = CHARACTER_FIRED_REQUEST_MESSAGE_TYPE;
-									message.addressIndex = addressIndex;
-									message.firedRequest.characterID = characterID;
-									
-									if (packetNumber == triggerIncomingPacketNumbers[addressIndex] + 1)
+									uint16_t inputSequence = newestInputSequence;
+									for (uint8_t inputIndex = 1; inputIndex < inputCount; inputIndex++)
 									{
-										triggerIncomingPacketNumbers[addressIndex]++;
-										
-										pushNetworkMessage(&gGameMessagesFromNet, message);
+										inputSequence = previousInputSequence(inputSequence);
 									}
 									
-									if (packetNumber <= triggerIncomingPacketNumbers[addressIndex])
+									// The same inputs arrive again in the datagrams after, so only pass on the ones we haven't yet, oldest first
+									for (uint8_t inputIndex = 0; inputIndex < inputCount; inputIndex++)
 									{
-										GameMessage ackMessage;
-										ackMessage.type = ACK_MESSAGE_TYPE;
-										ackMessage.packetNumber = packetNumber;
-										ackMessage.addressIndex = addressIndex;
-										pushNetworkMessage(&gGameMessagesToNet, ackMessage);
+										uint8_t direction = directions[inputIndex];
+										bool validDirection = (direction == LEFT || direction == RIGHT || direction == UP || direction == DOWN || direction == NO_DIRECTION);
+										
+										if (validDirection && (lastInputSequences[addressIndex] == 0 || inputSequenceGreaterThan(inputSequence, lastInputSequences[addressIndex])))
+										{
+											lastInputSequences[addressIndex] = inputSequence;
+											
+											GameMessage message;
+											message.type = MOVEMENT_REQUEST_MESSAGE_TYPE;
+											message.addressIndex = addressIndex;
+											message.movementRequest.direction = direction;
+											message.movementRequest.inputSequence = inputSequence;
+											deliverNetworkMessage(message);
+										}
+										
+										inputSequence = (inputSequence == UINT16_MAX) ? 1 : inputSequence + 1;
 									}
 								}
 							}
 						}
-						
-						else if (messageTag == ACK_MESSAGE_TAG)
+					}
+					
+					else if (messageTag == SHOOT_WEAPON_MESSAGE_TAG)
+					{
+						// shoot weapon
+						uint32_t packetNumber = 0;
+						uint32_t renderTime = 0;
+						if (buffer + sizeof(packetNumber) + sizeof(renderTime) <= packetBuffer + numberOfBytes)
 						{
-							uint32_t packetNumber = 0;
-							if (buffer + sizeof(packetNumber) <= packetBuffer + numberOfBytes)
+							ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
+							ADVANCE_RECEIVE_BUFFER(&buffer, renderTime);
+							
+							uint8_t characterID = characterIDForClientAddress(&address);
+							if (characterID > NO_CHARACTER && characterID <= PINK_BUBBLE_GUM)
 							{
-								ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
+								uint8_t addressIndex = characterID - 1;
 								
-								uint8_t characterID = characterIDForClientAddress(&address);
-								if (characterID != NO_CHARACTER)
-								{
-									uint8_t addressIndex = characterID - 1;
-									
-									bool foundAck = false;
-									uint32_t maxPacketCount = receivedAckPacketCount < (uint32_t)receivedAckPacketsCapacity ? receivedAckPacketCount : (uint32_t)receivedAckPacketsCapacity;
-									for (uint32_t packetIndex = 0; packetIndex < maxPacketCount; packetIndex++)
-									{
-										if (packetNumber == receivedAckPacketNumbers[addressIndex][packetIndex])
-										{
-											foundAck = true;
-											break;
-										}
-									}
-									if (!foundAck)
-									{
-										receivedAckPacketNumbers[addressIndex][receivedAckPacketCount % receivedAckPacketsCapacity] = packetNumber;
-										receivedAckPacketCount++;
-									}
-								}
+								GameMessage message;
+								message.packetNumber = packetNumber;
+								message.type = CHARACTER_FIRED_REQUEST_MESSAGE_TYPE;
+								message.addressIndex = addressIndex;
+								message.firedRequest.characterID = characterID;
+								message.firedRequest.renderTime = renderTime;
+								
+								receiveReliableMessage(&reliableReceiveStates[addressIndex], packetNumber, &message);
 							}
 						}
-						
-						else if (messageTag == PING_MESSAGE_TAG)
+					}
+					
+					else if (messageTag == ACK_MESSAGE_TAG)
+					{
+						uint32_t ack = 0;
+						uint32_t ackBits = 0;
+						if (buffer + sizeof(ack) + sizeof(ackBits) <= packetBuffer + numberOfBytes)
 						{
-							uint32_t timestamp = 0;
-							if (buffer + sizeof(timestamp) <= packetBuffer + numberOfBytes)
+							ADVANCE_RECEIVE_BUFFER(&buffer, ack);
+							ADVANCE_RECEIVE_BUFFER(&buffer, ackBits);
+							
+							uint8_t characterID = characterIDForClientAddress(&address);
+							if (characterID != NO_CHARACTER)
+							{
+								receiveReliableAcks(&reliableSendStates[characterID - 1], ack, ackBits);
+							}
+						}
+					}
+					
+					else if (messageTag == WORLD_SNAPSHOT_ACK_MESSAGE_TAG)
+					{
+						uint32_t snapshotNumber = 0;
+						if (buffer + sizeof(snapshotNumber) <= packetBuffer + numberOfBytes)
+						{
+							ADVANCE_RECEIVE_BUFFER(&buffer, snapshotNumber);
+							
+							uint8_t characterID = characterIDForClientAddress(&address);
+							if (characterID != NO_CHARACTER)
 							{
-								ADVANCE_RECEIVE_BUFFER(&buffer, timestamp);
-								
-								uint8_t characterID = characterIDForClientAddress(&address);
-								if (characterID != NO_CHARACTER)
+								WorldSnapshotSendState *snapshotSendState = &worldSnapshotSendStates[characterID - 1];
+								if (sequenceGreaterThan(snapshotNumber, snapshotSendState->ackedSnapshotNumber) && !sequenceGreaterThan(snapshotNumber, latestWorldSnapshotNumber))
 								{
-									uint8_t addressIndex = characterID - 1;
-									
-									GameMessage pongMessage;
-									pongMessage.type = PONG_MESSAGE_TYPE;
-									pongMessage.addressIndex = addressIndex;
-									pongMessage.pongTimestamp = timestamp;
-									pushNetworkMessage(&gGameMessagesToNet, pongMessage);
+									snapshotSendState->ackedSnapshotNumber = snapshotNumber;
 								}
 							}
 						}
-						
-						else if (messageTag == PONG_MESSAGE_TAG)
+					}
+					
+					else if (messageTag == PING_MESSAGE_TAG)
+					{
+						uint32_t timestamp = 0;
+						if (buffer + sizeof(timestamp) <= packetBuffer + numberOfBytes)
 						{
-							// pong message
-							uint32_t timestamp = 0;
-							if (buffer + sizeof(timestamp) <= packetBuffer + numberOfBytes)
+							ADVANCE_RECEIVE_BUFFER(&buffer, timestamp);
+							
+							uint8_t characterID = characterIDForClientAddress(&address);
+							if (characterID != NO_CHARACTER)
 							{
-								ADVANCE_RECEIVE_BUFFER(&buffer, timestamp);
+								uint8_t addressIndex = characterID - 1;
 								
-								uint8_t characterID = characterIDForClientAddress(&address);
-								if (characterID != NO_CHARACTER)
-								{
-									uint8_t addressIndex = characterID - 1;
-									
-									GameMessage message;
-									message.type = PONG_MESSAGE_TYPE;
-									message.addressIndex = addressIndex;
-									message.pongTimestamp = timestamp;
-									pushNetworkMessage(&gGameMessagesFromNet, message);
-									
-									lastPongReceivedTimestamps[addressIndex] = ZGGetTicks();
-								}
+								GameMessage pongMessage = {0};
+								pongMessage.type = PONG_MESSAGE_TYPE;
+								pongMessage.addressIndex = addressIndex;
+								pongMessage.pong.pingTimestamp = timestamp;
+								pongMessage.pong.receiveTime = receiveTime;
+								queueOutgoingMessage(&gNetworkBuffers->networkThreadMessages, &pongMessage);
 							}
 						}
-						
-						else if (messageTag == QUIT_MESSAGE_TAG)
+					}
+					
+					else if (messageTag == PONG_MESSAGE_TAG)
+					{
+						// pong message
+						PongMessage pong;
+						if (buffer + sizeof(pong.pingTimestamp) + sizeof(pong.receiveTime) + sizeof(pong.holdTime) <= packetBuffer + numberOfBytes)
 						{
+							ADVANCE_RECEIVE_BUFFER(&buffer, pong.pingTimestamp);
+							ADVANCE_RECEIVE_BUFFER(&buffer, pong.receiveTime);
+							ADVANCE_RECEIVE_BUFFER(&buffer, pong.holdTime);
+							pong.arrivalTime = receiveTime;
+							
 							uint8_t characterID = characterIDForClientAddress(&address);
 							if (characterID != NO_CHARACTER)
 							{
 								uint8_t addressIndex = characterID - 1;
 								
-								disconnectClient(addressIndex, lastPongReceivedTimestamps);
+								GameMessage message;
+								message.type = PONG_MESSAGE_TYPE;
+								message.addressIndex = addressIndex;
+								message.pong = pong;
+								deliverNetworkMessage(message);
+								
+								lastPongReceivedTimestamps[addressIndex] = networkTicks();
+								updateRoundTripTime(&reliableSendStates[addressIndex], pongRoundTripTime(&pong) / 1000);
+								recordReceivedPong(&sendRateControllers[addressIndex], &pong, networkTicks());
+							}
+						}
+					}
+					
+					else if (messageTag == SEND_TIME_MESSAGE_TAG)
+					{
+						uint64_t sendTime = 0;
+						if (buffer + sizeof(sendTime) <= packetBuffer + numberOfBytes)
+						{
+							ADVANCE_RECEIVE_BUFFER(&buffer, sendTime);
+							traceDatagramSendTime(sendTime);
+						}
+					}
+					
+					else if (messageTag == QUIT_MESSAGE_TAG)
+					{
+						uint8_t characterID = characterIDForClientAddress(&address);
+						if (characterID != NO_CHARACTER)
+						{
+							uint8_t addressIndex = characterID - 1;
+							
+							disconnectClient(addressIndex, lastPongReceivedTimestamps);
+						}
+						else
+						{
+							int spectatorIndex = spectatorIndexForAddress(&spectatorStream, &address);
+							if (spectatorIndex != -1)
+							{
+								removeSpectator(&spectatorStream, (uint32_t)spectatorIndex);
+							}
+						}
+					}
+					
+					else if (messageTag == SPECTATE_MESSAGE_TAG)
+					{
+						uint8_t networkVersion = 0;
+						uint32_t matchIndex = 0;
+						if (buffer + sizeof(networkVersion) + sizeof(matchIndex) <= packetBuffer + numberOfBytes)
+						{
+							ADVANCE_RECEIVE_BUFFER(&buffer, networkVersion);
+							// Only the router needs the match index to find us
+							ADVANCE_RECEIVE_BUFFER(&buffer, matchIndex);
+							
+							uint64_t cookie = 0;
+							if (networkVersion == NETWORK_VERSION && buffer + sizeof(cookie) <= packetBuffer + numberOfBytes)
+							{
+								ADVANCE_RECEIVE_BUFFER(&buffer, cookie);
+							}
+							
+							if (characterIDForClientAddress(&address) == NO_CHARACTER)
+							{
+								// Frames are only streamed to an address that has shown it asked for them
+								if (networkVersion == NETWORK_VERSION && spectatorIndexForAddress(&spectatorStream, &address) == -1 && !acceptsHandshakeCookie(cookieKeys, &address, cookie, currentTime))
+								{
+									if (takeHandshakeReplyToken(&rateLimiter, currentTime))
+									{
+										sendHandshakeCookie(gNetworkConnection->socket, cookieKeys, &address, currentTime);
+									}
+								}
+								else if ((networkVersion != NETWORK_VERSION || !addSpectator(&spectatorStream, &address, networkTicks())) && takeHandshakeReplyToken(&rateLimiter, currentTime))
+								{
+									uint8_t rejectionTag = SERVER_REJECTION_MESSAGE_TAG;
+									sendData(gNetworkConnection->socket, &rejectionTag, sizeof(rejectionTag), &address);
+								}
 							}
 						}
 					}
+					
+					countReceivedMessage(receivedChannels, messageTag, (size_t)(buffer - messageStart));
+				}
+				
+				uint8_t senderCharacterID = characterIDForClientAddress(&address);
+				if (senderCharacterID != NO_CHARACTER)
+				{
+					countReceivedDatagram(&peerStats[senderCharacterID - 1], receivedChannels, (size_t)numberOfBytes);
 				}
+				
+				traceReceivedDatagram(0);
 			}
-		}
-		
-		if (!needsToQuit)
-		{
-			uint32_t timeAfterProcessing = ZGGetTicks();
-			uint32_t deltaProcessingTime = timeAfterProcessing - timeBeforeProcessing;
-			const uint32_t targetDelay = 5;
 			
-			if (deltaProcessingTime < targetDelay)
+			// We drained everything that was pending
+			if (numberOfDatagrams < DATAGRAM_BATCH_CAPACITY)
 			{
-				ZGDelay(targetDelay - deltaProcessingTime);
+				break;
 			}
 		}
+		
+		publishReplayProgress();
+		
+		if (networkTicks() - lastStatsPublishTime >= NETWORK_STATS_PUBLISH_INTERVAL)
+		{
+			publishNetworkPeerStats(peerStats, 3);
+			lastStatsPublishTime = networkTicks();
+		}
+		
+		// If we just received data, loop back right away so acks and pongs we queued go out immediately
+		// Otherwise block until there's something to read or send, or a message is due to be re-sent
+		if (!needsToQuit && !receivedData)
+		{
+			waitForNetworkEvents(gNetworkConnection->socket, gNetworkConnection->router == NULL && gNetworkConnection->replay == NULL && gNetworkConnection->transport == NULL, networkWaitTimeout(hasPendingResends, nextResendTime));
+		}
 	}
 	
-	for (size_t receivedAckPacketNumberIndex = 0; receivedAckPacketNumberIndex < sizeof(receivedAckPacketNumbers) / sizeof(receivedAckPacketNumbers[0]); receivedAckPacketNumberIndex++)
-	{
-		free(receivedAckPacketNumbers[receivedAckPacketNumberIndex]);
-	}
+	storeReleaseUInt8(&gNetworkConnection->networkThreadStopped, 1);
+	publishSteppedNetworkThreadState(STEPPED_NETWORK_STOPPED);
+	
+	// Spectators never ack anything, so this is only a courtesy
+	uint8_t quitTag = QUIT_MESSAGE_TAG;
+	fanOutDatagram(gNetworkConnection->socket, &quitTag, sizeof(quitTag), spectatorStream.addresses, spectatorStream.count);
+	
+	finishNetworkConditioner();
+	finishNetworkCapture();
 	
 	return 0;
 }
 
 int clientNetworkThread(void *context)
 {
+	gNetworkConnection = context;
+	gNetworkBuffers = gNetworkConnection->buffers;
+	
+	gOverflowedNetworkPeers = 0;
+	
+	startNetworkCapture();
+	
+	if (gNetworkConnection->replay == NULL && gNetworkConnection->transport == NULL)
+	{
+		enableReceiveTimestamps(gNetworkConnection->socket);
+	}
+	
 	uint32_t triggerOutgoingPacketNumber = 1;
 	
-	uint32_t triggerIncomingPacketNumber = 0;
 	uint32_t realTimeIncomingPacketNumber = 0;
 	
-	size_t receivedAckPacketsCapacity = 512;
-	uint32_t *receivedAckPacketNumbers = calloc(sizeof(*receivedAckPacketNumbers), receivedAckPacketsCapacity);
-	uint32_t receivedAckPacketCount = 0;
+	NetworkPeerStats serverStats;
+	memset(&serverStats, 0, sizeof(serverStats));
+	uint32_t lastStatsPublishTime = networkTicks();
+	
+	ReliableReceiveState reliableReceiveState;
+	memset(&reliableReceiveState, 0, sizeof(reliableReceiveState));
+	reliableReceiveState.stats = &serverStats;
+	
+	ReliableSendState reliableSendState;
+	initializeReliableSendState(&reliableSendState, &serverStats);
+	
+	// Snapshots we have received and could be sent deltas against, starting with the default world as snapshot 0
+	WorldSnapshot worldSnapshots[WORLD_SNAPSHOT_HISTORY_SIZE];
+	uint32_t worldSnapshotNumbers[WORLD_SNAPSHOT_HISTORY_SIZE];
+	memset(worldSnapshots, 0, sizeof(worldSnapshots));
+	memset(worldSnapshotNumbers, 0, sizeof(worldSnapshotNumbers));
+	
+	// The latest snapshot we applied, which is what we ack
+	uint32_t latestWorldSnapshotNumber = 0;
+	uint32_t latestWorldSnapshotRequiredSequence = 0;
+	bool needsToSendWorldSnapshotAck = false;
 	
 	// tell the server we exist
-	GameMessage welcomeMessage;
+	GameMessage welcomeMessage = {0};
 	welcomeMessage.type = WELCOME_MESSAGE_TO_SERVER_MESSAGE_TYPE;
 	welcomeMessage.welcomeMessage.version = NETWORK_VERSION;
-	welcomeMessage.welcomeMessage.netName = gUserNameString;
-	sendToServer(welcomeMessage);
+	copyNetName(welcomeMessage.welcomeMessage.netName, gUserNameString);
+	welcomeMessage.packetNumber = 0;
+	queueOutgoingMessage(&gNetworkBuffers->networkThreadMessages, &welcomeMessage);
+	
+	// The server only answers our request to play once it echoes back a cookie it gave us
+	uint64_t handshakeCookie = 0;
+	
+	uint32_t lastPongReceivedTimestamp = networkTicks();
 	
-	uint32_t lastPongReceivedTimestamp = ZGGetTicks();
+	// Our latest movement inputs, which go out with every datagram until the server acknowledges them
+	// That way losing a datagram only holds a direction change up until the next one rather than until it's re-sent
+	MovementInput recentMovementInputs[MOVEMENT_INPUT_REDUNDANCY];
+	memset(recentMovementInputs, 0, sizeof(recentMovementInputs));
+	uint16_t newestMovementInputSequence = 0;
+	uint16_t acknowledgedMovementInputSequence = 0;
 	
 	bool needsToQuit = false;
 	
 	while (!needsToQuit)
 	{
-		uint32_t timeBeforeProcessing = ZGGetTicks();
+		// A hole in the reliable messages we send would never be filled, so the connection is given up on instead
+		if (gOverflowedNetworkPeers != 0)
+		{
+			fprintf(stderr, "Error: too many network messages are queued, disconnecting\n");
+			
+			GameMessage message;
+			message.type = QUIT_MESSAGE_TYPE;
+			deliverNetworkMessage(message);
+			
+			break;
+		}
+		
+		uint32_t currentTime = networkTicks();
+		
+		if (gNetworkTracing)
+		{
+			ZGLockMutex(gNetworkStatsMutex);
+			gTracedServerClockOffset = gNetworkConnection->tracedServerClockOffset;
+			gTracedServerClockSynchronized = gNetworkConnection->tracedServerClockSynchronized;
+			ZGUnlockMutex(gNetworkStatsMutex);
+		}
+		
+		bool hasPendingResends = false;
+		uint32_t nextResendTime = 0;
+		bool receivedData = false;
+		
+		// Our own queued messages were queued on an earlier pass, so they come first
+		uint32_t networkThreadMessagesCount = beginReadingNetworkMessages(&gNetworkBuffers->networkThreadMessages);
+		uint32_t queuedMessagesCount = beginReadingNetworkMessages(&gNetworkBuffers->gameMessagesToNet);
+		uint32_t messagesCount = networkThreadMessagesCount + queuedMessagesCount;
 		
-		uint32_t messagesCount = 0;
-		GameMessage *messagesAvailable = popNetworkMessages(&gGameMessagesToNet, &messagesCount);
-		if (messagesAvailable != NULL)
+		// Acks ride along with whatever we send, but still need to go out on their own if there's nothing else
+		if (messagesCount > 0 || reliableReceiveState.needsToSendAcks || needsToSendWorldSnapshotAck)
 		{
 			char sendBuffer[MAX_PACKET_SIZE];
 			char *sendBufferPtr = sendBuffer;
 			
+			if (needsToSendWorldSnapshotAck)
+			{
+				uint8_t snapshotAckTag = WORLD_SNAPSHOT_ACK_MESSAGE_TAG;
+				ADVANCE_SEND_BUFFER(&sendBufferPtr, snapshotAckTag);
+				ADVANCE_SEND_BUFFER(&sendBufferPtr, latestWorldSnapshotNumber);
+				
+				countSentMessage(&serverStats, sendBuffer, sendBufferPtr);
+				
+				needsToSendWorldSnapshotAck = false;
+			}
+			
 			uint32_t lastPingIndex = 0;
 			for (uint32_t messagesLeft = messagesCount; messagesLeft > 0; messagesLeft--)
 			{
-				GameMessage message = messagesAvailable[messagesLeft - 1];
-				if (message.type == PING_MESSAGE_TYPE)
+				GameMessage *message = pendingNetworkMessageAtIndex(messagesLeft - 1, networkThreadMessagesCount);
+				if (message->type == PING_MESSAGE_TYPE)
 				{
 					if (lastPingIndex == 0)
 					{
@@ -1632,52 +6242,38 @@ int clientNetworkThread(void *context)
 			
 			for (uint32_t messageIndex = 0; messageIndex < messagesCount && !needsToQuit; messageIndex++)
 			{
-				GameMessage message = messagesAvailable[messageIndex];
-				if (message.type != QUIT_MESSAGE_TYPE && message.type != ACK_MESSAGE_TYPE && message.type != PING_MESSAGE_TYPE && message.type != PONG_MESSAGE_TYPE)
+				GameMessage message = *pendingNetworkMessageAtIndex(messageIndex, networkThreadMessagesCount);
+				if (messageIndex >= networkThreadMessagesCount)
+				{
+					traceDequeuedMessage(&message);
+				}
+				if (message.type != QUIT_MESSAGE_TYPE && message.type != PING_MESSAGE_TYPE && message.type != PONG_MESSAGE_TYPE && message.type != MOVEMENT_REQUEST_MESSAGE_TYPE)
 				{
 					if (message.packetNumber == 0)
 					{
 						message.packetNumber = triggerOutgoingPacketNumber;
 						triggerOutgoingPacketNumber++;
 						
-						// Re-send message until we receive an ack
-						pushNetworkMessage(&gGameMessagesToNet, message);
+						message.resendTime = currentTime;
+						message.sendCount = 0;
 					}
-					else
+					
+					// Re-send message until we receive an ack
+					if (!scheduleReliableMessage(&reliableSendState, &message, currentTime, &hasPendingResends, &nextResendTime))
 					{
-						bool foundAck = false;
-						uint32_t maxPacketCount = receivedAckPacketCount < (uint32_t)receivedAckPacketsCapacity ? receivedAckPacketCount : (uint32_t)receivedAckPacketsCapacity;
-						for (uint32_t packetIndex = 0; packetIndex < maxPacketCount; packetIndex++)
-						{
-							if (message.packetNumber == receivedAckPacketNumbers[packetIndex])
-							{
-								foundAck = true;
-								break;
-							}
-						}
-						
-						if (foundAck)
-						{
-							continue;
-						}
-						else
-						{
-							// Re-send message until we receive an ack
-							pushNetworkMessage(&gGameMessagesToNet, message);
-						}
+						continue;
 					}
 				}
 				
+				char *messageStart = sendBufferPtr;
+				
 				switch (message.type)
 				{
 					case WELCOME_MESSAGE_TO_SERVER_MESSAGE_TYPE:
 					{
-						advanceSendBufferForInitialMessage(&sendBufferPtr, CAN_I_PLAY_MESSAGE_TAG, message.packetNumber);
-						
-						ADVANCE_SEND_BUFFER(&sendBufferPtr, message.welcomeMessage.version);
-						advanceSendBuffer(&sendBufferPtr, message.welcomeMessage.netName, MAX_USER_NAME_SIZE - 1);
+						writeRequestToPlay(&sendBufferPtr, message.packetNumber, message.welcomeMessage.version, message.welcomeMessage.netName, handshakeCookie);
 						
-						sendAndResetBufferIfNeeded(sendBuffer, sizeof(sendBuffer), &sendBufferPtr, &gNetworkConnection->hostAddress);
+						sendAndResetBufferIfNeeded(sendBuffer, sizeof(sendBuffer), &sendBufferPtr, messageStart, &gNetworkConnection->hostAddress, &reliableReceiveState, NULL);
 						
 						break;
 					}
@@ -1698,28 +6294,33 @@ int clientNetworkThread(void *context)
 							ADVANCE_SEND_BUFFER(&sendBufferPtr, pingTag);
 							ADVANCE_SEND_BUFFER(&sendBufferPtr, message.pingTimestamp);
 							
-							sendAndResetBufferIfNeeded(sendBuffer, sizeof(sendBuffer), &sendBufferPtr, &gNetworkConnection->hostAddress);
+							sendAndResetBufferIfNeeded(sendBuffer, sizeof(sendBuffer), &sendBufferPtr, messageStart, &gNetworkConnection->hostAddress, &reliableReceiveState, NULL);
 						}
 						
 						break;
 					}
 					case PONG_MESSAGE_TYPE:
 					{
+						uint32_t holdTime = (uint32_t)(networkMicroTicks() - message.pong.receiveTime);
+						
 						uint8_t pongTag = PONG_MESSAGE_TAG;
 						ADVANCE_SEND_BUFFER(&sendBufferPtr, pongTag);
-						ADVANCE_SEND_BUFFER(&sendBufferPtr, message.pongTimestamp);
+						ADVANCE_SEND_BUFFER(&sendBufferPtr, message.pong.pingTimestamp);
+						ADVANCE_SEND_BUFFER(&sendBufferPtr, message.pong.receiveTime);
+						ADVANCE_SEND_BUFFER(&sendBufferPtr, holdTime);
 						
-						sendAndResetBufferIfNeeded(sendBuffer, sizeof(sendBuffer), &sendBufferPtr, &gNetworkConnection->hostAddress);
+						sendAndResetBufferIfNeeded(sendBuffer, sizeof(sendBuffer), &sendBufferPtr, messageStart, &gNetworkConnection->hostAddress, &reliableReceiveState, NULL);
 						
 						break;
 					}
 					case MOVEMENT_REQUEST_MESSAGE_TYPE:
 					{
-						advanceSendBufferForInitialMessage(&sendBufferPtr, REQUEST_MOVEMENT_MESSAGE_TAG, message.packetNumber);
-						
-						ADVANCE_SEND_BUFFER(&sendBufferPtr, message.movementRequest.direction);
+						// Sent along with the inputs before it once we're done with the queued messages
+						MovementInput *movementInput = &recentMovementInputs[message.movementRequest.inputSequence & (MOVEMENT_INPUT_REDUNDANCY - 1)];
+						movementInput->inputSequence = message.movementRequest.inputSequence;
+						movementInput->direction = message.movementRequest.direction;
 						
-						sendAndResetBufferIfNeeded(sendBuffer, sizeof(sendBuffer), &sendBufferPtr, &gNetworkConnection->hostAddress);
+						newestMovementInputSequence = message.movementRequest.inputSequence;
 						
 						break;
 					}
@@ -1727,15 +6328,9 @@ int clientNetworkThread(void *context)
 					{
 						advanceSendBufferForInitialMessage(&sendBufferPtr, SHOOT_WEAPON_MESSAGE_TAG, message.packetNumber);
 						
-						sendAndResetBufferIfNeeded(sendBuffer, sizeof(sendBuffer), &sendBufferPtr, &gNetworkConnection->hostAddress);
-						
-						break;
-					}
-					case ACK_MESSAGE_TYPE:
-					{
-						advanceSendBufferForInitialMessage(&sendBufferPtr, ACK_MESSAGE_TAG, message.packetNumber);
+						ADVANCE_SEND_BUFFER(&sendBufferPtr, message.firedRequest.renderTime);
 						
-						sendAndResetBufferIfNeeded(sendBuffer, sizeof(sendBuffer), &sendBufferPtr, &gNetworkConnection->hostAddress);
+						sendAndResetBufferIfNeeded(sendBuffer, sizeof(sendBuffer), &sendBufferPtr, messageStart, &gNetworkConnection->hostAddress, &reliableReceiveState, NULL);
 						
 						break;
 					}
@@ -1772,76 +6367,144 @@ int clientNetworkThread(void *context)
 					case FIRST_DATA_TO_CLIENT_MESSAGE_TYPE:
 						break;
 				}
+				
+				traceSentMessage(&message);
+			}
+			
+			if (newestMovementInputSequence != 0 && newestMovementInputSequence != acknowledgedMovementInputSequence)
+			{
+				char *messageStart = sendBufferPtr;
+				
+				// Going back from the newest input until one the server acknowledged, and sent oldest first
+				uint8_t directions[MOVEMENT_INPUT_REDUNDANCY];
+				uint8_t inputCount = 0;
+				uint16_t inputSequence = newestMovementInputSequence;
+				while (inputCount < MOVEMENT_INPUT_REDUNDANCY && inputSequence != acknowledgedMovementInputSequence)
+				{
+					MovementInput *movementInput = &recentMovementInputs[inputSequence & (MOVEMENT_INPUT_REDUNDANCY - 1)];
+					if (movementInput->inputSequence != inputSequence)
+					{
+						break;
+					}
+					
+					directions[MOVEMENT_INPUT_REDUNDANCY - 1 - inputCount] = movementInput->direction;
+					inputCount++;
+					
+					inputSequence = previousInputSequence(inputSequence);
+				}
+				
+				if (inputCount > 0)
+				{
+					uint8_t requestMovementTag = REQUEST_MOVEMENT_MESSAGE_TAG;
+					ADVANCE_SEND_BUFFER(&sendBufferPtr, requestMovementTag);
+					ADVANCE_SEND_BUFFER(&sendBufferPtr, newestMovementInputSequence);
+					ADVANCE_SEND_BUFFER(&sendBufferPtr, inputCount);
+					advanceSendBuffer(&sendBufferPtr, &directions[MOVEMENT_INPUT_REDUNDANCY - inputCount], inputCount * sizeof(*directions));
+					
+					countSentMessage(&serverStats, messageStart, sendBufferPtr);
+				}
 			}
 			
-			if ((size_t)(sendBufferPtr - sendBuffer) > 0)
+			if ((size_t)(sendBufferPtr - sendBuffer) > 0 || reliableReceiveState.needsToSendAcks)
 			{
-				sendData(gNetworkConnection->socket, sendBuffer, (size_t)(sendBufferPtr - sendBuffer), &gNetworkConnection->hostAddress);
+				sendPacket(sendBuffer, &sendBufferPtr, &gNetworkConnection->hostAddress, &reliableReceiveState, NULL);
 			}
 			
-			free(messagesAvailable);
+			finishReadingNetworkMessages(&gNetworkBuffers->networkThreadMessages, networkThreadMessagesCount);
+			finishReadingNetworkMessages(&gNetworkBuffers->gameMessagesToNet, queuedMessagesCount);
 			
 			if (needsToQuit)
 			{
 				GameMessage message;
 				message.type = QUIT_MESSAGE_TYPE;
 				
-				pushNetworkMessage(&gGameMessagesFromNet, message);
+				deliverNetworkMessage(message);
 				
 				break;
 			}
 		}
 		
 		// 4 seconds is a long time without hearing back from server
-		if (ZGGetTicks() - lastPongReceivedTimestamp >= 4000)
+		if (networkTicks() - lastPongReceivedTimestamp >= 4000)
 		{
 			GameMessage message;
 			message.type = QUIT_MESSAGE_TYPE;
-			pushNetworkMessage(&gGameMessagesFromNet, message);
+			deliverNetworkMessage(message);
 			
 			needsToQuit = true;
 		}
 		
 		while (!needsToQuit)
 		{
-			fd_set socketSet;
-			FD_ZERO(&socketSet);
-			FD_SET(gNetworkConnection->socket, &socketSet);
-			
-			struct timeval waitValue;
-			waitValue.tv_sec = 0;
-			waitValue.tv_usec = 0;
-			
-			if (select((int)(gNetworkConnection->socket + 1), &socketSet, NULL, NULL, &waitValue) <= 0)
+			if (!clientDatagramIsPending())
 			{
 				break;
 			}
 			else
 			{
 				char packetBuffer[MAX_PACKET_SIZE];
+				uint64_t receiveTime = 0;
 				int numberOfBytes;
-				if ((numberOfBytes = (int)receiveData(gNetworkConnection->socket, packetBuffer, sizeof(packetBuffer), &gNetworkConnection->hostAddress)) == -1)
+				if ((numberOfBytes = receiveClientDatagram(packetBuffer, sizeof(packetBuffer), &receiveTime)) == -1)
 				{
 					fprintf(stderr, "receiveData() actually returned -1\n");
 				}
 				else
 				{
+					receivedData = true;
+					
+					NetworkChannelStats receivedChannels[NETWORK_CHANNEL_COUNT];
+					memset(receivedChannels, 0, sizeof(receivedChannels));
+					
+					traceReceivedDatagram(receiveTime);
+					
 					char *buffer = packetBuffer;
 					uint8_t messageTag = 0;
 					while (buffer + sizeof(messageTag) <= packetBuffer + numberOfBytes)
 					{
+						char *messageStart = buffer;
 						ADVANCE_RECEIVE_BUFFER(&buffer, messageTag);
 						
 						if (messageTag == SERVER_REJECTION_MESSAGE_TAG)
 						{
 							GameMessage message;
 							message.type = QUIT_MESSAGE_TYPE;
-							pushNetworkMessage(&gGameMessagesFromNet, message);
+							deliverNetworkMessage(message);
 							
 							needsToQuit = true;
 							
 							break;
 						}
+						else if (messageTag == SEND_TIME_MESSAGE_TAG)
+						{
+							uint64_t sendTime = 0;
+							if (buffer + sizeof(sendTime) <= packetBuffer + numberOfBytes)
+							{
+								ADVANCE_RECEIVE_BUFFER(&buffer, sendTime);
+								traceDatagramSendTime(sendTime);
+							}
+						}
+						else if (messageTag == HANDSHAKE_COOKIE_MESSAGE_TAG)
+						{
+							uint64_t cookie = 0;
+							if (buffer + sizeof(cookie) <= packetBuffer + numberOfBytes)
+							{
+								ADVANCE_RECEIVE_BUFFER(&buffer, cookie);
+								
+								// Ask again right away rather than waiting to re-send, since our request to play is always our first reliable message
+								if (cookie != 0 && !isReliableMessageAcked(&reliableSendState, 1))
+								{
+									handshakeCookie = cookie;
+									
+									char requestBuffer[MAX_PACKET_SIZE];
+									char *requestBufferPtr = requestBuffer;
+									writeRequestToPlay(&requestBufferPtr, 1, welcomeMessage.welcomeMessage.version, welcomeMessage.welcomeMessage.netName, handshakeCookie);
+									
+									countSentMessage(&serverStats, requestBuffer, requestBufferPtr);
+									sendData(gNetworkConnection->socket, requestBuffer, (size_t)(requestBufferPtr - requestBuffer), &gNetworkConnection->hostAddress);
+								}
+							}
+						}
 						else if (messageTag == SERVER_ACCEPTANCE_MESSAGE_TAG)
 						{
 							uint32_t packetNumber = 0;
@@ -1855,25 +6518,12 @@ int clientNetworkThread(void *context)
 								uint8_t slotID = (flags & 0x3);
 								uint8_t characterLives = (flags >> 2);
 								
-								if (packetNumber == triggerIncomingPacketNumber + 1)
-								{
-									triggerIncomingPacketNumber++;
-									
-									GameMessage message;
-									message.type = FIRST_SERVER_RESPONSE_MESSAGE_TYPE;
-									message.firstServerResponse.slotID = slotID;
-									message.firstServerResponse.characterLives = characterLives;
-									
-									pushNetworkMessage(&gGameMessagesFromNet, message);
-								}
+								GameMessage message;
+								message.type = FIRST_SERVER_RESPONSE_MESSAGE_TYPE;
+								message.firstServerResponse.slotID = slotID;
+								message.firstServerResponse.characterLives = characterLives;
 								
-								if (packetNumber <= triggerIncomingPacketNumber)
-								{
-									GameMessage ackMessage;
-									ackMessage.type = ACK_MESSAGE_TYPE;
-									ackMessage.packetNumber = packetNumber;
-									pushNetworkMessage(&gGameMessagesToNet, ackMessage);
-								}
+								receiveReliableMessage(&reliableReceiveState, packetNumber, &message);
 							}
 						}
 						else if (messageTag == NUMBER_OF_PLAYERS_WAITING_MESSAGE_TAG)
@@ -1886,23 +6536,12 @@ int clientNetworkThread(void *context)
 								ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
 								ADVANCE_RECEIVE_BUFFER(&buffer, numberOfWaitingPlayers);
 								
-								if (packetNumber == triggerIncomingPacketNumber + 1 && numberOfWaitingPlayers < 4)
-								{
-									triggerIncomingPacketNumber++;
-									
-									GameMessage message;
-									message.type = NUMBER_OF_PLAYERS_WAITING_FOR_MESSAGE_TYPE;
-									message.numberOfWaitingPlayers = numberOfWaitingPlayers;
-									pushNetworkMessage(&gGameMessagesFromNet, message);
-								}
+								GameMessage message;
+								message.type = NUMBER_OF_PLAYERS_WAITING_FOR_MESSAGE_TYPE;
+								message.numberOfWaitingPlayers = numberOfWaitingPlayers;
 								
-								if (packetNumber <= triggerIncomingPacketNumber)
-								{
-									GameMessage ackMessage;
-									ackMessage.type = ACK_MESSAGE_TYPE;
-									ackMessage.packetNumber = packetNumber;
-									pushNetworkMessage(&gGameMessagesToNet, ackMessage);
-								}
+								bool validMessage = (numberOfWaitingPlayers < 4);
+								receiveReliableMessage(&reliableReceiveState, packetNumber, validMessage ? &message : NULL);
 							}
 						}
 						else if (messageTag == NET_NAME_MESSAGE_TAG)
@@ -1913,38 +6552,17 @@ int clientNetworkThread(void *context)
 							
 							if (buffer + sizeof(packetNumber) + sizeof(characterID) + (MAX_USER_NAME_SIZE - 1)  <= packetBuffer + numberOfBytes)
 							{
-								char *netName = calloc(MAX_USER_NAME_SIZE, 1);
-								if (netName != NULL)
-								{
-									ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
-									ADVANCE_RECEIVE_BUFFER(&buffer, characterID);
-									
-									strncpy(netName, buffer, MAX_USER_NAME_SIZE - 1);
-									buffer += MAX_USER_NAME_SIZE - 1;
-									
-									if (packetNumber == triggerIncomingPacketNumber + 1 && characterID > NO_CHARACTER && characterID <= PINK_BUBBLE_GUM)
-									{
-										triggerIncomingPacketNumber++;
-										
-										GameMessage message;
-										message.type = NET_NAME_MESSAGE_TYPE;
-										message.netNameRequest.characterID = characterID;
-										message.netNameRequest.netName = netName;
-										pushNetworkMessage(&gGameMessagesFromNet, message);
-									}
-									else
-									{
-										free(netName);
-									}
-									
-									if (packetNumber <= triggerIncomingPacketNumber)
-									{
-										GameMessage ackMessage;
-										ackMessage.type = ACK_MESSAGE_TYPE;
-										ackMessage.packetNumber = packetNumber;
-										pushNetworkMessage(&gGameMessagesToNet, ackMessage);
-									}
-								}
+								ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
+								ADVANCE_RECEIVE_BUFFER(&buffer, characterID);
+								
+								GameMessage message;
+								message.type = NET_NAME_MESSAGE_TYPE;
+								message.netNameRequest.characterID = characterID;
+								readNetName(message.netNameRequest.netName, buffer);
+								buffer += MAX_USER_NAME_SIZE - 1;
+								
+								bool validMessage = (characterID > NO_CHARACTER && characterID <= PINK_BUBBLE_GUM);
+								receiveReliableMessage(&reliableReceiveState, packetNumber, validMessage ? &message : NULL);
 							}
 						}
 						else if (messageTag == START_GAME_MESSAGE_TAG)
@@ -1955,22 +6573,10 @@ int clientNetworkThread(void *context)
 							
 							if (buffer + sizeof(packetNumber) <= packetBuffer + numberOfBytes)
 							{
-								if (packetNumber == triggerIncomingPacketNumber + 1)
-								{
-									triggerIncomingPacketNumber++;
-									
-									GameMessage message;
-									message.type = START_GAME_MESSAGE_TYPE;
-									pushNetworkMessage(&gGameMessagesFromNet, message);
-								}
+								GameMessage message;
+								message.type = START_GAME_MESSAGE_TYPE;
 								
-								if (packetNumber <= triggerIncomingPacketNumber)
-								{
-									GameMessage ackMessage;
-									ackMessage.type = ACK_MESSAGE_TYPE;
-									ackMessage.packetNumber = packetNumber;
-									pushNetworkMessage(&gGameMessagesToNet, ackMessage);
-								}
+								receiveReliableMessage(&reliableReceiveState, packetNumber, &message);
 							}
 						}
 						else if (messageTag == GAME_START_NUMBER_MESSAGE_TAG)
@@ -1981,132 +6587,86 @@ int clientNetworkThread(void *context)
 							if (buffer + sizeof(packetNumber) + sizeof(gameStartNumber) <= packetBuffer + numberOfBytes)
 							{
 								ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
-								ADVANCE_RECEIVE_BUFFER(&buffer, gameStartNumber);
-								
-								if (packetNumber == triggerIncomingPacketNumber + 1)
-								{
-									triggerIncomingPacketNumber++;
-									
-									GameMessage message;
-									message.type = GAME_START_NUMBER_UPDATE_MESSAGE_TYPE;
-									message.gameStartNumber = gameStartNumber;
-									pushNetworkMessage(&gGameMessagesFromNet, message);
-									
-									GameMessage ackMessage;
-									ackMessage.type = ACK_MESSAGE_TYPE;
-									ackMessage.packetNumber = packetNumber;
-									pushNetworkMessage(&gGameMessagesToNet, ackMessage);
-								}
-								
-								if (packetNumber <= triggerIncomingPacketNumber)
-								{
-									GameMessage ackMessage;
-									ackMessage.type = ACK_MESSAGE_TYPE;
-									ackMessage.packetNumber = packetNumber;
-									pushNetworkMessage(&gGameMessagesToNet, ackMessage);
-								}
-							}
-						}
-						else if (messageTag == MOVEMENT_MESSAGE_TAG)
-						{
-							uint32_t packetNumber = 0;
-							float x = 0.0f;
-							float y = 0.0f;
-							uint8_t flags = 0;
-							
-							if (buffer + sizeof(packetNumber) + sizeof(x) + sizeof(y) + sizeof(flags) <= packetBuffer + numberOfBytes)
-							{
-								ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
-								ADVANCE_RECEIVE_BUFFER(&buffer, x);
-								ADVANCE_RECEIVE_BUFFER(&buffer, y);
-								ADVANCE_RECEIVE_BUFFER(&buffer, flags);
-								
-								uint8_t characterID = (flags & 0x3) + 1;
-								uint8_t direction = (flags >> 2) & 0x7;
-								uint8_t pointing_direction = ((flags >> 5) & 0x3) + 1;
-								uint8_t dead = (flags >> 7) != 0;
-								
-								if (packetNumber > realTimeIncomingPacketNumber && characterID > NO_CHARACTER && characterID <= PINK_BUBBLE_GUM)
-								{
-									realTimeIncomingPacketNumber = packetNumber;
-									
-									GameMessage message;
-									message.type = CHARACTER_MOVED_UPDATE_MESSAGE_TYPE;
-									message.movedUpdate.characterID = characterID;
-									message.movedUpdate.x = x;
-									message.movedUpdate.y = y;
-									message.movedUpdate.direction = direction;
-									message.movedUpdate.pointing_direction = pointing_direction;
-									message.movedUpdate.dead = dead;
-									pushNetworkMessage(&gGameMessagesFromNet, message);
-								}
+								ADVANCE_RECEIVE_BUFFER(&buffer, gameStartNumber);
+								
+								GameMessage message;
+								message.type = GAME_START_NUMBER_UPDATE_MESSAGE_TYPE;
+								message.gameStartNumber = gameStartNumber;
+								
+								receiveReliableMessage(&reliableReceiveState, packetNumber, &message);
 							}
 						}
-						else if (messageTag == PLAYER_KILLED_MESSAGE_TAG)
+						else if (messageTag == MOVEMENT_MESSAGE_TAG)
 						{
-							// character gets killed
-							uint32_t packetNumber = 0;
-							uint8_t flags = 0;
-							
-							if (buffer + sizeof(packetNumber) + sizeof(flags) <= packetBuffer + numberOfBytes)
+							if (buffer + MOVEMENT_MESSAGE_SIZE <= packetBuffer + numberOfBytes)
 							{
-								ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
-								ADVANCE_RECEIVE_BUFFER(&buffer, flags);
+								// An acknowledgement makes the message longer, so don't let the reader go past the datagram
+								size_t remainingSize = (size_t)(packetBuffer + numberOfBytes - buffer);
 								
-								uint8_t characterID = (flags & 0x3) + 1;
-								uint8_t characterLives = (flags >> 2);
+								BitReader reader;
+								initializeBitReader(&reader, buffer, remainingSize < MOVEMENT_MESSAGE_WITH_INPUT_SIZE ? remainingSize : MOVEMENT_MESSAGE_WITH_INPUT_SIZE);
+								
+								uint32_t packetNumber = expandPacketNumber(readBits(&reader, MOVEMENT_PACKET_NUMBER_BITS), MOVEMENT_PACKET_NUMBER_BITS, realTimeIncomingPacketNumber);
+								uint8_t characterID = (uint8_t)readBits(&reader, 2) + 1;
+								uint8_t direction = (uint8_t)readBits(&reader, 3);
+								uint8_t pointing_direction = (uint8_t)readBits(&reader, 2) + 1;
+								uint8_t dead = readBits(&reader, 1) != 0;
+								float x = dequantizeFloat(readBits(&reader, MOVEMENT_POSITION_BITS), MOVEMENT_POSITION_MIN, MOVEMENT_POSITION_MAX, MOVEMENT_POSITION_BITS);
+								float y = dequantizeFloat(readBits(&reader, MOVEMENT_POSITION_BITS), MOVEMENT_POSITION_MIN, MOVEMENT_POSITION_MAX, MOVEMENT_POSITION_BITS);
 								
-								if (packetNumber == triggerIncomingPacketNumber + 1 && characterID > NO_CHARACTER && characterID <= PINK_BUBBLE_GUM)
+								uint16_t inputSequence = 0;
+								uint16_t inputSteps = 0;
+								if (readBits(&reader, 1) != 0)
 								{
-									triggerIncomingPacketNumber++;
+									inputSequence = (uint16_t)readBits(&reader, MOVEMENT_INPUT_SEQUENCE_BITS);
+									inputSteps = (uint16_t)readBits(&reader, MOVEMENT_INPUT_STEPS_BITS);
 									
-									GameMessage message;
-									message.type = CHARACTER_DIED_UPDATE_MESSAGE_TYPE;
-									message.diedUpdate.characterID = characterID;
-									message.diedUpdate.characterLives = characterLives;
-									pushNetworkMessage(&gGameMessagesFromNet, message);
+									// Saturated step counts can't be lined up with our inputs
+									if (inputSteps == (1 << MOVEMENT_INPUT_STEPS_BITS) - 1)
+									{
+										inputSteps = UINT16_MAX;
+									}
+									
+									buffer += MOVEMENT_MESSAGE_WITH_INPUT_SIZE;
 								}
-								
-								if (packetNumber <= triggerIncomingPacketNumber)
+								else
 								{
-									GameMessage ackMessage;
-									ackMessage.type = ACK_MESSAGE_TYPE;
-									ackMessage.packetNumber = packetNumber;
-									pushNetworkMessage(&gGameMessagesToNet, ackMessage);
+									buffer += MOVEMENT_MESSAGE_SIZE;
 								}
-							}
-						}
-						else if (messageTag == CHARACTER_KILLS_MESSAGE_TAG)
-						{
-							// character's kills increase
-							uint32_t packetNumber = 0;
-							uint8_t flags = 0;
-							
-							if (buffer + sizeof(packetNumber) + sizeof(flags) <= packetBuffer + numberOfBytes)
-							{
-								ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
-								ADVANCE_RECEIVE_BUFFER(&buffer, flags);
 								
-								uint8_t characterID = (flags & 0x3) + 1;
-								uint8_t characterKills = (flags >> 2);
+								if (reader.overflowed)
+								{
+									break;
+								}
 								
-								if (packetNumber == triggerIncomingPacketNumber + 1 && characterID > NO_CHARACTER && characterID <= PINK_BUBBLE_GUM)
+								if (sequenceGreaterThan(packetNumber, realTimeIncomingPacketNumber) && characterID > NO_CHARACTER && characterID <= PINK_BUBBLE_GUM)
 								{
-									triggerIncomingPacketNumber++;
+									realTimeIncomingPacketNumber = packetNumber;
 									
 									GameMessage message;
-									message.type = CHARACTER_KILLED_UPDATE_MESSAGE_TYPE;
-									message.killedUpdate.characterID = characterID;
-									message.killedUpdate.kills = characterKills;
-									pushNetworkMessage(&gGameMessagesFromNet, message);
+									message.type = CHARACTER_MOVED_UPDATE_MESSAGE_TYPE;
+									message.movedUpdate.characterID = characterID;
+									message.movedUpdate.x = x;
+									message.movedUpdate.y = y;
+									message.movedUpdate.direction = direction;
+									message.movedUpdate.pointing_direction = pointing_direction;
+									message.movedUpdate.dead = dead;
+									message.movedUpdate.inputSequence = inputSequence;
+									message.movedUpdate.inputSteps = inputSteps;
+									
+									if (inputSequence != 0 && (acknowledgedMovementInputSequence == 0 || inputSequenceGreaterThan(inputSequence, acknowledgedMovementInputSequence)))
+									{
+										acknowledgedMovementInputSequence = inputSequence;
+									}
+									
+									// Stamped here rather than when the main thread gets to it so the time between arrivals can be measured precisely
+									message.ticks = networkTicks();
+									deliverNetworkMessage(message);
 								}
-								
-								if (packetNumber <= triggerIncomingPacketNumber)
+								else if (!sequenceGreaterThan(packetNumber, realTimeIncomingPacketNumber))
 								{
-									GameMessage ackMessage;
-									ackMessage.type = ACK_MESSAGE_TYPE;
-									ackMessage.packetNumber = packetNumber;
-									pushNetworkMessage(&gGameMessagesToNet, ackMessage);
+									// A newer movement update already arrived
+									serverStats.outOfOrder++;
 								}
 							}
 						}
@@ -2128,126 +6688,64 @@ int clientNetworkThread(void *context)
 								uint8_t characterID = (flags & 0x3) + 1;
 								uint8_t pointing_direction = (flags >> 2) + 1;
 								
-								if (packetNumber == triggerIncomingPacketNumber + 1 && characterID > NO_CHARACTER && characterID <= PINK_BUBBLE_GUM)
-								{
-									triggerIncomingPacketNumber++;
-									
-									GameMessage message;
-									message.type = CHARACTER_FIRED_UPDATE_MESSAGE_TYPE;
-									message.firedUpdate.x = x;
-									message.firedUpdate.y = y;
-									message.firedUpdate.characterID = characterID;
-									message.firedUpdate.direction = pointing_direction;
-									
-									pushNetworkMessage(&gGameMessagesFromNet, message);
-								}
+								GameMessage message;
+								message.type = CHARACTER_FIRED_UPDATE_MESSAGE_TYPE;
+								message.firedUpdate.x = x;
+								message.firedUpdate.y = y;
+								message.firedUpdate.characterID = characterID;
+								message.firedUpdate.direction = pointing_direction;
 								
-								if (packetNumber <= triggerIncomingPacketNumber)
-								{
-									GameMessage ackMessage;
-									ackMessage.type = ACK_MESSAGE_TYPE;
-									ackMessage.packetNumber = packetNumber;
-									pushNetworkMessage(&gGameMessagesToNet, ackMessage);
-								}
+								bool validMessage = (characterID > NO_CHARACTER && characterID <= PINK_BUBBLE_GUM);
+								receiveReliableMessage(&reliableReceiveState, packetNumber, validMessage ? &message : NULL);
 							}
 						}
-						else if (messageTag == COLOR_TILE_MESSAGE_TAG)
+						else if (messageTag == WORLD_SNAPSHOT_MESSAGE_TAG)
 						{
-							uint32_t packetNumber = 0;
-							uint8_t flags = 0;
+							BitReader reader;
+							initializeBitReader(&reader, buffer, (uint32_t)(packetBuffer + numberOfBytes - buffer));
 							
-							if (buffer + sizeof(packetNumber) + sizeof(flags) <= packetBuffer + numberOfBytes)
+							uint32_t snapshotNumber = expandPacketNumber(readBits(&reader, WORLD_SNAPSHOT_NUMBER_BITS), WORLD_SNAPSHOT_NUMBER_BITS, latestWorldSnapshotNumber);
+							uint32_t baselineAge = readBits(&reader, WORLD_SNAPSHOT_BASELINE_AGE_BITS);
+							uint32_t requiredSequence = expandPacketNumber(readBits(&reader, WORLD_SNAPSHOT_REQUIRED_SEQUENCE_BITS), WORLD_SNAPSHOT_REQUIRED_SEQUENCE_BITS, reliableReceiveState.sequence);
+							
+							uint32_t baselineNumber = snapshotNumber - baselineAge;
+							uint32_t baselineIndex = baselineNumber % WORLD_SNAPSHOT_HISTORY_SIZE;
+							bool hasBaseline = (baselineAge == 0 || worldSnapshotNumbers[baselineIndex] == baselineNumber);
+							
+							WorldSnapshot snapshot;
+							if (baselineAge == 0 || !hasBaseline)
 							{
-								ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
-								ADVANCE_RECEIVE_BUFFER(&buffer, flags);
-								
-								uint8_t characterID = (flags & 0x3) + 1;
-								uint8_t tileIndex = (flags >> 2);
-								
-								if (packetNumber == triggerIncomingPacketNumber + 1 && characterID > NO_CHARACTER && characterID <= PINK_BUBBLE_GUM && tileIndex < NUMBER_OF_TILES)
-								{
-									triggerIncomingPacketNumber++;
-									
-									GameMessage message;
-									message.type = COLOR_TILE_MESSAGE_TYPE;
-									message.colorTile.characterID = characterID;
-									message.colorTile.tileIndex = tileIndex;
-									
-									pushNetworkMessage(&gGameMessagesFromNet, message);
-								}
-								
-								if (packetNumber <= triggerIncomingPacketNumber)
-								{
-									GameMessage ackMessage;
-									ackMessage.type = ACK_MESSAGE_TYPE;
-									ackMessage.packetNumber = packetNumber;
-									pushNetworkMessage(&gGameMessagesToNet, ackMessage);
-								}
+								memset(&snapshot, 0, sizeof(snapshot));
+							}
+							else
+							{
+								snapshot = worldSnapshots[baselineIndex];
 							}
-						}
-						else if (messageTag == TILE_FALLING_MESSAGE_TAG)
-						{
-							uint32_t packetNumber = 0;
-							uint8_t flags = 0;
 							
-							if (buffer + sizeof(packetNumber) + sizeof(flags) <= packetBuffer + numberOfBytes)
+							// Changes are absolute values so the snapshot can be read through even if we can't use it
+							if (!readWorldSnapshotChanges(&reader, &snapshot))
 							{
-								ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
-								ADVANCE_RECEIVE_BUFFER(&buffer, flags);
-								
-								int8_t dead = (flags & 0x1);
-								uint8_t tileIndex = (flags >> 1);
-								
-								if (packetNumber == triggerIncomingPacketNumber + 1 && tileIndex < NUMBER_OF_TILES)
-								{
-									triggerIncomingPacketNumber++;
-									
-									GameMessage message;
-									message.type = TILE_FALLING_DOWN_MESSAGE_TYPE;
-									message.fallingTile.dead = (dead != 0);
-									message.fallingTile.tileIndex = tileIndex;
-									
-									pushNetworkMessage(&gGameMessagesFromNet, message);
-								}
-								
-								if (packetNumber <= triggerIncomingPacketNumber)
-								{
-									GameMessage ackMessage;
-									ackMessage.type = ACK_MESSAGE_TYPE;
-									ackMessage.packetNumber = packetNumber;
-									pushNetworkMessage(&gGameMessagesToNet, ackMessage);
-								}
+								break;
 							}
-						}
-						else if (messageTag == RECOVER_TILE_MESSAGE_TAG)
-						{
-							uint32_t packetNumber = 0;
-							uint8_t tileIndex = 0;
+							buffer += reader.byteIndex;
 							
-							if (buffer + sizeof(packetNumber) + sizeof(tileIndex) <= packetBuffer + numberOfBytes)
+							// Don't get ahead of a game reset we haven't been delivered yet
+							bool resetWasDelivered = !sequenceGreaterThan(requiredSequence, reliableReceiveState.sequence);
+							
+							if (hasBaseline && resetWasDelivered && sequenceGreaterThan(snapshotNumber, latestWorldSnapshotNumber))
 							{
-								ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
-								ADVANCE_RECEIVE_BUFFER(&buffer, tileIndex);
+								pushWorldSnapshotChanges(&worldSnapshots[latestWorldSnapshotNumber % WORLD_SNAPSHOT_HISTORY_SIZE], &snapshot, requiredSequence != latestWorldSnapshotRequiredSequence);
 								
-								if (packetNumber == triggerIncomingPacketNumber + 1 && tileIndex < NUMBER_OF_TILES)
-								{
-									triggerIncomingPacketNumber++;
-									
-									GameMessage message;
-									message.type = RECOVER_TILE_MESSAGE_TYPE;
-									message.recoverTile.tileIndex = tileIndex;
-									
-									pushNetworkMessage(&gGameMessagesFromNet, message);
-								}
+								uint32_t snapshotIndex = snapshotNumber % WORLD_SNAPSHOT_HISTORY_SIZE;
+								worldSnapshots[snapshotIndex] = snapshot;
+								worldSnapshotNumbers[snapshotIndex] = snapshotNumber;
 								
-								if (packetNumber <= triggerIncomingPacketNumber)
-								{
-									GameMessage ackMessage;
-									ackMessage.type = ACK_MESSAGE_TYPE;
-									ackMessage.packetNumber = packetNumber;
-									pushNetworkMessage(&gGameMessagesToNet, ackMessage);
-								}
+								latestWorldSnapshotNumber = snapshotNumber;
+								latestWorldSnapshotRequiredSequence = requiredSequence;
 							}
+							
+							// Even snapshots we didn't use are acked in case our last ack was lost
+							needsToSendWorldSnapshotAck = true;
 						}
 						else if (messageTag == LAGGED_OUT_MESSAGE_TAG)
 						{
@@ -2261,23 +6759,12 @@ int clientNetworkThread(void *context)
 								
 								uint8_t characterID = flags + 1;
 								
-								if (packetNumber == triggerIncomingPacketNumber + 1 && characterID > NO_CHARACTER && characterID <= PINK_BUBBLE_GUM)
-								{
-									triggerIncomingPacketNumber++;
-									
-									GameMessage message;
-									message.type = LAGGED_OUT_MESSAGE_TYPE;
-									message.laggedUpdate.characterID = characterID;
-									pushNetworkMessage(&gGameMessagesFromNet, message);
-								}
+								GameMessage message;
+								message.type = LAGGED_OUT_MESSAGE_TYPE;
+								message.laggedUpdate.characterID = characterID;
 								
-								if (packetNumber <= triggerIncomingPacketNumber)
-								{
-									GameMessage ackMessage;
-									ackMessage.type = ACK_MESSAGE_TYPE;
-									ackMessage.packetNumber = packetNumber;
-									pushNetworkMessage(&gGameMessagesToNet, ackMessage);
-								}
+								bool validMessage = (characterID > NO_CHARACTER && characterID <= PINK_BUBBLE_GUM);
+								receiveReliableMessage(&reliableReceiveState, packetNumber, validMessage ? &message : NULL);
 							}
 						}
 						else if (messageTag == NEW_GAME_MESSAGE_TAG)
@@ -2288,47 +6775,22 @@ int clientNetworkThread(void *context)
 							{
 								ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
 								
-								if (packetNumber == triggerIncomingPacketNumber + 1)
-								{
-									triggerIncomingPacketNumber++;
-									
-									GameMessage message;
-									message.type = GAME_RESET_MESSAGE_TYPE;
-									
-									pushNetworkMessage(&gGameMessagesFromNet, message);
-								}
+								GameMessage message;
+								message.type = GAME_RESET_MESSAGE_TYPE;
 								
-								if (packetNumber <= triggerIncomingPacketNumber)
-								{
-									GameMessage ackMessage;
-									ackMessage.type = ACK_MESSAGE_TYPE;
-									ackMessage.packetNumber = packetNumber;
-									pushNetworkMessage(&gGameMessagesToNet, ackMessage);
-								}
+								receiveReliableMessage(&reliableReceiveState, packetNumber, &message);
 							}
 						}
 						else if (messageTag == ACK_MESSAGE_TAG)
 						{
-							uint32_t packetNumber = 0;
-							if (buffer + sizeof(packetNumber) <= packetBuffer + numberOfBytes)
+							uint32_t ack = 0;
+							uint32_t ackBits = 0;
+							if (buffer + sizeof(ack) + sizeof(ackBits) <= packetBuffer + numberOfBytes)
 							{
-								ADVANCE_RECEIVE_BUFFER(&buffer, packetNumber);
+								ADVANCE_RECEIVE_BUFFER(&buffer, ack);
+								ADVANCE_RECEIVE_BUFFER(&buffer, ackBits);
 								
-								bool foundAck = false;
-								uint32_t maxPacketCount = receivedAckPacketCount < (uint32_t)receivedAckPacketsCapacity ? receivedAckPacketCount : (uint32_t)receivedAckPacketsCapacity;
-								for (uint32_t packetIndex = 0; packetIndex < maxPacketCount; packetIndex++)
-								{
-									if (packetNumber == receivedAckPacketNumbers[packetIndex])
-									{
-										foundAck = true;
-										break;
-									}
-								}
-								if (!foundAck)
-								{
-									receivedAckPacketNumbers[receivedAckPacketCount % receivedAckPacketsCapacity] = packetNumber;
-									receivedAckPacketCount++;
-								}
+								receiveReliableAcks(&reliableSendState, ack, ackBits);
 							}
 						}
 						else if (messageTag == PING_MESSAGE_TAG)
@@ -2339,156 +6801,454 @@ int clientNetworkThread(void *context)
 							{
 								ADVANCE_RECEIVE_BUFFER(&buffer, timestamp);
 								
-								GameMessage pongMessage;
+								GameMessage pongMessage = {0};
 								pongMessage.type = PONG_MESSAGE_TYPE;
-								pongMessage.pongTimestamp = timestamp;
-								pushNetworkMessage(&gGameMessagesToNet, pongMessage);
+								pongMessage.pong.pingTimestamp = timestamp;
+								pongMessage.pong.receiveTime = receiveTime;
+								queueOutgoingMessage(&gNetworkBuffers->networkThreadMessages, &pongMessage);
 							}
 						}
 						else if (messageTag == PONG_MESSAGE_TAG)
 						{
 							// pong message
-							uint32_t timestamp = 0;
-							if (buffer + sizeof(timestamp) <= packetBuffer + numberOfBytes)
+							PongMessage pong;
+							if (buffer + sizeof(pong.pingTimestamp) + sizeof(pong.receiveTime) + sizeof(pong.holdTime) <= packetBuffer + numberOfBytes)
 							{
-								ADVANCE_RECEIVE_BUFFER(&buffer, timestamp);
+								ADVANCE_RECEIVE_BUFFER(&buffer, pong.pingTimestamp);
+								ADVANCE_RECEIVE_BUFFER(&buffer, pong.receiveTime);
+								ADVANCE_RECEIVE_BUFFER(&buffer, pong.holdTime);
+								pong.arrivalTime = receiveTime;
 								
 								GameMessage message;
 								message.type = PONG_MESSAGE_TYPE;
-								message.pongTimestamp = timestamp;
-								pushNetworkMessage(&gGameMessagesFromNet, message);
+								message.pong = pong;
+								deliverNetworkMessage(message);
 								
-								lastPongReceivedTimestamp = ZGGetTicks();
+								lastPongReceivedTimestamp = networkTicks();
+								updateRoundTripTime(&reliableSendState, pongRoundTripTime(&pong) / 1000);
 							}
 						}
 						else if (messageTag == QUIT_MESSAGE_TAG)
 						{
-							// quit
-							GameMessage message;
-							message.type = QUIT_MESSAGE_TYPE;
-							pushNetworkMessage(&gGameMessagesFromNet, message);
-							
-							needsToQuit = true;
-							
-							break;
+							// quit
+							GameMessage message;
+							message.type = QUIT_MESSAGE_TYPE;
+							deliverNetworkMessage(message);
+							
+							needsToQuit = true;
+							
+							break;
+						}
+						
+						countReceivedMessage(receivedChannels, messageTag, (size_t)(buffer - messageStart));
+					}
+					
+					countReceivedDatagram(&serverStats, receivedChannels, (size_t)numberOfBytes);
+					
+					traceReceivedDatagram(0);
+				}
+			}
+		}
+		
+		publishReplayProgress();
+		
+		if (networkTicks() - lastStatsPublishTime >= NETWORK_STATS_PUBLISH_INTERVAL)
+		{
+			publishNetworkPeerStats(&serverStats, 1);
+			lastStatsPublishTime = networkTicks();
+		}
+		
+		// If we just received data, loop back right away so acks and pongs we queued go out immediately
+		// Otherwise block until there's something to read or send, or a message is due to be re-sent
+		if (!needsToQuit && !receivedData)
+		{
+			waitForNetworkEvents(gNetworkConnection->socket, gNetworkConnection->replay == NULL && gNetworkConnection->transport == NULL, networkWaitTimeout(hasPendingResends, nextResendTime));
+		}
+	}
+	
+	storeReleaseUInt8(&gNetworkConnection->networkThreadStopped, 1);
+	publishSteppedNetworkThreadState(STEPPED_NETWORK_STOPPED);
+	
+	finishNetworkConditioner();
+	finishNetworkCapture();
+	
+	return 0;
+}
+
+// What a spectator has been handed so far, which the next frame is checked against
+typedef struct
+{
+	bool receivedFrame;
+	uint32_t frameNumber;
+	// The world the main thread was brought to with the last frame, and the game reset it was after
+	WorldSnapshot worldSnapshot;
+	uint32_t requiredSequence;
+	// The newest event handed to the main thread, the first one we saw, and the last game reset among them
+	uint32_t eventNumber;
+	uint32_t firstEventNumber;
+	uint32_t resetEventNumber;
+	
+	SpectatorStats stats;
+} SpectatorReceiveState;
+
+static void sendSpectateRequest(uint64_t cookie, NetworkPeerStats *serverStats)
+{
+	char requestBuffer[MAX_PACKET_SIZE];
+	char *requestBufferPtr = requestBuffer;
+	
+	uint8_t tag = SPECTATE_MESSAGE_TAG;
+	uint8_t networkVersion = NETWORK_VERSION;
+	uint32_t matchIndex = gNetworkConnection->spectatedMatchIndex;
+	ADVANCE_SEND_BUFFER(&requestBufferPtr, tag);
+	ADVANCE_SEND_BUFFER(&requestBufferPtr, networkVersion);
+	ADVANCE_SEND_BUFFER(&requestBufferPtr, matchIndex);
+	ADVANCE_SEND_BUFFER(&requestBufferPtr, cookie);
+	
+	countSentMessage(serverStats, requestBuffer, requestBufferPtr);
+	sendData(gNetworkConnection->socket, requestBuffer, (size_t)(requestBufferPtr - requestBuffer), &gNetworkConnection->hostAddress);
+}
+
+// Deaths aren't compared since a character dying more than once between frames is only handed over as one death
+static bool worldSnapshotsMatch(WorldSnapshot *snapshot1, WorldSnapshot *snapshot2)
+{
+	if (memcmp(snapshot1->tiles, snapshot2->tiles, sizeof(snapshot1->tiles)) != 0)
+	{
+		return false;
+	}
+	
+	for (uint8_t characterIndex = 0; characterIndex < 4; characterIndex++)
+	{
+		if (snapshot1->characters[characterIndex].lives != snapshot2->characters[characterIndex].lives || snapshot1->characters[characterIndex].kills != snapshot2->characters[characterIndex].kills)
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+// Hands the main thread what's new in a frame like a client would be handed it from playing, checking the frame against what came before it
+static void receiveSpectatorFrame(SpectatorReceiveState *state, SpectatorFrame *frame)
+{
+	uint32_t frameNumber = expandPacketNumber(frame->frameNumber, SPECTATOR_FRAME_NUMBER_BITS, state->frameNumber);
+	if (state->receivedFrame)
+	{
+		// Everything in an older frame was either in a newer one too or is outdated
+		if (!sequenceGreaterThan(frameNumber, state->frameNumber))
+		{
+			return;
+		}
+		state->stats.lostFrames += frameNumber - state->frameNumber - 1;
+	}
+	state->stats.frames++;
+	
+	// Events go first since the frame's world is the one after them
+	for (uint32_t eventIndex = 0; eventIndex < frame->eventCount; eventIndex++)
+	{
+		SpectatorEvent *event = &frame->events[eventIndex];
+		uint32_t eventNumber = expandPacketNumber(event->eventNumber, SPECTATOR_EVENT_NUMBER_BITS, state->eventNumber);
+		
+		if (state->eventNumber != 0)
+		{
+			if (!sequenceGreaterThan(eventNumber, state->eventNumber))
+			{
+				continue;
+			}
+			state->stats.missedEvents += eventNumber - state->eventNumber - 1;
+		}
+		else
+		{
+			state->firstEventNumber = eventNumber;
+		}
+		
+		state->eventNumber = eventNumber;
+		state->stats.events++;
+		
+		if (event->message.type == GAME_RESET_MESSAGE_TYPE)
+		{
+			state->resetEventNumber = eventNumber;
+		}
+		
+		deliverNetworkMessage(event->message);
+	}
+	
+	uint32_t requiredSequence = expandPacketNumber(frame->requiredSequence, WORLD_SNAPSHOT_REQUIRED_SEQUENCE_BITS, state->eventNumber);
+	
+	// We can only tell which reset the world should be after if we were watching when it happened
+	if (state->firstEventNumber != 0 && !sequenceGreaterThan(state->firstEventNumber, requiredSequence) && requiredSequence != state->resetEventNumber)
+	{
+		state->stats.resetMismatches++;
+	}
+	
+	bool gameWasReset = (requiredSequence != state->requiredSequence);
+	
+	GameMessage changes[MAX_WORLD_SNAPSHOT_CHANGE_MESSAGES];
+	uint32_t changesCount = worldSnapshotChangeMessages(&state->worldSnapshot, &frame->worldSnapshot, gameWasReset, changes);
+	
+	// The main thread only ever sees the changes, so they have to get it from the world it had to the one in the frame
+	WorldSnapshot changedSnapshot = state->worldSnapshot;
+	if (gameWasReset)
+	{
+		resetWorldSnapshotTiles(&changedSnapshot);
+	}
+	
+	for (uint32_t changeIndex = 0; changeIndex < changesCount; changeIndex++)
+	{
+		applyMessageToWorldSnapshot(&changedSnapshot, &changes[changeIndex]);
+		deliverNetworkMessage(changes[changeIndex]);
+	}
+	
+	if (!worldSnapshotsMatch(&changedSnapshot, &frame->worldSnapshot))
+	{
+		state->stats.snapshotMismatches++;
+	}
+	
+	for (uint8_t characterIndex = 0; characterIndex < 4; characterIndex++)
+	{
+		if ((frame->movedCharacters & (1 << characterIndex)) != 0)
+		{
+			GameMessage message;
+			message.type = CHARACTER_MOVED_UPDATE_MESSAGE_TYPE;
+			message.movedUpdate = frame->movements[characterIndex];
+			message.ticks = networkTicks();
+			deliverNetworkMessage(message);
+		}
+	}
+	
+	if (frame->hasNetNames)
+	{
+		for (uint8_t characterIndex = 0; characterIndex < 4; characterIndex++)
+		{
+			if (strncmp(state->stats.netNames[characterIndex], frame->netNames[characterIndex], MAX_USER_NAME_SIZE) != 0)
+			{
+				memcpy(state->stats.netNames[characterIndex], frame->netNames[characterIndex], MAX_USER_NAME_SIZE);
+				
+				GameMessage message;
+				message.type = NET_NAME_MESSAGE_TYPE;
+				message.netNameRequest.characterID = characterIndex + 1;
+				memcpy(message.netNameRequest.netName, frame->netNames[characterIndex], MAX_USER_NAME_SIZE);
+				deliverNetworkMessage(message);
+			}
+		}
+	}
+	
+	state->receivedFrame = true;
+	state->frameNumber = frameNumber;
+	state->worldSnapshot = frame->worldSnapshot;
+	state->requiredSequence = requiredSequence;
+}
+
+// Watches a match without playing in it, handing the main thread the frames it's streamed like a client would be handed the game
+// Every frame is checked against the ones before it along the way, which can be read with copySpectatorStats()
+int spectatorNetworkThread(void *context)
+{
+	gNetworkConnection = context;
+	gNetworkBuffers = gNetworkConnection->buffers;
+	
+	gOverflowedNetworkPeers = 0;
+	
+	NetworkPeerStats serverStats;
+	memset(&serverStats, 0, sizeof(serverStats));
+	uint32_t lastStatsPublishTime = networkTicks();
+	
+	SpectatorReceiveState receiveState;
+	memset(&receiveState, 0, sizeof(receiveState));
+	
+	// The server only streams to us once we echo back a cookie it gave us
+	uint64_t handshakeCookie = 0;
+	uint32_t nextSpectateTime = networkTicks();
+	uint32_t lastFrameReceivedTime = networkTicks();
+	
+	bool needsToQuit = false;
+	
+	// We're done once the main thread can't be handed what we're sent
+	while (!needsToQuit && gOverflowedNetworkPeers == 0)
+	{
+		// All we ever send is our request to keep watching and that we quit
+		uint32_t messagesCount = beginReadingNetworkMessages(&gNetworkBuffers->gameMessagesToNet);
+		for (uint32_t messageIndex = 0; messageIndex < messagesCount && !needsToQuit; messageIndex++)
+		{
+			if (networkMessageAtIndex(&gNetworkBuffers->gameMessagesToNet, messageIndex)->type == QUIT_MESSAGE_TYPE)
+			{
+				uint8_t quitTag = QUIT_MESSAGE_TAG;
+				sendData(gNetworkConnection->socket, &quitTag, sizeof(quitTag), &gNetworkConnection->hostAddress);
+				
+				needsToQuit = true;
+			}
+		}
+		finishReadingNetworkMessages(&gNetworkBuffers->gameMessagesToNet, messagesCount);
+		
+		uint32_t currentTime = networkTicks();
+		if (!needsToQuit && (int32_t)(currentTime - nextSpectateTime) >= 0)
+		{
+			sendSpectateRequest(handshakeCookie, &serverStats);
+			nextSpectateTime = currentTime + SPECTATE_INTERVAL;
+		}
+		
+		// Frames are streamed every simulation step, so the server is gone if they stop for this long
+		if (currentTime - lastFrameReceivedTime >= SPECTATOR_TIMEOUT)
+		{
+			needsToQuit = true;
+		}
+		
+		bool receivedData = false;
+		while (!needsToQuit && clientDatagramIsPending())
+		{
+			char packetBuffer[MAX_PACKET_SIZE];
+			uint64_t receiveTime = 0;
+			int numberOfBytes;
+			if ((numberOfBytes = receiveClientDatagram(packetBuffer, sizeof(packetBuffer), &receiveTime)) == -1)
+			{
+				fprintf(stderr, "receiveData() actually returned -1\n");
+				break;
+			}
+			
+			receivedData = true;
+			
+			NetworkChannelStats receivedChannels[NETWORK_CHANNEL_COUNT];
+			memset(receivedChannels, 0, sizeof(receivedChannels));
+			
+			char *buffer = packetBuffer;
+			uint8_t messageTag = 0;
+			while (buffer + sizeof(messageTag) <= packetBuffer + numberOfBytes)
+			{
+				char *messageStart = buffer;
+				ADVANCE_RECEIVE_BUFFER(&buffer, messageTag);
+				
+				if (messageTag == SERVER_REJECTION_MESSAGE_TAG || messageTag == QUIT_MESSAGE_TAG)
+				{
+					needsToQuit = true;
+					
+					break;
+				}
+				else if (messageTag == SEND_TIME_MESSAGE_TAG)
+				{
+					uint64_t sendTime = 0;
+					if (buffer + sizeof(sendTime) <= packetBuffer + numberOfBytes)
+					{
+						ADVANCE_RECEIVE_BUFFER(&buffer, sendTime);
+					}
+				}
+				else if (messageTag == HANDSHAKE_COOKIE_MESSAGE_TAG)
+				{
+					uint64_t cookie = 0;
+					if (buffer + sizeof(cookie) <= packetBuffer + numberOfBytes)
+					{
+						ADVANCE_RECEIVE_BUFFER(&buffer, cookie);
+						
+						// Ask again right away rather than waiting to keep watching
+						if (cookie != 0 && !receiveState.receivedFrame)
+						{
+							handshakeCookie = cookie;
+							sendSpectateRequest(handshakeCookie, &serverStats);
 						}
 					}
 				}
+				else if (messageTag == SPECTATOR_FRAME_MESSAGE_TAG)
+				{
+					// A frame takes up the rest of the datagram
+					SpectatorFrame frame;
+					if (readSpectatorFrame(buffer, (uint32_t)(packetBuffer + numberOfBytes - buffer), &frame))
+					{
+						receiveSpectatorFrame(&receiveState, &frame);
+						lastFrameReceivedTime = networkTicks();
+					}
+					else
+					{
+						receiveState.stats.malformedFrames++;
+					}
+					buffer = packetBuffer + numberOfBytes;
+				}
+				else
+				{
+					// Nothing else is meant for spectators, and there's no telling how long it is
+					break;
+				}
+				
+				countReceivedMessage(receivedChannels, messageTag, (size_t)(buffer - messageStart));
 			}
+			
+			countReceivedDatagram(&serverStats, receivedChannels, (size_t)numberOfBytes);
 		}
 		
-		if (!needsToQuit)
+		if (needsToQuit || networkTicks() - lastStatsPublishTime >= NETWORK_STATS_PUBLISH_INTERVAL)
 		{
-			uint32_t timeAfterProcessing = ZGGetTicks();
-			uint32_t deltaProcessingTime = timeAfterProcessing - timeBeforeProcessing;
-			const uint32_t targetDelay = 5;
+			ZGLockMutex(gNetworkStatsMutex);
+			gNetworkConnection->spectatorStats = receiveState.stats;
+			ZGUnlockMutex(gNetworkStatsMutex);
 			
-			if (deltaProcessingTime < targetDelay)
-			{
-				ZGDelay(targetDelay - deltaProcessingTime);
-			}
+			publishNetworkPeerStats(&serverStats, 1);
+			lastStatsPublishTime = networkTicks();
+		}
+		
+		if (!needsToQuit && !receivedData)
+		{
+			waitForNetworkEvents(gNetworkConnection->socket, gNetworkConnection->transport == NULL, networkWaitTimeout(true, nextSpectateTime));
 		}
 	}
 	
-	free(receivedAckPacketNumbers);
+	storeReleaseUInt8(&gNetworkConnection->networkThreadStopped, 1);
+	publishSteppedNetworkThreadState(STEPPED_NETWORK_STOPPED);
+	
+	GameMessage message;
+	message.type = QUIT_MESSAGE_TYPE;
+	deliverNetworkMessage(message);
 	
 	return 0;
 }
 
-static void initializeGameBuffer(GameMessageArray *messageArray)
-{
-	messageArray->messages = NULL;
-	messageArray->count = 0;
-	messageArray->capacity = 1024;
-	messageArray->mutex = ZGCreateMutex();
-}
-
 void initializeNetworkBuffers(void)
 {
-	initializeGameBuffer(&gGameMessagesFromNet);
-	initializeGameBuffer(&gGameMessagesToNet);
-	
-	gCurrentSlotAndClientStatesMutex = ZGCreateMutex();
-}
-
-static void _pushNetworkMessage(GameMessageArray *messageArray, GameMessage message)
-{
-	bool appending = true;
-	
-	if (messageArray->messages == NULL)
-	{
-		messageArray->messages = malloc(messageArray->capacity * sizeof(message));
-		if (messageArray->messages == NULL)
-		{
-			appending = false;
-		}
-	}
-	
-	if (messageArray->count >= messageArray->capacity)
-	{
-		uint32_t newCapacity = (uint32_t)(messageArray->capacity * 1.6f);
-		void *newBuffer = realloc(messageArray->messages, messageArray->capacity * sizeof(message));
-		if (newBuffer == NULL)
-		{
-			appending = false;
-		}
-		else
-		{
-			messageArray->messages = newBuffer;
-			messageArray->capacity = newCapacity;
-		}
-	}
-	
-	if (appending)
+	if (gNetworkBuffers != NULL)
 	{
-		messageArray->messages[messageArray->count] = message;
-		messageArray->count++;
+		return;
 	}
-}
-
-void pushNetworkMessage(GameMessageArray *messageArray, GameMessage message)
-{
-	ZGLockMutex(messageArray->mutex);
-	
-	_pushNetworkMessage(messageArray, message);
 	
-	ZGUnlockMutex(messageArray->mutex);
+	gNetworkBuffers = calloc(1, sizeof(*gNetworkBuffers));
+	createNetworkWakeup(gNetworkBuffers);
 }
 
-static void depleteNetworkMessages(GameMessageArray *messageArray)
+NetworkConnection *createNetworkConnection(int type)
 {
-	ZGLockMutex(messageArray->mutex);
+	NetworkConnection *connection = malloc(sizeof(*connection));
+	memset(connection, 0, sizeof(*connection));
 	
-	messageArray->count = 0;
+	connection->type = type;
+	connection->buffers = gNetworkBuffers;
 	
-	ZGUnlockMutex(messageArray->mutex);
+	return connection;
 }
 
-GameMessage *popNetworkMessages(GameMessageArray *messageArray, uint32_t *count)
+void initializeNetwork(void)
 {
-	GameMessage *newMessages = NULL;
-	
-	ZGLockMutex(messageArray->mutex);
-	
-	if (messageArray->count > 0)
+	if (!gInitializedNetworkOnce)
 	{
-		size_t size = sizeof(*newMessages) * messageArray->count;
-		newMessages = malloc(size);
-		if (newMessages != NULL)
+		const char *profile = getenv(NETWORK_CONDITIONER_ENVIRONMENT_VARIABLE);
+		if (profile != NULL)
+		{
+			configureNetworkConditioner(profile);
+		}
+		
+		gNetworkStatsMutex = ZGCreateMutex();
+		
+		const char *statsPath = getenv(NETWORK_STATS_ENVIRONMENT_VARIABLE);
+		if (statsPath != NULL)
 		{
-			memcpy(newMessages, messageArray->messages, size);
-			*count = messageArray->count;
-			messageArray->count = 0;
+			gNetworkStatsFile = (strcmp(statsPath, "-") == 0) ? stderr : fopen(statsPath, "a");
+			if (gNetworkStatsFile == NULL)
+			{
+				fprintf(stderr, "Failed to open network stats file %s\n", statsPath);
+			}
 		}
+		
+		gNetworkCapturePath = getenv(NETWORK_CAPTURE_ENVIRONMENT_VARIABLE);
+		
+		const char *trace = getenv(NETWORK_TRACE_ENVIRONMENT_VARIABLE);
+		gNetworkTracing = (trace != NULL && strcmp(trace, "0") != 0);
+		
+		gInitializedNetworkOnce = true;
 	}
 	
-	ZGUnlockMutex(messageArray->mutex);
-	
-	return newMessages;
-}
-
-void initializeNetwork(void)
-{
 #if PLATFORM_WINDOWS
 	WSADATA wsaData;
 	
@@ -2508,12 +7268,7 @@ void deinitializeNetwork(void)
 
 static void cleanUpNetName(Character *character)
 {
-	if (character->netName && character->netName != gUserNameString)
-	{
-		free(character->netName);
-	}
-	
-	character->netName = NULL;
+	memset(character->netName, 0, sizeof(character->netName));
 }
 
 // Not to be called on network threads
@@ -2537,37 +7292,313 @@ static void cleanupStateFromNetwork(void)
 	resetCharacterWins();
 }
 
-void sendToClients(int exception, GameMessage *message)
+static void queueMessageToClients(GameMessageQueue *messageQueue, int exception, GameMessage *message)
 {
-	ZGLockMutex(gCurrentSlotAndClientStatesMutex);
-	ZGLockMutex(gGameMessagesToNet.mutex);
-	
 	message->packetNumber = 0;
 	
-	for (int clientIndex = 0; clientIndex < gCurrentSlot; clientIndex++)
+	// Clients are sent changes to the world through snapshots, which only need the server's own copy
+	uint8_t currentSlot = isWorldSnapshotMessage(message->type) ? 0 : loadAcquireUInt8(&gNetworkConnection->currentSlot);
+	for (int clientIndex = 0; clientIndex < currentSlot; clientIndex++)
 	{
-		if (clientIndex + 1 != exception && gClientStates[clientIndex] == CLIENT_STATE_ALIVE)
+		if (clientIndex + 1 != exception && loadAcquireUInt8(&gNetworkConnection->clientStates[clientIndex]) == CLIENT_STATE_ALIVE)
 		{
 			message->addressIndex = clientIndex;
-			_pushNetworkMessage(&gGameMessagesToNet, *message);
+			queueOutgoingMessage(messageQueue, message);
 		}
 	}
 	
+	// Spectators see every message including the ones clients are excepted from
+	if (isSpectatorMessage(message->type))
+	{
+		message->addressIndex = SPECTATORS_ADDRESS_INDEX;
+		queueOutgoingMessage(messageQueue, message);
+	}
+	
 	if (message->type == QUIT_MESSAGE_TYPE)
 	{
 		// Just add a quit message in case there's no clients we need to tell to quit
 		message->addressIndex = -1;
-		_pushNetworkMessage(&gGameMessagesToNet, *message);
+		queueOutgoingMessage(messageQueue, message);
 	}
-	
-	ZGUnlockMutex(gGameMessagesToNet.mutex);
-	ZGUnlockMutex(gCurrentSlotAndClientStatesMutex);
+}
+
+void sendToClients(int exception, GameMessage *message)
+{
+	traceCreatedMessage(message);
+	queueMessageToClients(&gNetworkBuffers->gameMessagesToNet, exception, message);
+	wakeNetworkThread(gNetworkBuffers);
 }
 
 void sendToServer(GameMessage message)
 {
 	message.packetNumber = 0;
-	pushNetworkMessage(&gGameMessagesToNet, message);
+	traceCreatedMessage(&message);
+	queueOutgoingMessage(&gNetworkBuffers->gameMessagesToNet, &message);
+	wakeNetworkThread(gNetworkBuffers);
+}
+
+static uint8_t numberOfNetworkPeers(void)
+{
+	return (gNetworkConnection->type == NETWORK_SERVER_TYPE) ? loadAcquireUInt8(&gNetworkConnection->currentSlot) : 1;
+}
+
+bool copyNetworkPeerStats(uint8_t peerIndex, NetworkPeerStats *stats)
+{
+	if (gNetworkConnection == NULL || peerIndex >= numberOfNetworkPeers())
+	{
+		return false;
+	}
+	
+	ZGLockMutex(gNetworkStatsMutex);
+	*stats = gNetworkConnection->peerStats[peerIndex];
+	ZGUnlockMutex(gNetworkStatsMutex);
+	
+	return true;
+}
+
+uint32_t networkRoundTripTimePercentile(const NetworkPeerStats *stats, uint32_t percentile)
+{
+	if (stats->roundTripTimeSamples == 0)
+	{
+		return 0;
+	}
+	
+	// Smallest bucket that has at least the percentile of samples at or below it, reported by its upper bound
+	uint64_t targetSamples = ((uint64_t)stats->roundTripTimeSamples * percentile + 99) / 100;
+	uint64_t samples = 0;
+	for (uint32_t bucket = 0; bucket < NETWORK_RTT_HISTOGRAM_BUCKET_COUNT; bucket++)
+	{
+		samples += stats->roundTripTimeHistogram[bucket];
+		if (samples >= targetSamples && samples > 0)
+		{
+			return (bucket + 1) * NETWORK_RTT_HISTOGRAM_BUCKET_SIZE;
+		}
+	}
+	
+	return NETWORK_RTT_HISTOGRAM_BUCKET_COUNT * NETWORK_RTT_HISTOGRAM_BUCKET_SIZE;
+}
+
+bool copySpectatorStats(SpectatorStats *stats)
+{
+	if (gNetworkConnection == NULL || gNetworkConnection->type != NETWORK_CLIENT_TYPE || !gNetworkConnection->spectating)
+	{
+		return false;
+	}
+	
+	ZGLockMutex(gNetworkStatsMutex);
+	*stats = gNetworkConnection->spectatorStats;
+	ZGUnlockMutex(gNetworkStatsMutex);
+	
+	return true;
+}
+
+bool copyNetworkLatencyStats(NetworkLatencyStats *stats)
+{
+	if (gNetworkConnection == NULL)
+	{
+		return false;
+	}
+	
+	ZGLockMutex(gNetworkStatsMutex);
+	*stats = gNetworkConnection->publishedLatencyStats;
+	ZGUnlockMutex(gNetworkStatsMutex);
+	
+	// The one stage that's measured on the main thread
+	memcpy(stats->stages[NETWORK_LATENCY_FROM_NET_QUEUE], gNetworkConnection->appliedLatencyStats.stages[NETWORK_LATENCY_FROM_NET_QUEUE], sizeof(stats->stages[NETWORK_LATENCY_FROM_NET_QUEUE]));
+	
+	return true;
+}
+
+uint32_t networkLatencyPercentile(const NetworkLatencyHistogram *histogram, uint32_t percentile)
+{
+	if (histogram->samples == 0)
+	{
+		return 0;
+	}
+	
+	// Smallest bucket that has at least the percentile of samples at or below it, reported by its upper bound unless the longest latency is lower
+	uint64_t targetSamples = ((uint64_t)histogram->samples * percentile + 99) / 100;
+	uint64_t samples = 0;
+	for (uint32_t bucket = 0; bucket + 1 < NETWORK_LATENCY_HISTOGRAM_BUCKET_COUNT; bucket++)
+	{
+		samples += histogram->histogram[bucket];
+		if (samples >= targetSamples && samples > 0)
+		{
+			// Inverse of how recordMessageLatency() picks buckets
+			uint32_t upperBound = (bucket < 4) ? bucket + 1 : (5 + bucket % 4) << (bucket / 4 - 1);
+			return upperBound < histogram->maxLatency ? upperBound : histogram->maxLatency;
+		}
+	}
+	
+	return histogram->maxLatency;
+}
+
+static const char *gNetworkChannelNames[NETWORK_CHANNEL_COUNT] = {"control", "reliable", "movement", "snapshot"};
+
+static const char *gNetworkLatencyStageNames[NETWORK_LATENCY_STAGE_COUNT] = {"toNetQueue", "send", "wire", "receive", "fromNetQueue"};
+
+const char *networkLatencyStageName(NetworkLatencyStage stage)
+{
+	return gNetworkLatencyStageNames[stage];
+}
+
+void enableNetworkTracing(void)
+{
+	gNetworkTracing = true;
+}
+
+static const char *gTracedMessageTypeNames[NETWORK_LATENCY_MESSAGE_TYPE_COUNT] =
+{
+	[QUIT_MESSAGE_TYPE] = "quit",
+	[MOVEMENT_REQUEST_MESSAGE_TYPE] = "movementRequest",
+	[CHARACTER_FIRED_REQUEST_MESSAGE_TYPE] = "firedRequest",
+	[NUMBER_OF_PLAYERS_WAITING_FOR_MESSAGE_TYPE] = "numberOfPlayersWaiting",
+	[NET_NAME_MESSAGE_TYPE] = "netName",
+	[START_GAME_MESSAGE_TYPE] = "startGame",
+	[GAME_START_NUMBER_UPDATE_MESSAGE_TYPE] = "gameStartNumber",
+	[CHARACTER_DIED_UPDATE_MESSAGE_TYPE] = "died",
+	[CHARACTER_MOVED_UPDATE_MESSAGE_TYPE] = "moved",
+	[CHARACTER_KILLED_UPDATE_MESSAGE_TYPE] = "killed",
+	[GAME_RESET_MESSAGE_TYPE] = "gameReset",
+	[FIRST_SERVER_RESPONSE_MESSAGE_TYPE] = "firstServerResponse",
+	[FIRST_CLIENT_RESPONSE_MESSAGE_TYPE] = "firstClientResponse",
+	[FIRST_DATA_TO_CLIENT_MESSAGE_TYPE] = "firstDataToClient",
+	[WELCOME_MESSAGE_TO_SERVER_MESSAGE_TYPE] = "welcome",
+	[CHARACTER_FIRED_UPDATE_MESSAGE_TYPE] = "fired",
+	[COLOR_TILE_MESSAGE_TYPE] = "colorTile",
+	[TILE_FALLING_DOWN_MESSAGE_TYPE] = "fallingTile",
+	[RECOVER_TILE_MESSAGE_TYPE] = "recoverTile",
+	[LAGGED_OUT_MESSAGE_TYPE] = "laggedOut",
+	[PING_MESSAGE_TYPE] = "ping",
+	[PONG_MESSAGE_TYPE] = "pong"
+};
+
+void printNetworkStats(FILE *file)
+{
+	if (gNetworkConnection == NULL)
+	{
+		fprintf(file, "Not connected\n");
+		return;
+	}
+	
+	uint8_t numberOfPeers = numberOfNetworkPeers();
+	for (uint8_t peerIndex = 0; peerIndex < numberOfPeers; peerIndex++)
+	{
+		NetworkPeerStats stats;
+		if (!copyNetworkPeerStats(peerIndex, &stats))
+		{
+			continue;
+		}
+		
+		if (gNetworkConnection->type == NETWORK_SERVER_TYPE)
+		{
+			fprintf(file, "Client %d:\n", peerIndex + 1);
+		}
+		else
+		{
+			fprintf(file, "Server:\n");
+		}
+		
+		fprintf(file, "  datagrams out %u (%llu bytes), in %u (%llu bytes)\n", stats.datagramsSent, (unsigned long long)stats.bytesSent, stats.datagramsReceived, (unsigned long long)stats.bytesReceived);
+		for (uint32_t channel = 0; channel < NETWORK_CHANNEL_COUNT; channel++)
+		{
+			NetworkChannelStats *channelStats = &stats.channels[channel];
+			fprintf(file, "  %s: out %u (%llu bytes), in %u (%llu bytes)\n", gNetworkChannelNames[channel], channelStats->messagesSent, (unsigned long long)channelStats->bytesSent, channelStats->messagesReceived, (unsigned long long)channelStats->bytesReceived);
+		}
+		fprintf(file, "  retransmissions %u, duplicates %u, out of order %u\n", stats.retransmissions, stats.duplicates, stats.outOfOrder);
+		fprintf(file, "  ack latency avg %u ms, max %u ms\n", stats.ackLatencySamples > 0 ? (uint32_t)(stats.totalAckLatency / stats.ackLatencySamples) : 0, stats.maxAckLatency);
+		fprintf(file, "  rtt p50 %u ms, p95 %u ms, p99 %u ms (%u samples)\n", networkRoundTripTimePercentile(&stats, 50), networkRoundTripTimePercentile(&stats, 95), networkRoundTripTimePercentile(&stats, 99), stats.roundTripTimeSamples);
+		if (gNetworkConnection->type == NETWORK_SERVER_TYPE)
+		{
+			fprintf(file, "  movement send rate %u/s, lost pings %u\n", stats.movementSendRate, stats.lostPings);
+		}
+	}
+	
+	if (gNetworkTracing)
+	{
+		NetworkLatencyStats latencyStats;
+		if (copyNetworkLatencyStats(&latencyStats))
+		{
+			fprintf(file, "Latency p50/p99/max in microseconds:\n");
+			for (uint32_t type = 0; type < NETWORK_LATENCY_MESSAGE_TYPE_COUNT; type++)
+			{
+				char stagesString[512] = {0};
+				size_t stagesLength = 0;
+				for (uint32_t stage = 0; stage < NETWORK_LATENCY_STAGE_COUNT && stagesLength < sizeof(stagesString); stage++)
+				{
+					NetworkLatencyHistogram *histogram = &latencyStats.stages[stage][type];
+					if (histogram->samples > 0)
+					{
+						stagesLength += (size_t)snprintf(stagesString + stagesLength, sizeof(stagesString) - stagesLength, "%s%s %u/%u/%u", stagesLength > 0 ? ", " : "", gNetworkLatencyStageNames[stage], networkLatencyPercentile(histogram, 50), networkLatencyPercentile(histogram, 99), histogram->maxLatency);
+					}
+				}
+				
+				if (stagesLength > 0)
+				{
+					fprintf(file, "  %s: %s\n", gTracedMessageTypeNames[type], stagesString);
+				}
+			}
+		}
+	}
+}
+
+// One JSON object per line and peer, so dumps are easy to feed to other tools
+static void dumpNetworkStats(FILE *file)
+{
+	uint8_t numberOfPeers = numberOfNetworkPeers();
+	for (uint8_t peerIndex = 0; peerIndex < numberOfPeers; peerIndex++)
+	{
+		NetworkPeerStats stats;
+		if (!copyNetworkPeerStats(peerIndex, &stats))
+		{
+			continue;
+		}
+		
+		bool server = (gNetworkConnection->type == NETWORK_SERVER_TYPE);
+		
+		char channelsString[512] = {0};
+		size_t channelsLength = 0;
+		for (uint32_t channel = 0; channel < NETWORK_CHANNEL_COUNT && channelsLength < sizeof(channelsString); channel++)
+		{
+			NetworkChannelStats *channelStats = &stats.channels[channel];
+			channelsLength += (size_t)snprintf(channelsString + channelsLength, sizeof(channelsString) - channelsLength, "%s\"%s\":{\"messagesOut\":%u,\"bytesOut\":%llu,\"messagesIn\":%u,\"bytesIn\":%llu}", channel > 0 ? "," : "", gNetworkChannelNames[channel], channelStats->messagesSent, (unsigned long long)channelStats->bytesSent, channelStats->messagesReceived, (unsigned long long)channelStats->bytesReceived);
+		}
+		
+		// fprintf() locks the file, so lines from matches on other threads don't get mixed up
+		fprintf(file, "{\"time\":%u,\"role\":\"%s\",\"match\":%d,\"peer\":%d,\"datagramsOut\":%u,\"bytesOut\":%llu,\"datagramsIn\":%u,\"bytesIn\":%llu,\"channels\":{%s},\"retransmissions\":%u,\"duplicates\":%u,\"outOfOrder\":%u,\"ackLatencyAvg\":%u,\"ackLatencyMax\":%u,\"rttSamples\":%u,\"rttP50\":%u,\"rttP95\":%u,\"rttP99\":%u,\"movementSendRate\":%u,\"lostPings\":%u}\n", ZGGetTicks(), server ? "server" : "client", (server && gNetworkConnection->router != NULL) ? (int)gNetworkConnection->matchIndex : -1, peerIndex, stats.datagramsSent, (unsigned long long)stats.bytesSent, stats.datagramsReceived, (unsigned long long)stats.bytesReceived, channelsString, stats.retransmissions, stats.duplicates, stats.outOfOrder, stats.ackLatencySamples > 0 ? (uint32_t)(stats.totalAckLatency / stats.ackLatencySamples) : 0, stats.maxAckLatency, stats.roundTripTimeSamples, networkRoundTripTimePercentile(&stats, 50), networkRoundTripTimePercentile(&stats, 95), networkRoundTripTimePercentile(&stats, 99), stats.movementSendRate, stats.lostPings);
+	}
+	
+	NetworkLatencyStats latencyStats;
+	if (gNetworkTracing && copyNetworkLatencyStats(&latencyStats))
+	{
+		bool server = (gNetworkConnection->type == NETWORK_SERVER_TYPE);
+		
+		// Every message type with samples, holding every stage of it with samples
+		char latencyString[16384] = {0};
+		size_t latencyLength = 0;
+		for (uint32_t type = 0; type < NETWORK_LATENCY_MESSAGE_TYPE_COUNT; type++)
+		{
+			char typeString[1024] = {0};
+			size_t typeLength = 0;
+			for (uint32_t stage = 0; stage < NETWORK_LATENCY_STAGE_COUNT && typeLength < sizeof(typeString); stage++)
+			{
+				NetworkLatencyHistogram *histogram = &latencyStats.stages[stage][type];
+				if (histogram->samples > 0)
+				{
+					typeLength += (size_t)snprintf(typeString + typeLength, sizeof(typeString) - typeLength, "%s\"%s\":{\"samples\":%u,\"avg\":%llu,\"p50\":%u,\"p99\":%u,\"max\":%u}", typeLength > 0 ? "," : "", gNetworkLatencyStageNames[stage], histogram->samples, (unsigned long long)(histogram->totalLatency / histogram->samples), networkLatencyPercentile(histogram, 50), networkLatencyPercentile(histogram, 99), histogram->maxLatency);
+				}
+			}
+			
+			if (typeLength > 0 && latencyLength < sizeof(latencyString))
+			{
+				latencyLength += (size_t)snprintf(latencyString + latencyLength, sizeof(latencyString) - latencyLength, "%s\"%s\":{%s}", latencyLength > 0 ? "," : "", gTracedMessageTypeNames[type], typeString);
+			}
+		}
+		
+		fprintf(file, "{\"time\":%u,\"role\":\"%s\",\"match\":%d,\"latency\":{%s}}\n", ZGGetTicks(), server ? "server" : "client", (server && gNetworkConnection->router != NULL) ? (int)gNetworkConnection->matchIndex : -1, latencyString);
+	}
+	
+	fflush(file);
 }
 
 void closeSocket(socket_t sockfd)
@@ -2579,6 +7610,66 @@ void closeSocket(socket_t sockfd)
 #endif
 }
 
+bool openServerSocket(socket_t *serverSocket)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+	
+	struct addrinfo *serverInfoList;
+	
+	int getaddrinfoError;
+	if ((getaddrinfoError = getaddrinfo(NULL, NETWORK_PORT, &hints, &serverInfoList)) != 0)
+	{
+		fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(getaddrinfoError));
+		return false;
+	}
+	
+	struct addrinfo *serverInfo;
+	for (serverInfo = serverInfoList; serverInfo != NULL; serverInfo = serverInfo->ai_next)
+	{
+		if (serverInfo->ai_family != AF_INET && serverInfo->ai_family != AF_INET6)
+		{
+			continue;
+		}
+		
+		*serverSocket = socket(serverInfo->ai_family, serverInfo->ai_socktype, serverInfo->ai_protocol);
+		if (*serverSocket == -1)
+		{
+			perror("server: socket");
+			continue;
+		}
+		
+#if PLATFORM_WINDOWS
+		int addressLength = (int)serverInfo->ai_addrlen;
+#else
+		socklen_t addressLength = serverInfo->ai_addrlen;
+#endif
+		if (bind(*serverSocket, serverInfo->ai_addr, addressLength) == -1)
+		{
+			perror("server: bind");
+			closeSocket(*serverSocket);
+			continue;
+		}
+		
+		enableReceiveTimestamps(*serverSocket);
+		
+		break;
+	}
+	
+	freeaddrinfo(serverInfoList);
+	
+	if (serverInfo == NULL)
+	{
+		fprintf(stderr, "Failed to create binding socket for server.\n");
+		return false;
+	}
+	
+	return true;
+}
+
 #if PLATFORM_WINDOWS
 void retrieveLocalIPAddress(char *ipAddressBuffer, size_t bufferSize)
 {
@@ -2692,20 +7783,20 @@ void retrieveLocalIPAddress(char *ipAddressBuffer, size_t bufferSize)
 				if ((family == AF_INET || (family == AF_INET6 && !retrievedIPv6Address)) && currentIfaddr->ifa_name != NULL && (strcmp(currentIfaddr->ifa_name, "en0") == 0 || strcmp(currentIfaddr->ifa_name, "en1") == 0 || strncmp(currentIfaddr->ifa_name, "enp", 3) == 0))
 				{
 					// Don't use ifa_addr->sa_len because it's not portable
-					socklen_t socketAddressLength = 0;
+					socklen_t interfaceAddressLength = 0;
 					if (family == AF_INET)
 					{
-						socketAddressLength = sizeof(struct sockaddr_in);
+						interfaceAddressLength = sizeof(struct sockaddr_in);
 					}
 					else if (family == AF_INET6)
 					{
-						socketAddressLength = sizeof(struct sockaddr_in6);
+						interfaceAddressLength = sizeof(struct sockaddr_in6);
 					}
 					
-					if (socketAddressLength > 0)
+					if (interfaceAddressLength > 0)
 					{
 						char *tempBuffer = calloc(1, bufferSize);
-						int nameInfoResult = getnameinfo(ifa_addr, socketAddressLength, tempBuffer, (socklen_t)bufferSize, NULL, 0, NI_NUMERICHOST);
+						int nameInfoResult = getnameinfo(ifa_addr, interfaceAddressLength, tempBuffer, (socklen_t)bufferSize, NULL, 0, NI_NUMERICHOST);
 						if (nameInfoResult != 0)
 						{
 							fprintf(stderr, "Error: failed to getnameinfo(): %d - %s\n", nameInfoResult, gai_strerror(nameInfoResult));
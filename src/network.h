@@ -61,7 +61,59 @@ typedef struct
 	uint8_t dead;
 } CharacterMovement;
 
-#define CHARACTER_MOVEMENTS_CAPACITY 20
+// Must be a power of two
+#define CHARACTER_MOVEMENTS_CAPACITY 32
+
+// Movements of a character received from the server, in a ring buffer indexed by the order they were received in
+// Their times never decrease, so the movement to render at a time is found by stepping forward from the last one rendered
+typedef struct
+{
+	CharacterMovement movements[CHARACTER_MOVEMENTS_CAPACITY];
+	uint32_t count;
+	uint32_t renderIndex;
+} CharacterMovementBuffer;
+
+// Must be powers of two
+#define PREDICTED_STEPS_CAPACITY 256
+#define PREDICTED_INPUTS_CAPACITY 64
+
+// Must be a power of two, and covers a little over a second of simulation steps
+#define LAG_COMPENSATION_HISTORY_CAPACITY 64
+
+// Longest a server looks back by to find where characters were when a client fired, in milliseconds
+#define DEFAULT_MAX_LAG_COMPENSATION_REWIND 200
+#define MAX_LAG_COMPENSATION_REWIND 1000
+
+// Must be a power of two
+#define CLOCK_SYNC_SAMPLES_CAPACITY 128
+
+// One exchange of a ping and its pong with the server, in microseconds
+typedef struct
+{
+	// When the pong arrived by our clock
+	uint64_t localTime;
+	// Server clock minus our clock, assuming the ping and pong took as long as each other
+	int64_t offset;
+	// Not counting how long the server held on to the ping
+	uint32_t roundTripTime;
+} ClockSyncSample;
+
+// Where every character was and which tiles were standing at the end of a server simulation step
+typedef struct
+{
+	uint32_t ticks;
+	float characterXs[4];
+	float characterYs[4];
+	uint8_t aliveCharacters;
+	uint64_t aliveTiles;
+} LagCompensationFrame;
+
+// A movement request the client made, and the step its own character first moved with it at
+typedef struct
+{
+	uint16_t inputSequence;
+	uint32_t step;
+} PredictedInput;
 
 typedef enum
 {
@@ -81,7 +133,6 @@ typedef enum
 	FIRST_DATA_TO_CLIENT_MESSAGE_TYPE = 13,
 	WELCOME_MESSAGE_TO_SERVER_MESSAGE_TYPE = 14,
 	CHARACTER_FIRED_UPDATE_MESSAGE_TYPE = 15,
-	ACK_MESSAGE_TYPE = 16,
 	COLOR_TILE_MESSAGE_TYPE = 17,
 	TILE_FALLING_DOWN_MESSAGE_TYPE = 18,
 	RECOVER_TILE_MESSAGE_TYPE = 19,
@@ -93,11 +144,16 @@ typedef enum
 typedef struct
 {
 	uint8_t direction;
+	// Numbers every movement request a client makes, starting from 1
+	uint16_t inputSequence;
 } CharacterMovementRequest;
 
 typedef struct
 {
 	uint8_t characterID;
+	// Server time the client was showing the other characters at when it fired, in milliseconds
+	// 0 if the client didn't know the server's clock yet
+	uint32_t renderTime;
 } CharacterFiredRequest;
 
 typedef struct
@@ -110,7 +166,7 @@ typedef struct
 typedef struct
 {
 	uint8_t characterID;
-	char *netName;
+	char netName[MAX_USER_NAME_SIZE];
 } CharacterNetNameRequest;
 
 typedef struct
@@ -126,6 +182,10 @@ typedef struct
 	uint8_t direction;
 	uint8_t pointing_direction;
 	uint8_t dead;
+	// The latest movement request of the character's client that the server applied, and how many steps the character moved since
+	// Only sent to the client playing the character
+	uint16_t inputSequence;
+	uint16_t inputSteps;
 } CharacterMovedUpdate;
 
 typedef struct
@@ -148,21 +208,22 @@ typedef struct
 
 typedef struct
 {
-	char *netName;
+	char netName[MAX_USER_NAME_SIZE];
 	int32_t slotID;
 	uint8_t numberOfPlayersToWaitFor;
 } FirstClientResponse;
 
 typedef struct
 {
-	char *netNames[4];
+	// Empty for characters no one is playing over the network
+	char netNames[4][MAX_USER_NAME_SIZE];
 	uint8_t characterID;
 	uint8_t numberOfPlayersToWaitFor;
 } FirstDataToClient;
 
 typedef struct
 {
-	char *netName;
+	char netName[MAX_USER_NAME_SIZE];
 	uint8_t version;
 } WelcomeMessage;
 
@@ -188,12 +249,41 @@ typedef struct
 	uint8_t characterID;
 } LaggedOutMessage;
 
+typedef struct
+{
+	// When the ping was sent by the clock of whoever sent it, in microseconds
+	uint32_t pingTimestamp;
+	// How long the peer held on to the ping before replying to it, in microseconds
+	uint32_t holdTime;
+	// When the peer received the ping by its own clock, in microseconds
+	uint64_t receiveTime;
+	// When the pong arrived by our clock, in microseconds
+	uint64_t arrivalTime;
+} PongMessage;
+
+// Stamped on messages only while latency is traced, in microseconds by networkMicroTicks()
+typedef struct
+{
+	// When the main thread queued a message to send, and when its network thread took it, which is cleared once the message is first sent
+	uint64_t createdTime;
+	uint64_t dequeuedTime;
+	// When the network thread handed a message it received to the main thread
+	uint64_t deliveredTime;
+} NetworkMessageTrace;
+
+// Messages are copied between threads by value, so nothing in them may point to memory that has to be freed
 typedef struct
 {
 	MessageType type;
 	uint32_t packetNumber;
 	int addressIndex;
 	uint32_t ticks;
+	// Used by network threads for scheduling when a reliable message is sent again if it isn't acked
+	uint32_t resendTime;
+	uint32_t sendCount;
+	// When a reliable message was first sent, for measuring how long it takes to be acked
+	uint32_t firstSendTime;
+	NetworkMessageTrace trace;
 	union
 	{
 		CharacterMovementRequest movementRequest;
@@ -213,20 +303,158 @@ typedef struct
 		RecoverTileMessage recoverTile;
 		LaggedOutMessage laggedUpdate;
 		uint32_t pingTimestamp;
-		uint32_t pongTimestamp;
+		PongMessage pong;
 		
 		uint8_t numberOfWaitingPlayers;
 		uint8_t gameStartNumber;
 	};
 } GameMessage;
 
+// A message from the server that is applied once characters are rendered at the time it was sent
 typedef struct
 {
-	GameMessage *messages;
-	uint32_t count;
-	uint32_t capacity;
-	ZGMutex *mutex;
-} GameMessageArray;
+	GameMessage message;
+	// Messages due at the same time are applied in the order they arrived in
+	uint32_t order;
+} CharacterTriggerMessage;
+
+// Must be a power of two
+#define GAME_MESSAGE_QUEUE_CAPACITY 4096
+
+#define CACHE_LINE_SIZE 64
+
+// Bounded lock-free queue that is only pushed to from one thread and only read from one other thread
+// The producer and consumer indices are kept on separate cache lines so the two threads don't keep stealing them from each other
+// Indices are never wrapped; they are masked when indexing into messages
+typedef struct
+{
+	// Only writable from the producer thread
+	uint32_t writeIndex;
+	// Producer's copy of readIndex which is only refreshed when the queue looks full
+	uint32_t cachedReadIndex;
+	uint8_t producerPadding[CACHE_LINE_SIZE - 2 * sizeof(uint32_t)];
+	
+	// Only writable from the consumer thread
+	uint32_t readIndex;
+	uint8_t consumerPadding[CACHE_LINE_SIZE - sizeof(uint32_t)];
+	
+	GameMessage messages[GAME_MESSAGE_QUEUE_CAPACITY];
+} GameMessageQueue;
+
+// Queues and wakeup state shared between a thread running a game and its network thread
+typedef struct NetworkBuffers NetworkBuffers;
+
+// Routes datagrams arriving on one shared server socket to the matches of a dedicated server
+typedef struct NetworkMatchRouter NetworkMatchRouter;
+
+// Feeds the datagrams a network thread received in a captured session back to a network thread
+typedef struct NetworkReplay NetworkReplay;
+
+// Carries datagrams between connections in place of UDP sockets
+typedef struct NetworkTransport NetworkTransport;
+
+// Kinds of traffic that telemetry is broken down by
+typedef enum
+{
+	NETWORK_CHANNEL_CONTROL = 0, // acks, pings, pongs and connection management
+	NETWORK_CHANNEL_RELIABLE, // messages that are re-sent until they are acked
+	NETWORK_CHANNEL_MOVEMENT,
+	NETWORK_CHANNEL_SNAPSHOT, // world snapshots and their acks
+	NETWORK_CHANNEL_COUNT
+} NetworkChannel;
+
+typedef struct
+{
+	uint64_t bytesSent;
+	uint64_t bytesReceived;
+	uint32_t messagesSent;
+	uint32_t messagesReceived;
+} NetworkChannelStats;
+
+// Width and number of the round trip time histogram's buckets, in milliseconds
+// The last bucket also counts every round trip time longer than the histogram covers
+#define NETWORK_RTT_HISTOGRAM_BUCKET_SIZE 5
+#define NETWORK_RTT_HISTOGRAM_BUCKET_COUNT 100
+
+// Telemetry for one peer of a connection
+typedef struct
+{
+	NetworkChannelStats channels[NETWORK_CHANNEL_COUNT];
+	
+	// Whole datagrams including acks
+	uint64_t bytesSent;
+	uint64_t bytesReceived;
+	uint32_t datagramsSent;
+	uint32_t datagramsReceived;
+	
+	// Reliable messages sent again because they weren't acked in time
+	uint32_t retransmissions;
+	// Reliable messages received more than once, and messages that arrived before ones sent earlier
+	uint32_t duplicates;
+	uint32_t outOfOrder;
+	
+	// Time from first sending a reliable message to noticing it was acked, in milliseconds
+	uint64_t totalAckLatency;
+	uint32_t ackLatencySamples;
+	uint32_t maxAckLatency;
+	
+	uint32_t roundTripTimeSamples;
+	uint32_t roundTripTimeHistogram[NETWORK_RTT_HISTOGRAM_BUCKET_COUNT];
+	
+	// Only kept by the server: how many movement updates per second the client's link is currently paced to, and pings it never answered
+	uint32_t movementSendRate;
+	uint32_t lostPings;
+} NetworkPeerStats;
+
+// Where the time a message takes to get from one game to another is spent
+typedef enum
+{
+	NETWORK_LATENCY_TO_NET_QUEUE = 0, // waiting for the network thread to take it from the main thread
+	NETWORK_LATENCY_SEND, // from the network thread taking it until it's first sent, such as while it's paced or outside the reliable window
+	NETWORK_LATENCY_WIRE, // from the datagram carrying it being sent until it's received
+	NETWORK_LATENCY_RECEIVE, // from being received until the network thread hands it to the main thread, such as while earlier reliable messages are missing
+	NETWORK_LATENCY_FROM_NET_QUEUE, // waiting for syncNetworkState() to apply it
+	NETWORK_LATENCY_STAGE_COUNT
+} NetworkLatencyStage;
+
+// Latencies under 4 microseconds get a bucket each, and every power of two of microseconds after is split into four buckets
+// That keeps percentiles within a quarter of the latencies they stand for, up to about 30 seconds which the last bucket also counts anything longer than
+#define NETWORK_LATENCY_HISTOGRAM_BUCKET_COUNT 96
+#define NETWORK_LATENCY_MESSAGE_TYPE_COUNT (PONG_MESSAGE_TYPE + 1)
+
+typedef struct
+{
+	uint32_t samples;
+	uint32_t maxLatency;
+	uint64_t totalLatency;
+	uint32_t histogram[NETWORK_LATENCY_HISTOGRAM_BUCKET_COUNT];
+} NetworkLatencyHistogram;
+
+// Latency of every stage by message type, in microseconds
+typedef struct
+{
+	NetworkLatencyHistogram stages[NETWORK_LATENCY_STAGE_COUNT][NETWORK_LATENCY_MESSAGE_TYPE_COUNT];
+} NetworkLatencyStats;
+
+// What a spectator made of the frames a server streamed to it
+typedef struct
+{
+	uint32_t frames;
+	// Frames that never arrived, and ones that couldn't be read
+	uint32_t lostFrames;
+	uint32_t malformedFrames;
+	
+	uint32_t events;
+	// Events that dropped out of every frame before one reached us
+	uint32_t missedEvents;
+	// Frames whose world snapshot wasn't after the last game reset we were sent
+	uint32_t resetMismatches;
+	// Frames whose world snapshot differed from the world the messages handed to the main thread led to
+	uint32_t snapshotMismatches;
+	
+	// Empty for characters no one is playing over the network
+	char netNames[4][MAX_USER_NAME_SIZE];
+} SpectatorStats;
 
 // Use a union to avoid violating strict aliasing
 // instead of casting to sockaddr_storage
@@ -243,6 +471,11 @@ typedef struct
 	// Only writable before threads are created
 	int type;
 	socket_t socket;
+	NetworkBuffers *buffers;
+	// When set, received datagrams are read from a capture instead of the socket and nothing is sent
+	NetworkReplay *replay;
+	// When set, datagrams are sent and received through the transport and the socket is only the index of the connection's endpoint on it
+	NetworkTransport *transport;
 	
 	// Writable & readable from main thread only
 	Character *character;
@@ -252,6 +485,25 @@ typedef struct
 	// Only used from main thread
 	ZGThread thread;
 	
+	// Only written by the network thread, once it stops reading the messages it's handed
+	// and when it gives up on the connection because the main thread fell too far behind to be handed a message
+	uint8_t networkThreadStopped;
+	uint8_t deliveryOverflowed;
+	
+	// Telemetry of every client for servers, or of the server at index 0 for clients
+	// Only written by the network thread which publishes it every so often; read it with copyNetworkPeerStats()
+	NetworkPeerStats peerStats[3];
+	// Only kept by spectators, and published along with peerStats; read it with copySpectatorStats()
+	SpectatorStats spectatorStats;
+	
+	// Latency of messages sent and received, only kept while tracing is turned on with SKYCHECKERS_NETWORK_TRACE
+	// The stages measured by the network thread are only written by it, which publishes them along with peerStats
+	// The stages measured as messages are applied are only readable/writable from main thread
+	// Read both with copyNetworkLatencyStats()
+	NetworkLatencyStats networkThreadLatencyStats;
+	NetworkLatencyStats publishedLatencyStats;
+	NetworkLatencyStats appliedLatencyStats;
+	
 	union
 	{
 		// Client state
@@ -259,6 +511,9 @@ typedef struct
 		{
 			// Only writable before client thread is created
 			SocketAddress hostAddress;
+			// Spectators only watch the match of the server with this index, and don't play in it
+			bool spectating;
+			uint32_t spectatedMatchIndex;
 			// Writable & readable from main thread only
 			uint8_t characterLives;
 			
@@ -268,20 +523,60 @@ typedef struct
 			uint32_t recentServerHalfPings[10];
 			uint32_t recentServerHalfPingIndex;
 			
+			// Estimate of the server's clock from recent pings, in microseconds
+			// The offset was estimated at serverClockOffsetTime and drifts by serverClockSkew for every microsecond after
+			// Only readable/writable from main thread
+			ClockSyncSample clockSyncSamples[CLOCK_SYNC_SAMPLES_CAPACITY];
+			uint32_t clockSyncSampleCount;
+			int64_t serverClockOffset;
+			uint64_t serverClockOffsetTime;
+			double serverClockSkew;
+			// The offset the skew was last measured from
+			int64_t serverClockSkewReferenceOffset;
+			uint64_t serverClockSkewReferenceTime;
+			bool serverClockSynchronized;
+			// Copy of the offset for the client thread to stamp datagrams with the server's clock while tracing, guarded by the telemetry's mutex
+			int64_t tracedServerClockOffset;
+			bool tracedServerClockSynchronized;
+			
 			// Keeping track of past character movements
 			// Only used by client currently and only readable/writable from main thread
-			CharacterMovement characterMovements[4][CHARACTER_MOVEMENTS_CAPACITY];
-			uint32_t characterMovementCounts[4];
+			CharacterMovementBuffer characterMovementBuffers[4];
+			// When the last datagram with movements arrived, and smoothed estimates of the time between those arrivals and of how much it varies by (jitter)
+			uint32_t lastMovementArrivalTime;
+			float movementArrivalInterval;
+			float movementArrivalJitter;
+			// How far behind the server characters are rendered, in milliseconds
+			uint32_t interpolationDelay;
+			
+			// Our own character is moved by our input right away and corrected once the server acknowledges that input
+			// The direction it moved in at every step is kept so the steps after an acknowledged one can be simulated again
+			// Only readable/writable from main thread
+			uint8_t predictedStepDirections[PREDICTED_STEPS_CAPACITY];
+			uint32_t predictedStep;
+			PredictedInput predictedInputs[PREDICTED_INPUTS_CAPACITY];
+			uint16_t lastInputSequence;
 			
-			// Keeping track of past character trigger messages, only readable/writable from main thread
-			GameMessage *characterTriggerMessages;
+			// Keeping track of character trigger messages that aren't due yet, only readable/writable from main thread
+			// They're kept in a binary min-heap ordered by when they're due so the next one is always first
+			CharacterTriggerMessage *characterTriggerMessages;
 			uint32_t characterTriggerMessagesCount;
 			uint32_t characterTriggerMessagesCapacity;
+			uint32_t nextCharacterTriggerMessageOrder;
 		};
 		
 		// Server state
 		struct
 		{
+			// Only writable before the server thread is created
+			// When a router is set, datagrams are read from the router's match instead of from the socket, which the router owns
+			NetworkMatchRouter *router;
+			uint32_t matchIndex;
+			
+			// Only written by the server thread and published to the main thread without locking
+			uint8_t currentSlot;
+			uint8_t clientStates[3];
+			
 			// Only readable/writable from server thread
 			SocketAddress clientAddresses[3];
 			// Keeping track of half-ping from clients
@@ -289,6 +584,14 @@ typedef struct
 			uint32_t clientHalfPings[3];
 			uint32_t recentClientHalfPings[3][10];
 			uint32_t recentClientHalfPingIndices[3];
+			// The latest movement request applied for every client's character, and how many steps it moved since
+			// Only readable/writable from main thread
+			uint16_t clientInputSequences[3];
+			uint16_t clientInputSteps[3];
+			// Recent simulation steps for judging shots against what a client saw when it fired
+			// Only readable/writable from main thread
+			LagCompensationFrame lagCompensationFrames[LAG_COMPENSATION_HISTORY_CAPACITY];
+			uint32_t lagCompensationFrameCount;
 			// Local IP address
 			// Only readable/writable from main thread
 			char ipAddress[MAX_SERVER_ADDRESS_SIZE];
@@ -296,24 +599,149 @@ typedef struct
 	};
 } NetworkConnection;
 
-// For the server.. These should be initialized to zero before creating the server thread.
-extern uint8_t gCurrentSlot;
-extern uint8_t gClientStates[3];
+// Connection of the game running on the current thread
+// Network threads are handed their connection when they are created
+extern ZG_THREAD_LOCAL NetworkConnection *gNetworkConnection;
 
-extern NetworkConnection *gNetworkConnection;
+// Limits how far back servers look when judging shots from clients, in milliseconds
+// Only writable before any server is started
+extern uint32_t gMaxLagCompensationRewind;
 
+// Creates the buffers used by connections made from the calling thread
 void initializeNetworkBuffers(void);
-GameMessage *popNetworkMessages(GameMessageArray *messageArray, uint32_t *count);
 
+NetworkConnection *createNetworkConnection(int type);
+
+// Binds a socket on NETWORK_PORT for a server to receive from
+bool openServerSocket(socket_t *serverSocket);
+
+NetworkMatchRouter *createNetworkMatchRouter(socket_t socket, uint32_t numberOfMatches, uint8_t playersPerMatch);
+int networkMatchRouterThread(void *context);
+void stopNetworkMatchRouter(NetworkMatchRouter *router);
+
+// Has a server connection receive from one of a router's matches rather than reading the router's socket itself
+// Clients the router previously assigned to the match are forgotten
+void attachNetworkMatch(NetworkConnection *connection, NetworkMatchRouter *router, uint32_t matchIndex);
+
+// Connects a server and clients running on threads of the same process without going through sockets
+// Endpoint 0 is the server and endpoints 1 to numberOfClients are its clients
+// The transport has to outlive every connection attached to it
+NetworkTransport *createInProcessNetworkTransport(uint8_t numberOfClients);
+void destroyNetworkTransport(NetworkTransport *transport);
+
+// Has a connection use an endpoint of a transport instead of a socket
+// Must be called before the connection's network thread is created
+void attachNetworkTransport(NetworkConnection *connection, NetworkTransport *transport, uint8_t endpointIndex);
+
+// Stepping an in-process transport runs its endpoints in lockstep as fast as they can go instead of in real time
+// Each step, the endpoints' games take a simulation step and then their network threads exchange everything they have to send
+// Must be called before any connection is attached, with what the transport's clock starts at
+void enableNetworkTransportStepping(NetworkTransport *transport, uint32_t startTicks);
+
+// Moves the transport's clock forward to the given time and returns once the step has settled
+// It has settled when every endpoint's game has taken this step or stopped taking steps, and every network thread is idle with nothing left to send or read
+// Every endpoint has to have a game that takes steps or says it won't, since the ones that haven't started yet are waited for
+// Returns how many endpoints haven't stopped taking steps yet
+uint32_t stepNetworkTransport(NetworkTransport *transport, uint32_t ticks);
+
+// Called by an endpoint's game thread before each of its steps
+// Returns the step to take once the transport moves past the last one the endpoint took
+uint32_t waitForNetworkTransportStep(NetworkTransport *transport, uint8_t endpointIndex);
+void finishNetworkTransportStep(NetworkTransport *transport, uint8_t endpointIndex, uint32_t step);
+// Called by an endpoint's game thread once it won't take any more steps
+void leaveNetworkTransportStepping(NetworkTransport *transport, uint8_t endpointIndex);
+
+// True once every client that joined the server has disconnected
+bool allNetworkClientsDisconnected(void);
+
+// Initializing the network the first time also reads the network conditioner's profile from the environment
 void initializeNetwork(void);
 void deinitializeNetwork(void);
 
-void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState);
+typedef enum
+{
+	NETWORK_CONDITIONER_LATENCY = 0, // milliseconds
+	NETWORK_CONDITIONER_JITTER, // milliseconds, added to or subtracted from the latency
+	NETWORK_CONDITIONER_LOSS, // percent
+	NETWORK_CONDITIONER_DUPLICATE, // percent
+	NETWORK_CONDITIONER_REORDER, // percent
+	NETWORK_CONDITIONER_SEED,
+	NETWORK_CONDITIONER_SETTINGS_COUNT
+} NetworkConditionerSetting;
+
+// Applies a profile like "wifi" or "latency=80,jitter=20,loss=5,seed=42" to outgoing datagrams
+// Presets are off, lan, broadband, wifi, mobile and congested
+bool configureNetworkConditioner(const char *profile);
+void setNetworkConditionerSetting(NetworkConditionerSetting setting, float value);
+float networkConditionerSetting(NetworkConditionerSetting setting);
+
+// What a capture recorded about the connection it was made from
+typedef struct
+{
+	int type;
+	uint8_t numberOfPlayersToWaitFor;
+	uint8_t characterLives;
+	uint32_t datagramsReceived;
+	uint32_t datagramsSent;
+	// Time of the last datagram, in milliseconds since the capture started
+	uint32_t duration;
+} NetworkCaptureInfo;
+
+// Returns NULL if the file isn't a capture made with this network version
+NetworkReplay *openNetworkReplay(const char *path, NetworkCaptureInfo *info);
+void closeNetworkReplay(NetworkReplay *replay);
+// Lets the current connection's network thread handle every captured datagram it received up to the given time
+// Blocks until the network thread has handed their messages to the main thread, so they're synced on the same step every replay
+void advanceNetworkReplay(NetworkReplay *replay, uint32_t replayTime);
+// True once every captured datagram has been handled or the network thread exited
+bool networkReplayFinished(NetworkReplay *replay);
+
+// Clock that pings, pongs, timeouts and the timing of networked game events are measured with, in milliseconds
+// While a capture is replayed, it's the clock the captured session had at the point being replayed
+// Connections over a stepped transport share the transport's clock instead
+uint32_t networkTicks(void);
+
+// Same clock as networkTicks() in microseconds, and only as precise as the captured session's or stepped transport's clock when it's used
+uint64_t networkMicroTicks(void);
+
+// Best estimate of networkTicks() on the server right now
+// Servers and clients that haven't heard a pong from the server yet get their own clock
+uint32_t serverTimeNow(void);
 
-void setPredictedDirection(Character *character, int direction);
+void syncNetworkState(ZGWindow *window, float timeDelta, GameState gameState);
 
-int serverNetworkThread(void *unused);
+// Copies the latest published telemetry of a peer of the current connection
+// Returns false if there's no connection or no such peer
+bool copyNetworkPeerStats(uint8_t peerIndex, NetworkPeerStats *stats);
+// Round trip time that the given percent of samples are at or below, in milliseconds
+uint32_t networkRoundTripTimePercentile(const NetworkPeerStats *stats, uint32_t percentile);
+// Copies the latest published account of the frames a spectator was streamed
+// Returns false if the current connection isn't spectating
+bool copySpectatorStats(SpectatorStats *stats);
+// Copies the latency traced so far on the current connection, which is all zero unless tracing is turned on
+// Returns false if there's no connection
+bool copyNetworkLatencyStats(NetworkLatencyStats *stats);
+// Latency that the given percent of samples are at or below, in microseconds
+uint32_t networkLatencyPercentile(const NetworkLatencyHistogram *histogram, uint32_t percentile);
+// Short name of a latency stage for printing
+const char *networkLatencyStageName(NetworkLatencyStage stage);
+// Times messages as if SKYCHECKERS_NETWORK_TRACE was set
+// Must be called after initializeNetwork() and before any network thread is created
+void enableNetworkTracing(void);
+// Prints the current connection's telemetry for people to read
+void printNetworkStats(FILE *file);
+
+// Finds the tile a character was standing on the given number of milliseconds ago on a server
+// Returns -1 if the character or its tile wasn't alive then or the history doesn't go back that far
+int rewoundCharacterTileIndex(Character *character, uint32_t rewindTime);
+
+// Turns the client's own character right away instead of waiting for the server
+// Returns the input sequence number to send with the movement request
+uint16_t predictCharacterDirection(Character *character, int direction);
+
+int serverNetworkThread(void *context);
 int clientNetworkThread(void *context);
+int spectatorNetworkThread(void *context);
 
 void sendToClients(int exception, GameMessage *message);
 
@@ -321,6 +749,9 @@ void sendToServer(GameMessage message);
 
 void closeSocket(socket_t sockfd);
 
+// Copies a user name into a character's or message's net name, truncating it if needed
+void copyNetName(char *netName, const char *name);
+
 // Enumerates through host names and returns the first enumerated en0 one.
 // An IPv4 address will take priority over an IPv6 one due to being more user friendly
 void retrieveLocalIPAddress(char *ipAddressBuffer, size_t bufferSize);
@@ -39,7 +39,7 @@
 #define DIEING_STONE2_COLOR_GREEN 0.23f
 #define DIEING_STONE2_COLOR_BLUE 0.26f
 
-Tile gTiles[NUMBER_OF_TILES];
+ZG_THREAD_LOCAL Tile gTiles[NUMBER_OF_TILES];
 
 static TextureObject gSkyTex;
 
@@ -20,6 +20,7 @@
 #pragma once
 
 #include "renderer.h"
+#include "thread.h"
 
 #define TILE_ALIVE_Z -25.0f
 #define TILE_TERMINATING_Z -105.0f
@@ -52,7 +53,7 @@ typedef struct
 	double recovery_timer;
 } Tile;
 
-extern Tile gTiles[NUMBER_OF_TILES];
+extern ZG_THREAD_LOCAL Tile gTiles[NUMBER_OF_TILES];
 
 void loadTiles(void);
 
@@ -34,6 +34,7 @@ void initWeapon(Weapon *weap)
 	weap->initialX = 0.0f;
 	
 	weap->compensation = 0.0f;
+	weap->rewindTime = 0;
 	weap->timeFiring = 0.0f;
 	
 	weap->drawingState = false;
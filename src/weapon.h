@@ -30,6 +30,8 @@ typedef struct
 	ZGFloat red, green, blue;
 	float initialX, initialY;
 	float compensation;
+	// How far back in milliseconds a server looks for characters standing on the tiles a client's shot destroys
+	uint32_t rewindTime;
 	float timeFiring;
 	
 	bool drawingState;